@@ -0,0 +1,925 @@
+#include <threadutils.hpp>
+
+#include <CLI/CLI.hpp>
+#include <curl/curl.h>
+#include <fmt/core.h>
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+enum class Operation
+{
+    HEAD,
+    GET,
+    PUT,
+    COUNT
+};
+
+static constexpr size_t OperationCount = static_cast<size_t>(Operation::COUNT);
+static constexpr std::array<std::string_view, OperationCount> OperationNames{ "head", "get", "put" };
+
+// Keys above these offsets are never part of the prepared population
+static constexpr uint64_t UploadKeyOffset = 1ull << 40;
+static constexpr uint64_t MissKeyOffset = 1ull << 41;
+
+// Longest path kept by the access log, longer paths were truncated when they were recorded
+static constexpr size_t AccessLogMaxPathLength = 192;
+
+struct BenchOptions
+{
+    std::string url{ "http://localhost" };
+    std::string apiKey;
+    std::string triplet{ "x64-linux" };
+    uint32_t concurrency{ 16 };
+    uint32_t duration{ 30 }; // Seconds
+    uint64_t requests{ 0 };  // 0 to run for the duration
+    std::string mix{ "head=70,get=25,put=5" };
+    std::string sizes{ "lognormal:1M:1.5" };
+    double missRatio{ 0.1 };
+    uint64_t keys{ 1000 };
+    double zipf{ 0.0 };
+    bool skipPrepare{ false };
+    std::string replayFile;
+    double replaySpeed{ 0.0 }; // 0 to replay as fast as possible
+    uint64_t seed{ 1 };
+    uint32_t timeout{ 30000 }; // Milliseconds
+    std::string outputFile;
+    std::string cpus; // CPUs the connections are pinned to, empty to leave them to the scheduler
+    std::string label;
+    std::string baselineFile;
+};
+
+struct Request
+{
+    Operation operation;
+    std::string path;
+    uint64_t size;   // Body size of uploads
+    int64_t offset;  // Microseconds since the first request of a replayed log
+};
+
+struct OperationStats
+{
+    std::vector<int64_t> latencies; // Microseconds
+    uint64_t errors{ 0 };
+    uint64_t bytesSent{ 0 };
+    uint64_t bytesReceived{ 0 };
+    std::map<long, uint64_t> statusCodes;
+};
+
+using WorkerStats = std::array<OperationStats, OperationCount>;
+
+static uint64_t SplitMix64(uint64_t& state)
+{
+    uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+/**
+ * @brief Parse a size with an optional K, M or G suffix (powers of 1024)
+ */
+static uint64_t ParseSize(std::string_view str)
+{
+    if (str.empty())
+    {
+        throw std::runtime_error("Empty size.");
+    }
+
+    uint64_t multiplier = 1;
+    switch (std::toupper(static_cast<unsigned char>(str.back())))
+    {
+    case 'K':
+        multiplier = 1024ull;
+        break;
+    case 'M':
+        multiplier = 1024ull * 1024;
+        break;
+    case 'G':
+        multiplier = 1024ull * 1024 * 1024;
+        break;
+    }
+
+    if (multiplier != 1)
+    {
+        str.remove_suffix(1);
+    }
+
+    return static_cast<uint64_t>(std::stod(std::string(str)) * multiplier);
+}
+
+static std::vector<std::string_view> Split(std::string_view str, char separator)
+{
+    std::vector<std::string_view> parts;
+    while (true)
+    {
+        const size_t pos = str.find(separator);
+        parts.push_back(str.substr(0, pos));
+        if (pos == std::string_view::npos)
+        {
+            return parts;
+        }
+        str.remove_prefix(pos + 1);
+    }
+}
+
+/**
+ * @brief Package size distribution, "fixed:<size>", "uniform:<min>:<max>" or "lognormal:<median>:<sigma>"
+ */
+class SizeDistribution final
+{
+public:
+    explicit SizeDistribution(const std::string& spec)
+    {
+        const std::vector<std::string_view> parts = Split(spec, ':');
+        if (parts[0] == "fixed" && parts.size() == 2)
+        {
+            m_Type = Type::FIXED;
+            m_First = static_cast<double>(ParseSize(parts[1]));
+        }
+        else if (parts[0] == "uniform" && parts.size() == 3)
+        {
+            m_Type = Type::UNIFORM;
+            m_First = static_cast<double>(ParseSize(parts[1]));
+            m_Second = static_cast<double>(ParseSize(parts[2]));
+        }
+        else if (parts[0] == "lognormal" && parts.size() == 3)
+        {
+            m_Type = Type::LOGNORMAL;
+            m_First = std::log(static_cast<double>(ParseSize(parts[1])));
+            m_Second = std::stod(std::string(parts[2]));
+        }
+        else
+        {
+            throw std::runtime_error(fmt::format("Invalid size distribution \"{}\".", spec));
+        }
+    }
+
+    /**
+     * @brief Size of a given package, the same key always gets the same size
+     */
+    uint64_t GetSize(uint64_t key, uint64_t seed) const
+    {
+        std::mt19937_64 rng(seed ^ (key * 0x9e3779b97f4a7c15ull));
+
+        double size = m_First;
+        switch (m_Type)
+        {
+        case Type::UNIFORM:
+            size = std::uniform_real_distribution<double>(m_First, m_Second)(rng);
+            break;
+        case Type::LOGNORMAL:
+            size = std::lognormal_distribution<double>(m_First, m_Second)(rng);
+            break;
+        default:
+            break;
+        }
+
+        // Upload bodies come from a shared buffer, keep outliers reasonable
+        return std::clamp<uint64_t>(static_cast<uint64_t>(size), 1, MaxSize);
+    }
+
+    static constexpr uint64_t MaxSize = 1024ull * 1024 * 1024;
+
+private:
+    enum class Type
+    {
+        FIXED,
+        UNIFORM,
+        LOGNORMAL
+    };
+
+    Type m_Type;
+    double m_First{ 0 };
+    double m_Second{ 0 };
+};
+
+/**
+ * @brief Synthetic workload, drawing requests from a fixed package population
+ */
+class Workload final
+{
+public:
+    explicit Workload(const BenchOptions& options)
+        : m_Options(options)
+        , m_Sizes(options.sizes)
+        , m_NextUpload(0)
+    {
+        for (std::string_view entry : Split(options.mix, ','))
+        {
+            const std::vector<std::string_view> parts = Split(entry, '=');
+            const auto it = std::find(OperationNames.begin(), OperationNames.end(), parts[0]);
+            if (parts.size() != 2 || it == OperationNames.end())
+            {
+                throw std::runtime_error(fmt::format("Invalid request mix entry \"{}\", expected head=<weight>, get=<weight> or put=<weight>.", entry));
+            }
+            m_Weights[std::distance(OperationNames.begin(), it)] = std::stod(std::string(parts[1]));
+        }
+
+        if (m_Options.keys == 0)
+        {
+            throw std::runtime_error("The package population must not be empty.");
+        }
+
+        // Cumulative Zipf weights, only needed for skewed popularity
+        if (m_Options.zipf > 0)
+        {
+            m_ZipfCdf.resize(m_Options.keys);
+            double total = 0;
+            for (uint64_t i = 0; i < m_Options.keys; ++i)
+            {
+                total += 1.0 / std::pow(static_cast<double>(i + 1), m_Options.zipf);
+                m_ZipfCdf[i] = total;
+            }
+            for (double& value : m_ZipfCdf)
+            {
+                value /= total;
+            }
+        }
+    }
+
+    Request Next(std::mt19937_64& rng)
+    {
+        const Operation operation = static_cast<Operation>(std::discrete_distribution<size_t>(m_Weights.begin(), m_Weights.end())(rng));
+
+        uint64_t key;
+        if (operation == Operation::PUT)
+        {
+            key = UploadKeyOffset + m_NextUpload.fetch_add(1, std::memory_order_relaxed);
+        }
+        else if (std::uniform_real_distribution<double>(0, 1)(rng) < m_Options.missRatio)
+        {
+            key = MissKeyOffset + (rng() >> 24);
+        }
+        else if (!m_ZipfCdf.empty())
+        {
+            const double value = std::uniform_real_distribution<double>(0, 1)(rng);
+            key = std::min<uint64_t>(std::lower_bound(m_ZipfCdf.begin(), m_ZipfCdf.end(), value) - m_ZipfCdf.begin(), m_Options.keys - 1);
+        }
+        else
+        {
+            key = std::uniform_int_distribution<uint64_t>(0, m_Options.keys - 1)(rng);
+        }
+
+        return Request{ operation, GetPath(key), m_Sizes.GetSize(key, m_Options.seed), -1 };
+    }
+
+    Request GetPrepareRequest(uint64_t key) const
+    {
+        return Request{ Operation::PUT, GetPath(key), m_Sizes.GetSize(key, m_Options.seed), -1 };
+    }
+
+    /**
+     * @brief Largest upload of the population and of the first new packages, later outliers are truncated to it
+     */
+    uint64_t GetMaxUploadSize() const
+    {
+        uint64_t size = 0;
+        for (uint64_t key = 0; key < m_Options.keys; ++key)
+        {
+            size = std::max(size, m_Sizes.GetSize(key, m_Options.seed));
+        }
+        for (uint64_t key = 0; key < std::max<uint64_t>(m_Options.keys, 10000); ++key)
+        {
+            size = std::max(size, m_Sizes.GetSize(UploadKeyOffset + key, m_Options.seed));
+        }
+        return size;
+    }
+
+    bool HasReads() const
+    {
+        return m_Weights[static_cast<size_t>(Operation::HEAD)] > 0 || m_Weights[static_cast<size_t>(Operation::GET)] > 0;
+    }
+
+private:
+    std::string GetPath(uint64_t key) const
+    {
+        uint64_t state = m_Options.seed ^ key;
+        const uint64_t a = SplitMix64(state);
+        const uint64_t b = SplitMix64(state);
+        const uint64_t c = SplitMix64(state);
+        const uint64_t d = SplitMix64(state);
+        return fmt::format("/{}/bench{}/1.0.0/{:016x}{:016x}{:016x}{:016x}", m_Options.triplet, key % 4096, a, b, c, d);
+    }
+
+    const BenchOptions& m_Options;
+    SizeDistribution m_Sizes;
+    std::array<double, OperationCount> m_Weights{};
+    std::vector<double> m_ZipfCdf;
+    std::atomic<uint64_t> m_NextUpload;
+};
+
+/**
+ * @brief Parse an ISO 8601 UTC time as written by the access log, to microseconds since epoch
+ */
+static std::optional<int64_t> ParseLogTime(const std::string& str)
+{
+    int year, month, day, hour, minute, second, micros = 0;
+    if (std::sscanf(str.c_str(), "%d-%d-%dT%d:%d:%d.%dZ", &year, &month, &day, &hour, &minute, &second, &micros) < 6)
+    {
+        return std::nullopt;
+    }
+
+    const std::chrono::sys_days days = std::chrono::year(year) / std::chrono::month(month) / std::chrono::day(day);
+    return (days.time_since_epoch().count() * 86400ll + hour * 3600ll + minute * 60ll + second) * 1000000ll + micros;
+}
+
+/**
+ * @brief Load the package requests of an access log, in the order they were recorded
+ */
+static std::vector<Request> LoadAccessLog(const std::string& filename)
+{
+    std::ifstream file(filename);
+    if (!file.is_open())
+    {
+        throw std::runtime_error(fmt::format("Failed to open access log \"{}\".", filename));
+    }
+
+    std::vector<Request> requests;
+    std::optional<int64_t> firstTime;
+    uint64_t skipped = 0;
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        const nlohmann::json record = nlohmann::json::parse(line, nullptr, false);
+        if (record.is_discarded() || !record.contains("method") || !record.contains("path"))
+        {
+            // Dropped record notices and damaged lines
+            continue;
+        }
+
+        const std::string method = record["method"].get<std::string>();
+        const std::string path = record["path"].get<std::string>();
+
+        Request request{ Operation::GET, path, record.value("bytes_received", uint64_t(0)), -1 };
+        if (method == "HEAD")
+        {
+            request.operation = Operation::HEAD;
+        }
+        else if (method == "PUT" && request.size > 0)
+        {
+            request.operation = Operation::PUT;
+        }
+        else if (method != "GET" || path.size() >= AccessLogMaxPathLength)
+        {
+            ++skipped;
+            continue;
+        }
+
+        if (const std::optional<int64_t> time = ParseLogTime(record.value("time", std::string())))
+        {
+            firstTime = firstTime.value_or(time.value());
+            request.offset = time.value() - firstTime.value();
+        }
+
+        requests.emplace_back(std::move(request));
+    }
+
+    std::cerr << "Loaded " << requests.size() << " requests from " << filename << " (" << skipped << " skipped)" << std::endl;
+    return requests;
+}
+
+static size_t DiscardCallback(void* contents, size_t size, size_t nmemb, void* userp)
+{
+    *static_cast<uint64_t*>(userp) += size * nmemb;
+    return size * nmemb;
+}
+
+/**
+ * @brief One connection to the server, reused for every request of a worker
+ */
+class Client final
+{
+public:
+    Client(const BenchOptions& options, const std::vector<char>& uploadBuffer)
+        : m_Options(options)
+        , m_UploadBuffer(uploadBuffer)
+        , m_Curl(curl_easy_init())
+        , m_Headers(nullptr)
+    {
+        if (!m_Curl)
+        {
+            throw std::runtime_error("Failed to create curl handle.");
+        }
+
+        if (!m_Options.apiKey.empty())
+        {
+            m_Headers = curl_slist_append(m_Headers, fmt::format("X-API-Key: {}", m_Options.apiKey).c_str());
+        }
+        m_Headers = curl_slist_append(m_Headers, "Content-Type: application/octet-stream");
+        m_Headers = curl_slist_append(m_Headers, "Expect:");
+    }
+
+    ~Client()
+    {
+        curl_slist_free_all(m_Headers);
+        curl_easy_cleanup(m_Curl);
+    }
+
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+
+    void Send(const Request& request, WorkerStats& stats)
+    {
+        // Reset keeps the open connection, only the options of the previous request are cleared
+        curl_easy_reset(m_Curl);
+
+        uint64_t received = 0;
+        const std::string url = m_Options.url + request.path;
+        curl_easy_setopt(m_Curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(m_Curl, CURLOPT_HTTPHEADER, m_Headers);
+        curl_easy_setopt(m_Curl, CURLOPT_WRITEFUNCTION, DiscardCallback);
+        curl_easy_setopt(m_Curl, CURLOPT_WRITEDATA, &received);
+        curl_easy_setopt(m_Curl, CURLOPT_TIMEOUT_MS, static_cast<long>(m_Options.timeout));
+        curl_easy_setopt(m_Curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(m_Curl, CURLOPT_TCP_KEEPALIVE, 1L);
+
+        uint64_t sent = 0;
+        switch (request.operation)
+        {
+        case Operation::HEAD:
+            curl_easy_setopt(m_Curl, CURLOPT_NOBODY, 1L);
+            break;
+        case Operation::PUT:
+            sent = std::min<uint64_t>(request.size, m_UploadBuffer.size());
+            curl_easy_setopt(m_Curl, CURLOPT_CUSTOMREQUEST, "PUT");
+            curl_easy_setopt(m_Curl, CURLOPT_POSTFIELDS, m_UploadBuffer.data());
+            curl_easy_setopt(m_Curl, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(sent));
+            break;
+        default:
+            curl_easy_setopt(m_Curl, CURLOPT_HTTPGET, 1L);
+            break;
+        }
+
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        const CURLcode res = curl_easy_perform(m_Curl);
+        const int64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+        OperationStats& operationStats = stats[static_cast<size_t>(request.operation)];
+        operationStats.latencies.push_back(elapsed);
+        operationStats.bytesReceived += received;
+
+        if (res != CURLE_OK)
+        {
+            ++operationStats.errors;
+            ++operationStats.statusCodes[0];
+            return;
+        }
+
+        long statusCode = 0;
+        curl_easy_getinfo(m_Curl, CURLINFO_RESPONSE_CODE, &statusCode);
+        ++operationStats.statusCodes[statusCode];
+        operationStats.bytesSent += sent;
+
+        // Misses are an expected outcome, only server errors count as failures
+        if (statusCode >= 500 || (request.operation == Operation::PUT && statusCode >= 400))
+        {
+            ++operationStats.errors;
+        }
+    }
+
+private:
+    const BenchOptions& m_Options;
+    const std::vector<char>& m_UploadBuffer;
+    CURL* m_Curl;
+    curl_slist* m_Headers;
+};
+
+static size_t AppendCallback(void* contents, size_t size, size_t nmemb, void* userp)
+{
+    static_cast<std::string*>(userp)->append(static_cast<const char*>(contents), size * nmemb);
+    return size * nmemb;
+}
+
+/**
+ * @brief Get the thread placement and worker processes of the server from /status, to tell the runs apart
+ * @return The "affinity" and "workers" parts of the status, null if it cannot be read
+ */
+static nlohmann::json GetServerPlacement(const BenchOptions& options)
+{
+    CURL* curl = curl_easy_init();
+    if (!curl)
+    {
+        return nullptr;
+    }
+
+    curl_slist* headers = nullptr;
+    if (!options.apiKey.empty())
+    {
+        headers = curl_slist_append(headers, fmt::format("X-API-Key: {}", options.apiKey).c_str());
+    }
+
+    std::string body;
+    const std::string url = options.url + "/status";
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, AppendCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, static_cast<long>(options.timeout));
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+
+    const CURLcode res = curl_easy_perform(curl);
+    curl_slist_free_all(headers);
+    curl_easy_cleanup(curl);
+
+    const nlohmann::json status = res == CURLE_OK ? nlohmann::json::parse(body, nullptr, false) : nlohmann::json();
+    if (!status.is_object())
+    {
+        return nullptr;
+    }
+
+    nlohmann::json placement = nlohmann::json::object();
+    for (const char* key : { "affinity", "workers" })
+    {
+        if (status.contains(key))
+        {
+            placement[key] = status.at(key);
+        }
+    }
+    return placement;
+}
+
+/**
+ * @brief Compare a report with the one of a previous run, such as pinned against unpinned threads
+ * @return Ratios of this run over the baseline, above 1 for more throughput or higher latencies
+ */
+static nlohmann::json CompareReports(const nlohmann::json& report, const std::string& baselineFile)
+{
+    std::ifstream file(baselineFile);
+    if (!file.is_open())
+    {
+        throw std::runtime_error(fmt::format("Failed to open \"{}\".", baselineFile));
+    }
+
+    const nlohmann::json baseline = nlohmann::json::parse(file, nullptr, false);
+    if (!baseline.is_object())
+    {
+        throw std::runtime_error(fmt::format("\"{}\" is not a report.", baselineFile));
+    }
+
+    const auto ratio = [](const nlohmann::json& current, const nlohmann::json& previous) -> nlohmann::json
+    {
+        if (!current.is_number() || !previous.is_number() || previous.get<double>() == 0)
+        {
+            return nullptr;
+        }
+        return current.get<double>() / previous.get<double>();
+    };
+
+    const auto latencyRatios = [&ratio](const nlohmann::json& current, const nlohmann::json& previous)
+    {
+        nlohmann::json ratios = nlohmann::json::object();
+        for (const char* percentile : { "p50", "p90", "p99", "p999" })
+        {
+            ratios[percentile] = ratio(current.value(percentile, nlohmann::json()), previous.value(percentile, nlohmann::json()));
+        }
+        return ratios;
+    };
+
+    nlohmann::json comparison
+    {
+        { "baseline", baselineFile },
+        { "baseline_label", baseline.value("label", std::string()) },
+        { "throughput_rps", ratio(report.value("throughput_rps", nlohmann::json()), baseline.value("throughput_rps", nlohmann::json())) },
+        { "throughput_mbps", ratio(report.value("throughput_mbps", nlohmann::json()), baseline.value("throughput_mbps", nlohmann::json())) },
+        { "latency_us", latencyRatios(report.value("latency_us", nlohmann::json::object()), baseline.value("latency_us", nlohmann::json::object())) }
+    };
+
+    if (report.contains("operations") && baseline.contains("operations"))
+    {
+        for (const auto& [operation, current] : report.at("operations").items())
+        {
+            if (!baseline.at("operations").contains(operation))
+            {
+                continue;
+            }
+
+            const nlohmann::json& previous = baseline.at("operations").at(operation);
+            comparison["operations"][operation] =
+            {
+                { "throughput_rps", ratio(current.value("throughput_rps", nlohmann::json()), previous.value("throughput_rps", nlohmann::json())) },
+                { "latency_us", latencyRatios(current.value("latency_us", nlohmann::json::object()), previous.value("latency_us", nlohmann::json::object())) }
+            };
+        }
+    }
+
+    return comparison;
+}
+
+static nlohmann::json GetLatencySummary(std::vector<int64_t>& latencies)
+{
+    if (latencies.empty())
+    {
+        return nlohmann::json::object();
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    // Nearest rank
+    const auto percentile = [&latencies](double p)
+    {
+        const size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * latencies.size()));
+        return latencies[std::clamp<size_t>(rank, 1, latencies.size()) - 1];
+    };
+
+    int64_t sum = 0;
+    for (const int64_t latency : latencies)
+    {
+        sum += latency;
+    }
+
+    return
+    {
+        { "min", latencies.front() },
+        { "mean", static_cast<double>(sum) / latencies.size() },
+        { "p50", percentile(50) },
+        { "p90", percentile(90) },
+        { "p99", percentile(99) },
+        { "p999", percentile(99.9) },
+        { "max", latencies.back() }
+    };
+}
+
+/**
+ * @brief Upload the package population, so the hits of the synthetic workload find something
+ */
+static void Prepare(const BenchOptions& options, const Workload& workload, const std::vector<char>& uploadBuffer)
+{
+    std::cerr << "Uploading " << options.keys << " packages..." << std::endl;
+
+    std::atomic<uint64_t> nextKey{ 0 };
+    std::atomic<uint64_t> failures{ 0 };
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < options.concurrency; ++i)
+    {
+        threads.emplace_back([&]()
+        {
+            Client client(options, uploadBuffer);
+            WorkerStats stats;
+            for (uint64_t key = nextKey++; key < options.keys; key = nextKey++)
+            {
+                client.Send(workload.GetPrepareRequest(key), stats);
+            }
+            failures += stats[static_cast<size_t>(Operation::PUT)].errors;
+        });
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    if (failures > 0)
+    {
+        throw std::runtime_error(fmt::format("{} of {} packages failed to upload, check the URL and API key.", failures.load(), options.keys));
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    CLI::App app{ "vcpkg-http-cache-bench" };
+
+    BenchOptions options;
+    app.add_option("-u,--url", options.url, fmt::format("Base URL of the server (default: {})", options.url));
+    app.add_option("-k,--api-key", options.apiKey, "API key sent with every request");
+    app.add_option("-c,--concurrency", options.concurrency, fmt::format("Number of concurrent connections (default: {})", options.concurrency))->check(CLI::PositiveNumber);
+    app.add_option("-d,--duration", options.duration, fmt::format("Duration of the run in seconds (default: {})", options.duration));
+    app.add_option("-n,--requests", options.requests, "Stop after this many requests instead of the duration");
+    app.add_option("-m,--mix", options.mix, fmt::format("Request mix as weights (default: {})", options.mix));
+    app.add_option("-s,--sizes", options.sizes, fmt::format("Package size distribution: fixed:<size>, uniform:<min>:<max> or lognormal:<median>:<sigma> (default: {})", options.sizes));
+    app.add_option("--miss-ratio", options.missRatio, fmt::format("Fraction of HEAD/GET requests for packages that do not exist (default: {})", options.missRatio))->check(CLI::Range(0.0, 1.0));
+    app.add_option("--keys", options.keys, fmt::format("Number of packages uploaded before the run and read during it (default: {})", options.keys));
+    app.add_option("--zipf", options.zipf, "Zipf exponent of package popularity, 0 for uniform (default: 0)");
+    app.add_flag("--skip-prepare", options.skipPrepare, "Do not upload the packages before the run, they were uploaded by a previous run with the same seed");
+    app.add_option("-r,--replay", options.replayFile, "Replay the requests of an access log instead of the synthetic workload");
+    app.add_option("--replay-speed", options.replaySpeed, "Replay at this multiple of the recorded pace, 0 for as fast as possible (default: 0)");
+    app.add_option("--seed", options.seed, fmt::format("Random seed, also used to name packages (default: {})", options.seed));
+    app.add_option("--timeout", options.timeout, fmt::format("Request timeout in milliseconds (default: {})", options.timeout));
+    app.add_option("-o,--output", options.outputFile, "Write the JSON report to this file instead of stdout");
+    app.add_option("--cpus", options.cpus, "Pin the connections to these CPUs (e.g. 0-7 or node:1), one CPU each in turn, so the load generator does not compete with a pinned server");
+    app.add_option("--label", options.label, "Label of the run in the report, e.g. pinned or unpinned");
+    app.add_option("--baseline", options.baselineFile, "Report of a previous run to compare this run with, added to the report");
+
+    CLI11_PARSE(app, argc, argv);
+
+    try
+    {
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+
+        const std::optional<std::vector<uint32_t>> cpus = ParseCpuList(options.cpus);
+        if (!cpus.has_value())
+        {
+            throw std::runtime_error(fmt::format("Invalid CPU list \"{}\".", options.cpus));
+        }
+
+        std::optional<Workload> workload;
+        std::vector<Request> replay;
+        uint64_t maxUploadSize = 0;
+
+        if (!options.replayFile.empty())
+        {
+            replay = LoadAccessLog(options.replayFile);
+            for (const Request& request : replay)
+            {
+                maxUploadSize = std::max(maxUploadSize, request.operation == Operation::PUT ? request.size : 0);
+            }
+        }
+        else
+        {
+            workload.emplace(options);
+            maxUploadSize = workload->GetMaxUploadSize();
+        }
+
+        // Every upload sends a prefix of the same random buffer
+        std::vector<char> uploadBuffer(std::min(std::max<uint64_t>(maxUploadSize, 1), SizeDistribution::MaxSize));
+        std::mt19937_64 bufferRng(options.seed);
+        for (char& c : uploadBuffer)
+        {
+            c = static_cast<char>(bufferRng());
+        }
+
+        if (workload && workload->HasReads() && options.missRatio < 1.0 && !options.skipPrepare)
+        {
+            Prepare(options, workload.value(), uploadBuffer);
+        }
+
+        std::cerr << "Running with " << options.concurrency << " connections..." << std::endl;
+        const nlohmann::json serverPlacement = GetServerPlacement(options);
+
+        std::vector<WorkerStats> stats(options.concurrency);
+        std::atomic<uint64_t> nextRequest{ 0 };
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        const std::chrono::steady_clock::time_point deadline = start + std::chrono::seconds(options.duration);
+
+        std::vector<std::thread> threads;
+        for (uint32_t i = 0; i < options.concurrency; ++i)
+        {
+            threads.emplace_back([&, i]()
+            {
+                if (!cpus->empty())
+                {
+                    SetCurrentThreadAffinity({ cpus->at(i % cpus->size()) });
+                }
+
+                Client client(options, uploadBuffer);
+                std::mt19937_64 rng(options.seed + i + 1);
+
+                while (true)
+                {
+                    const uint64_t index = nextRequest++;
+                    if (!replay.empty())
+                    {
+                        if (index >= replay.size())
+                        {
+                            break;
+                        }
+
+                        const Request& request = replay[index];
+                        if (options.replaySpeed > 0 && request.offset > 0)
+                        {
+                            std::this_thread::sleep_until(start + std::chrono::microseconds(static_cast<int64_t>(request.offset / options.replaySpeed)));
+                        }
+                        client.Send(request, stats[i]);
+                    }
+                    else
+                    {
+                        if ((options.requests > 0 && index >= options.requests) || (options.requests == 0 && std::chrono::steady_clock::now() >= deadline))
+                        {
+                            break;
+                        }
+                        client.Send(workload->Next(rng), stats[i]);
+                    }
+                }
+            });
+        }
+
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        nlohmann::json report
+        {
+            { "label", options.label },
+            { "mode", replay.empty() ? "synthetic" : "replay" },
+            { "concurrency", options.concurrency },
+            { "duration_s", elapsed },
+            { "client_cpus", cpus.value() },
+            { "server", serverPlacement }
+        };
+
+        if (replay.empty())
+        {
+            report["workload"] = { { "mix", options.mix }, { "sizes", options.sizes }, { "miss_ratio", options.missRatio }, { "keys", options.keys }, { "zipf", options.zipf }, { "seed", options.seed } };
+        }
+        else
+        {
+            report["workload"] = { { "replay", options.replayFile }, { "replay_speed", options.replaySpeed } };
+        }
+
+        uint64_t totalRequests = 0;
+        uint64_t totalErrors = 0;
+        uint64_t totalSent = 0;
+        uint64_t totalReceived = 0;
+        std::vector<int64_t> allLatencies;
+
+        for (size_t operation = 0; operation < OperationCount; ++operation)
+        {
+            OperationStats merged;
+            for (WorkerStats& worker : stats)
+            {
+                OperationStats& operationStats = worker[operation];
+                merged.latencies.insert(merged.latencies.end(), operationStats.latencies.begin(), operationStats.latencies.end());
+                merged.errors += operationStats.errors;
+                merged.bytesSent += operationStats.bytesSent;
+                merged.bytesReceived += operationStats.bytesReceived;
+                for (const auto& [code, count] : operationStats.statusCodes)
+                {
+                    merged.statusCodes[code] += count;
+                }
+            }
+
+            if (merged.latencies.empty())
+            {
+                continue;
+            }
+
+            nlohmann::json statusCodes = nlohmann::json::object();
+            for (const auto& [code, count] : merged.statusCodes)
+            {
+                statusCodes[code == 0 ? std::string("transport_error") : std::to_string(code)] = count;
+            }
+
+            totalRequests += merged.latencies.size();
+            totalErrors += merged.errors;
+            totalSent += merged.bytesSent;
+            totalReceived += merged.bytesReceived;
+            allLatencies.insert(allLatencies.end(), merged.latencies.begin(), merged.latencies.end());
+
+            report["operations"][std::string(OperationNames[operation])] =
+            {
+                { "requests", merged.latencies.size() },
+                { "errors", merged.errors },
+                { "throughput_rps", merged.latencies.size() / elapsed },
+                { "sent_bytes", merged.bytesSent },
+                { "received_bytes", merged.bytesReceived },
+                { "status_codes", statusCodes },
+                { "latency_us", GetLatencySummary(merged.latencies) }
+            };
+        }
+
+        report["requests"] = totalRequests;
+        report["errors"] = totalErrors;
+        report["throughput_rps"] = totalRequests / elapsed;
+        report["sent_bytes"] = totalSent;
+        report["received_bytes"] = totalReceived;
+        report["throughput_mbps"] = (totalSent + totalReceived) * 8 / elapsed / 1e6;
+        report["latency_us"] = GetLatencySummary(allLatencies);
+
+        if (!options.baselineFile.empty())
+        {
+            report["comparison"] = CompareReports(report, options.baselineFile);
+        }
+
+        if (options.outputFile.empty())
+        {
+            std::cout << report.dump(4) << std::endl;
+        }
+        else
+        {
+            std::ofstream file(options.outputFile);
+            if (!file.is_open())
+            {
+                throw std::runtime_error(fmt::format("Failed to open \"{}\".", options.outputFile));
+            }
+            file << report.dump(4) << std::endl;
+        }
+
+        curl_global_cleanup();
+        return totalErrors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,543 @@
+#include <filters/authfilter.hpp>
+#include <metrics.hpp>
+#include <options.hpp>
+#include <packageindex.hpp>
+#include <packagerouter.hpp>
+#include <persistence.hpp>
+#include <policyengine.hpp>
+#include <requesttimer.hpp>
+#include <server.hpp>
+#include <storagetiers.hpp>
+
+#include <benchmark/benchmark.h>
+#include <fmt/core.h>
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+// Every allocation of the process goes through these, so each benchmark can report its allocations per iteration
+static thread_local uint64_t AllocationCount = 0;
+static thread_local uint64_t AllocatedBytes = 0;
+
+void* operator new(size_t size)
+{
+    ++AllocationCount;
+    AllocatedBytes += size;
+
+    if (void* ptr = std::malloc(size > 0 ? size : 1))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+/**
+ * @brief Reports the allocations made between its construction and Report() as per-iteration counters
+ */
+class AllocationCounter final
+{
+public:
+    AllocationCounter()
+        : m_Count(AllocationCount)
+        , m_Bytes(AllocatedBytes)
+    {
+    }
+
+    void Report(benchmark::State& state) const
+    {
+        state.counters["allocs"] = benchmark::Counter(static_cast<double>(AllocationCount - m_Count), benchmark::Counter::kAvgIterations);
+        state.counters["alloc_bytes"] = benchmark::Counter(static_cast<double>(AllocatedBytes - m_Bytes), benchmark::Counter::kAvgIterations);
+    }
+
+private:
+    const uint64_t m_Count;
+    const uint64_t m_Bytes;
+};
+
+/**
+ * @brief Access to the private hot-path helpers, declared as a friend by the classes exposing them
+ */
+struct BenchmarkAccess
+{
+    static bool IsValidHash(std::string_view hash)
+    {
+        return BinaryCacheServer::IsValidHash(hash);
+    }
+
+    static std::optional<std::string_view> ExtractApiKey(const ApiKeyFilter& filter, const drogon::HttpRequestPtr& req)
+    {
+        return filter.ExtractApiKey(req);
+    }
+
+    static drogon::HttpResponsePtr CreateUnauthorizedResponse(const ApiKeyFilter& filter, std::string_view message)
+    {
+        return filter.CreateUnauthorizedResponse(message);
+    }
+};
+
+static constexpr size_t ApiKeyCount = 1000;
+static constexpr size_t PackageCount = 100000;
+
+static const std::string Triplet{ "x64-linux" };
+static const std::string Name{ "zlib" };
+static const std::string Version{ "1.3.1" };
+static const std::string Sha{ "66672cc2e2ace73f33808e213287489112b3a9f1667f0f78b8af05003ebc262f" };
+static const std::string MissingSha{ "0000000000000000000000000000000000000000000000000000000000000000" };
+
+/**
+ * @brief Components shared by every benchmark, backed by a temporary directory
+ */
+class Environment final
+{
+public:
+    Environment()
+        : m_Directory(std::filesystem::temp_directory_path() / fmt::format("vcpkg-http-cache-microbench-{:016x}", std::random_device()()))
+        , m_PolicyEngine(std::make_shared<PolicyEngine>(m_PersistenceInfo))
+        , m_Metrics(std::make_shared<Metrics>())
+        , m_RequestTimer(std::make_shared<RequestTimer>(false, std::chrono::milliseconds(1000), 0))
+        , m_Filter(m_PolicyEngine, m_Metrics, m_RequestTimer, true, true, true)
+    {
+        m_Options.cache.directory = (m_Directory / "cache").string();
+        m_StorageTiers = std::make_unique<StorageTiers>(m_Options, nullptr);
+
+        for (size_t i = 0; i < ApiKeyCount; ++i)
+        {
+            const std::string key = m_PolicyEngine->CreateApiKey(fmt::format("Benchmark key {}", i), AccessPermission::READWRITE);
+            if (i == ApiKeyCount / 2)
+            {
+                m_ApiKey = key;
+            }
+        }
+
+        m_PackageIndex = std::make_unique<PackageIndex>(m_Directory / "index.bin");
+        m_PackageIndex->Open({ m_Options.cache.directory });
+        for (size_t i = 0; i < PackageCount; ++i)
+        {
+            m_PackageIndex->Insert(Triplet, fmt::format("package{}", i), Version, fmt::format("{:064x}", i), 1024 * 1024, 0);
+        }
+        m_PackageIndex->Insert(Triplet, Name, Version, Sha, 1024 * 1024, 0);
+    }
+
+    ~Environment()
+    {
+        m_PackageIndex.reset();
+        m_StorageTiers.reset();
+
+        std::error_code error;
+        std::filesystem::remove_all(m_Directory, error);
+    }
+
+    const ApiKeyFilter& GetFilter() const { return m_Filter; }
+    const PolicyEngine& GetPolicyEngine() const { return *m_PolicyEngine; }
+    const StorageTiers& GetStorageTiers() const { return *m_StorageTiers; }
+    const PackageIndex& GetPackageIndex() const { return *m_PackageIndex; }
+    const std::string& GetApiKey() const { return m_ApiKey; }
+
+private:
+    std::filesystem::path m_Directory;
+    Options m_Options;
+    PersistenceInfo m_PersistenceInfo;
+    std::shared_ptr<PolicyEngine> m_PolicyEngine;
+    std::shared_ptr<Metrics> m_Metrics;
+    std::shared_ptr<RequestTimer> m_RequestTimer;
+    ApiKeyFilter m_Filter;
+    std::unique_ptr<StorageTiers> m_StorageTiers;
+    std::unique_ptr<PackageIndex> m_PackageIndex;
+    std::string m_ApiKey;
+};
+
+static Environment& GetEnvironment()
+{
+    static Environment environment;
+    return environment;
+}
+
+static drogon::HttpRequestPtr CreateRequest(drogon::HttpMethod method, const std::string& header, const std::string& value)
+{
+    drogon::HttpRequestPtr req = drogon::HttpRequest::newHttpRequest();
+    req->setMethod(method);
+    req->setPath(fmt::format("/{}/{}/{}/{}", Triplet, Name, Version, Sha));
+    if (!header.empty())
+    {
+        req->addHeader(header, value);
+    }
+    return req;
+}
+
+static void BM_IsValidHash(benchmark::State& state)
+{
+    const AllocationCounter allocations;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(BenchmarkAccess::IsValidHash(Sha));
+    }
+    allocations.Report(state);
+}
+BENCHMARK(BM_IsValidHash);
+
+static void BM_PackageRouterParse(benchmark::State& state)
+{
+    const std::string path = state.range(0) ? fmt::format("/{}/{}/{}/{}", Triplet, Name, Version, Sha) : fmt::format("/{}.zip", Sha);
+
+    const AllocationCounter allocations;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(PackageRouter::Parse(path));
+    }
+    allocations.Report(state);
+}
+BENCHMARK(BM_PackageRouterParse)->Arg(1)->Arg(0);
+
+static void BM_GetPackagePath(benchmark::State& state)
+{
+    const StorageTiers& storageTiers = GetEnvironment().GetStorageTiers();
+
+    const AllocationCounter allocations;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(storageTiers.GetPackagePath(0, Triplet, Name, Version, Sha));
+    }
+    allocations.Report(state);
+}
+BENCHMARK(BM_GetPackagePath);
+
+static void BM_GetPackagePath_Reused(benchmark::State& state)
+{
+    const StorageTiers& storageTiers = GetEnvironment().GetStorageTiers();
+    std::string path;
+
+    const AllocationCounter allocations;
+    for (auto _ : state)
+    {
+        storageTiers.GetPackagePath(path, 0, Triplet, Name, Version, Sha);
+        benchmark::DoNotOptimize(path.data());
+    }
+    allocations.Report(state);
+}
+BENCHMARK(BM_GetPackagePath_Reused);
+
+static void BM_ExtractApiKey(benchmark::State& state)
+{
+    const Environment& environment = GetEnvironment();
+    const drogon::HttpRequestPtr req = CreateRequest(drogon::Head, "X-API-Key", environment.GetApiKey());
+
+    const AllocationCounter allocations;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(BenchmarkAccess::ExtractApiKey(environment.GetFilter(), req));
+    }
+    allocations.Report(state);
+}
+BENCHMARK(BM_ExtractApiKey);
+
+static void BM_ExtractApiKey_Bearer(benchmark::State& state)
+{
+    const Environment& environment = GetEnvironment();
+    const drogon::HttpRequestPtr req = CreateRequest(drogon::Head, "Authorization", "Bearer " + environment.GetApiKey());
+
+    const AllocationCounter allocations;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(BenchmarkAccess::ExtractApiKey(environment.GetFilter(), req));
+    }
+    allocations.Report(state);
+}
+BENCHMARK(BM_ExtractApiKey_Bearer);
+
+static void BM_ValidateApiKey(benchmark::State& state)
+{
+    const Environment& environment = GetEnvironment();
+
+    const AllocationCounter allocations;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(environment.GetPolicyEngine().ValidateApiKey(environment.GetApiKey(), AccessPermission::READ));
+    }
+    allocations.Report(state);
+}
+BENCHMARK(BM_ValidateApiKey);
+
+static void BM_ValidateApiKey_Unknown(benchmark::State& state)
+{
+    const Environment& environment = GetEnvironment();
+    const std::string apiKey{ "vcpkg_00000000000000000000000000000000" };
+
+    const AllocationCounter allocations;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(environment.GetPolicyEngine().ValidateApiKey(apiKey));
+    }
+    allocations.Report(state);
+}
+BENCHMARK(BM_ValidateApiKey_Unknown);
+
+static void BM_CreateUnauthorizedResponse(benchmark::State& state)
+{
+    const Environment& environment = GetEnvironment();
+
+    const AllocationCounter allocations;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(BenchmarkAccess::CreateUnauthorizedResponse(environment.GetFilter(), "Invalid API Key"));
+    }
+    allocations.Report(state);
+}
+BENCHMARK(BM_CreateUnauthorizedResponse);
+
+static void BM_PackageIndexFind(benchmark::State& state)
+{
+    const PackageIndex& packageIndex = GetEnvironment().GetPackageIndex();
+    const std::string& sha = state.range(0) ? Sha : MissingSha;
+
+    const AllocationCounter allocations;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(packageIndex.Find(Triplet, Name, Version, sha));
+    }
+    allocations.Report(state);
+}
+BENCHMARK(BM_PackageIndexFind)->Arg(1)->Arg(0);
+
+/**
+ * @brief Work done for an authorized HEAD request, from the API key filter to the index lookup
+ */
+static void BM_HeadRequestPath(benchmark::State& state)
+{
+    const Environment& environment = GetEnvironment();
+    const drogon::HttpRequestPtr req = CreateRequest(drogon::Head, "X-API-Key", environment.GetApiKey());
+
+    const AllocationCounter allocations;
+    for (auto _ : state)
+    {
+        const std::optional<std::string_view> apiKey = BenchmarkAccess::ExtractApiKey(environment.GetFilter(), req);
+        bool authorized = apiKey && environment.GetPolicyEngine().ValidateApiKey(apiKey.value()) && !environment.GetPolicyEngine().IsExpired(apiKey.value());
+        authorized = authorized && environment.GetPolicyEngine().ValidateApiKey(apiKey.value(), AccessPermission::READ);
+        authorized = authorized && BenchmarkAccess::IsValidHash(Sha);
+        benchmark::DoNotOptimize(authorized && environment.GetPackageIndex().Find(Triplet, Name, Version, Sha).has_value());
+    }
+    allocations.Report(state);
+}
+BENCHMARK(BM_HeadRequestPath);
+
+/**
+ * @brief Work done for a request rejected by the API key filter
+ */
+static void BM_RejectedRequestPath(benchmark::State& state)
+{
+    const Environment& environment = GetEnvironment();
+    const drogon::HttpRequestPtr req = CreateRequest(drogon::Head, "X-API-Key", "vcpkg_00000000000000000000000000000000");
+
+    const AllocationCounter allocations;
+    for (auto _ : state)
+    {
+        const std::optional<std::string_view> apiKey = BenchmarkAccess::ExtractApiKey(environment.GetFilter(), req);
+        if (!apiKey || !environment.GetPolicyEngine().ValidateApiKey(apiKey.value()))
+        {
+            benchmark::DoNotOptimize(BenchmarkAccess::CreateUnauthorizedResponse(environment.GetFilter(), "Invalid API Key"));
+        }
+    }
+    allocations.Report(state);
+}
+BENCHMARK(BM_RejectedRequestPath);
+
+struct BenchmarkResult
+{
+    double realTime; // Nanoseconds per iteration
+    double allocations;
+};
+
+static double GetNanosecondMultiplier(const std::string& unit)
+{
+    if (unit == "us")
+    {
+        return 1e3;
+    }
+    if (unit == "ms")
+    {
+        return 1e6;
+    }
+    if (unit == "s")
+    {
+        return 1e9;
+    }
+    return 1;
+}
+
+/**
+ * @brief Console reporter also keeping the fastest repetition of every benchmark, to compare with a baseline
+ */
+class CollectingReporter final : public benchmark::ConsoleReporter
+{
+public:
+    void ReportRuns(const std::vector<Run>& runs) override
+    {
+        benchmark::ConsoleReporter::ReportRuns(runs);
+
+        for (const Run& run : runs)
+        {
+            if (run.run_type != Run::RT_Iteration)
+            {
+                continue;
+            }
+
+            const auto allocations = run.counters.find("allocs");
+            AddResult(m_Results, run.benchmark_name(), BenchmarkResult
+            {
+                run.GetAdjustedRealTime() * GetNanosecondMultiplier(benchmark::GetTimeUnitString(run.time_unit)),
+                allocations != run.counters.end() ? static_cast<double>(allocations->second) : 0
+            });
+        }
+    }
+
+    const std::map<std::string, BenchmarkResult>& GetResults() const { return m_Results; }
+
+    static void AddResult(std::map<std::string, BenchmarkResult>& results, const std::string& name, const BenchmarkResult& result)
+    {
+        const auto [it, inserted] = results.emplace(name, result);
+        if (!inserted)
+        {
+            it->second.realTime = std::min(it->second.realTime, result.realTime);
+        }
+    }
+
+private:
+    std::map<std::string, BenchmarkResult> m_Results;
+};
+
+/**
+ * @brief Load a baseline written with --benchmark_out=<file> --benchmark_out_format=json
+ */
+static std::map<std::string, BenchmarkResult> LoadBaseline(const std::string& filename)
+{
+    std::ifstream file(filename);
+    if (!file.is_open())
+    {
+        throw std::runtime_error(fmt::format("Failed to open baseline \"{}\".", filename));
+    }
+
+    const nlohmann::json json = nlohmann::json::parse(file);
+
+    std::map<std::string, BenchmarkResult> results;
+    for (const nlohmann::json& benchmark : json.at("benchmarks"))
+    {
+        if (benchmark.value("run_type", std::string("iteration")) != "iteration")
+        {
+            continue;
+        }
+
+        CollectingReporter::AddResult(results, benchmark.at("name").get<std::string>(), BenchmarkResult
+        {
+            benchmark.at("real_time").get<double>() * GetNanosecondMultiplier(benchmark.value("time_unit", std::string("ns"))),
+            benchmark.value("allocs", 0.0)
+        });
+    }
+
+    return results;
+}
+
+/**
+ * @brief Print the comparison with the baseline
+ * @return false if a benchmark is slower than allowed, or allocates more than before
+ */
+static bool CompareWithBaseline(const std::map<std::string, BenchmarkResult>& baseline, const std::map<std::string, BenchmarkResult>& results, double maxRegression)
+{
+    bool passed = true;
+
+    std::cout << std::endl << fmt::format("{:<40} {:>14} {:>14} {:>9} {:>16}", "Benchmark", "Baseline (ns)", "Current (ns)", "Change", "Allocations") << std::endl;
+    for (const auto& [name, result] : results)
+    {
+        const auto it = baseline.find(name);
+        if (it == baseline.end())
+        {
+            std::cout << fmt::format("{:<40} {:>14} {:>14.1f} {:>9} {:>16.1f}", name, "-", result.realTime, "new", result.allocations) << std::endl;
+            continue;
+        }
+
+        const double change = (result.realTime / it->second.realTime - 1) * 100;
+
+        // Allocation counts are averages over the iterations, allow for rounding
+        const bool slower = change > maxRegression;
+        const bool allocatesMore = result.allocations > it->second.allocations + 0.01;
+
+        std::cout << fmt::format("{:<40} {:>14.1f} {:>14.1f} {:>+8.1f}% {:>7.1f} -> {:<6.1f}{}", name, it->second.realTime, result.realTime, change, it->second.allocations, result.allocations,
+                                 slower || allocatesMore ? " REGRESSION" : "") << std::endl;
+
+        passed = passed && !slower && !allocatesMore;
+    }
+
+    return passed;
+}
+
+int main(int argc, char* argv[])
+{
+    // Options of the baseline comparison, the others are passed to Google Benchmark
+    std::string baselineFile;
+    double maxRegression = 10;
+
+    std::vector<char*> args;
+    for (int i = 0; i < argc; ++i)
+    {
+        const std::string_view arg = argv[i];
+        if (arg.starts_with("--baseline="))
+        {
+            baselineFile = arg.substr(std::string_view("--baseline=").size());
+        }
+        else if (arg.starts_with("--max_regression="))
+        {
+            maxRegression = std::stod(std::string(arg.substr(std::string_view("--max_regression=").size())));
+        }
+        else
+        {
+            args.push_back(argv[i]);
+        }
+    }
+
+    int benchmarkArgc = static_cast<int>(args.size());
+    benchmark::Initialize(&benchmarkArgc, args.data());
+    if (benchmark::ReportUnrecognizedArguments(benchmarkArgc, args.data()))
+    {
+        return EXIT_FAILURE;
+    }
+
+    try
+    {
+        // Loaded first, a missing baseline should not wait for the whole run
+        const std::map<std::string, BenchmarkResult> baseline = baselineFile.empty() ? std::map<std::string, BenchmarkResult>() : LoadBaseline(baselineFile);
+
+        CollectingReporter reporter;
+        benchmark::RunSpecifiedBenchmarks(&reporter);
+        benchmark::Shutdown();
+
+        if (!baselineFile.empty() && !CompareWithBaseline(baseline, reporter.GetResults(), maxRegression))
+        {
+            std::cerr << "Benchmarks regressed by more than " << maxRegression << "% or allocate more than the baseline" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
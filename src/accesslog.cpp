@@ -0,0 +1,310 @@
+#include <accesslog.hpp>
+
+#include <metrics.hpp>
+#include <threadutils.hpp>
+
+#include <fmt/chrono.h>
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <iostream>
+#include <string_view>
+
+struct AccessLog::Ring
+{
+    explicit Ring(size_t capacity)
+        : records(capacity)
+        , head(0)
+        , tail(0)
+        , dropped(0)
+    {
+    }
+
+    std::vector<Record> records;
+
+    // Written by the owning thread only
+    alignas(64) std::atomic<uint64_t> head;
+    std::atomic<uint64_t> dropped;
+
+    // Written by the writer thread only
+    alignas(64) std::atomic<uint64_t> tail;
+};
+
+static std::string_view GetMethodName(uint8_t method)
+{
+    switch (static_cast<drogon::HttpMethod>(method))
+    {
+    case drogon::Get:
+        return "GET";
+    case drogon::Post:
+        return "POST";
+    case drogon::Head:
+        return "HEAD";
+    case drogon::Put:
+        return "PUT";
+    case drogon::Delete:
+        return "DELETE";
+    case drogon::Options:
+        return "OPTIONS";
+    case drogon::Patch:
+        return "PATCH";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+static void AppendJsonEscaped(std::string& out, std::string_view str)
+{
+    for (const char c : str)
+    {
+        switch (c)
+        {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20)
+            {
+                out += fmt::format("\\u{:04x}", static_cast<unsigned char>(c));
+            }
+            else
+            {
+                out += c;
+            }
+            break;
+        }
+    }
+}
+
+static size_t CopyTruncated(char* destination, size_t capacity, std::string_view source)
+{
+    const size_t length = std::min(capacity, source.size());
+    std::memcpy(destination, source.data(), length);
+    return length;
+}
+
+AccessLog::AccessLog(const std::filesystem::path& path, uint64_t maxFileSize, uint32_t maxFiles, uint32_t bufferSize, std::chrono::milliseconds flushInterval)
+    : m_Path(path)
+    , m_MaxFileSize(maxFileSize)
+    , m_MaxFiles(maxFiles)
+    , m_BufferSize(std::bit_ceil(std::max<size_t>(bufferSize, 64)))
+    , m_FlushInterval(flushInterval)
+    , m_File(nullptr)
+    , m_FileSize(0)
+    , m_Written(0)
+    , m_ReportedDrops(0)
+    , m_ShouldContinue(true)
+{
+    if (m_Path.has_parent_path() && !std::filesystem::exists(m_Path.parent_path()))
+    {
+        std::filesystem::create_directories(m_Path.parent_path());
+    }
+
+    m_File = std::fopen(m_Path.string().c_str(), "ab");
+    if (!m_File)
+    {
+        throw std::runtime_error(fmt::format("Failed to open access log \"{}\".", m_Path.string()));
+    }
+
+    std::error_code error;
+    m_FileSize = std::filesystem::file_size(m_Path, error);
+
+    m_Thread = std::thread(&AccessLog::WriterThread, this);
+}
+
+AccessLog::~AccessLog()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_ShouldContinue = false;
+    }
+    m_Condition.notify_all();
+
+    if (m_Thread.joinable())
+    {
+        m_Thread.join();
+    }
+
+    if (m_File)
+    {
+        std::fclose(m_File);
+    }
+}
+
+void AccessLog::OnResponse(const drogon::HttpRequestPtr& req, const drogon::HttpResponsePtr& resp)
+{
+    Ring& ring = GetRing();
+
+    const uint64_t head = ring.head.load(std::memory_order_relaxed);
+    if (head - ring.tail.load(std::memory_order_acquire) >= ring.records.size())
+    {
+        // Never block a request on the log, the writer reports the loss instead
+        ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+    }
+
+    const int64_t now = trantor::Date::now().microSecondsSinceEpoch();
+    const int64_t start = req->creationDate().microSecondsSinceEpoch();
+
+    Record& record = ring.records[head & (ring.records.size() - 1)];
+    record.time = start;
+    record.duration = std::max<int64_t>(now - start, 0);
+    record.bytesReceived = req->getBody().size();
+    record.bytesSent = Metrics::GetBodySize(req, resp);
+    record.statusCode = static_cast<uint16_t>(resp->getStatusCode());
+    record.method = static_cast<uint8_t>(req->getMethod());
+    record.pathLength = static_cast<uint8_t>(CopyTruncated(record.path, sizeof(record.path), req->getPath()));
+
+    const std::string peer = req->peerAddr().toIp();
+    const size_t peerLength = CopyTruncated(record.peer, sizeof(record.peer) - 1, peer);
+    record.peer[peerLength] = '\0';
+
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+uint64_t AccessLog::GetDroppedCount() const
+{
+    uint64_t dropped = 0;
+
+    for (const Ring* ring : m_Rings.GetAll())
+    {
+        dropped += ring->dropped.load(std::memory_order_relaxed);
+    }
+
+    return dropped;
+}
+
+AccessLog::Ring& AccessLog::GetRing()
+{
+    return m_Rings.Get([this]() { return std::make_unique<Ring>(m_BufferSize); });
+}
+
+void AccessLog::WriterThread()
+{
+    ThreadPlacement::Apply(ThreadRole::BACKGROUND);
+
+    std::string buffer;
+    buffer.reserve(1024 * 1024);
+
+    while (true)
+    {
+        bool shouldContinue;
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_Condition.wait_for(lock, m_FlushInterval, [this]() { return !m_ShouldContinue; });
+            shouldContinue = m_ShouldContinue;
+        }
+
+        // One last drain on shutdown, so the requests handled before it are not lost
+        Drain(buffer);
+
+        if (!shouldContinue)
+        {
+            break;
+        }
+    }
+}
+
+void AccessLog::Drain(std::string& buffer)
+{
+    const std::vector<Ring*> rings = m_Rings.GetAll();
+
+    buffer.clear();
+    uint64_t written = 0;
+    uint64_t dropped = 0;
+
+    for (Ring* ring : rings)
+    {
+        const uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        const uint64_t head = ring->head.load(std::memory_order_acquire);
+
+        for (uint64_t position = tail; position != head; ++position)
+        {
+            const Record& record = ring->records[position & (ring->records.size() - 1)];
+
+            buffer += fmt::format("{{\"time\":\"{:%Y-%m-%dT%H:%M:%S}.{:06}Z\",\"method\":\"{}\",\"path\":\"",
+                                  fmt::gmtime(static_cast<std::time_t>(record.time / 1000000)), record.time % 1000000, GetMethodName(record.method));
+            AppendJsonEscaped(buffer, std::string_view(record.path, record.pathLength));
+            buffer += fmt::format("\",\"status\":{},\"duration_us\":{},\"bytes_received\":{},\"bytes_sent\":{},\"peer\":\"{}\"}}\n",
+                                  record.statusCode, record.duration, record.bytesReceived, record.bytesSent, record.peer);
+        }
+
+        written += head - tail;
+        ring->tail.store(head, std::memory_order_release);
+
+        dropped += ring->dropped.load(std::memory_order_relaxed);
+    }
+
+    if (dropped > m_ReportedDrops)
+    {
+        buffer += fmt::format("{{\"event\":\"dropped\",\"count\":{}}}\n", dropped - m_ReportedDrops);
+        m_ReportedDrops = dropped;
+    }
+
+    if (!buffer.empty())
+    {
+        Write(buffer);
+        m_Written += written;
+    }
+}
+
+void AccessLog::Write(const std::string& buffer)
+{
+    if (m_MaxFileSize > 0 && m_FileSize > 0 && m_FileSize + buffer.size() > m_MaxFileSize)
+    {
+        Rotate();
+    }
+
+    if (!m_File)
+    {
+        // Reopening failed after a rotation, retry with every batch
+        m_File = std::fopen(m_Path.string().c_str(), "ab");
+        if (!m_File)
+        {
+            return;
+        }
+    }
+
+    if (std::fwrite(buffer.data(), 1, buffer.size(), m_File) != buffer.size())
+    {
+        std::cerr << "Error writing access log " << m_Path.string() << std::endl;
+    }
+    std::fflush(m_File);
+    m_FileSize += buffer.size();
+}
+
+void AccessLog::Rotate()
+{
+    if (m_File)
+    {
+        std::fclose(m_File);
+        m_File = nullptr;
+    }
+
+    std::error_code error;
+    if (m_MaxFiles == 0)
+    {
+        std::filesystem::remove(m_Path, error);
+    }
+    else
+    {
+        // path.N-1 becomes path.N (dropping the oldest one), ..., path becomes path.1
+        for (uint32_t i = m_MaxFiles; i > 1; --i)
+        {
+            std::filesystem::rename(fmt::format("{}.{}", m_Path.string(), i - 1), fmt::format("{}.{}", m_Path.string(), i), error);
+        }
+        std::filesystem::rename(m_Path, fmt::format("{}.1", m_Path.string()), error);
+    }
+
+    m_File = std::fopen(m_Path.string().c_str(), "ab");
+    m_FileSize = 0;
+    if (!m_File)
+    {
+        std::cerr << "Error reopening access log " << m_Path.string() << std::endl;
+    }
+}
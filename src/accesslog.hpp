@@ -0,0 +1,96 @@
+#pragma once
+
+#include <perthread.hpp>
+
+#include <drogon/HttpRequest.h>
+#include <drogon/HttpResponse.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Access log of every request, written as JSON lines by a background thread
+ *
+ * Each thread pushes fixed-size records into its own single-producer single-consumer ring buffer,
+ * so logging a request neither allocates nor takes a lock. The writer thread drains all rings in
+ * batches, rotates the file once it reaches its maximum size, and counts the records dropped when a
+ * ring is full instead of blocking the request.
+ */
+class AccessLog final
+{
+public:
+    /**
+     * @brief Constructor
+     * @param path Location of the log file
+     * @param maxFileSize Size at which the file is rotated (0 to never rotate)
+     * @param maxFiles Number of rotated files kept, as path.1 to path.N
+     * @param bufferSize Number of records buffered per thread, rounded up to a power of two
+     * @param flushInterval Interval between two batches written by the background thread
+     */
+    AccessLog(const std::filesystem::path& path, uint64_t maxFileSize, uint32_t maxFiles, uint32_t bufferSize, std::chrono::milliseconds flushInterval);
+    ~AccessLog();
+
+    /**
+     * @brief Called from the pre-sending advice, records the request
+     */
+    void OnResponse(const drogon::HttpRequestPtr& req, const drogon::HttpResponsePtr& resp);
+
+    uint64_t GetWrittenCount() const { return m_Written; }
+    uint64_t GetDroppedCount() const;
+
+private:
+    struct Record
+    {
+        int64_t time;     // Microseconds since epoch
+        int64_t duration; // Microseconds
+        uint64_t bytesReceived;
+        uint64_t bytesSent;
+        uint16_t statusCode;
+        uint8_t method;
+        uint8_t pathLength;
+        char peer[46];    // Long enough for any IPv6 address
+        char path[192];   // Truncated beyond that
+    };
+
+    struct Ring;
+
+    Ring& GetRing();
+
+    void WriterThread();
+
+    /**
+     * @brief Move the records of every ring to the log file
+     */
+    void Drain(std::string& buffer);
+
+    void Write(const std::string& buffer);
+    void Rotate();
+
+private:
+    std::filesystem::path m_Path;
+    uint64_t m_MaxFileSize;
+    uint32_t m_MaxFiles;
+    size_t m_BufferSize;
+    std::chrono::milliseconds m_FlushInterval;
+
+    PerThread<Ring> m_Rings;
+
+    std::FILE* m_File;
+    uint64_t m_FileSize;
+    std::atomic<uint64_t> m_Written;
+    uint64_t m_ReportedDrops;
+
+    std::atomic<bool> m_ShouldContinue;
+    std::mutex m_Mutex;
+    std::condition_variable m_Condition;
+    std::thread m_Thread;
+};
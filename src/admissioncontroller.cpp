@@ -0,0 +1,325 @@
+#include <admissioncontroller.hpp>
+
+#include <metrics.hpp>
+#include <responsecache.hpp>
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <string_view>
+#include <vector>
+
+static const std::string AdmissionAttribute{ "admissionClass" };
+
+// Key of the shared 503 response, distinct from the bodies used as keys by ResponseCache::Get()
+static constexpr std::string_view ShedResponseKey{ "admission" };
+
+static constexpr std::array<std::string_view, static_cast<size_t>(RequestClass::COUNT)> ClassNames = { "head", "get", "put", "admin" };
+
+AdmissionController::AdmissionController(const std::array<ClassLimits, static_cast<size_t>(RequestClass::COUNT)>& limits, uint32_t maxInFlight, std::chrono::seconds retryAfter)
+    : m_MaxInFlight(maxInFlight)
+    , m_RetryAfter(retryAfter)
+    , m_InFlight(0)
+{
+    for (size_t i = 0; i < m_Classes.size(); ++i)
+    {
+        m_Classes[i].limits = limits[i];
+        m_Classes[i].active = 0;
+        m_Classes[i].admitted = 0;
+        m_Classes[i].queued = 0;
+        m_Classes[i].shed = 0;
+    }
+}
+
+std::optional<RequestClass> AdmissionController::Classify(const drogon::HttpRequestPtr& req)
+{
+    const std::string_view path = req->getPath();
+    if (path.starts_with("/health/"))
+    {
+        return std::nullopt;
+    }
+
+    switch (Metrics::GetRoute(req->getMethod(), path))
+    {
+    case MetricsRoute::HEAD:
+    case MetricsRoute::CHECK:
+        return RequestClass::HEAD;
+    case MetricsRoute::GET:
+    case MetricsRoute::DOWNLOAD:
+        return RequestClass::GET;
+    case MetricsRoute::PUT:
+        return RequestClass::PUT;
+    default:
+        return RequestClass::ADMIN;
+    }
+}
+
+void AdmissionController::OnRequest(const drogon::HttpRequestPtr& req, drogon::AdviceCallback&& acb, drogon::AdviceChainCallback&& accb)
+{
+    const std::optional<RequestClass> requestClass = Classify(req);
+    if (!requestClass.has_value())
+    {
+        accb();
+        return;
+    }
+
+    ClassState& state = m_Classes[static_cast<size_t>(requestClass.value())];
+    if (!IsTracked(requestClass.value()))
+    {
+        state.admitted.fetch_add(1, std::memory_order_relaxed);
+        accb();
+        return;
+    }
+
+    std::shared_ptr<Ticket> ticket;
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        // Requests already waiting go first
+        if (state.queue.empty() && HasCapacity(requestClass.value()))
+        {
+            ++state.active;
+            if (requestClass.value() != RequestClass::HEAD)
+            {
+                ++m_InFlight;
+            }
+            lock.unlock();
+
+            Acquire(req, requestClass.value());
+            accb();
+            return;
+        }
+
+        trantor::EventLoop* loop = trantor::EventLoop::getEventLoopOfCurrentThread();
+        if (loop == nullptr || state.queue.size() >= state.limits.queueSize || state.limits.maxQueueTime.count() <= 0)
+        {
+            lock.unlock();
+
+            Shed(requestClass.value(), acb);
+            return;
+        }
+
+        ticket = std::make_shared<Ticket>(Ticket{ requestClass.value(), req, std::chrono::steady_clock::now(), loop, std::move(acb), std::move(accb), true });
+        state.queue.push_back(ticket);
+        state.queued.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    ticket->loop->runAfter(std::chrono::duration<double>(state.limits.maxQueueTime).count(), [this, ticket]()
+    {
+        ShedExpired(ticket);
+    });
+}
+
+void AdmissionController::OnResponse(const drogon::HttpRequestPtr& req)
+{
+    if (!req->attributes()->find(AdmissionAttribute))
+    {
+        return;
+    }
+
+    const RequestClass requestClass = req->attributes()->get<RequestClass>(AdmissionAttribute);
+    req->attributes()->erase(AdmissionAttribute);
+
+    std::vector<std::shared_ptr<Ticket>> admitted;
+    std::vector<std::shared_ptr<Ticket>> expired;
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        --m_Classes[static_cast<size_t>(requestClass)].active;
+        if (requestClass != RequestClass::HEAD)
+        {
+            --m_InFlight;
+        }
+
+        while (std::shared_ptr<Ticket> ticket = Dequeue(expired))
+        {
+            admitted.push_back(std::move(ticket));
+        }
+    }
+
+    // Queued requests resume on the IO loop of their connection
+    for (const std::shared_ptr<Ticket>& ticket : admitted)
+    {
+        ticket->loop->queueInLoop([this, ticket]()
+        {
+            Acquire(ticket->req, ticket->requestClass);
+            ticket->accb();
+        });
+    }
+
+    for (const std::shared_ptr<Ticket>& ticket : expired)
+    {
+        ticket->loop->queueInLoop([this, ticket]()
+        {
+            Shed(ticket->requestClass, ticket->acb);
+        });
+    }
+}
+
+nlohmann::json AdmissionController::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    nlohmann::json stats;
+    stats["max_in_flight"] = m_MaxInFlight;
+    stats["in_flight"] = m_InFlight;
+    stats["retry_after"] = m_RetryAfter.count();
+
+    for (size_t i = 0; i < m_Classes.size(); ++i)
+    {
+        const ClassState& state = m_Classes[i];
+        nlohmann::json& classStats = stats["classes"][std::string(ClassNames[i])];
+        classStats["concurrency"] = state.limits.concurrency;
+        classStats["queue_size"] = state.limits.queueSize;
+        classStats["max_queue_time_ms"] = state.limits.maxQueueTime.count();
+        classStats["active"] = state.active;
+        classStats["waiting"] = state.queue.size();
+        classStats["admitted"] = state.admitted.load(std::memory_order_relaxed);
+        classStats["queued"] = state.queued.load(std::memory_order_relaxed);
+        classStats["shed"] = state.shed.load(std::memory_order_relaxed);
+    }
+
+    return stats;
+}
+
+void AdmissionController::Export(std::string& out) const
+{
+    std::array<uint32_t, static_cast<size_t>(RequestClass::COUNT)> active{};
+    std::array<size_t, static_cast<size_t>(RequestClass::COUNT)> waiting{};
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        for (size_t i = 0; i < m_Classes.size(); ++i)
+        {
+            active[i] = m_Classes[i].active;
+            waiting[i] = m_Classes[i].queue.size();
+        }
+    }
+
+    out += "# HELP vcpkg_cache_admission_active Requests holding an admission slot, by class\n";
+    out += "# TYPE vcpkg_cache_admission_active gauge\n";
+    for (size_t i = 0; i < m_Classes.size(); ++i)
+    {
+        out += fmt::format("vcpkg_cache_admission_active{{class=\"{}\"}} {}\n", ClassNames[i], active[i]);
+    }
+
+    out += "# HELP vcpkg_cache_admission_waiting Requests waiting for an admission slot, by class\n";
+    out += "# TYPE vcpkg_cache_admission_waiting gauge\n";
+    for (size_t i = 0; i < m_Classes.size(); ++i)
+    {
+        out += fmt::format("vcpkg_cache_admission_waiting{{class=\"{}\"}} {}\n", ClassNames[i], waiting[i]);
+    }
+
+    out += "# HELP vcpkg_cache_admission_admitted_total Requests admitted, by class\n";
+    out += "# TYPE vcpkg_cache_admission_admitted_total counter\n";
+    for (size_t i = 0; i < m_Classes.size(); ++i)
+    {
+        out += fmt::format("vcpkg_cache_admission_admitted_total{{class=\"{}\"}} {}\n", ClassNames[i], m_Classes[i].admitted.load(std::memory_order_relaxed));
+    }
+
+    out += "# HELP vcpkg_cache_admission_queued_total Requests that had to wait for an admission slot, by class\n";
+    out += "# TYPE vcpkg_cache_admission_queued_total counter\n";
+    for (size_t i = 0; i < m_Classes.size(); ++i)
+    {
+        out += fmt::format("vcpkg_cache_admission_queued_total{{class=\"{}\"}} {}\n", ClassNames[i], m_Classes[i].queued.load(std::memory_order_relaxed));
+    }
+
+    out += "# HELP vcpkg_cache_admission_shed_total Requests rejected with a 503 by the admission control, by class\n";
+    out += "# TYPE vcpkg_cache_admission_shed_total counter\n";
+    for (size_t i = 0; i < m_Classes.size(); ++i)
+    {
+        out += fmt::format("vcpkg_cache_admission_shed_total{{class=\"{}\"}} {}\n", ClassNames[i], m_Classes[i].shed.load(std::memory_order_relaxed));
+    }
+}
+
+bool AdmissionController::IsTracked(RequestClass requestClass) const
+{
+    return m_Classes[static_cast<size_t>(requestClass)].limits.concurrency > 0 || (requestClass != RequestClass::HEAD && m_MaxInFlight > 0);
+}
+
+bool AdmissionController::HasCapacity(RequestClass requestClass) const
+{
+    const ClassState& state = m_Classes[static_cast<size_t>(requestClass)];
+    if (state.limits.concurrency > 0 && state.active >= state.limits.concurrency)
+    {
+        return false;
+    }
+
+    return requestClass == RequestClass::HEAD || m_MaxInFlight == 0 || m_InFlight < m_MaxInFlight;
+}
+
+void AdmissionController::Acquire(const drogon::HttpRequestPtr& req, RequestClass requestClass)
+{
+    req->attributes()->insert(AdmissionAttribute, requestClass);
+    m_Classes[static_cast<size_t>(requestClass)].admitted.fetch_add(1, std::memory_order_relaxed);
+}
+
+void AdmissionController::Shed(RequestClass requestClass, const drogon::AdviceCallback& acb)
+{
+    m_Classes[static_cast<size_t>(requestClass)].shed.fetch_add(1, std::memory_order_relaxed);
+
+    drogon::HttpResponsePtr resp = ResponseCache::Find(drogon::k503ServiceUnavailable, ShedResponseKey);
+    if (!resp)
+    {
+        resp = drogon::HttpResponse::newHttpResponse();
+        resp->setStatusCode(drogon::k503ServiceUnavailable);
+        resp->setBody("Server is overloaded, retry later");
+        resp->addHeader("Retry-After", std::to_string(m_RetryAfter.count()));
+        resp = ResponseCache::Add(drogon::k503ServiceUnavailable, ShedResponseKey, std::move(resp));
+    }
+
+    acb(resp);
+}
+
+void AdmissionController::ShedExpired(const std::shared_ptr<Ticket>& ticket)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (!ticket->queued)
+        {
+            return;
+        }
+
+        std::deque<std::shared_ptr<Ticket>>& queue = m_Classes[static_cast<size_t>(ticket->requestClass)].queue;
+        queue.erase(std::find(queue.begin(), queue.end(), ticket));
+        ticket->queued = false;
+    }
+
+    Shed(ticket->requestClass, ticket->acb);
+}
+
+std::shared_ptr<AdmissionController::Ticket> AdmissionController::Dequeue(std::vector<std::shared_ptr<Ticket>>& expired)
+{
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    // Classes are ordered by priority, HEAD first
+    for (size_t i = 0; i < m_Classes.size(); ++i)
+    {
+        ClassState& state = m_Classes[i];
+
+        // Their timer may not have fired yet
+        while (!state.queue.empty() && now - state.queue.front()->queueTime >= state.limits.maxQueueTime)
+        {
+            state.queue.front()->queued = false;
+            expired.push_back(std::move(state.queue.front()));
+            state.queue.pop_front();
+        }
+
+        if (state.queue.empty() || !HasCapacity(static_cast<RequestClass>(i)))
+        {
+            continue;
+        }
+
+        std::shared_ptr<Ticket> ticket = std::move(state.queue.front());
+        state.queue.pop_front();
+        ticket->queued = false;
+
+        ++state.active;
+        if (ticket->requestClass != RequestClass::HEAD)
+        {
+            ++m_InFlight;
+        }
+        return ticket;
+    }
+
+    return nullptr;
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <drogon/HttpAppFramework.h>
+#include <drogon/HttpRequest.h>
+#include <drogon/HttpResponse.h>
+#include <nlohmann/json.hpp>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Classes of requests admitted separately, from the most to the least latency sensitive
+ */
+enum class RequestClass
+{
+    HEAD,  // HEAD on a package, POST /api/packages/check
+    GET,   // GET on a package, POST /api/packages/download
+    PUT,   // PUT on a package
+    ADMIN, // Status, metrics, API keys and anything else
+    COUNT
+};
+
+/**
+ * @brief Admission control in front of the request handlers, with a concurrency limit and a queue per request class
+ *
+ * A request of a class at its concurrency limit waits in the queue of its class, and is shed with a 503
+ * and a Retry-After header when the queue is full or when it waited longer than the maximum queue time,
+ * so a burst of large uploads cannot starve the checks gating every build. A request holds its slot from
+ * the pre-routing advice until its response is about to be sent.
+ *
+ * GET, PUT and admin requests also share an optional global limit. HEAD requests never count towards it,
+ * and when a slot is released the HEAD queue is always served first. Classes without a concurrency limit
+ * that are not covered by the global limit are admitted without being tracked. Health probes are never
+ * limited.
+ */
+class AdmissionController final
+{
+public:
+    /**
+     * @brief Limits of a request class
+     */
+    struct ClassLimits
+    {
+        uint32_t concurrency; // 0 for unlimited
+        uint32_t queueSize;
+        std::chrono::milliseconds maxQueueTime;
+    };
+
+    /**
+     * @brief Constructor
+     * @param limits Limits of every request class, in RequestClass order
+     * @param maxInFlight Requests admitted at once over the GET, PUT and admin classes, 0 for unlimited
+     * @param retryAfter Delay suggested to the clients of shed requests
+     */
+    AdmissionController(const std::array<ClassLimits, static_cast<size_t>(RequestClass::COUNT)>& limits, uint32_t maxInFlight, std::chrono::seconds retryAfter);
+
+    /**
+     * @brief Get the class of a request
+     * @return The class, or std::nullopt for requests that are never limited
+     */
+    static std::optional<RequestClass> Classify(const drogon::HttpRequestPtr& req);
+
+    /**
+     * @brief Called from the pre-routing advice, admits, queues or sheds the request
+     * @param acb Called with the 503 response when the request is shed
+     * @param accb Called when the request is admitted, possibly later from its IO loop
+     */
+    void OnRequest(const drogon::HttpRequestPtr& req, drogon::AdviceCallback&& acb, drogon::AdviceChainCallback&& accb);
+
+    /**
+     * @brief Called from the pre-sending advice, releases the slot of the request and admits the next queued one
+     */
+    void OnResponse(const drogon::HttpRequestPtr& req);
+
+    /**
+     * @brief Get the limits, active and queued requests and counters of every class
+     */
+    nlohmann::json GetStats() const;
+
+    /**
+     * @brief Append the admission metrics to a Prometheus text exposition
+     */
+    void Export(std::string& out) const;
+
+private:
+    struct Ticket
+    {
+        RequestClass requestClass;
+        drogon::HttpRequestPtr req;
+        std::chrono::steady_clock::time_point queueTime;
+        trantor::EventLoop* loop;
+        drogon::AdviceCallback acb;
+        drogon::AdviceChainCallback accb;
+        bool queued;
+    };
+
+    struct ClassState
+    {
+        ClassLimits limits;
+        uint32_t active;
+        std::deque<std::shared_ptr<Ticket>> queue;
+        std::atomic<uint64_t> admitted;
+        std::atomic<uint64_t> queued;
+        std::atomic<uint64_t> shed;
+    };
+
+    bool IsTracked(RequestClass requestClass) const;
+    bool HasCapacity(RequestClass requestClass) const;
+    void Acquire(const drogon::HttpRequestPtr& req, RequestClass requestClass);
+    void Shed(RequestClass requestClass, const drogon::AdviceCallback& acb);
+    void ShedExpired(const std::shared_ptr<Ticket>& ticket);
+
+    /**
+     * @brief Take the next queued request that fits in the free slots, HEAD first, with m_Mutex held
+     * @param expired Receives the requests found waiting longer than the maximum queue time
+     * @return The ticket, or nullptr if no queued request can be admitted
+     */
+    std::shared_ptr<Ticket> Dequeue(std::vector<std::shared_ptr<Ticket>>& expired);
+
+private:
+    const uint32_t m_MaxInFlight;
+    const std::chrono::seconds m_RetryAfter;
+
+    std::array<ClassState, static_cast<size_t>(RequestClass::COUNT)> m_Classes;
+    uint32_t m_InFlight;
+    mutable std::mutex m_Mutex;
+};
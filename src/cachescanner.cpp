@@ -0,0 +1,422 @@
+#include <cachescanner.hpp>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif // __linux__
+
+// Packages are stored as triplet/name/version/sha.zip, so they live in directories at depth 3
+static constexpr uint32_t PackageDirectoryDepth = 3;
+
+// Idle workers are woken up when work is queued, this only bounds how long they take to notice Stop()
+static constexpr std::chrono::milliseconds IdleStopCheckInterval(100);
+
+#ifdef __linux__
+static constexpr size_t DirectoryBufferSize = 128 * 1024;
+
+// Layout of the records returned by getdents64, see getdents(2)
+struct DirectoryEntry64
+{
+    uint64_t inode;
+    int64_t offset;
+    unsigned short length;
+    unsigned char type;
+    char name[1];
+};
+#endif // __linux__
+
+namespace
+{
+    struct Directory
+    {
+        std::filesystem::path path;
+        std::array<std::string, PackageDirectoryDepth> parts;
+        uint32_t depth;
+    };
+
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<Directory> directories;
+    };
+
+    struct ScanState
+    {
+        explicit ScanState(uint32_t threads)
+            : pending(0)
+            , queued(0)
+            , directories(0)
+            , packages(0)
+            , bytes(0)
+            , errors(0)
+            , finishedWorkers(0)
+            , start(std::chrono::steady_clock::now())
+        {
+            for (uint32_t i = 0; i < threads; ++i)
+            {
+                queues.emplace_back(std::make_unique<WorkQueue>());
+            }
+        }
+
+        void Push(size_t worker, Directory&& directory)
+        {
+            ++pending;
+
+            {
+                std::lock_guard<std::mutex> lock(queues[worker]->mutex);
+                queues[worker]->directories.emplace_back(std::move(directory));
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(idleMutex);
+                ++queued;
+            }
+            idleCondition.notify_one();
+        }
+
+        /**
+         * @brief Record that a directory was fully listed, waking the idle workers up once the scan is complete
+         */
+        void Complete()
+        {
+            ++directories;
+            if (--pending == 0)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(idleMutex);
+                }
+                idleCondition.notify_all();
+            }
+        }
+
+        /**
+         * @brief Wait until a directory is queued, the scan completes or the timeout expires
+         */
+        void WaitForWork(const std::atomic<bool>& stop)
+        {
+            std::unique_lock<std::mutex> lock(idleMutex);
+            idleCondition.wait_for(lock, IdleStopCheckInterval, [this, &stop]() { return queued.load() > 0 || pending.load() == 0 || stop; });
+        }
+
+        std::optional<Directory> Take(size_t worker)
+        {
+            // Newest work from our own queue first to stay depth-first, oldest work from the others
+            {
+                WorkQueue& queue = *queues[worker];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (!queue.directories.empty())
+                {
+                    Directory directory = std::move(queue.directories.back());
+                    queue.directories.pop_back();
+                    --queued;
+                    return directory;
+                }
+            }
+
+            for (size_t offset = 1; offset < queues.size(); ++offset)
+            {
+                WorkQueue& queue = *queues[(worker + offset) % queues.size()];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (!queue.directories.empty())
+                {
+                    Directory directory = std::move(queue.directories.front());
+                    queue.directories.pop_front();
+                    --queued;
+                    return directory;
+                }
+            }
+
+            return std::nullopt;
+        }
+
+        CacheScanner::Progress Snapshot() const
+        {
+            return CacheScanner::Progress
+            {
+                directories.load(),
+                packages.load(),
+                bytes.load(),
+                errors.load(),
+                std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start),
+                pending.load() == 0
+            };
+        }
+
+        std::vector<std::unique_ptr<WorkQueue>> queues;
+
+        std::atomic<uint64_t> pending;
+        std::atomic<uint64_t> queued; // Directories waiting in the queues, not yet taken by a worker
+        std::atomic<uint64_t> directories;
+        std::atomic<uint64_t> packages;
+        std::atomic<uint64_t> bytes;
+        std::atomic<uint64_t> errors;
+
+        std::mutex mutex;
+        std::condition_variable condition;
+        uint32_t finishedWorkers;
+
+        std::mutex idleMutex;
+        std::condition_variable idleCondition;
+
+        const std::chrono::steady_clock::time_point start;
+    };
+}
+
+static Directory MakeChild(const Directory& parent, std::string_view name)
+{
+    Directory child{ parent.path / name, parent.parts, parent.depth + 1 };
+    child.parts[parent.depth] = name;
+    return child;
+}
+
+static void EmitPackage(ScanState& state, const Directory& directory, std::string_view fileName, uint64_t size, int64_t modifiedTime, const std::function<void(const CacheScanner::Package&)>& onPackage)
+{
+    const CacheScanner::Package package
+    {
+        directory.parts[0],
+        directory.parts[1],
+        directory.parts[2],
+        std::string(fileName.substr(0, fileName.size() - 4)),
+        size,
+        modifiedTime
+    };
+
+    onPackage(package);
+
+    ++state.packages;
+    state.bytes += size;
+}
+
+static bool IsPackageFile(std::string_view fileName)
+{
+    return fileName.size() > 4 && fileName.substr(fileName.size() - 4) == ".zip";
+}
+
+#ifdef __linux__
+static void ScanDirectory(ScanState& state, size_t worker, const Directory& directory, std::vector<char>& buffer, const std::function<void(const CacheScanner::Package&)>& onPackage)
+{
+    const int directoryFd = ::open(directory.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directoryFd < 0)
+    {
+        ++state.errors;
+        return;
+    }
+
+    while (true)
+    {
+        const long length = syscall(SYS_getdents64, directoryFd, buffer.data(), buffer.size());
+        if (length <= 0)
+        {
+            if (length < 0)
+            {
+                ++state.errors;
+            }
+            break;
+        }
+
+        for (long position = 0; position < length; )
+        {
+            const DirectoryEntry64* entry = reinterpret_cast<const DirectoryEntry64*>(buffer.data() + position);
+            position += entry->length;
+
+            const std::string_view name(entry->name);
+            if (name == "." || name == "..")
+            {
+                continue;
+            }
+
+            if (directory.depth < PackageDirectoryDepth)
+            {
+                bool isDirectory = entry->type == DT_DIR;
+                if (entry->type == DT_UNKNOWN)
+                {
+                    struct stat entryStat;
+                    isDirectory = ::fstatat(directoryFd, entry->name, &entryStat, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(entryStat.st_mode);
+                }
+
+                if (isDirectory)
+                {
+                    state.Push(worker, MakeChild(directory, name));
+                }
+            }
+            else if ((entry->type == DT_REG || entry->type == DT_UNKNOWN) && IsPackageFile(name))
+            {
+#ifdef STATX_SIZE
+                struct statx entryStat;
+                if (::statx(directoryFd, entry->name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_TYPE | STATX_SIZE | STATX_MTIME, &entryStat) != 0)
+                {
+                    ++state.errors;
+                    continue;
+                }
+
+                if (S_ISREG(entryStat.stx_mode))
+                {
+                    EmitPackage(state, directory, name, entryStat.stx_size, entryStat.stx_mtime.tv_sec, onPackage);
+                }
+#else
+                struct stat entryStat;
+                if (::fstatat(directoryFd, entry->name, &entryStat, AT_SYMLINK_NOFOLLOW) != 0)
+                {
+                    ++state.errors;
+                    continue;
+                }
+
+                if (S_ISREG(entryStat.st_mode))
+                {
+                    EmitPackage(state, directory, name, entryStat.st_size, entryStat.st_mtime, onPackage);
+                }
+#endif // STATX_SIZE
+            }
+        }
+    }
+
+    ::close(directoryFd);
+}
+#else
+static void ScanDirectory(ScanState& state, size_t worker, const Directory& directory, std::vector<char>& buffer, const std::function<void(const CacheScanner::Package&)>& onPackage)
+{
+    std::error_code error;
+    for (std::filesystem::directory_iterator iter(directory.path, std::filesystem::directory_options::skip_permission_denied, error), end; !error && iter != end; iter.increment(error))
+    {
+        const std::filesystem::directory_entry& entry = *iter;
+        const std::string name = entry.path().filename().string();
+
+        std::error_code entryError;
+        if (directory.depth < PackageDirectoryDepth)
+        {
+            if (entry.is_directory(entryError))
+            {
+                state.Push(worker, MakeChild(directory, name));
+            }
+        }
+        else if (entry.is_regular_file(entryError) && IsPackageFile(name))
+        {
+            // Directory iteration already provides the size and time on Windows, no extra stat is needed
+            const uint64_t size = entry.file_size(entryError);
+            const std::filesystem::file_time_type modifiedTime = entry.last_write_time(entryError);
+            if (entryError)
+            {
+                ++state.errors;
+                continue;
+            }
+
+            const int64_t unixTime = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::file_clock::to_sys(modifiedTime).time_since_epoch()).count();
+            EmitPackage(state, directory, name, size, unixTime, onPackage);
+        }
+    }
+
+    if (error)
+    {
+        ++state.errors;
+    }
+}
+#endif // __linux__
+
+static void RunWorker(ScanState& state, size_t worker, const std::atomic<bool>& stop, const std::function<void(const CacheScanner::Package&)>& onPackage)
+{
+#ifdef __linux__
+    std::vector<char> buffer(DirectoryBufferSize);
+#else
+    std::vector<char> buffer;
+#endif // __linux__
+
+    // Pending only reaches 0 once every queued directory has been fully listed, so no new work can appear after that
+    while (state.pending.load() > 0 && !stop)
+    {
+        const std::optional<Directory> directory = state.Take(worker);
+        if (!directory.has_value())
+        {
+            state.WaitForWork(stop);
+            continue;
+        }
+
+        try
+        {
+            ScanDirectory(state, worker, directory.value(), buffer, onPackage);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Error scanning " << directory->path.string() << ": " << e.what() << std::endl;
+            ++state.errors;
+        }
+
+        state.Complete();
+    }
+}
+
+CacheScanner::CacheScanner(uint32_t threads, IoPriority ioPriority, std::chrono::milliseconds progressInterval)
+    : m_Stop(false)
+    , m_Threads(threads)
+    , m_IoPriority(ioPriority)
+    , m_ProgressInterval(progressInterval)
+{
+    if (m_Threads == 0)
+    {
+        // Listing directories is dominated by I/O latency, so oversubscribe the cores
+        m_Threads = std::max(4u, std::thread::hardware_concurrency() * 2);
+    }
+}
+
+CacheScanner::Progress CacheScanner::Scan(const std::filesystem::path& root, const std::function<void(const Package&)>& onPackage, const std::function<void(const Progress&)>& onProgress) const
+{
+    ScanState state(m_Threads);
+    state.Push(0, Directory{ root, {}, 0 });
+
+    std::vector<std::thread> workers;
+    workers.reserve(m_Threads);
+    for (uint32_t i = 0; i < m_Threads; ++i)
+    {
+        workers.emplace_back([this, &state, &onPackage, i]()
+        {
+            ThreadPlacement::Apply(ThreadRole::DISK);
+            SetCurrentThreadIoPriority(m_IoPriority);
+            RunWorker(state, i, m_Stop, onPackage);
+
+            {
+                std::lock_guard<std::mutex> lock(state.mutex);
+                ++state.finishedWorkers;
+            }
+            state.condition.notify_one();
+        });
+    }
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(state.mutex);
+            if (state.condition.wait_for(lock, m_ProgressInterval, [&state, this]() { return state.finishedWorkers == m_Threads; }))
+            {
+                break;
+            }
+        }
+
+        if (onProgress)
+        {
+            onProgress(state.Snapshot());
+        }
+    }
+
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+
+    return state.Snapshot();
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <threadutils.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string>
+
+/**
+ * @brief Parallel scanner for the triplet/name/version/sha.zip layout of the cache directory
+ *
+ * Directories are spread over a pool of worker threads with work stealing. On Linux, every
+ * directory is listed with large getdents64 batches and packages are stat'ed relative to the
+ * directory handle with statx, which keeps the number of round trips low on network file systems.
+ */
+class CacheScanner final
+{
+public:
+    /**
+     * @brief Package found while scanning
+     */
+    struct Package
+    {
+        std::string triplet;
+        std::string name;
+        std::string version;
+        std::string sha;
+        uint64_t size;
+        int64_t modifiedTime; // Seconds since epoch
+    };
+
+    /**
+     * @brief Scan counters, reported periodically while the scan runs and once it completes
+     */
+    struct Progress
+    {
+        uint64_t directories;
+        uint64_t packages;
+        uint64_t bytes;
+        uint64_t errors;
+        std::chrono::milliseconds elapsed;
+        bool completed;
+    };
+
+    /**
+     * @brief Constructor
+     * @param threads Number of worker threads (0 picks a default based on the hardware)
+     * @param ioPriority I/O priority applied to the worker threads
+     * @param progressInterval Interval between two progress reports
+     */
+    CacheScanner(uint32_t threads = 0, IoPriority ioPriority = IoPriority::NORMAL, std::chrono::milliseconds progressInterval = std::chrono::seconds(5));
+
+    /**
+     * @brief Scan a cache directory
+     * @param root Cache directory to scan
+     * @param onPackage Called for every package, concurrently from the worker threads
+     * @param onProgress Called periodically from the calling thread while the scan runs
+     * @return Final counters
+     */
+    Progress Scan(const std::filesystem::path& root, const std::function<void(const Package&)>& onPackage, const std::function<void(const Progress&)>& onProgress = {}) const;
+
+    /**
+     * @brief Abort running and future scans, which then return with completed set to false
+     */
+    void Stop() { m_Stop = true; }
+
+    uint32_t GetThreadCount() const { return m_Threads; }
+
+private:
+    std::atomic<bool> m_Stop;
+
+    uint32_t m_Threads;
+    IoPriority m_IoPriority;
+    std::chrono::milliseconds m_ProgressInterval;
+};
@@ -0,0 +1,453 @@
+#include <coaccessprefetcher.hpp>
+
+#include <downloadscheduler.hpp>
+#include <pagecache.hpp>
+#include <threadutils.hpp>
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+// Packages remembered per client session
+static constexpr size_t SessionDepth = 16;
+
+// Client sessions tracked, the idle ones are forgotten first
+static constexpr size_t MaxSessions = 4096;
+
+// Counts of a package and of its successors are halved once it reaches this count
+static constexpr uint32_t AgingThreshold = 1024;
+
+static int64_t GetNow()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t GetPackageId(std::string_view key, const uint8_t (&lengths)[4])
+{
+    // The parts are stored without separators, their lengths tell a/bc from ab/c
+    uint32_t packedLengths = 0;
+    std::memcpy(&packedLengths, lengths, sizeof(packedLengths));
+    return std::hash<std::string_view>{}(key) ^ (static_cast<uint64_t>(packedLengths) * 0x9e3779b97f4a7c15ull);
+}
+
+struct CoAccessPrefetcher::Ring
+{
+    explicit Ring(size_t capacity)
+        : events(capacity)
+        , head(0)
+        , tail(0)
+        , dropped(0)
+    {
+    }
+
+    std::vector<Event> events;
+
+    // Written by the owning thread only
+    alignas(64) std::atomic<uint64_t> head;
+    std::atomic<uint64_t> dropped;
+
+    // Written by the prefetch thread only
+    alignas(64) std::atomic<uint64_t> tail;
+};
+
+CoAccessPrefetcher::CoAccessPrefetcher(const Settings& settings, const PageCache& pageCache, Resolver resolver)
+    : m_Settings(settings)
+    , m_PageCache(pageCache)
+    , m_Resolver(std::move(resolver))
+    , m_Triggers(0)
+    , m_Prefetched(0)
+    , m_PrefetchedBytes(0)
+    , m_AlreadyResident(0)
+    , m_Hits(0)
+    , m_HitBytes(0)
+    , m_Wasted(0)
+    , m_WastedBytes(0)
+    , m_TrackedPackages(0)
+    , m_ShouldContinue(true)
+{
+    m_Thread = std::thread(&CoAccessPrefetcher::PrefetchThread, this);
+}
+
+CoAccessPrefetcher::~CoAccessPrefetcher()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_ShouldContinue = false;
+    }
+    m_Condition.notify_all();
+
+    if (m_Thread.joinable())
+    {
+        m_Thread.join();
+    }
+}
+
+void CoAccessPrefetcher::Record(const drogon::HttpRequestPtr& req, std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha)
+{
+    const std::string_view parts[4] = { triplet, name, version, sha };
+
+    size_t length = 0;
+    for (std::string_view part : parts)
+    {
+        if (part.size() > UINT8_MAX)
+        {
+            return;
+        }
+        length += part.size();
+    }
+
+    // Packages with keys too long to be stored are not learned, rather than learned under a truncated key
+    if (length > KeyLength)
+    {
+        return;
+    }
+
+    Ring& ring = GetRing();
+
+    const uint64_t head = ring.head.load(std::memory_order_relaxed);
+    if (head - ring.tail.load(std::memory_order_acquire) >= ring.events.size())
+    {
+        ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+    }
+
+    Event& event = ring.events[head & (ring.events.size() - 1)];
+    event.clientId = DownloadScheduler::GetFlowId(req);
+
+    size_t offset = 0;
+    for (size_t i = 0; i < 4; ++i)
+    {
+        std::memcpy(event.key + offset, parts[i].data(), parts[i].size());
+        event.lengths[i] = static_cast<uint8_t>(parts[i].size());
+        offset += parts[i].size();
+    }
+
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+nlohmann::json CoAccessPrefetcher::GetStats() const
+{
+    uint64_t dropped = 0;
+    for (const Ring* ring : m_Rings.GetAll())
+    {
+        dropped += ring->dropped.load(std::memory_order_relaxed);
+    }
+
+    const uint64_t hits = m_Hits.load(std::memory_order_relaxed);
+    const uint64_t wasted = m_Wasted.load(std::memory_order_relaxed);
+
+    nlohmann::json stats;
+    stats["tracked_packages"] = m_TrackedPackages.load(std::memory_order_relaxed);
+    stats["triggers"] = m_Triggers.load(std::memory_order_relaxed);
+    stats["prefetched"] = m_Prefetched.load(std::memory_order_relaxed);
+    stats["prefetched_bytes"] = m_PrefetchedBytes.load(std::memory_order_relaxed);
+    stats["already_resident"] = m_AlreadyResident.load(std::memory_order_relaxed);
+    stats["hits"] = hits;
+    stats["hit_bytes"] = m_HitBytes.load(std::memory_order_relaxed);
+    stats["wasted"] = wasted;
+    stats["wasted_bytes"] = m_WastedBytes.load(std::memory_order_relaxed);
+    stats["accuracy"] = hits + wasted > 0 ? static_cast<double>(hits) / static_cast<double>(hits + wasted) : 0.0;
+    stats["dropped"] = dropped;
+    return stats;
+}
+
+void CoAccessPrefetcher::Export(std::string& out) const
+{
+    out += "# HELP vcpkg_cache_prefetch_tracked_packages Packages whose successors are tracked\n";
+    out += "# TYPE vcpkg_cache_prefetch_tracked_packages gauge\n";
+    out += fmt::format("vcpkg_cache_prefetch_tracked_packages {}\n", m_TrackedPackages.load(std::memory_order_relaxed));
+    out += "# HELP vcpkg_cache_prefetch_triggers_total Requests which prefetched at least one package\n";
+    out += "# TYPE vcpkg_cache_prefetch_triggers_total counter\n";
+    out += fmt::format("vcpkg_cache_prefetch_triggers_total {}\n", m_Triggers.load(std::memory_order_relaxed));
+    out += "# HELP vcpkg_cache_prefetch_packages_total Packages prefetched, by outcome\n";
+    out += "# TYPE vcpkg_cache_prefetch_packages_total counter\n";
+    out += fmt::format("vcpkg_cache_prefetch_packages_total{{outcome=\"prefetched\"}} {}\n", m_Prefetched.load(std::memory_order_relaxed));
+    out += fmt::format("vcpkg_cache_prefetch_packages_total{{outcome=\"resident\"}} {}\n", m_AlreadyResident.load(std::memory_order_relaxed));
+    out += fmt::format("vcpkg_cache_prefetch_packages_total{{outcome=\"hit\"}} {}\n", m_Hits.load(std::memory_order_relaxed));
+    out += fmt::format("vcpkg_cache_prefetch_packages_total{{outcome=\"wasted\"}} {}\n", m_Wasted.load(std::memory_order_relaxed));
+    out += "# HELP vcpkg_cache_prefetch_bytes_total Bytes read ahead of the requests, by outcome\n";
+    out += "# TYPE vcpkg_cache_prefetch_bytes_total counter\n";
+    out += fmt::format("vcpkg_cache_prefetch_bytes_total{{outcome=\"prefetched\"}} {}\n", m_PrefetchedBytes.load(std::memory_order_relaxed));
+    out += fmt::format("vcpkg_cache_prefetch_bytes_total{{outcome=\"hit\"}} {}\n", m_HitBytes.load(std::memory_order_relaxed));
+    out += fmt::format("vcpkg_cache_prefetch_bytes_total{{outcome=\"wasted\"}} {}\n", m_WastedBytes.load(std::memory_order_relaxed));
+}
+
+CoAccessPrefetcher::Ring& CoAccessPrefetcher::GetRing()
+{
+    return m_Rings.Get([this]() { return std::make_unique<Ring>(std::bit_ceil(std::max<size_t>(m_Settings.bufferSize, 64))); });
+}
+
+void CoAccessPrefetcher::PrefetchThread()
+{
+    // Checking the residency and prefetching read the package files
+    ThreadPlacement::Apply(ThreadRole::DISK);
+
+    while (true)
+    {
+        bool shouldContinue;
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_Condition.wait_for(lock, m_Settings.flushInterval, [this]() { return !m_ShouldContinue; });
+            shouldContinue = m_ShouldContinue;
+        }
+
+        if (!shouldContinue)
+        {
+            break;
+        }
+
+        Drain();
+    }
+}
+
+void CoAccessPrefetcher::Drain()
+{
+    const std::vector<Ring*> rings = m_Rings.GetAll();
+
+    const int64_t now = GetNow();
+
+    for (Ring* ring : rings)
+    {
+        const uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        const uint64_t head = ring->head.load(std::memory_order_acquire);
+
+        for (uint64_t position = tail; position != head; ++position)
+        {
+            OnAccess(ring->events[position & (ring->events.size() - 1)], now);
+        }
+
+        ring->tail.store(head, std::memory_order_release);
+    }
+
+    Expire(now);
+    Trim(now);
+    m_TrackedPackages.store(m_Nodes.size(), std::memory_order_relaxed);
+}
+
+void CoAccessPrefetcher::OnAccess(const Event& event, int64_t now)
+{
+    const size_t length = static_cast<size_t>(event.lengths[0]) + event.lengths[1] + event.lengths[2] + event.lengths[3];
+    const uint64_t id = GetPackageId(std::string_view(event.key, length), event.lengths);
+
+    if (const auto it = m_Outstanding.find(id); it != m_Outstanding.end())
+    {
+        m_Hits.fetch_add(1, std::memory_order_relaxed);
+        m_HitBytes.fetch_add(it->second.bytes, std::memory_order_relaxed);
+        m_Outstanding.erase(it);
+    }
+
+    Session& session = m_Sessions[event.clientId];
+    session.lastSeen = now;
+
+    const int64_t window = std::chrono::duration_cast<std::chrono::milliseconds>(m_Settings.window).count();
+    session.recent.erase(std::remove_if(session.recent.begin(), session.recent.end(), [now, window](const Session::Access& access)
+    {
+        return now - access.time > window;
+    }), session.recent.end());
+
+    // The GET following the HEAD of a package teaches nothing new
+    if (std::any_of(session.recent.begin(), session.recent.end(), [id](const Session::Access& access) { return access.id == id; }))
+    {
+        return;
+    }
+
+    Node& node = GetNode(id, event, now);
+    ++node.count;
+    node.lastSeen = now;
+
+    if (node.count >= AgingThreshold)
+    {
+        node.count /= 2;
+        for (Successor& successor : node.successors)
+        {
+            successor.count /= 2;
+        }
+        node.successors.erase(std::remove_if(node.successors.begin(), node.successors.end(), [](const Successor& successor) { return successor.count == 0; }), node.successors.end());
+    }
+
+    Learn(session, id, now);
+
+    session.recent.push_back(Session::Access{ id, now });
+    if (session.recent.size() > SessionDepth)
+    {
+        session.recent.erase(session.recent.begin());
+    }
+
+    Prefetch(node, now);
+}
+
+void CoAccessPrefetcher::Learn(Session& session, uint64_t id, int64_t now)
+{
+    for (const Session::Access& access : session.recent)
+    {
+        const auto it = m_Nodes.find(access.id);
+        if (it == m_Nodes.end())
+        {
+            continue;
+        }
+
+        std::vector<Successor>& successors = it->second.successors;
+        const auto successor = std::find_if(successors.begin(), successors.end(), [id](const Successor& s) { return s.id == id; });
+        if (successor != successors.end())
+        {
+            ++successor->count;
+        }
+        else if (successors.size() < m_Settings.maxSuccessors)
+        {
+            successors.push_back(Successor{ id, 1 });
+        }
+        else if (!successors.empty())
+        {
+            // The weakest successor loses a count and is replaced once it has none left, a newcomer starts from
+            // scratch rather than inheriting the count, which would fake a confidence
+            const auto weakest = std::min_element(successors.begin(), successors.end(), [](const Successor& lhs, const Successor& rhs) { return lhs.count < rhs.count; });
+            if (weakest->count <= 1)
+            {
+                *weakest = Successor{ id, 1 };
+            }
+            else
+            {
+                --weakest->count;
+            }
+        }
+    }
+}
+
+void CoAccessPrefetcher::Prefetch(const Node& node, int64_t now)
+{
+    std::vector<Successor> candidates;
+    for (const Successor& successor : node.successors)
+    {
+        if (successor.count >= m_Settings.minSupport && static_cast<uint64_t>(successor.count) * 100 >= static_cast<uint64_t>(m_Settings.minConfidence) * node.count)
+        {
+            candidates.push_back(successor);
+        }
+    }
+
+    std::sort(candidates.begin(), candidates.end(), [](const Successor& lhs, const Successor& rhs) { return lhs.count > rhs.count; });
+
+    uint64_t budget = m_Settings.maxBytes;
+    bool triggered = false;
+
+    for (const Successor& candidate : candidates)
+    {
+        if (m_Outstanding.find(candidate.id) != m_Outstanding.end())
+        {
+            continue;
+        }
+
+        const auto it = m_Nodes.find(candidate.id);
+        if (it == m_Nodes.end())
+        {
+            continue;
+        }
+
+        const Node& target = it->second;
+        const std::string_view key = target.key;
+        const std::string_view triplet = key.substr(0, target.lengths[0]);
+        const std::string_view name = key.substr(target.lengths[0], target.lengths[1]);
+        const std::string_view version = key.substr(target.lengths[0] + target.lengths[1], target.lengths[2]);
+        const std::string_view sha = key.substr(target.lengths[0] + target.lengths[1] + target.lengths[2], target.lengths[3]);
+
+        const std::optional<Target> location = m_Resolver(triplet, name, version, sha);
+        if (!location || location->size > budget)
+        {
+            continue;
+        }
+
+        // Only the bytes actually read count, a package already in memory costs nothing
+        uint64_t bytes = location->size;
+        if (const std::optional<PageCache::Residency> residency = m_PageCache.GetResidency(location->path))
+        {
+            if (residency->resident >= residency->size)
+            {
+                m_AlreadyResident.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            bytes = residency->size - residency->resident;
+        }
+
+        m_PageCache.Prefetch(location->path);
+        m_Outstanding[candidate.id] = Outstanding{ now, bytes };
+        budget -= location->size;
+        triggered = true;
+
+        m_Prefetched.fetch_add(1, std::memory_order_relaxed);
+        m_PrefetchedBytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    if (triggered)
+    {
+        m_Triggers.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+CoAccessPrefetcher::Node& CoAccessPrefetcher::GetNode(uint64_t id, const Event& event, int64_t now)
+{
+    const auto [it, inserted] = m_Nodes.try_emplace(id);
+    if (inserted)
+    {
+        const size_t length = static_cast<size_t>(event.lengths[0]) + event.lengths[1] + event.lengths[2] + event.lengths[3];
+        it->second.key.assign(event.key, length);
+        std::memcpy(it->second.lengths, event.lengths, sizeof(event.lengths));
+        it->second.count = 0;
+        it->second.lastSeen = now;
+    }
+    return it->second;
+}
+
+void CoAccessPrefetcher::Trim(int64_t now)
+{
+    if (m_Nodes.size() > m_Settings.maxPackages)
+    {
+        // Forgets an eighth at once, so the sort is not paid for every new package
+        std::vector<std::pair<int64_t, uint64_t>> nodes;
+        nodes.reserve(m_Nodes.size());
+        for (const auto& [id, node] : m_Nodes)
+        {
+            nodes.emplace_back(node.lastSeen, id);
+        }
+
+        const size_t count = m_Nodes.size() - m_Settings.maxPackages * 7 / 8;
+        std::nth_element(nodes.begin(), nodes.begin() + count, nodes.end());
+        for (size_t i = 0; i < count; ++i)
+        {
+            m_Nodes.erase(nodes[i].second);
+        }
+    }
+
+    if (m_Sessions.size() > MaxSessions)
+    {
+        const int64_t window = std::chrono::duration_cast<std::chrono::milliseconds>(m_Settings.window).count();
+        for (auto it = m_Sessions.begin(); it != m_Sessions.end(); )
+        {
+            it = now - it->second.lastSeen > window ? m_Sessions.erase(it) : std::next(it);
+        }
+
+        // Still too many clients active at once, they will start over
+        if (m_Sessions.size() > MaxSessions)
+        {
+            m_Sessions.clear();
+        }
+    }
+}
+
+void CoAccessPrefetcher::Expire(int64_t now)
+{
+    const int64_t horizon = std::chrono::duration_cast<std::chrono::milliseconds>(m_Settings.horizon).count();
+    for (auto it = m_Outstanding.begin(); it != m_Outstanding.end(); )
+    {
+        if (now - it->second.time > horizon)
+        {
+            m_Wasted.fetch_add(1, std::memory_order_relaxed);
+            m_WastedBytes.fetch_add(it->second.bytes, std::memory_order_relaxed);
+            it = m_Outstanding.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
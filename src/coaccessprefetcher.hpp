@@ -0,0 +1,189 @@
+#pragma once
+
+#include <perthread.hpp>
+
+#include <drogon/HttpRequest.h>
+#include <nlohmann/json.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class PageCache;
+
+/**
+ * @brief Learns which packages are requested together and prefetches them into the page cache
+ *
+ * A vcpkg restore requests the same groups of packages over and over, e.g. the boost ports of a triplet
+ * all follow boost-config. Each client, identified like the flows of the download scheduler, has a session
+ * holding the packages it requested recently; a package requested within the co-access window after
+ * another one strengthens the edge from the latter to the former. When a package is requested, the
+ * successors seen after it often enough are read into the page cache, so they are served from memory by
+ * the time the client asks for them.
+ *
+ * Memory is bounded: the least recently requested packages are forgotten beyond the configured count, each
+ * one keeps a fixed number of successors, and the counts are halved as they grow so the edges follow the
+ * changes of the builds. The handlers only push the request into a ring buffer owned by their thread, like
+ * the access log; the learning and the prefetching are done by a background thread.
+ *
+ * A prefetched package requested within the accuracy horizon is a hit, one which is not counted as wasted,
+ * along with the bytes read for it.
+ */
+class CoAccessPrefetcher final
+{
+public:
+    struct Settings
+    {
+        std::chrono::seconds window; // A package requested within this time after another one is a successor
+        std::chrono::seconds horizon; // A prefetched package must be requested within this time to count as a hit
+        size_t maxPackages; // Packages tracked, the least recently requested ones are forgotten beyond
+        size_t maxSuccessors; // Successors kept per package
+        uint32_t minSupport; // Times a successor must have followed the package to be prefetched
+        uint32_t minConfidence; // Percentage of the requests of the package a successor must have followed
+        uint64_t maxBytes; // Bytes prefetched per requested package
+        size_t bufferSize; // Requests buffered per thread
+        std::chrono::milliseconds flushInterval;
+    };
+
+    /**
+     * @brief Location and size of a stored package, or std::nullopt if it is not stored anymore
+     */
+    struct Target
+    {
+        std::string path;
+        uint64_t size;
+    };
+    using Resolver = std::function<std::optional<Target>(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha)>;
+
+    /**
+     * @brief Constructor
+     * @param pageCache Reads the packages into the page cache
+     * @param resolver Locates the packages to prefetch, called from the background thread
+     */
+    CoAccessPrefetcher(const Settings& settings, const PageCache& pageCache, Resolver resolver);
+    ~CoAccessPrefetcher();
+
+    /**
+     * @brief Called from the package handlers when a stored package is requested
+     */
+    void Record(const drogon::HttpRequestPtr& req, std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha);
+
+    /**
+     * @brief Get the prefetch counters, the accuracy and the tracked packages
+     */
+    nlohmann::json GetStats() const;
+
+    /**
+     * @brief Append the prefetch metrics to a Prometheus text exposition
+     */
+    void Export(std::string& out) const;
+
+private:
+    static constexpr size_t KeyLength = 232;
+
+    struct Event
+    {
+        uint64_t clientId;
+        uint8_t lengths[4]; // triplet, name, version, sha
+        char key[KeyLength]; // The four parts one after the other
+    };
+
+    struct Ring;
+
+    struct Successor
+    {
+        uint64_t id;
+        uint32_t count;
+    };
+
+    struct Node
+    {
+        std::string key;
+        uint8_t lengths[4];
+        uint32_t count;
+        int64_t lastSeen; // Milliseconds of the steady clock
+        std::vector<Successor> successors;
+    };
+
+    struct Session
+    {
+        struct Access
+        {
+            uint64_t id;
+            int64_t time;
+        };
+
+        std::vector<Access> recent; // Oldest first
+        int64_t lastSeen;
+    };
+
+    struct Outstanding
+    {
+        int64_t time;
+        uint64_t bytes;
+    };
+
+    Ring& GetRing();
+
+    void PrefetchThread();
+
+    /**
+     * @brief Learn from the requests of every ring and prefetch the successors of the requested packages
+     */
+    void Drain();
+
+    void OnAccess(const Event& event, int64_t now);
+
+    void Learn(Session& session, uint64_t id, int64_t now);
+
+    void Prefetch(const Node& node, int64_t now);
+
+    Node& GetNode(uint64_t id, const Event& event, int64_t now);
+
+    /**
+     * @brief Forget the least recently requested packages and the idle sessions once they exceed their limits
+     */
+    void Trim(int64_t now);
+
+    /**
+     * @brief Count the prefetched packages not requested within the horizon as wasted
+     */
+    void Expire(int64_t now);
+
+private:
+    const Settings m_Settings;
+    const PageCache& m_PageCache;
+    const Resolver m_Resolver;
+
+    PerThread<Ring> m_Rings;
+
+    // Background thread only
+    std::unordered_map<uint64_t, Node> m_Nodes;
+    std::unordered_map<uint64_t, Session> m_Sessions;
+    std::unordered_map<uint64_t, Outstanding> m_Outstanding;
+
+    std::atomic<uint64_t> m_Triggers;
+    std::atomic<uint64_t> m_Prefetched;
+    std::atomic<uint64_t> m_PrefetchedBytes;
+    std::atomic<uint64_t> m_AlreadyResident;
+    std::atomic<uint64_t> m_Hits;
+    std::atomic<uint64_t> m_HitBytes;
+    std::atomic<uint64_t> m_Wasted;
+    std::atomic<uint64_t> m_WastedBytes;
+    std::atomic<uint64_t> m_TrackedPackages;
+
+    std::atomic<bool> m_ShouldContinue;
+    std::mutex m_Mutex;
+    std::condition_variable m_Condition;
+    std::thread m_Thread;
+};
@@ -0,0 +1,135 @@
+#include <conditionalrequest.hpp>
+
+#include <fmt/chrono.h>
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <ctime>
+
+static constexpr std::array<std::string_view, 12> MonthNames = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+static std::optional<int> ParseNumber(std::string_view str)
+{
+    int value = 0;
+    const std::from_chars_result result = std::from_chars(str.data(), str.data() + str.size(), value);
+    if (result.ec != std::errc() || result.ptr != str.data() + str.size())
+    {
+        return std::nullopt;
+    }
+    return value;
+}
+
+static std::string_view Trim(std::string_view str)
+{
+    while (!str.empty() && (str.front() == ' ' || str.front() == '\t'))
+    {
+        str.remove_prefix(1);
+    }
+    while (!str.empty() && (str.back() == ' ' || str.back() == '\t'))
+    {
+        str.remove_suffix(1);
+    }
+    return str;
+}
+
+std::string ConditionalRequest::FormatETag(std::string_view sha, const PackageIndex::Entry& entry)
+{
+    return fmt::format("\"{}-{:x}-{:x}\"", sha, entry.size, entry.modifiedTime);
+}
+
+std::string ConditionalRequest::FormatHttpDate(int64_t unixTime)
+{
+    return fmt::format("{:%a, %d %b %Y %H:%M:%S} GMT", fmt::gmtime(static_cast<std::time_t>(unixTime)));
+}
+
+std::optional<int64_t> ConditionalRequest::ParseHttpDate(std::string_view date)
+{
+    // Sun, 06 Nov 1994 08:49:37 GMT
+    if (date.size() != 29 || date.substr(3, 2) != ", " || date[7] != ' ' || date[11] != ' ' || date[16] != ' ' || date[19] != ':' || date[22] != ':' || date.substr(25) != " GMT")
+    {
+        return std::nullopt;
+    }
+
+    const std::array<std::string_view, 12>::const_iterator month = std::find(MonthNames.begin(), MonthNames.end(), date.substr(8, 3));
+    const std::optional<int> day = ParseNumber(date.substr(5, 2));
+    const std::optional<int> year = ParseNumber(date.substr(12, 4));
+    const std::optional<int> hour = ParseNumber(date.substr(17, 2));
+    const std::optional<int> minute = ParseNumber(date.substr(20, 2));
+    const std::optional<int> second = ParseNumber(date.substr(23, 2));
+    if (month == MonthNames.end() || !day || !year || !hour || !minute || !second || hour.value() > 23 || minute.value() > 59 || second.value() > 60)
+    {
+        return std::nullopt;
+    }
+
+    const std::chrono::year_month_day yearMonthDay{ std::chrono::year(year.value()), std::chrono::month(static_cast<unsigned>(month - MonthNames.begin() + 1)), std::chrono::day(static_cast<unsigned>(day.value())) };
+    if (!yearMonthDay.ok())
+    {
+        return std::nullopt;
+    }
+
+    const std::chrono::seconds time = std::chrono::sys_days(yearMonthDay).time_since_epoch() + std::chrono::hours(hour.value()) + std::chrono::minutes(minute.value()) + std::chrono::seconds(second.value());
+    return time.count();
+}
+
+bool ConditionalRequest::MatchesETag(std::string_view ifNoneMatch, std::string_view etag)
+{
+    while (!ifNoneMatch.empty())
+    {
+        const size_t separator = ifNoneMatch.find(',');
+        std::string_view candidate = Trim(ifNoneMatch.substr(0, separator));
+        ifNoneMatch.remove_prefix(separator == std::string_view::npos ? ifNoneMatch.size() : separator + 1);
+
+        // If-None-Match uses the weak comparison, so W/"x" matches "x"
+        if (candidate.starts_with("W/"))
+        {
+            candidate.remove_prefix(2);
+        }
+
+        if (candidate == "*" || candidate == etag)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool ConditionalRequest::IsNotModified(const drogon::HttpRequestPtr& req, std::string_view etag, int64_t modifiedTime)
+{
+    // If-Modified-Since is ignored when If-None-Match is present
+    const std::string& ifNoneMatch = req->getHeader("If-None-Match");
+    if (!ifNoneMatch.empty())
+    {
+        return MatchesETag(ifNoneMatch, etag);
+    }
+
+    const std::string& ifModifiedSince = req->getHeader("If-Modified-Since");
+    if (ifModifiedSince.empty() || modifiedTime <= 0)
+    {
+        return false;
+    }
+
+    const std::optional<int64_t> since = ParseHttpDate(ifModifiedSince);
+    return since.has_value() && modifiedTime <= since.value();
+}
+
+void ConditionalRequest::AddValidators(const drogon::HttpResponsePtr& resp, const std::string& etag, int64_t modifiedTime, const std::string& cacheControl)
+{
+    resp->addHeader("ETag", etag);
+    if (modifiedTime > 0)
+    {
+        resp->addHeader("Last-Modified", FormatHttpDate(modifiedTime));
+    }
+    resp->addHeader("Cache-Control", cacheControl);
+}
+
+drogon::HttpResponsePtr ConditionalRequest::CreateNotModifiedResponse(const std::string& etag, int64_t modifiedTime, const std::string& cacheControl)
+{
+    drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
+    resp->setStatusCode(drogon::k304NotModified);
+    AddValidators(resp, etag, modifiedTime, cacheControl);
+    return resp;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <packageindex.hpp>
+
+#include <drogon/HttpRequest.h>
+#include <drogon/HttpResponse.h>
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+/**
+ * @brief Validators of the package responses, and evaluation of the conditional request headers
+ *
+ * A package never changes for a given key, except when the same sha is uploaded again, so its
+ * strong ETag is made of the sha, size and modification time. Responses carrying the validators
+ * can be cached by clients and proxies, and revalidated with If-None-Match or If-Modified-Since.
+ */
+class ConditionalRequest final
+{
+public:
+    /**
+     * @brief Format the strong ETag of a package, including the quotes
+     */
+    static std::string FormatETag(std::string_view sha, const PackageIndex::Entry& entry);
+
+    /**
+     * @brief Format a time as an HTTP date (Sun, 06 Nov 1994 08:49:37 GMT)
+     * @param unixTime Seconds since epoch
+     */
+    static std::string FormatHttpDate(int64_t unixTime);
+
+    /**
+     * @brief Parse an HTTP date in the preferred IMF-fixdate format
+     * @return Seconds since epoch, or std::nullopt if the date is malformed
+     */
+    static std::optional<int64_t> ParseHttpDate(std::string_view date);
+
+    /**
+     * @brief Check if an If-None-Match header lists an ETag, or is "*"
+     */
+    static bool MatchesETag(std::string_view ifNoneMatch, std::string_view etag);
+
+    /**
+     * @brief Evaluate If-None-Match, or If-Modified-Since when it is absent (RFC 9110, section 13.2.2)
+     * @return true if the client copy is current and a 304 must be sent
+     */
+    static bool IsNotModified(const drogon::HttpRequestPtr& req, std::string_view etag, int64_t modifiedTime);
+
+    /**
+     * @brief Add the ETag, Last-Modified and Cache-Control headers to a package response
+     */
+    static void AddValidators(const drogon::HttpResponsePtr& resp, const std::string& etag, int64_t modifiedTime, const std::string& cacheControl);
+
+    /**
+     * @brief Create a 304 response carrying the validators
+     */
+    static drogon::HttpResponsePtr CreateNotModifiedResponse(const std::string& etag, int64_t modifiedTime, const std::string& cacheControl);
+};
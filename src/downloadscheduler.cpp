@@ -0,0 +1,348 @@
+#include <downloadscheduler.hpp>
+
+#include <filters/authfilter.hpp>
+#include <threadutils.hpp>
+
+#include <algorithm>
+#include <memory>
+#include <string_view>
+
+// Largest piece of a package read and queued on its connection at once
+static constexpr uint64_t ChunkSize = 64 * 1024;
+
+// Bytes of a download that may wait in the output buffer of its connection before its flow is skipped
+static constexpr uint64_t MaxBufferedBytes = 4 * ChunkSize;
+
+// Longest wait for the egress rate to allow more bytes
+static constexpr std::chrono::milliseconds MaxWait{ 100 };
+
+// Wait for the connections to drain, or the chunks to be read, when every active flow is held back
+static constexpr std::chrono::milliseconds DrainWait{ 2 };
+
+// Threads reading the chunks of the scheduled downloads, so a slow disk only delays the transfers it holds
+static constexpr size_t ReaderCount = 4;
+
+DownloadScheduler::DownloadScheduler(uint64_t egressRate, uint64_t quantum, uint64_t threshold)
+    : m_EgressRate(egressRate)
+    , m_Quantum(std::max<uint64_t>(quantum, 1))
+    , m_Threshold(threshold)
+    , m_TransferCount(0)
+    , m_Tokens(0)
+    , m_ScheduledBytes(0)
+    , m_ChargedBytes(0)
+    , m_ShouldContinue(true)
+    , m_Readers(std::make_unique<trantor::ConcurrentTaskQueue>(ReaderCount, "download-reader"))
+{
+    m_Thread = std::thread(&DownloadScheduler::SchedulerThread, this);
+}
+
+DownloadScheduler::~DownloadScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_ShouldContinue = false;
+    }
+    m_Condition.notify_all();
+
+    if (m_Thread.joinable())
+    {
+        m_Thread.join();
+    }
+
+    // The chunks being read refer to their transfers
+    m_Readers.reset();
+
+    // Clients of the downloads still queued get a truncated body
+    for (auto& [flowId, flow] : m_Flows)
+    {
+        for (Transfer& transfer : flow.transfers)
+        {
+            transfer.stream->close();
+        }
+    }
+}
+
+uint64_t DownloadScheduler::GetFlowId(const drogon::HttpRequestPtr& req)
+{
+    if (const std::optional<std::string_view> apiKey = ApiKeyFilter::ExtractApiKey(req))
+    {
+        return std::hash<std::string_view>{}(apiKey.value());
+    }
+
+    return std::hash<std::string>{}(req->peerAddr().toIp());
+}
+
+drogon::HttpResponsePtr DownloadScheduler::Schedule(const drogon::HttpRequestPtr& req, Reader reader, uint64_t size)
+{
+    // Drogon hands the stream over once the headers are sent, the transfer waits for it here
+    std::shared_ptr<Transfer> transfer = std::make_shared<Transfer>(Transfer{ std::move(reader), size, 0, nullptr, req->getConnectionPtr(), nullptr, false, false });
+    return drogon::HttpResponse::newAsyncStreamResponse([this, flowId = GetFlowId(req), transfer](drogon::ResponseStreamPtr stream)
+    {
+        // Called on the event loop of the connection, the only thread allowed to read its counters
+        const std::shared_ptr<trantor::TcpConnection> connection = transfer->connection.lock();
+        transfer->progress = std::make_shared<Progress>(connection ? connection->bytesSent() : 0);
+        transfer->stream = std::move(stream);
+        Enqueue(flowId, std::move(*transfer));
+    });
+}
+
+void DownloadScheduler::Charge(uint64_t size)
+{
+    if (m_EgressRate > 0)
+    {
+        m_Tokens.fetch_sub(static_cast<int64_t>(size), std::memory_order_relaxed);
+    }
+    m_ChargedBytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+nlohmann::json DownloadScheduler::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    nlohmann::json stats;
+    stats["egress_rate"] = m_EgressRate;
+    stats["quantum"] = m_Quantum;
+    stats["threshold"] = m_Threshold;
+    stats["active_flows"] = m_Flows.size();
+    stats["active_transfers"] = m_TransferCount;
+    stats["scheduled_bytes"] = m_ScheduledBytes.load(std::memory_order_relaxed);
+    stats["charged_bytes"] = m_ChargedBytes.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void DownloadScheduler::Enqueue(uint64_t flowId, Transfer&& transfer)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (!m_ShouldContinue)
+        {
+            transfer.stream->close();
+            return;
+        }
+
+        Flow& flow = m_Flows[flowId];
+        flow.transfers.push_back(std::move(transfer));
+        ++m_TransferCount;
+
+        // A flow being served is put back by the scheduler thread
+        if (!flow.active)
+        {
+            flow.active = true;
+            m_ActiveFlows.push_back(flowId);
+        }
+    }
+    m_Condition.notify_one();
+}
+
+void DownloadScheduler::SchedulerThread()
+{
+    ThreadPlacement::Apply(ThreadRole::BACKGROUND);
+
+    // Without a cap, the flows are still served in turn, only held back by their connections
+    const bool capped = m_EgressRate > 0;
+
+    // Allows a short burst after an idle period, without exceeding the rate over a longer one
+    const int64_t burst = static_cast<int64_t>(std::max(m_Quantum, m_EgressRate / 10));
+    std::chrono::steady_clock::time_point lastRefill = std::chrono::steady_clock::now();
+
+    // Flows skipped in a row because their connection was not drained yet
+    size_t blockedFlows = 0;
+
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    while (m_ShouldContinue)
+    {
+        if (m_ActiveFlows.empty())
+        {
+            m_Condition.wait(lock, [this]() { return !m_ShouldContinue || !m_ActiveFlows.empty(); });
+            lastRefill = std::chrono::steady_clock::now();
+            blockedFlows = 0;
+            continue;
+        }
+
+        if (blockedFlows >= m_ActiveFlows.size())
+        {
+            // Every client is slower than its share, give their connections time to drain
+            m_Condition.wait_for(lock, DrainWait);
+            blockedFlows = 0;
+            continue;
+        }
+
+        if (capped)
+        {
+            const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            const int64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - lastRefill).count();
+            const int64_t refill = static_cast<int64_t>(static_cast<double>(m_EgressRate) * elapsed / 1000000.0);
+            if (refill > 0)
+            {
+                lastRefill = now;
+                int64_t tokens = m_Tokens.load(std::memory_order_relaxed);
+                while (!m_Tokens.compare_exchange_weak(tokens, std::min(tokens + refill, burst), std::memory_order_relaxed))
+                {
+                }
+            }
+
+            const int64_t tokens = m_Tokens.load(std::memory_order_relaxed);
+            if (tokens <= 0)
+            {
+                // Time for the rate to allow a chunk, or to pay back what unscheduled downloads were charged
+                const double seconds = static_cast<double>(static_cast<int64_t>(ChunkSize) - tokens) / static_cast<double>(m_EgressRate);
+                m_Condition.wait_for(lock, std::min(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::duration<double>(seconds)) + std::chrono::milliseconds(1), MaxWait));
+                continue;
+            }
+        }
+
+        const uint64_t flowId = m_ActiveFlows.front();
+        m_ActiveFlows.pop_front();
+        Flow& flow = m_Flows[flowId];
+
+        // A flow interrupted by the egress rate resumes its turn, otherwise it starts a new one. Transfers are
+        // sent in pieces of any size, so a backlogged flow always ends its turn with no deficit left
+        if (flow.deficit == 0)
+        {
+            flow.deficit = m_Quantum;
+        }
+
+        bool blocked = false;
+        while (flow.deficit > 0 && !flow.transfers.empty() && (!capped || m_Tokens.load(std::memory_order_relaxed) > 0))
+        {
+            // Only this thread removes transfers, and adding to a deque keeps references to its elements valid
+            Transfer& transfer = flow.transfers.front();
+            if (transfer.reading)
+            {
+                blocked = true;
+                break;
+            }
+
+            if (transfer.done || transfer.remaining == 0)
+            {
+                transfer.stream->close();
+                flow.transfers.pop_front();
+                --m_TransferCount;
+                continue;
+            }
+
+            const uint64_t buffered = GetBufferedBytes(transfer);
+            if (buffered >= MaxBufferedBytes)
+            {
+                blocked = true;
+                break;
+            }
+
+            uint64_t size = std::min({ flow.deficit, transfer.remaining, ChunkSize, MaxBufferedBytes - buffered });
+            if (capped)
+            {
+                size = std::min(size, static_cast<uint64_t>(m_Tokens.load(std::memory_order_relaxed)));
+                m_Tokens.fetch_sub(static_cast<int64_t>(size), std::memory_order_relaxed);
+            }
+            flow.deficit -= size;
+
+            // The flow waits for its chunk, meanwhile the other flows are served
+            transfer.reading = true;
+            m_Readers->runTaskInQueue([this, &transfer, size]()
+            {
+                SendChunk(transfer, size);
+            });
+            blocked = true;
+            break;
+        }
+
+        blockedFlows = blocked ? blockedFlows + 1 : 0;
+
+        if (flow.transfers.empty())
+        {
+            // An idle flow does not keep its deficit
+            m_Flows.erase(flowId);
+        }
+        else if (flow.deficit > 0 && !blocked)
+        {
+            m_ActiveFlows.push_front(flowId);
+        }
+        else
+        {
+            // A blocked flow keeps the rest of its deficit for when its connection is drained
+            m_ActiveFlows.push_back(flowId);
+        }
+    }
+
+}
+
+void DownloadScheduler::SendChunk(Transfer& transfer, uint64_t size)
+{
+    thread_local bool placed = false;
+    if (!placed)
+    {
+        ThreadPlacement::Apply(ThreadRole::DISK);
+        placed = true;
+    }
+
+    // Reused by every chunk read on the thread, the stream keeps its own copy
+    thread_local std::string chunk;
+    chunk.resize(size);
+
+    size_t filled = 0;
+    while (filled < size)
+    {
+        const size_t count = transfer.reader(chunk.data() + filled, size - filled);
+        if (count == 0)
+        {
+            break;
+        }
+        filled += count;
+    }
+
+    // A package shorter than its size was truncated or replaced, the client will see a short body. A send
+    // fails once the client is gone
+    chunk.resize(filled);
+    uint64_t sent = 0;
+    if (filled > 0 && transfer.stream->send(chunk))
+    {
+        sent = filled;
+    }
+
+    if (m_EgressRate > 0 && sent < size)
+    {
+        m_Tokens.fetch_add(static_cast<int64_t>(size - sent), std::memory_order_relaxed);
+    }
+    m_ScheduledBytes.fetch_add(sent, std::memory_order_relaxed);
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        transfer.remaining -= std::min<uint64_t>(sent, transfer.remaining);
+        transfer.queued += sent;
+        transfer.done = sent == 0 || transfer.remaining == 0;
+        transfer.reading = false;
+    }
+    m_Condition.notify_one();
+}
+
+uint64_t DownloadScheduler::GetBufferedBytes(const Transfer& transfer)
+{
+    const uint64_t written = transfer.progress->written.load(std::memory_order_acquire);
+    if (written >= transfer.queued)
+    {
+        return 0;
+    }
+
+    // A closed connection makes the next send fail, which ends the transfer
+    const std::shared_ptr<trantor::TcpConnection> connection = transfer.connection.lock();
+    if (!connection)
+    {
+        return 0;
+    }
+
+    // Refreshed for the next check, with at most one read queued per transfer. Queued after the chunks already
+    // sent, so it runs once they are in the output buffer
+    if (!transfer.progress->sampling.exchange(true, std::memory_order_acq_rel))
+    {
+        connection->getLoop()->queueInLoop([connection = transfer.connection, progress = transfer.progress]()
+        {
+            if (const std::shared_ptr<trantor::TcpConnection> current = connection.lock())
+            {
+                progress->written.store(current->bytesSent() - progress->base, std::memory_order_release);
+            }
+            progress->sampling.store(false, std::memory_order_release);
+        });
+    }
+
+    return transfer.queued - written;
+}
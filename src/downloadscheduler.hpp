@@ -0,0 +1,156 @@
+#pragma once
+
+#include <drogon/HttpRequest.h>
+#include <drogon/HttpResponse.h>
+#include <nlohmann/json.hpp>
+#include <trantor/net/TcpConnection.h>
+#include <trantor/utils/ConcurrentTaskQueue.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+/**
+ * @brief Paces the bodies of large downloads, sharing the egress rate, or the link when uncapped, fairly between clients
+ *
+ * Downloads are grouped in flows, one per API key, or per client address for requests without one.
+ * Every round, each backlogged flow receives a quantum of bytes to send (deficit round robin), so a
+ * client pulling a multi-gigabyte package gets the same share of the egress rate as every other client,
+ * however many packages they each download. The transfers of a flow are sent one after the other.
+ *
+ * A flow is skipped while its connection still has a bounded amount of bytes waiting to be written, so a
+ * slow client neither piles its package up in memory nor takes the share of the others.
+ *
+ * Packages below the scheduling threshold keep being sent with sendfile() right away, so small restores
+ * are never queued behind large ones, but their size is charged to the egress rate. The scheduler thread
+ * only picks the flow sending next: the chunks of the scheduled bodies are read by a pool of reader
+ * threads, one chunk per transfer at a time, and pushed to asynchronous stream responses.
+ */
+class DownloadScheduler final
+{
+public:
+    /**
+     * @brief Fills a buffer with the next bytes of a package, returning their count (0 at the end)
+     */
+    using Reader = std::function<size_t(char*, size_t)>;
+
+    /**
+     * @brief Constructor
+     * @param egressRate Bytes per second sent by every download together, 0 for no cap
+     * @param quantum Bytes a flow may send per round
+     * @param threshold Packages at least this large are scheduled, smaller ones are only charged
+     */
+    DownloadScheduler(uint64_t egressRate, uint64_t quantum, uint64_t threshold);
+    ~DownloadScheduler();
+
+    /**
+     * @brief Whether a package of this size must be sent through Schedule()
+     */
+    bool IsScheduled(uint64_t size) const { return size >= m_Threshold; }
+
+    /**
+     * @brief Get the flow of a request, from its API key or its client address
+     */
+    static uint64_t GetFlowId(const drogon::HttpRequestPtr& req);
+
+    /**
+     * @brief Create the response of a scheduled download
+     * @param req Request of the download, giving its flow and its connection
+     * @param reader Reader of the package, owned by the transfer
+     * @param size Size of the package
+     * @return An asynchronous stream response, whose body is queued once Drogon starts sending it
+     */
+    drogon::HttpResponsePtr Schedule(const drogon::HttpRequestPtr& req, Reader reader, uint64_t size);
+
+    /**
+     * @brief Charge bytes sent outside of the scheduler to the egress rate
+     */
+    void Charge(uint64_t size);
+
+    /**
+     * @brief Get the egress rate, the active flows and transfers and the bytes sent
+     */
+    nlohmann::json GetStats() const;
+
+private:
+    /**
+     * @brief Bytes of a transfer written to its socket, read on the event loop of the connection
+     */
+    struct Progress
+    {
+        explicit Progress(uint64_t base)
+            : base(base)
+            , written(0)
+            , sampling(false)
+        {
+        }
+
+        const uint64_t base; // Bytes sent on the connection before the transfer
+        std::atomic<uint64_t> written;
+        std::atomic<bool> sampling; // A read is queued on the event loop
+    };
+
+    struct Transfer
+    {
+        Reader reader;
+        uint64_t remaining;
+        uint64_t queued; // Bytes passed to the stream
+        drogon::ResponseStreamPtr stream;
+        std::weak_ptr<trantor::TcpConnection> connection;
+        std::shared_ptr<Progress> progress;
+        bool reading; // A chunk is being read by a reader thread, which owns the transfer meanwhile
+        bool done; // Complete, or its client is gone
+    };
+
+    struct Flow
+    {
+        std::deque<Transfer> transfers;
+        uint64_t deficit;
+        bool active; // In m_ActiveFlows
+    };
+
+    void Enqueue(uint64_t flowId, Transfer&& transfer);
+    void SchedulerThread();
+
+    /**
+     * @brief Read and send up to a number of bytes of a transfer, on a reader thread
+     *
+     * The bytes were taken from the flow deficit and the egress rate when the chunk was scheduled, the ones
+     * that could not be sent are given back to the rate.
+     */
+    void SendChunk(Transfer& transfer, uint64_t size);
+
+    /**
+     * @brief Bytes of a transfer still waiting in the output buffer of its connection, as of the last read of its progress
+     */
+    static uint64_t GetBufferedBytes(const Transfer& transfer);
+
+private:
+    const uint64_t m_EgressRate;
+    const uint64_t m_Quantum;
+    const uint64_t m_Threshold;
+
+    mutable std::mutex m_Mutex;
+    std::condition_variable m_Condition;
+    std::unordered_map<uint64_t, Flow> m_Flows;
+    std::deque<uint64_t> m_ActiveFlows;
+    size_t m_TransferCount;
+
+    // Bytes that may be sent right now, negative after charging downloads that were not scheduled
+    std::atomic<int64_t> m_Tokens;
+
+    std::atomic<uint64_t> m_ScheduledBytes;
+    std::atomic<uint64_t> m_ChargedBytes;
+
+    bool m_ShouldContinue;
+    std::thread m_Thread;
+    std::unique_ptr<trantor::ConcurrentTaskQueue> m_Readers;
+};
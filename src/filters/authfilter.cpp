@@ -1,11 +1,16 @@
 #include <filters/authfilter.hpp>
 
+#include <metrics.hpp>
 #include <policyengine.hpp>
+#include <requesttimer.hpp>
+#include <responsecache.hpp>
 
 #include <nlohmann/json.hpp>
 
-ApiKeyFilter::ApiKeyFilter(std::shared_ptr<PolicyEngine> policyEngine, bool requireAuthForRead, bool requireAuthForWrite, bool requireAuthForStatus)
+ApiKeyFilter::ApiKeyFilter(std::shared_ptr<PolicyEngine> policyEngine, std::shared_ptr<Metrics> metrics, std::shared_ptr<RequestTimer> requestTimer, bool requireAuthForRead, bool requireAuthForWrite, bool requireAuthForStatus)
     : m_PolicyEngine(policyEngine)
+    , m_Metrics(metrics)
+    , m_RequestTimer(requestTimer)
     , m_RequireAuthForRead(requireAuthForRead)
     , m_RequireAuthForWrite(requireAuthForWrite)
     , m_RequireAuthForStatus(requireAuthForStatus)
@@ -14,116 +19,125 @@ ApiKeyFilter::ApiKeyFilter(std::shared_ptr<PolicyEngine> policyEngine, bool requ
 
 void ApiKeyFilter::doFilter(const drogon::HttpRequestPtr& req, drogon::FilterCallback&& fcb, drogon::FilterChainCallback&& fccb)
 {
-    const std::optional<std::string> apiKey = ExtractApiKey(req);
+    const drogon::HttpResponsePtr resp = Authorize(req);
+
+    // Continue to next filter or handler
+    if (!resp)
+    {
+        fccb();
+    }
+    else
+    {
+        fcb(resp);
+    }
+}
+
+drogon::HttpResponsePtr ApiKeyFilter::Authorize(const drogon::HttpRequestPtr& req) const
+{
+    m_RequestTimer->Mark(req, RequestPhase::ROUTE);
+
+    const std::optional<std::string_view> apiKey = ExtractApiKey(req);
+    const drogon::HttpMethod method = req->getMethod();
 
     drogon::HttpResponsePtr resp;
     if (apiKey && !m_PolicyEngine->ValidateApiKey(apiKey.value()))
     {
         resp = CreateUnauthorizedResponse("Invalid API Key");
+        m_Metrics->AddAuthReject(AuthRejectReason::INVALID_KEY);
     }
     else if (apiKey && m_PolicyEngine->IsExpired(apiKey.value()))
     {
         resp = CreateUnauthorizedResponse("API Key is expired");
+        m_Metrics->AddAuthReject(AuthRejectReason::EXPIRED_KEY);
     }
-    else if (req->getMethod() == drogon::HttpMethod::Get)
+    else if (method == drogon::HttpMethod::Get)
     {
-        if ((m_RequireAuthForStatus && req->getPath() == "/status") || m_RequireAuthForRead)
+        if ((m_RequireAuthForStatus && (req->getPath() == "/status" || req->getPath() == "/metrics")) || m_RequireAuthForRead)
         {
             if (!apiKey || !m_PolicyEngine->ValidateApiKey(apiKey.value(), AccessPermission::READ))
             {
                 resp = CreateForbiddenResponse("Invalid permissions for API Key (READ required)");
+                m_Metrics->AddAuthReject(AuthRejectReason::READ_REQUIRED);
             }
         }
     }
-    else if (req->getMethod() == drogon::HttpMethod::Post)
+    else if (method == drogon::HttpMethod::Post && (req->getPath() == "/api/packages/check" || req->getPath() == "/api/packages/download"))
     {
-        if (m_RequireAuthForWrite && (!apiKey || !m_PolicyEngine->ValidateApiKey(apiKey.value(), AccessPermission::WRITE)))
+        // Batch checks and downloads only read, even though the list of packages is posted
+        if (m_RequireAuthForRead && (!apiKey || !m_PolicyEngine->ValidateApiKey(apiKey.value(), AccessPermission::READ)))
         {
-            resp = CreateForbiddenResponse("Invalid permissions for API Key (WRITE required)");
+            resp = CreateForbiddenResponse("Invalid permissions for API Key (READ required)");
+            m_Metrics->AddAuthReject(AuthRejectReason::READ_REQUIRED);
         }
     }
-
-    // Continue to next filter or handler
-    const bool allowRequest = !resp;
-    if (allowRequest)
+    else if (method == drogon::HttpMethod::Post)
     {
-        fccb();
-    }
-    else if(resp)
-    {
-        fcb(resp);
-    }
-    else
-    {
-        nlohmann::json response =
+        if (m_RequireAuthForWrite && (!apiKey || !m_PolicyEngine->ValidateApiKey(apiKey.value(), AccessPermission::WRITE)))
         {
-            { "error", "Internal Server Error" },
-            { "message" , "Authorization issue that is not correclty handled on the server."},
-            { "status", 500 }
-        };
+            resp = CreateForbiddenResponse("Invalid permissions for API Key (WRITE required)");
+            m_Metrics->AddAuthReject(AuthRejectReason::WRITE_REQUIRED);
+        }
+    }
 
-        resp = drogon::HttpResponse::newHttpJsonResponse(response.dump(4));
-        resp->setStatusCode(drogon::k500InternalServerError);
+    m_RequestTimer->Mark(req, RequestPhase::FILTER);
 
-        fcb(resp);
-    }
+    return resp;
 }
 
-drogon::HttpResponsePtr ApiKeyFilter::CreateUnauthorizedResponse(const std::string& message) const
+static drogon::HttpResponsePtr GetErrorResponse(drogon::HttpStatusCode statusCode, std::string_view error, std::string_view message)
 {
+    // The message identifies the response, the body is only built the first time on each thread
+    if (drogon::HttpResponsePtr resp = ResponseCache::Find(statusCode, message))
+    {
+        return resp;
+    }
+
     nlohmann::json response =
     {
-        { "error", "Unauthorized" },
+        { "error", error },
         { "message" , message },
-        { "status", 401 }
+        { "status", static_cast<int>(statusCode) }
     };
 
     drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
-    resp->setStatusCode(drogon::k401Unauthorized);
-    resp->setBody(std::move(response.dump(4)));
+    resp->setStatusCode(statusCode);
+    resp->setBody(response.dump(4));
     resp->setContentTypeCode(drogon::CT_APPLICATION_JSON);
 
-    return resp;
+    return ResponseCache::Add(statusCode, message, std::move(resp));
 }
 
-drogon::HttpResponsePtr ApiKeyFilter::CreateForbiddenResponse(const std::string& message) const
+drogon::HttpResponsePtr ApiKeyFilter::CreateUnauthorizedResponse(std::string_view message) const
 {
-    nlohmann::json response =
-    {
-        { "error", "Forbidden" },
-        { "message" , message },
-        { "status", 403 }
-    };
-
-    drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
-    resp->setStatusCode(drogon::k403Forbidden);
-    resp->setBody(std::move(response.dump(4)));
-    resp->setContentTypeCode(drogon::CT_APPLICATION_JSON);
+    return GetErrorResponse(drogon::k401Unauthorized, "Unauthorized", message);
+}
 
-    return resp;
+drogon::HttpResponsePtr ApiKeyFilter::CreateForbiddenResponse(std::string_view message) const
+{
+    return GetErrorResponse(drogon::k403Forbidden, "Forbidden", message);
 }
 
-std::optional<std::string> ApiKeyFilter::ExtractApiKey(const drogon::HttpRequestPtr& req) const
+std::optional<std::string_view> ApiKeyFilter::ExtractApiKey(const drogon::HttpRequestPtr& req)
 {
     // Try X-API-Key header first (most common for API keys)
-    const std::string apiKeyHeader = req->getHeader("X-API-Key");
+    const std::string& apiKeyHeader = req->getHeader("X-API-Key");
     if (!apiKeyHeader.empty()) 
     {
         return apiKeyHeader;
     }
 
     // Try Authorization header
-    const std::string authHeader = req->getHeader("Authorization");
+    const std::string_view authHeader = req->getHeader("Authorization");
     if (!authHeader.empty()) 
     {
         // Support "Bearer <key>" format
-        if (authHeader.find("Bearer ") == 0) 
+        if (authHeader.starts_with("Bearer ")) 
         {
             return authHeader.substr(7); // Skip "Bearer "
         }
 
         // Support "ApiKey <key>" format
-        if (authHeader.find("ApiKey ") == 0) 
+        if (authHeader.starts_with("ApiKey ")) 
         {
             return authHeader.substr(7); // Skip "ApiKey "
         }
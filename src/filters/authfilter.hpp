@@ -2,7 +2,12 @@
 
 #include <drogon/HttpFilter.h>
 
+#include <optional>
+#include <string_view>
+
+class Metrics;
 class PolicyEngine;
+class RequestTimer;
 
 /**
  * @brief Drogon HTTP filter for API key authentication and authorization
@@ -17,8 +22,10 @@ public:
      * @brief Construct a new Api Key Filter
      *
      * @param policy_engine Shared pointer to the policy engine
+     * @param metrics Metrics counting the rejected requests
+     * @param requestTimer Timer measuring the time spent in the filter
      */
-    explicit ApiKeyFilter(std::shared_ptr<PolicyEngine> policyEngine, bool requireAuthForRead = false, bool requireAuthForWrite = false, bool requireAuthForStatus = false);
+    ApiKeyFilter(std::shared_ptr<PolicyEngine> policyEngine, std::shared_ptr<Metrics> metrics, std::shared_ptr<RequestTimer> requestTimer, bool requireAuthForRead = false, bool requireAuthForWrite = false, bool requireAuthForStatus = false);
 
     /**
      * @brief Filter method called before request handling
@@ -29,14 +36,34 @@ public:
      */
     void doFilter(const drogon::HttpRequestPtr& req, drogon::FilterCallback&& fcb, drogon::FilterChainCallback&& fecb) override;
 
+    /**
+     * @brief Check the API key of a request, for the requests that do not go through the filter chain
+     *
+     * @param req The HTTP request
+     * @return The error response to send, or nullptr if the request is authorized
+     */
+    drogon::HttpResponsePtr Authorize(const drogon::HttpRequestPtr& req) const;
+
+    /**
+     * @brief Find the API key of a request, from the X-API-Key or Authorization header
+     * @return A view of the request headers, valid as long as the request
+     */
+    static std::optional<std::string_view> ExtractApiKey(const drogon::HttpRequestPtr& req);
+
 private:
-    drogon::HttpResponsePtr CreateUnauthorizedResponse(const std::string& message) const;
-    drogon::HttpResponsePtr CreateForbiddenResponse(const std::string& message) const;
+    /**
+     * @brief Get the JSON error response of a rejection, shared by the requests of the calling thread
+     */
+    drogon::HttpResponsePtr CreateUnauthorizedResponse(std::string_view message) const;
+    drogon::HttpResponsePtr CreateForbiddenResponse(std::string_view message) const;
 
-    std::optional<std::string> ExtractApiKey(const drogon::HttpRequestPtr& req) const;
+    // Gives the microbenchmarks access to the hot-path helpers
+    friend struct BenchmarkAccess;
 
 private:
     std::shared_ptr<PolicyEngine> m_PolicyEngine;
+    std::shared_ptr<Metrics> m_Metrics;
+    std::shared_ptr<RequestTimer> m_RequestTimer;
 
     const bool m_RequireAuthForRead;
     const bool m_RequireAuthForWrite;
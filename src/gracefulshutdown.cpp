@@ -0,0 +1,145 @@
+#include <gracefulshutdown.hpp>
+
+#include <drogon/drogon.h>
+
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#endif // _WIN32
+
+// Seconds between two checks of the signal flag, then of the open connections
+static constexpr double PollInterval = 0.1;
+
+std::atomic<bool> GracefulShutdown::s_Requested{ false };
+
+#ifdef __linux__
+/**
+ * @brief Whether the kernel hands the connections in the backlog of a closed listener to another listener of its
+ * SO_REUSEPORT group (net.ipv4.tcp_migrate_req, Linux 5.14 and later), rather than resetting them
+ */
+static bool IsRequestMigrationEnabled()
+{
+    std::ifstream file("/proc/sys/net/ipv4/tcp_migrate_req");
+    std::string value;
+    return file >> value && value == "1";
+}
+#endif // __linux__
+
+GracefulShutdown::GracefulShutdown(std::chrono::seconds drainTimeout)
+    : m_DrainTimeout(drainTimeout)
+    , m_Draining(false)
+    , m_Quitting(false)
+{
+}
+
+void GracefulShutdown::AddListener(int fd)
+{
+    std::lock_guard<std::mutex> lock(m_ListenersMutex);
+    m_Listeners.push_back(fd);
+}
+
+void GracefulShutdown::Install()
+{
+#ifndef _WIN32
+    struct sigaction action = {};
+    action.sa_handler = &GracefulShutdown::OnSignal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR2, &action, nullptr);
+
+    // Only a flag can be set from the signal handler, the main loop does the rest
+    drogon::app().getLoop()->runEvery(PollInterval, [this]()
+    {
+        if (m_Draining)
+        {
+            CheckConnections();
+        }
+        else if (s_Requested.load(std::memory_order_relaxed))
+        {
+            Start();
+        }
+    });
+#endif // _WIN32
+}
+
+void GracefulShutdown::Start()
+{
+    if (m_Draining.exchange(true))
+    {
+        return;
+    }
+
+    m_Deadline = std::chrono::steady_clock::now() + m_DrainTimeout;
+    std::cout << "Replaced by a new instance, draining the open connections for up to " << m_DrainTimeout.count() << " seconds" << std::endl;
+
+#ifdef __linux__
+    if (!IsRequestMigrationEnabled())
+    {
+        std::cerr << "net.ipv4.tcp_migrate_req is not enabled, connections waiting to be accepted by this instance will be reset "
+                  << "(sysctl -w net.ipv4.tcp_migrate_req=1 hands them to the new instance)" << std::endl;
+    }
+#endif // __linux__
+
+#ifndef _WIN32
+    // Replacing the listening sockets with /dev/null closes them, which removes them from the event loops and
+    // from the SO_REUSEPORT group. Connections still in their backlog are handed to the new instance when
+    // net.ipv4.tcp_migrate_req is set, and reset otherwise; the ones already accepted complete.
+    //
+    // The descriptors stay open on /dev/null until Drogon closes them on exit, so that close never hits an
+    // unrelated file opened since. Removing them from the event loop at that point fails with EPERM, since
+    // /dev/null cannot be polled, which leaves the registrations of the other descriptors untouched.
+    const int devNull = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (devNull >= 0)
+    {
+        std::lock_guard<std::mutex> lock(m_ListenersMutex);
+        for (int fd : m_Listeners)
+        {
+            ::dup2(devNull, fd);
+        }
+        ::close(devNull);
+    }
+    else
+    {
+        std::cerr << "Failed to close the listening sockets, new connections may still reach this instance" << std::endl;
+    }
+#endif // _WIN32
+}
+
+void GracefulShutdown::OnResponse(const drogon::HttpResponsePtr& resp) const
+{
+    if (IsDraining())
+    {
+        resp->setCloseConnection(true);
+    }
+}
+
+void GracefulShutdown::CheckConnections()
+{
+    if (m_Quitting)
+    {
+        return;
+    }
+
+    const int64_t connections = drogon::app().getConnectionCount();
+    if (connections > 0 && std::chrono::steady_clock::now() < m_Deadline)
+    {
+        return;
+    }
+
+    if (connections > 0)
+    {
+        std::cerr << "Drain timeout reached, closing " << connections << " connections" << std::endl;
+    }
+
+    m_Quitting = true;
+    drogon::app().quit();
+}
+
+void GracefulShutdown::OnSignal(int)
+{
+    s_Requested.store(true, std::memory_order_relaxed);
+}
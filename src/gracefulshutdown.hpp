@@ -0,0 +1,69 @@
+#pragma once
+
+#include <drogon/HttpResponse.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief Drains the open connections of an instance replaced by a new one, then stops the application
+ *
+ * Every instance listens with SO_REUSEPORT, so a new instance started with --restart binds the same port
+ * while the previous one still serves, and sends it SIGUSR2 once listening. On SIGUSR2, the listening
+ * sockets of this process are closed so the kernel hands the new connections to the new instance only,
+ * the responses still sent ask the clients to close their connection, and the application quits once
+ * every connection is closed or the drain timeout is reached.
+ */
+class GracefulShutdown final
+{
+public:
+    /**
+     * @brief Constructor
+     * @param drainTimeout Time given to the open connections to complete
+     */
+    explicit GracefulShutdown(std::chrono::seconds drainTimeout);
+
+    /**
+     * @brief Called by Drogon before a listening socket listens, the socket is closed once draining
+     */
+    void AddListener(int fd);
+
+    /**
+     * @brief Handle SIGUSR2, called from the main loop once the application runs
+     */
+    void Install();
+
+    /**
+     * @brief Stop accepting connections and wait for the open ones to close
+     */
+    void Start();
+
+    bool IsDraining() const { return m_Draining.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Called from the pre-sending advice, closes the connection after the response once draining
+     */
+    void OnResponse(const drogon::HttpResponsePtr& resp) const;
+
+private:
+    /**
+     * @brief Quit the application once every connection closed or the deadline is reached
+     */
+    void CheckConnections();
+
+    static void OnSignal(int signal);
+
+private:
+    static std::atomic<bool> s_Requested;
+
+    const std::chrono::seconds m_DrainTimeout;
+
+    std::atomic<bool> m_Draining;
+    bool m_Quitting; // Main loop only
+    std::chrono::steady_clock::time_point m_Deadline;
+
+    std::vector<int> m_Listeners;
+    std::mutex m_ListenersMutex;
+};
@@ -0,0 +1,139 @@
+#include <instancelock.hpp>
+
+#include <string>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif // _WIN32
+
+InstanceLock::InstanceLock(const std::filesystem::path& path)
+    : m_Path(path)
+    , m_Locked(false)
+#ifdef _WIN32
+    , m_File(INVALID_HANDLE_VALUE)
+#else
+    , m_File(-1)
+#endif // _WIN32
+{
+}
+
+InstanceLock::~InstanceLock()
+{
+    Unlock();
+}
+
+bool InstanceLock::TryLock(int64_t owner)
+{
+    if (m_Locked)
+    {
+        return true;
+    }
+
+    if (m_Path.has_parent_path() && !std::filesystem::exists(m_Path.parent_path()))
+    {
+        std::filesystem::create_directories(m_Path.parent_path());
+    }
+
+    const std::string content = std::to_string(owner);
+
+#ifdef _WIN32
+    // Opened without sharing, so the handle itself is the lock
+    m_File = CreateFileW(m_Path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_File == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    DWORD written = 0;
+    SetEndOfFile(m_File);
+    WriteFile(m_File, content.data(), static_cast<DWORD>(content.size()), &written, nullptr);
+#else
+    if (m_File < 0)
+    {
+        m_File = ::open(m_Path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (m_File < 0)
+        {
+            return false;
+        }
+    }
+
+    // Released by the kernel when the process exits, however it exits
+    if (::flock(m_File, LOCK_EX | LOCK_NB) != 0)
+    {
+        return false;
+    }
+
+    if (::ftruncate(m_File, 0) != 0 || ::pwrite(m_File, content.data(), content.size(), 0) != static_cast<ssize_t>(content.size()))
+    {
+        ::flock(m_File, LOCK_UN);
+        return false;
+    }
+#endif // _WIN32
+
+    m_Locked = true;
+    return true;
+}
+
+void InstanceLock::Unlock()
+{
+#ifdef _WIN32
+    if (m_File != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_File);
+        m_File = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (m_File >= 0)
+    {
+        ::close(m_File);
+        m_File = -1;
+    }
+#endif // _WIN32
+
+    m_Locked = false;
+}
+
+std::optional<int64_t> InstanceLock::FindOwner(const std::filesystem::path& path)
+{
+#ifdef _WIN32
+    // Held open without sharing by its owner, whose id cannot be read
+    return std::nullopt;
+#else
+    const int file = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file < 0)
+    {
+        return std::nullopt;
+    }
+
+    // A lock that can be taken is not held by a running instance
+    if (::flock(file, LOCK_SH | LOCK_NB) == 0)
+    {
+        ::close(file);
+        return std::nullopt;
+    }
+
+    char buffer[32] = {};
+    const ssize_t count = ::pread(file, buffer, sizeof(buffer) - 1, 0);
+    ::close(file);
+
+    if (count <= 0)
+    {
+        return std::nullopt;
+    }
+
+    try
+    {
+        return std::stoll(std::string(buffer, static_cast<size_t>(count)));
+    }
+    catch (const std::exception&)
+    {
+        return std::nullopt;
+    }
+#endif // _WIN32
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+
+/**
+ * @brief Lock file held by the instance which owns the package index and the persistence file
+ *
+ * The file holds the id of the process to signal to stop that instance: the supervisor when the instance
+ * runs worker processes, the server itself otherwise. A second instance fails to start while the lock is
+ * held, unless it was started to take over from the running one, in which case it waits for the lock
+ * before opening the index.
+ */
+class InstanceLock final
+{
+public:
+    /**
+     * @brief Constructor
+     * @param path Location of the lock file
+     */
+    explicit InstanceLock(const std::filesystem::path& path);
+    ~InstanceLock();
+
+    InstanceLock(const InstanceLock&) = delete;
+    InstanceLock& operator=(const InstanceLock&) = delete;
+
+    /**
+     * @brief Take the lock if no other instance holds it
+     * @param owner Process id written to the lock file
+     * @return true if the lock is held by this process
+     */
+    bool TryLock(int64_t owner);
+
+    /**
+     * @brief Release the lock
+     */
+    void Unlock();
+
+    bool IsLocked() const { return m_Locked; }
+
+    /**
+     * @brief Get the process to signal to stop the instance holding a lock file
+     * @return The process id, or std::nullopt if no instance holds the lock
+     */
+    static std::optional<int64_t> FindOwner(const std::filesystem::path& path);
+
+private:
+    std::filesystem::path m_Path;
+    bool m_Locked;
+
+#ifdef _WIN32
+    void* m_File;
+#else
+    int m_File;
+#endif // _WIN32
+};
@@ -1,6 +1,18 @@
+#include <accesslog.hpp>
+#include <admissioncontroller.hpp>
 #include <filters/authfilter.hpp>
+#include <gracefulshutdown.hpp>
+#include <instancelock.hpp>
+#include <memorybudget.hpp>
+#include <metrics.hpp>
 #include <options.hpp>
+#include <packageimporter.hpp>
+#include <packageindex.hpp>
+#include <requesttimer.hpp>
 #include <server.hpp>
+#include <storagetiers.hpp>
+#include <supervisor.hpp>
+#include <threadutils.hpp>
 #include <version.hpp>
 
 #include <CLI/CLI.hpp>
@@ -8,9 +20,25 @@
 #include <fmt/core.h>
 #include <drogon/drogon.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <cstdlib>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <signal.h>
+#include <unistd.h>
+#endif // _WIN32
+
+// Packages added to the index of the running instance per request
+static constexpr size_t ImportBatchSize = 10000;
 
 // Callback function to handle response data
 static size_t WriteCallback(void* contents, size_t size, size_t nmemb, void* userp) 
@@ -19,6 +47,196 @@ static size_t WriteCallback(void* contents, size_t size, size_t nmemb, void* use
     return size * nmemb;
 }
 
+// Asks the running instance to add the imported packages, one "triplet/name/version/sha size modifiedTime" per line, to its package index
+static bool PostImportedPackages(uint16_t port, const std::string& body)
+{
+    CURL* curl = curl_easy_init();
+    if (!curl)
+    {
+        return false;
+    }
+
+    std::string readBuffer;
+    const std::string importUrl = fmt::format("http://127.0.0.1:{}/internal/import", port);
+    curl_slist* headers = curl_slist_append(nullptr, "Content-Type: text/plain");
+    curl_easy_setopt(curl, CURLOPT_URL, importUrl.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(body.size()));
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &readBuffer);
+
+    const CURLcode res = curl_easy_perform(curl);
+    long responseCode = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &responseCode);
+
+    curl_slist_free_all(headers);
+    curl_easy_cleanup(curl);
+
+    return res == CURLE_OK && responseCode == 200;
+}
+
+static void PrintImportProgress(const PackageImporter::Progress& progress)
+{
+    const double seconds = std::max(0.001, progress.elapsed.count() / 1000.0);
+    const double megabytes = progress.importedBytes / (1024.0 * 1024.0);
+    std::cout << fmt::format("{} of {}{} packages processed: {} imported ({:.1f} MB), {} already stored, {} failed - {:.1f} packages/s, {:.1f} MB/s",
+                             progress.imported + progress.present + progress.failed, progress.found, progress.listed ? "" : "+", progress.imported, megabytes,
+                             progress.present, progress.failed, progress.imported / seconds, megabytes / seconds) << std::endl;
+}
+
+/**
+ * @brief Import the packages of another cache directory or of a vcpkg files provider into the first tier
+ *
+ * While an instance runs, the packages are copied by this process and the instance adds them to its package
+ * index as they arrive, so it keeps serving requests. Otherwise the instance lock is taken for the duration
+ * of the import and the package index is updated directly. Packages already stored are skipped, so running
+ * an interrupted import again resumes it.
+ */
+static int RunImport(const Options& options, const std::filesystem::path& source)
+{
+    const PackageImporter::Settings settings
+    {
+        options.bulkImport.threads,
+        options.bulkImport.rate,
+        IoPriorityFromString(options.bulkImport.ioPriority).value_or(IoPriority::LOW),
+        options.bulkImport.hardlink
+    };
+
+    std::unique_ptr<InstanceLock> instanceLock;
+    std::unique_ptr<PackageIndex> packageIndex;
+
+    const std::optional<int64_t> runningInstance = InstanceLock::FindOwner(options.lockFile);
+    if (runningInstance.has_value())
+    {
+        std::cout << "Importing into the running instance (pid " << runningInstance.value() << ")" << std::endl;
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+    }
+    else
+    {
+        // Keeps an instance from starting, and opening the package index, during the import
+        instanceLock = std::make_unique<InstanceLock>(options.lockFile);
+#ifdef _WIN32
+        const int64_t owner = _getpid();
+#else
+        const int64_t owner = getpid();
+#endif // _WIN32
+        if (!instanceLock->TryLock(owner))
+        {
+            throw std::runtime_error("An instance started during the import, run it again to import through it");
+        }
+
+        if (!options.cache.indexFile.empty())
+        {
+            packageIndex = std::make_unique<PackageIndex>(options.cache.indexFile);
+        }
+    }
+
+    // Only used to lay the packages out and probe the tiers, migrations are left to the server
+    StorageTiers storageTiers(options, packageIndex.get());
+
+    bool indexValid = false;
+    if (packageIndex)
+    {
+        indexValid = packageIndex->Open(storageTiers.GetDirectories());
+        if (!indexValid)
+        {
+            std::cout << "The package index is out of date, the server rebuilds it on its next start" << std::endl;
+        }
+    }
+
+    std::vector<std::string> pendingPackages;
+    std::mutex pendingMutex;
+
+    const auto flushPendingPackages = [&]()
+    {
+        std::vector<std::string> packages;
+        {
+            std::lock_guard<std::mutex> lock(pendingMutex);
+            packages.swap(pendingPackages);
+        }
+
+        for (size_t start = 0; start < packages.size(); start += ImportBatchSize)
+        {
+            std::string body;
+            for (size_t i = start; i < std::min(packages.size(), start + ImportBatchSize); ++i)
+            {
+                body += packages[i];
+                body += '\n';
+            }
+
+            if (!PostImportedPackages(options.web.port, body))
+            {
+                std::cerr << "Failed to add the imported packages to the index of the running instance, retrying" << std::endl;
+
+                std::lock_guard<std::mutex> lock(pendingMutex);
+                pendingPackages.insert(pendingPackages.end(), packages.begin() + start, packages.end());
+                return;
+            }
+        }
+    };
+
+    PackageImporter importer(storageTiers, settings, [&](const PackageKey& key, uint64_t size, int64_t modifiedTime)
+    {
+        if (runningInstance.has_value())
+        {
+            std::lock_guard<std::mutex> lock(pendingMutex);
+            // Sent along, so the running instance does not have to stat the packages again
+            pendingPackages.push_back(fmt::format("{} {} {}", key.ToString(), size, modifiedTime));
+        }
+        else if (indexValid)
+        {
+            packageIndex->Insert(key.triplet, key.name, key.version, key.sha, size, modifiedTime);
+        }
+    });
+
+    std::cout << "Importing " << source.string() << " into " << storageTiers.GetDirectory(0).string() << " with " << importer.GetThreadCount() << " threads" << std::endl;
+
+    const PackageImporter::Progress progress = importer.Import(source, [&](const PackageImporter::Progress& progress)
+    {
+        PrintImportProgress(progress);
+        if (runningInstance.has_value())
+        {
+            flushPendingPackages();
+        }
+    });
+
+    if (runningInstance.has_value())
+    {
+        flushPendingPackages();
+        if (!pendingPackages.empty())
+        {
+            std::cerr << pendingPackages.size() << " imported packages could not be added to the index of the running instance, run the import again to add them" << std::endl;
+        }
+    }
+
+    if (packageIndex)
+    {
+        packageIndex->Close(indexValid);
+    }
+
+    PrintImportProgress(progress);
+    std::cout << "Linked: " << progress.linked << ", reflinked: " << progress.cloned << ", copied: " << progress.copied << std::endl;
+
+    return progress.completed && progress.failed == 0 && pendingPackages.empty() ? 0 : 1;
+}
+
+// Must run before any thread of the role is started, threads pin themselves when they start
+static void ConfigureThreadPlacement(ThreadRole role, const std::string& cpuList)
+{
+    const std::optional<std::vector<uint32_t>> cpus = ParseCpuList(cpuList);
+    if (!cpus.has_value())
+    {
+        throw std::runtime_error(fmt::format("Invalid CPU list \"{}\" for the {} threads", cpuList, ToString(role)));
+    }
+
+    if (!cpus->empty())
+    {
+        std::cout << "Pinning the " << ToString(role) << " threads to CPUs " << cpuList << std::endl;
+    }
+    ThreadPlacement::Configure(role, cpus.value());
+}
+
 int main(int argc, char* argv[]) 
 {
     CLI::App app{ "vcpkg-http-cache" };
@@ -40,16 +258,47 @@ int main(int argc, char* argv[])
         app.add_flag("-d,--daemon", options.runAsDaemon, "Forces the application to run as a daemon. Default: false");
 #endif // _WIN32
         app.add_flag("-k,--kill", options.sendTermSignal, "Sends kill signal via IPC to other instances on the same machine. Default: false");
+#ifndef _WIN32
+        app.add_flag("-r,--restart", options.restart, "Takes over from the running instance, which drains its connections once this one listens. Default: false");
+#endif // _WIN32
+
+        std::string importSource;
+        std::optional<uint16_t> importThreads;
+        std::optional<uint64_t> importRate;
+        bool importHardlink = false;
+        CLI::App* importCommand = app.add_subcommand("import", "Imports the packages of another cache directory or of a vcpkg files provider, then exits");
+        importCommand->add_option("source", importSource, "Directory to import, holding triplet/name/version/sha.zip or xx/sha.zip files")->required()->check(CLI::ExistingDirectory);
+        importCommand->add_option("-j,--threads", importThreads, "Number of threads copying packages (0 = automatic). Default: import.threads");
+        importCommand->add_option("--rate", importRate, "Bytes copied per second (0 = unlimited). Default: import.rate");
+        importCommand->add_flag("--hardlink", importHardlink, "Links the packages instead of copying them when the source is on the same file system. Default: import.hardlink");
 
         app.parse(argc, argv);
 
         options.load();
 
+        if (*importCommand)
+        {
+            if (importThreads.has_value())
+            {
+                options.bulkImport.threads = importThreads.value();
+            }
+            if (importRate.has_value())
+            {
+                options.bulkImport.rate = importRate.value();
+            }
+            if (importHardlink)
+            {
+                options.bulkImport.hardlink = true;
+            }
+        }
+
         std::cout << "Configuration:" << std::endl
             << "  Cache Directory: " << options.cache.directory << "" << std::endl
+            << "  Index File:      " << options.cache.indexFile << "" << std::endl
             << "  Host:            " << options.web.bindAddress << "" << std::endl
             << "  Port:            " << options.web.port << "" << std::endl
             << "  Threads:         " << options.web.threads << "" << std::endl
+            << "  Workers:         " << options.web.workers << "" << std::endl
             << "===========================================" << std::endl << std::endl;
 
         // Cache directory
@@ -101,7 +350,8 @@ int main(int argc, char* argv[])
             curl_global_init(CURL_GLOBAL_DEFAULT);
             curl = curl_easy_init();
 
-            curl_easy_setopt(curl, CURLOPT_URL, "http://localhost:8888/internal/kill");
+            const std::string killUrl = fmt::format("http://127.0.0.1:{}/internal/kill", options.web.port);
+            curl_easy_setopt(curl, CURLOPT_URL, killUrl.c_str());
             // Set the HTTP method to POST (you can change to GET if needed)
             //curl_easy_setopt(curl, CURLOPT_GET, 1L);
             curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
@@ -124,13 +374,161 @@ int main(int argc, char* argv[])
 
             return 0;
         }
+
+        ConfigureThreadPlacement(ThreadRole::IO, options.affinity.io);
+        ConfigureThreadPlacement(ThreadRole::DISK, options.affinity.disk);
+        ConfigureThreadPlacement(ThreadRole::BACKGROUND, options.affinity.background);
+
+        if (*importCommand)
+        {
+            return RunImport(options, importSource);
+        }
+
+        // Asked to drain its connections once this instance listens
+        std::optional<int64_t> previousInstance = InstanceLock::FindOwner(options.lockFile);
+        if (previousInstance.has_value())
+        {
+            if (!options.restart)
+            {
+                throw std::runtime_error(fmt::format("Another instance is running (pid {}), start with --restart to take over from it", previousInstance.value()));
+            }
+            std::cout << "Taking over from the running instance (pid " << previousInstance.value() << ")" << std::endl;
+        }
+        else if (options.restart)
+        {
+            std::cout << "No running instance to take over from, starting normally" << std::endl;
+        }
+
+#ifndef _WIN32
+        if (options.runAsDaemon)
+        {
+            // Before any thread is started and before forking the workers, so the pid written to the instance lock stays valid
+            std::cout << "Running application as a daemon" << std::endl;
+            if (daemon(1, 1) != 0)
+            {
+                throw std::runtime_error(fmt::format("Failed to run as a daemon: {}", std::strerror(errno)));
+            }
+        }
+
+        if (options.web.workers > 1)
+        {
+            // Only the workers continue, the supervisor returns once they all stopped
+            // The primary worker closes the index once drained
+            Supervisor supervisor(options.web.workers, std::chrono::seconds(options.web.drainTimeout + 30));
+            if (!supervisor.Run().has_value())
+            {
+                return 0;
+            }
+        }
+#else
+        if (options.web.workers > 1)
+        {
+            std::cerr << "Worker processes are not supported on Windows, serving from a single process" << std::endl;
+        }
+#endif // _WIN32
         
-        std::shared_ptr<BinaryCacheServer> server = std::make_shared<BinaryCacheServer>(options.cache.directory, options.persistenceFile);
+        std::shared_ptr<BinaryCacheServer> server = std::make_shared<BinaryCacheServer>(options);
         drogon::app().registerController(server);
 
         std::shared_ptr<ApiKeyFilter> filter = server->CreateApiKeyFilter(options.permissions.requireAuthForRead, options.permissions.requireAuthForWrite, options.permissions.requireAuthForStatus);
         drogon::app().registerFilter(filter);
 
+        std::shared_ptr<Metrics> metrics = server->GetMetrics();
+        std::shared_ptr<RequestTimer> requestTimer = server->GetRequestTimer();
+        std::shared_ptr<AccessLog> accessLog = server->GetAccessLog();
+        std::shared_ptr<AdmissionController> admissionController = server->GetAdmissionController();
+        std::shared_ptr<MemoryBudget> memoryBudget = server->GetMemoryBudget();
+        std::shared_ptr<GracefulShutdown> gracefulShutdown = std::make_shared<GracefulShutdown>(std::chrono::seconds(options.web.drainTimeout));
+
+        const std::string lockFile = options.lockFile;
+        const size_t ioThreads = options.web.threads;
+        drogon::app()
+            .registerBeginningAdvice([gracefulShutdown, previousInstance, lockFile, ioThreads]()
+            {
+                gracefulShutdown->Install();
+
+                // The event loops allocate their per-thread buffers on first use, once pinned they land on the node of their CPU.
+                // Each worker takes the next CPUs of the list.
+                ThreadPlacement::Apply(ThreadRole::BACKGROUND);
+                const size_t firstLoop = SharedState::Get() ? SharedState::GetWorkerId() * ioThreads : 0;
+                const std::vector<trantor::EventLoop*> loops = drogon::app().getIOLoops();
+                for (size_t i = 0; i < loops.size(); ++i)
+                {
+                    loops[i]->queueInLoop([index = firstLoop + i]()
+                    {
+                        ThreadPlacement::Apply(ThreadRole::IO, index);
+                    });
+                }
+
+#ifndef _WIN32
+                // Once listening, unless the lock was already released, e.g. workers restarted by the supervisor
+                if (previousInstance.has_value() && InstanceLock::FindOwner(lockFile) == previousInstance)
+                {
+                    std::cout << "Asking the previous instance (pid " << previousInstance.value() << ") to drain its connections" << std::endl;
+                    kill(static_cast<pid_t>(previousInstance.value()), SIGUSR2);
+                }
+#endif // _WIN32
+            })
+            .setBeforeListenSockOptCallback([gracefulShutdown](int fd)
+            {
+                gracefulShutdown->AddListener(fd);
+            });
+
+        drogon::app()
+            .registerPreRoutingAdvice([metrics, requestTimer](const drogon::HttpRequestPtr& req)
+            {
+                metrics->OnRequest(req);
+                requestTimer->OnRequest(req);
+            });
+
+        if (memoryBudget)
+        {
+            // Rejected bodies are freed before they can wait for an admission slot
+            drogon::app().registerPreRoutingAdvice([memoryBudget](const drogon::HttpRequestPtr& req, drogon::AdviceCallback&& acb, drogon::AdviceChainCallback&& accb)
+            {
+                memoryBudget->OnRequest(req, std::move(acb), std::move(accb));
+            });
+        }
+
+        if (admissionController)
+        {
+            // Runs before the package routing, so queued requests wait before any handler
+            drogon::app().registerPreRoutingAdvice([admissionController](const drogon::HttpRequestPtr& req, drogon::AdviceCallback&& acb, drogon::AdviceChainCallback&& accb)
+            {
+                admissionController->OnRequest(req, std::move(acb), std::move(accb));
+            });
+        }
+
+        drogon::app()
+            .registerPreRoutingAdvice([server](const drogon::HttpRequestPtr& req, drogon::AdviceCallback&& acb, drogon::AdviceChainCallback&& accb)
+            {
+                // Package requests skip the generic router, anything else continues to it
+                if (!server->RoutePackageRequest(req, acb))
+                {
+                    accb();
+                }
+            })
+            .registerPreSendingAdvice([metrics, requestTimer, accessLog, admissionController, memoryBudget, gracefulShutdown](const drogon::HttpRequestPtr& req, const drogon::HttpResponsePtr& resp)
+            {
+                gracefulShutdown->OnResponse(resp);
+
+                if (admissionController)
+                {
+                    admissionController->OnResponse(req);
+                }
+                if (memoryBudget)
+                {
+                    memoryBudget->OnResponse(req, resp);
+                }
+
+                requestTimer->OnResponse(req, resp);
+                metrics->OnResponse(req, resp);
+                if (accessLog)
+                {
+                    accessLog->OnResponse(req, resp);
+                }
+            });
+
         // Configure Drogon
         drogon::app()
             .setLogPath(options.web.logPath)
@@ -140,16 +538,10 @@ int main(int argc, char* argv[])
             .setMaxConnectionNum(options.web.maxConnectionNum)
             .setMaxConnectionNumPerIP(0)
             .setUploadPath(options.upload.directory)
-            .setClientMaxBodySize(options.web.maxUploadSize);
-
-#ifndef _WIN32
-        if (options.runAsDaemon)
-        {
-            std::cout << "Running application as a daemon" << std::endl;
-            drogon::app()
-                .enableRunAsDaemon();
-        }
-#endif // _WIN32
+            .setClientMaxBodySize(options.web.maxUploadSize)
+            .setClientMaxMemoryBodySize(options.web.maxMemoryBodySize)
+            // Lets the workers share the port, and a new instance listen before this one stops
+            .setReusePort(true);
 
         std::cout << "Starting server on " << options.web.bindAddress << ":" << options.web.port << std::endl;
         std::cout << "Press Ctrl+C to stop the server" << std::endl << std::endl;
@@ -157,7 +549,18 @@ int main(int argc, char* argv[])
         std::cout << "  HEAD   http://" << options.web.bindAddress << ":" << options.web.port << "/{triplet}/{name}/{version}/{sha}  - Check package" << std::endl;
         std::cout << "  GET    http://" << options.web.bindAddress << ":" << options.web.port << "/{triplet}/{name}/{version}/{sha}  - Download package" << std::endl;
         std::cout << "  PUT    http://" << options.web.bindAddress << ":" << options.web.port << "/{triplet}/{name}/{version}/{sha}  - Upload package" << std::endl;
+        std::cout << "  HEAD   http://" << options.web.bindAddress << ":" << options.web.port << "/{sha}.zip  - Check package (requires the package index)" << std::endl;
+        std::cout << "  GET    http://" << options.web.bindAddress << ":" << options.web.port << "/{sha}.zip  - Download package (requires the package index)" << std::endl;
+        std::cout << "  PUT    http://" << options.web.bindAddress << ":" << options.web.port << "/{sha}.zip  - Upload package, keyed from its CONTROL file" << std::endl;
+        std::cout << "  POST   http://" << options.web.bindAddress << ":" << options.web.port << "/api/packages/check  - Check multiple packages" << std::endl;
+        std::cout << "  POST   http://" << options.web.bindAddress << ":" << options.web.port << "/api/packages/download  - Download multiple packages" << std::endl;
         std::cout << "  GET    http://" << options.web.bindAddress << ":" << options.web.port << "/status  - Server status" << std::endl;
+        std::cout << "  GET    http://" << options.web.bindAddress << ":" << options.web.port << "/metrics  - Prometheus metrics" << std::endl;
+        std::cout << "  GET    http://" << options.web.bindAddress << ":" << options.web.port << "/health/live  - Liveness probe" << std::endl;
+        std::cout << "  GET    http://" << options.web.bindAddress << ":" << options.web.port << "/health/ready  - Readiness probe" << std::endl;
+        std::cout << "  GET    http://localhost:" << options.web.port << "/internal/slow-requests  - Slow request log" << std::endl;
+        std::cout << "  GET    http://localhost:" << options.web.port << "/internal/popularity  - Most requested packages, triplets and API keys" << std::endl;
+        std::cout << "  POST   http://localhost:" << options.web.port << "/internal/import  - Index packages copied by the import command" << std::endl;
         std::cout << "  POST   http://localhost:" << options.web.port << "/api/keys  - Create new API key" << std::endl;
         std::cout << "  GET    http://localhost:" << options.web.port << "/api/keys/{key} - Get API key info" << std::endl;
         std::cout << "  DELETE http://localhost:" << options.web.port << "/api/keys/{key} - Revokes/invalidates specified key" << std::endl;
@@ -0,0 +1,191 @@
+#include <mappedfile.hpp>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // _WIN32
+
+MappedFile::MappedFile()
+    : m_Data(nullptr)
+    , m_Size(0)
+#ifdef _WIN32
+    , m_File(INVALID_HANDLE_VALUE)
+    , m_Mapping(nullptr)
+#else
+    , m_File(-1)
+#endif // _WIN32
+{
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+bool MappedFile::Open(const std::filesystem::path& path, uint64_t minimumSize)
+{
+    Close();
+    m_Path = path;
+
+#ifdef _WIN32
+    m_File = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_File == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(m_File, &fileSize))
+    {
+        Close();
+        return false;
+    }
+    m_Size = static_cast<uint64_t>(fileSize.QuadPart);
+#else
+    m_File = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (m_File < 0)
+    {
+        return false;
+    }
+
+    struct stat fileStat;
+    if (::fstat(m_File, &fileStat) != 0)
+    {
+        Close();
+        return false;
+    }
+    m_Size = static_cast<uint64_t>(fileStat.st_size);
+#endif // _WIN32
+
+    if (m_Size < minimumSize)
+    {
+        return Resize(minimumSize);
+    }
+
+    if (m_Size == 0)
+    {
+        // Nothing to map yet, the caller is expected to Resize() before using the data
+        return true;
+    }
+
+    if (!Map())
+    {
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+bool MappedFile::Resize(uint64_t size)
+{
+    Unmap();
+
+#ifdef _WIN32
+    LARGE_INTEGER newSize;
+    newSize.QuadPart = static_cast<LONGLONG>(size);
+    if (!SetFilePointerEx(m_File, newSize, nullptr, FILE_BEGIN) || !SetEndOfFile(m_File))
+    {
+        return false;
+    }
+#else
+    if (::ftruncate(m_File, static_cast<off_t>(size)) != 0)
+    {
+        return false;
+    }
+#endif // _WIN32
+
+    m_Size = size;
+    return size == 0 || Map();
+}
+
+void MappedFile::Flush(bool async) const
+{
+    if (!m_Data)
+    {
+        return;
+    }
+
+#ifdef _WIN32
+    FlushViewOfFile(m_Data, 0);
+    if (!async)
+    {
+        FlushFileBuffers(m_File);
+    }
+#else
+    ::msync(m_Data, m_Size, async ? MS_ASYNC : MS_SYNC);
+#endif // _WIN32
+}
+
+void MappedFile::Close()
+{
+    Unmap();
+
+#ifdef _WIN32
+    if (m_File != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_File);
+        m_File = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (m_File >= 0)
+    {
+        ::close(m_File);
+        m_File = -1;
+    }
+#endif // _WIN32
+
+    m_Size = 0;
+}
+
+bool MappedFile::Map()
+{
+#ifdef _WIN32
+    m_Mapping = CreateFileMappingW(m_File, nullptr, PAGE_READWRITE, static_cast<DWORD>(m_Size >> 32), static_cast<DWORD>(m_Size & 0xFFFFFFFF), nullptr);
+    if (!m_Mapping)
+    {
+        return false;
+    }
+
+    m_Data = static_cast<uint8_t*>(MapViewOfFile(m_Mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+    if (!m_Data)
+    {
+        CloseHandle(m_Mapping);
+        m_Mapping = nullptr;
+        return false;
+    }
+#else
+    void* data = ::mmap(nullptr, m_Size, PROT_READ | PROT_WRITE, MAP_SHARED, m_File, 0);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+    m_Data = static_cast<uint8_t*>(data);
+#endif // _WIN32
+
+    return true;
+}
+
+void MappedFile::Unmap()
+{
+    if (!m_Data)
+    {
+        return;
+    }
+
+#ifdef _WIN32
+    UnmapViewOfFile(m_Data);
+    CloseHandle(m_Mapping);
+    m_Mapping = nullptr;
+#else
+    ::munmap(m_Data, m_Size);
+#endif // _WIN32
+
+    m_Data = nullptr;
+}
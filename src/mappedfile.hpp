@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+/**
+ * @brief Shared read/write memory mapping of a file on disk
+ *
+ * Writes made through GetData() end up in the file and are visible to every other mapping of
+ * the same file, including mappings held by other processes.
+ */
+class MappedFile final
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    /**
+     * @brief Open (or create) a file and map it into memory
+     * @param path File to map
+     * @param minimumSize The file is grown to at least this many bytes before being mapped
+     * @return true if the file is mapped
+     */
+    bool Open(const std::filesystem::path& path, uint64_t minimumSize = 0);
+
+    /**
+     * @brief Change the size of the file and remap it
+     * @param size New size in bytes
+     * @return true if the file is mapped with the new size
+     */
+    bool Resize(uint64_t size);
+
+    /**
+     * @brief Write dirty pages back to the file
+     * @param async Only schedule the write back instead of waiting for it
+     */
+    void Flush(bool async = false) const;
+
+    /**
+     * @brief Unmap and close the file
+     */
+    void Close();
+
+    bool IsOpen() const { return m_Data != nullptr; }
+    uint8_t* GetData() const { return m_Data; }
+    uint64_t GetSize() const { return m_Size; }
+    const std::filesystem::path& GetPath() const { return m_Path; }
+
+private:
+    bool Map();
+    void Unmap();
+
+private:
+    std::filesystem::path m_Path;
+    uint8_t* m_Data;
+    uint64_t m_Size;
+
+#ifdef _WIN32
+    void* m_File;
+    void* m_Mapping;
+#else
+    int m_File;
+#endif // _WIN32
+};
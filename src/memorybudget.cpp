@@ -0,0 +1,146 @@
+#include <memorybudget.hpp>
+
+#include <responsecache.hpp>
+
+#include <fmt/core.h>
+
+#include <string_view>
+
+static const std::string ReservationAttribute{ "memoryReservation" };
+
+// Key of the shared 503 response, distinct from the bodies used as keys by ResponseCache::Get()
+static constexpr std::string_view RejectResponseKey{ "memoryBudget" };
+
+MemoryBudget::Reservation::Reservation(std::shared_ptr<MemoryBudget> budget, uint64_t size)
+    : m_Budget(std::move(budget))
+    , m_Size(size)
+{
+}
+
+MemoryBudget::Reservation::~Reservation()
+{
+    m_Budget->Release(m_Size);
+}
+
+void MemoryBudget::Reservation::Add(uint64_t size)
+{
+    m_Budget->Acquire(size);
+    m_Size += size;
+}
+
+MemoryBudget::MemoryBudget(uint64_t capacity, uint64_t maxMemoryBodySize, std::chrono::seconds retryAfter)
+    : m_Capacity(capacity)
+    , m_MaxMemoryBodySize(maxMemoryBodySize)
+    , m_RetryAfter(retryAfter)
+    , m_Used(0)
+    , m_Peak(0)
+    , m_Rejected(0)
+{
+}
+
+std::shared_ptr<MemoryBudget::Reservation> MemoryBudget::TryReserve(uint64_t size)
+{
+    uint64_t used = m_Used.load(std::memory_order_relaxed);
+    do
+    {
+        if (used + size > m_Capacity)
+        {
+            m_Rejected.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+    } while (!m_Used.compare_exchange_weak(used, used + size, std::memory_order_relaxed));
+
+    // Only raised here, reservations growing past the capacity are not counted in the peak
+    uint64_t peak = m_Peak.load(std::memory_order_relaxed);
+    while (used + size > peak && !m_Peak.compare_exchange_weak(peak, used + size, std::memory_order_relaxed))
+    {
+    }
+
+    return std::make_shared<Reservation>(shared_from_this(), size);
+}
+
+void MemoryBudget::OnRequest(const drogon::HttpRequestPtr& req, drogon::AdviceCallback&& acb, drogon::AdviceChainCallback&& accb)
+{
+    // Larger bodies are in a file mapped by Drogon, and requests without a body hold nothing
+    const uint64_t bodySize = req->getBody().size();
+    if (bodySize == 0 || bodySize > m_MaxMemoryBodySize)
+    {
+        accb();
+        return;
+    }
+
+    std::shared_ptr<Reservation> reservation = TryReserve(bodySize);
+    if (!reservation)
+    {
+        drogon::HttpResponsePtr resp = ResponseCache::Find(drogon::k503ServiceUnavailable, RejectResponseKey);
+        if (!resp)
+        {
+            resp = drogon::HttpResponse::newHttpResponse();
+            resp->setStatusCode(drogon::k503ServiceUnavailable);
+            resp->setBody("Server is out of memory for request bodies, retry later");
+            resp->addHeader("Retry-After", std::to_string(m_RetryAfter.count()));
+            resp = ResponseCache::Add(drogon::k503ServiceUnavailable, RejectResponseKey, std::move(resp));
+        }
+
+        acb(resp);
+        return;
+    }
+
+    // Released with the request, along with its body
+    req->attributes()->insert(ReservationAttribute, std::move(reservation));
+    accb();
+}
+
+void MemoryBudget::OnResponse(const drogon::HttpRequestPtr& req, const drogon::HttpResponsePtr& resp)
+{
+    // Shared responses are allocated once per thread, files are sent straight from the page cache
+    const uint64_t bodySize = resp->getBody().size();
+    if (bodySize == 0 || !resp->sendfileName().empty() || ResponseCache::IsShared(resp))
+    {
+        return;
+    }
+
+    if (req->attributes()->find(ReservationAttribute))
+    {
+        req->attributes()->get<std::shared_ptr<Reservation>>(ReservationAttribute)->Add(bodySize);
+    }
+    else
+    {
+        Acquire(bodySize);
+        req->attributes()->insert(ReservationAttribute, std::make_shared<Reservation>(shared_from_this(), bodySize));
+    }
+}
+
+nlohmann::json MemoryBudget::GetStats() const
+{
+    nlohmann::json stats;
+    stats["capacity_bytes"] = m_Capacity;
+    stats["used_bytes"] = GetUsed();
+    stats["peak_bytes"] = GetPeak();
+    stats["max_memory_body_size"] = m_MaxMemoryBodySize;
+    stats["rejected"] = GetRejectedCount();
+    return stats;
+}
+
+void MemoryBudget::Export(std::string& out) const
+{
+    out += "# HELP vcpkg_cache_memory_budget_bytes Memory in-flight request and response bodies may hold\n";
+    out += "# TYPE vcpkg_cache_memory_budget_bytes gauge\n";
+    out += fmt::format("vcpkg_cache_memory_budget_bytes {}\n", m_Capacity);
+    out += "# HELP vcpkg_cache_memory_budget_used_bytes Memory held by in-flight request and response bodies\n";
+    out += "# TYPE vcpkg_cache_memory_budget_used_bytes gauge\n";
+    out += fmt::format("vcpkg_cache_memory_budget_used_bytes {}\n", GetUsed());
+    out += "# HELP vcpkg_cache_memory_budget_rejected_total Reservations refused because the memory budget was exhausted\n";
+    out += "# TYPE vcpkg_cache_memory_budget_rejected_total counter\n";
+    out += fmt::format("vcpkg_cache_memory_budget_rejected_total {}\n", GetRejectedCount());
+}
+
+void MemoryBudget::Acquire(uint64_t size)
+{
+    m_Used.fetch_add(size, std::memory_order_relaxed);
+}
+
+void MemoryBudget::Release(uint64_t size)
+{
+    m_Used.fetch_sub(size, std::memory_order_relaxed);
+}
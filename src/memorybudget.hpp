@@ -0,0 +1,102 @@
+#pragma once
+
+#include <drogon/HttpAppFramework.h>
+#include <drogon/HttpRequest.h>
+#include <drogon/HttpResponse.h>
+#include <nlohmann/json.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+/**
+ * @brief Global budget of the memory held by in-flight request and response bodies
+ *
+ * Drogon keeps a request body in memory up to web.maxMemoryBodySize and spools larger bodies to the
+ * upload directory, so without a budget the worst case is that size times the number of connections.
+ * Every request with a body in memory reserves its size from the pre-routing advice, and is rejected
+ * with a 503 and a Retry-After header when the budget is exhausted, which frees its body right away
+ * instead of holding it while the request waits for an admission slot or a handler. Bodies of the
+ * responses built in memory are added to the reservation of their request, and buffers allocated by the
+ * handlers (O_DIRECT downloads) reserve their size as well. A reservation is released when the request
+ * or the buffer is destroyed.
+ */
+class MemoryBudget final : public std::enable_shared_from_this<MemoryBudget>
+{
+public:
+    /**
+     * @brief Bytes held against the budget, released on destruction
+     */
+    class Reservation final
+    {
+    public:
+        Reservation(std::shared_ptr<MemoryBudget> budget, uint64_t size);
+        ~Reservation();
+
+        Reservation(const Reservation&) = delete;
+        Reservation& operator=(const Reservation&) = delete;
+
+        /**
+         * @brief Hold more bytes, even if the budget is exceeded
+         */
+        void Add(uint64_t size);
+
+    private:
+        std::shared_ptr<MemoryBudget> m_Budget;
+        uint64_t m_Size;
+    };
+
+    /**
+     * @brief Constructor
+     * @param capacity Bytes in-flight bodies may hold at once
+     * @param maxMemoryBodySize Request bodies larger than this are spooled to disk by Drogon
+     * @param retryAfter Delay suggested to the clients of rejected requests
+     */
+    MemoryBudget(uint64_t capacity, uint64_t maxMemoryBodySize, std::chrono::seconds retryAfter);
+
+    /**
+     * @brief Reserve bytes if they fit in the budget
+     * @return The reservation, or nullptr if the budget is exhausted
+     */
+    std::shared_ptr<Reservation> TryReserve(uint64_t size);
+
+    /**
+     * @brief Called from the pre-routing advice, reserves the body of the request or rejects it
+     */
+    void OnRequest(const drogon::HttpRequestPtr& req, drogon::AdviceCallback&& acb, drogon::AdviceChainCallback&& accb);
+
+    /**
+     * @brief Called from the pre-sending advice, adds a response body built in memory to the reservation of its request
+     */
+    void OnResponse(const drogon::HttpRequestPtr& req, const drogon::HttpResponsePtr& resp);
+
+    uint64_t GetCapacity() const { return m_Capacity; }
+    uint64_t GetUsed() const { return m_Used.load(std::memory_order_relaxed); }
+    uint64_t GetPeak() const { return m_Peak.load(std::memory_order_relaxed); }
+    uint64_t GetRejectedCount() const { return m_Rejected.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Get the capacity, usage and rejections
+     */
+    nlohmann::json GetStats() const;
+
+    /**
+     * @brief Append the memory budget metrics to a Prometheus text exposition
+     */
+    void Export(std::string& out) const;
+
+private:
+    void Acquire(uint64_t size);
+    void Release(uint64_t size);
+
+private:
+    const uint64_t m_Capacity;
+    const uint64_t m_MaxMemoryBodySize;
+    const std::chrono::seconds m_RetryAfter;
+
+    std::atomic<uint64_t> m_Used;
+    std::atomic<uint64_t> m_Peak;
+    std::atomic<uint64_t> m_Rejected;
+};
@@ -0,0 +1,305 @@
+#include <metrics.hpp>
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <bit>
+
+static constexpr std::array<std::string_view, static_cast<size_t>(MetricsRoute::COUNT)> RouteNames{ "head", "get", "put", "check", "download", "status", "other" };
+static constexpr std::array<std::string_view, static_cast<size_t>(AuthRejectReason::COUNT)> AuthRejectReasonNames{ "invalid_key", "expired_key", "read_required", "write_required" };
+static constexpr std::array<std::string_view, static_cast<size_t>(DiskOperation::COUNT)> DiskOperationNames{ "read", "write" };
+static constexpr std::array<std::string_view, 2> PageCacheReadNames{ "first", "repeat" };
+
+static const std::string SendfileSizeAttribute{ "sendfileSize" };
+
+// Shards are only written by the thread owning them, a plain load and store avoids a locked read-modify-write
+static void Increment(std::atomic<uint64_t>& counter, uint64_t value = 1)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+void Metrics::Histogram::Observe(uint64_t value)
+{
+    Increment(buckets[GetBucketIndex(value)]);
+    Increment(sum, value);
+}
+
+Metrics::Metrics()
+    : m_InFlight(0)
+{
+}
+
+Metrics::~Metrics() = default;
+
+void Metrics::OnRequest(const drogon::HttpRequestPtr& req)
+{
+    m_InFlight.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::OnResponse(const drogon::HttpRequestPtr& req, const drogon::HttpResponsePtr& resp)
+{
+    m_InFlight.fetch_sub(1, std::memory_order_relaxed);
+
+    const size_t route = static_cast<size_t>(GetRoute(req->getMethod(), req->getPath()));
+    const int64_t elapsed = trantor::Date::now().microSecondsSinceEpoch() - req->creationDate().microSecondsSinceEpoch();
+
+    Shard& shard = GetShard();
+    shard.latencies[route].Observe(static_cast<uint64_t>(std::max<int64_t>(elapsed, 0)));
+
+    const size_t statusCode = static_cast<size_t>(resp->getStatusCode());
+    if (statusCode >= 100 && statusCode < 100 + StatusCodeCount)
+    {
+        Increment(shard.statusCodes[route][statusCode - 100]);
+    }
+
+    Increment(shard.bytesReceived[route], req->getBody().size());
+    Increment(shard.bytesSent[route], GetBodySize(req, resp));
+}
+
+void Metrics::AddBytesSent(MetricsRoute route, uint64_t bytes)
+{
+    Increment(GetShard().bytesSent[static_cast<size_t>(route)], bytes);
+}
+
+void Metrics::AddAuthReject(AuthRejectReason reason)
+{
+    m_AuthRejects[static_cast<size_t>(reason)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::ObserveDiskOperation(DiskOperation operation, std::chrono::microseconds duration)
+{
+    GetShard().diskOperations[static_cast<size_t>(operation)].Observe(static_cast<uint64_t>(std::max<int64_t>(duration.count(), 0)));
+}
+
+void Metrics::ObservePageCache(bool repeat, uint64_t size, uint64_t residentSize)
+{
+    Shard& shard = GetShard();
+    Increment(shard.pageCacheSampled[repeat ? 1 : 0], size);
+    Increment(shard.pageCacheResident[repeat ? 1 : 0], residentSize);
+}
+
+void Metrics::Export(std::string& out) const
+{
+    constexpr size_t RouteCount = static_cast<size_t>(MetricsRoute::COUNT);
+    constexpr size_t DiskOperationCount = static_cast<size_t>(DiskOperation::COUNT);
+
+    std::vector<std::array<uint64_t, BucketCount>> latencyBuckets(RouteCount);
+    std::vector<uint64_t> latencySums(RouteCount);
+    std::vector<std::array<uint64_t, StatusCodeCount>> statusCodes(RouteCount);
+    std::vector<uint64_t> bytesReceived(RouteCount);
+    std::vector<uint64_t> bytesSent(RouteCount);
+    std::vector<std::array<uint64_t, BucketCount>> diskBuckets(DiskOperationCount);
+    std::vector<uint64_t> diskSums(DiskOperationCount);
+    std::array<uint64_t, 2> pageCacheSampled{};
+    std::array<uint64_t, 2> pageCacheResident{};
+
+    for (const Shard* shard : m_Shards.GetAll())
+    {
+        for (size_t route = 0; route < RouteCount; ++route)
+        {
+            for (size_t bucket = 0; bucket < BucketCount; ++bucket)
+            {
+                latencyBuckets[route][bucket] += shard->latencies[route].buckets[bucket].load(std::memory_order_relaxed);
+            }
+            latencySums[route] += shard->latencies[route].sum.load(std::memory_order_relaxed);
+
+            for (size_t code = 0; code < StatusCodeCount; ++code)
+            {
+                statusCodes[route][code] += shard->statusCodes[route][code].load(std::memory_order_relaxed);
+            }
+
+            bytesReceived[route] += shard->bytesReceived[route].load(std::memory_order_relaxed);
+            bytesSent[route] += shard->bytesSent[route].load(std::memory_order_relaxed);
+        }
+
+        for (size_t operation = 0; operation < DiskOperationCount; ++operation)
+        {
+            for (size_t bucket = 0; bucket < BucketCount; ++bucket)
+            {
+                diskBuckets[operation][bucket] += shard->diskOperations[operation].buckets[bucket].load(std::memory_order_relaxed);
+            }
+            diskSums[operation] += shard->diskOperations[operation].sum.load(std::memory_order_relaxed);
+        }
+
+        for (size_t read = 0; read < pageCacheSampled.size(); ++read)
+        {
+            pageCacheSampled[read] += shard->pageCacheSampled[read].load(std::memory_order_relaxed);
+            pageCacheResident[read] += shard->pageCacheResident[read].load(std::memory_order_relaxed);
+        }
+    }
+
+    ExportHistograms(out, "vcpkg_cache_request_duration_seconds", "Time from the start of a request to its response headers", "route",
+                     std::vector<std::string_view>(RouteNames.begin(), RouteNames.end()), latencyBuckets, latencySums);
+
+    out += "# HELP vcpkg_cache_responses_total Responses sent, by route and status code\n";
+    out += "# TYPE vcpkg_cache_responses_total counter\n";
+    for (size_t route = 0; route < RouteCount; ++route)
+    {
+        for (size_t code = 0; code < StatusCodeCount; ++code)
+        {
+            if (statusCodes[route][code] > 0)
+            {
+                out += fmt::format("vcpkg_cache_responses_total{{route=\"{}\",code=\"{}\"}} {}\n", RouteNames[route], code + 100, statusCodes[route][code]);
+            }
+        }
+    }
+
+    out += "# HELP vcpkg_cache_received_bytes_total Request body bytes received, by route\n";
+    out += "# TYPE vcpkg_cache_received_bytes_total counter\n";
+    for (size_t route = 0; route < RouteCount; ++route)
+    {
+        out += fmt::format("vcpkg_cache_received_bytes_total{{route=\"{}\"}} {}\n", RouteNames[route], bytesReceived[route]);
+    }
+
+    out += "# HELP vcpkg_cache_sent_bytes_total Response body bytes sent, by route\n";
+    out += "# TYPE vcpkg_cache_sent_bytes_total counter\n";
+    for (size_t route = 0; route < RouteCount; ++route)
+    {
+        out += fmt::format("vcpkg_cache_sent_bytes_total{{route=\"{}\"}} {}\n", RouteNames[route], bytesSent[route]);
+    }
+
+    out += "# HELP vcpkg_cache_auth_rejections_total Requests rejected by the API key filter, by reason\n";
+    out += "# TYPE vcpkg_cache_auth_rejections_total counter\n";
+    for (size_t reason = 0; reason < m_AuthRejects.size(); ++reason)
+    {
+        out += fmt::format("vcpkg_cache_auth_rejections_total{{reason=\"{}\"}} {}\n", AuthRejectReasonNames[reason], m_AuthRejects[reason].load(std::memory_order_relaxed));
+    }
+
+    out += "# HELP vcpkg_cache_requests_in_flight Requests being handled\n";
+    out += "# TYPE vcpkg_cache_requests_in_flight gauge\n";
+    out += fmt::format("vcpkg_cache_requests_in_flight {}\n", m_InFlight.load(std::memory_order_relaxed));
+
+    ExportHistograms(out, "vcpkg_cache_disk_operation_duration_seconds", "Time spent reading and writing package files", "operation",
+                     std::vector<std::string_view>(DiskOperationNames.begin(), DiskOperationNames.end()), diskBuckets, diskSums);
+
+    out += "# HELP vcpkg_cache_page_cache_sampled_bytes_total Size of the sampled package downloads, by whether the package was read before\n";
+    out += "# TYPE vcpkg_cache_page_cache_sampled_bytes_total counter\n";
+    for (size_t read = 0; read < pageCacheSampled.size(); ++read)
+    {
+        out += fmt::format("vcpkg_cache_page_cache_sampled_bytes_total{{read=\"{}\"}} {}\n", PageCacheReadNames[read], pageCacheSampled[read]);
+    }
+
+    out += "# HELP vcpkg_cache_page_cache_resident_bytes_total Part of the sampled package downloads found in the page cache\n";
+    out += "# TYPE vcpkg_cache_page_cache_resident_bytes_total counter\n";
+    for (size_t read = 0; read < pageCacheResident.size(); ++read)
+    {
+        out += fmt::format("vcpkg_cache_page_cache_resident_bytes_total{{read=\"{}\"}} {}\n", PageCacheReadNames[read], pageCacheResident[read]);
+    }
+}
+
+MetricsRoute Metrics::GetRoute(drogon::HttpMethod method, std::string_view path)
+{
+    switch (method)
+    {
+    case drogon::Head:
+        return MetricsRoute::HEAD;
+    case drogon::Put:
+        return MetricsRoute::PUT;
+    case drogon::Post:
+        if (path == "/api/packages/check")
+        {
+            return MetricsRoute::CHECK;
+        }
+        if (path == "/api/packages/download")
+        {
+            return MetricsRoute::DOWNLOAD;
+        }
+        return MetricsRoute::OTHER;
+    case drogon::Get:
+        if (path == "/status" || path == "/metrics")
+        {
+            return MetricsRoute::STATUS;
+        }
+        // Packages are the only GET routes with four path segments, or a single one ending with .zip
+        if (path.ends_with(".zip") && std::count(path.begin(), path.end(), '/') == 1)
+        {
+            return MetricsRoute::GET;
+        }
+        return std::count(path.begin(), path.end(), '/') == 4 && path.substr(0, 5) != "/api/" ? MetricsRoute::GET : MetricsRoute::OTHER;
+    default:
+        return MetricsRoute::OTHER;
+    }
+}
+
+void Metrics::SetSendfileSize(const drogon::HttpRequestPtr& req, uint64_t size)
+{
+    req->attributes()->insert(SendfileSizeAttribute, size);
+}
+
+uint64_t Metrics::GetBodySize(const drogon::HttpRequestPtr& req, const drogon::HttpResponsePtr& resp)
+{
+    const std::string& sendfileName = resp->sendfileName();
+    if (sendfileName.empty())
+    {
+        return resp->getBody().size();
+    }
+
+    const auto& [offset, length] = resp->sendfileRange();
+    if (length > 0)
+    {
+        return length;
+    }
+
+    // The whole file from the offset, sized by the handler rather than by a stat() of every download
+    if (!req->attributes()->find(SendfileSizeAttribute))
+    {
+        return 0;
+    }
+
+    const uint64_t size = req->attributes()->get<uint64_t>(SendfileSizeAttribute);
+    return size > offset ? size - offset : 0;
+}
+
+Metrics::Shard& Metrics::GetShard()
+{
+    return m_Shards.Get([]() { return std::make_unique<Shard>(); });
+}
+
+size_t Metrics::GetBucketIndex(uint64_t value)
+{
+    // Values below SubBucketCount get a bucket each, above that every power of two is split in SubBucketCount buckets
+    if (value < SubBucketCount)
+    {
+        return static_cast<size_t>(value);
+    }
+
+    const size_t exponent = 63 - std::countl_zero(value);
+    const size_t mantissa = static_cast<size_t>(value >> (exponent - SubBucketBits)) & (SubBucketCount - 1);
+    return std::min((exponent - SubBucketBits + 1) * SubBucketCount + mantissa, BucketCount - 1);
+}
+
+uint64_t Metrics::GetBucketUpperBound(size_t index)
+{
+    if (index < SubBucketCount)
+    {
+        return index + 1;
+    }
+
+    const size_t exponent = index / SubBucketCount + SubBucketBits - 1;
+    return static_cast<uint64_t>(SubBucketCount + index % SubBucketCount + 1) << (exponent - SubBucketBits);
+}
+
+void Metrics::ExportHistograms(std::string& out, std::string_view name, std::string_view help, std::string_view label, const std::vector<std::string_view>& labelValues, const std::vector<std::array<uint64_t, BucketCount>>& buckets, const std::vector<uint64_t>& sums)
+{
+    out += fmt::format("# HELP {} {}\n", name, help);
+    out += fmt::format("# TYPE {} histogram\n", name);
+
+    for (size_t i = 0; i < labelValues.size(); ++i)
+    {
+        uint64_t count = 0;
+        for (size_t bucket = 0; bucket < BucketCount; ++bucket)
+        {
+            count += buckets[i][bucket];
+
+            // Only the power of two boundaries are exported, to keep the number of series reasonable
+            if ((bucket + 1) % SubBucketCount == 0 && bucket + 1 < BucketCount)
+            {
+                out += fmt::format("{}_bucket{{{}=\"{}\",le=\"{}\"}} {}\n", name, label, labelValues[i], GetBucketUpperBound(bucket) / 1e6, count);
+            }
+        }
+
+        out += fmt::format("{}_bucket{{{}=\"{}\",le=\"+Inf\"}} {}\n", name, label, labelValues[i], count);
+        out += fmt::format("{}_sum{{{}=\"{}\"}} {}\n", name, label, labelValues[i], sums[i] / 1e6);
+        out += fmt::format("{}_count{{{}=\"{}\"}} {}\n", name, label, labelValues[i], count);
+    }
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <perthread.hpp>
+
+#include <drogon/HttpRequest.h>
+#include <drogon/HttpResponse.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @brief Request routes tracked separately by the metrics
+ */
+enum class MetricsRoute
+{
+    HEAD,     // HEAD /{triplet}/{name}/{version}/{sha}
+    GET,      // GET /{triplet}/{name}/{version}/{sha}
+    PUT,      // PUT /{triplet}/{name}/{version}/{sha}
+    CHECK,    // POST /api/packages/check
+    DOWNLOAD, // POST /api/packages/download
+    STATUS,   // GET /status and /metrics
+    OTHER,
+    COUNT
+};
+
+/**
+ * @brief Reasons for ApiKeyFilter to reject a request
+ */
+enum class AuthRejectReason
+{
+    INVALID_KEY,
+    EXPIRED_KEY,
+    READ_REQUIRED,
+    WRITE_REQUIRED,
+    COUNT
+};
+
+/**
+ * @brief Disk operations timed by the metrics
+ */
+enum class DiskOperation
+{
+    READ,
+    WRITE,
+    COUNT
+};
+
+/**
+ * @brief Request and disk metrics, exported in the Prometheus text format
+ *
+ * Every thread records into its own shard, so the request path never contends on a lock or a shared
+ * cache line. Latencies go to log-linear histograms (4 sub-buckets per power of two, in microseconds),
+ * which keeps the relative error under 25% from 1us to over 2 hours. Shards are only summed when the
+ * metrics are exported.
+ */
+class Metrics final
+{
+public:
+    Metrics();
+    ~Metrics();
+
+    /**
+     * @brief Called from the pre-routing advice, when a request starts being handled
+     */
+    void OnRequest(const drogon::HttpRequestPtr& req);
+
+    /**
+     * @brief Called from the pre-sending advice, when the response headers are about to be sent
+     */
+    void OnResponse(const drogon::HttpRequestPtr& req, const drogon::HttpResponsePtr& resp);
+
+    /**
+     * @brief Account bytes sent outside of the response body (streamed responses)
+     */
+    void AddBytesSent(MetricsRoute route, uint64_t bytes);
+
+    void AddAuthReject(AuthRejectReason reason);
+    void ObserveDiskOperation(DiskOperation operation, std::chrono::microseconds duration);
+
+    /**
+     * @brief Record how much of a downloaded package was in the page cache
+     * @param repeat Whether the package was read before, the set the page cache is expected to hold
+     */
+    void ObservePageCache(bool repeat, uint64_t size, uint64_t residentSize);
+
+    /**
+     * @brief Append every metric to a Prometheus text exposition
+     */
+    void Export(std::string& out) const;
+
+    static MetricsRoute GetRoute(drogon::HttpMethod method, std::string_view path);
+
+    /**
+     * @brief Record the size of the file a response sends after its headers, which is already known from the package index
+     */
+    static void SetSendfileSize(const drogon::HttpRequestPtr& req, uint64_t size);
+
+    /**
+     * @brief Get the size of a response body, including files sent after the headers
+     */
+    static uint64_t GetBodySize(const drogon::HttpRequestPtr& req, const drogon::HttpResponsePtr& resp);
+
+public:
+    static constexpr size_t SubBucketBits = 2;
+    static constexpr size_t SubBucketCount = 1 << SubBucketBits;
+    static constexpr size_t BucketCount = 128;
+
+    // HTTP status codes 100 to 599
+    static constexpr size_t StatusCodeCount = 500;
+
+private:
+    struct Histogram
+    {
+        std::array<std::atomic<uint64_t>, BucketCount> buckets;
+        std::atomic<uint64_t> sum; // Microseconds
+
+        void Observe(uint64_t value);
+    };
+
+    struct Shard
+    {
+        std::array<Histogram, static_cast<size_t>(MetricsRoute::COUNT)> latencies;
+        std::array<std::array<std::atomic<uint64_t>, StatusCodeCount>, static_cast<size_t>(MetricsRoute::COUNT)> statusCodes;
+        std::array<std::atomic<uint64_t>, static_cast<size_t>(MetricsRoute::COUNT)> bytesReceived;
+        std::array<std::atomic<uint64_t>, static_cast<size_t>(MetricsRoute::COUNT)> bytesSent;
+        std::array<Histogram, static_cast<size_t>(DiskOperation::COUNT)> diskOperations;
+        std::array<std::atomic<uint64_t>, 2> pageCacheSampled; // First reads, repeated reads
+        std::array<std::atomic<uint64_t>, 2> pageCacheResident;
+    };
+
+    Shard& GetShard();
+
+    static size_t GetBucketIndex(uint64_t value);
+    static uint64_t GetBucketUpperBound(size_t index);
+
+    static void ExportHistograms(std::string& out, std::string_view name, std::string_view help, std::string_view label, const std::vector<std::string_view>& labelValues, const std::vector<std::array<uint64_t, BucketCount>>& buckets, const std::vector<uint64_t>& sums);
+
+private:
+    std::atomic<int64_t> m_InFlight;
+    std::array<std::atomic<uint64_t>, static_cast<size_t>(AuthRejectReason::COUNT)> m_AuthRejects;
+
+    PerThread<Shard> m_Shards;
+};
@@ -1,5 +1,7 @@
 #include "options.hpp"
 
+#include <threadutils.hpp>
+
 #include <fmt/core.h>
 #include <toml.hpp>
 
@@ -15,7 +17,7 @@ bool get_toml_value(toml::table& table, const std::string& variable, T& value)
             value = table[variable].as_string();
             return true;
         }
-        else if constexpr (std::is_same_v<T, int> || std::is_same_v<T, uint32_t> || std::is_same_v<T, uint16_t>)
+        else if constexpr (std::is_same_v<T, int> || std::is_same_v<T, uint64_t> || std::is_same_v<T, uint32_t> || std::is_same_v<T, uint16_t>)
         {
             value = table[variable].as_integer();
             return true;
@@ -40,6 +42,18 @@ bool get_toml_value(toml::table& table, const std::string& variable, T& value)
             }
             return true;
         }
+        else if constexpr (std::is_same_v<T, std::vector<uint32_t>>)
+        {
+            // Replaces the defaults rather than adding to them
+            std::vector<toml::value>& tomlArray = table[variable].as_array();
+            value.clear();
+            value.reserve(tomlArray.size());
+            for (toml::value& tomlValue : tomlArray)
+            {
+                value.emplace_back(static_cast<uint32_t>(tomlValue.as_integer()));
+            }
+            return true;
+        }
         else
         {
             static_assert(!std::is_same_v<T, T>, "Unsupported type for TOML value.");
@@ -60,11 +74,13 @@ static const std::string PersistenceFile{ "/etc/vcpkg.cache/persistence.json" };
 Options::Options()
     : configFile{ DefaultConfigFile }
     , persistenceFile{ PersistenceFile }
+    , lockFile{ PersistenceFile + ".lock" }
     , saveConfigFile(false)
 #ifndef _WIN32
     , runAsDaemon(false)
 #endif // _WIN32
     , sendTermSignal(false)
+    , restart(false)
 {
 }
 
@@ -79,11 +95,107 @@ void Options::save()
     config["web"]["bind"] = web.bindAddress;
     config["web"]["port"] = web.port;
     config["web"]["threads"] = web.threads;
+    config["web"]["workers"] = web.workers;
     config["web"]["logPath"] = web.logPath;
     config["web"]["maxConnectionNum"] = web.maxConnectionNum;
     config["web"]["maxUploadSize"] = web.maxUploadSize;
+    config["web"]["maxMemoryBodySize"] = web.maxMemoryBodySize;
+    config["web"]["memoryBudget"] = web.memoryBudget;
+    config["web"]["drainTimeout"] = web.drainTimeout;
 
     config["cache"]["path"] = cache.directory;
+    config["cache"]["index"] = cache.indexFile;
+    config["cache"]["capacity"] = cache.capacity;
+    if (!cache.tiers.empty())
+    {
+        toml::array tiers;
+        for (const CacheProperties::TierProperties& tier : cache.tiers)
+        {
+            tiers.emplace_back(toml::table{ { "path", tier.directory }, { "capacity", tier.capacity } });
+        }
+        config["cache"]["tiers"] = tiers;
+    }
+
+    config["tiering"]["promoteOnRead"] = tiering.promoteOnRead;
+    config["tiering"]["highWatermark"] = tiering.highWatermark;
+    config["tiering"]["lowWatermark"] = tiering.lowWatermark;
+    config["tiering"]["migrationRate"] = tiering.migrationRate;
+    config["tiering"]["interval"] = tiering.interval;
+    config["tiering"]["ioPriority"] = tiering.ioPriority;
+
+    config["scanner"]["threads"] = scanner.threads;
+    config["scanner"]["ioPriority"] = scanner.ioPriority;
+    config["scanner"]["progressInterval"] = scanner.progressInterval;
+
+    config["timing"]["enabled"] = timing.enabled;
+    config["timing"]["slowRequestThreshold"] = timing.slowRequestThreshold;
+    config["timing"]["slowRequestLogSize"] = timing.slowRequestLogSize;
+
+    config["accessLog"]["path"] = accessLog.path;
+    config["accessLog"]["maxFileSize"] = accessLog.maxFileSize;
+    config["accessLog"]["maxFiles"] = accessLog.maxFiles;
+    config["accessLog"]["bufferSize"] = accessLog.bufferSize;
+    config["accessLog"]["flushInterval"] = accessLog.flushInterval;
+
+    config["pageCache"]["dropUploads"] = pageCache.dropUploads;
+    config["pageCache"]["readaheadThreshold"] = pageCache.readaheadThreshold;
+    config["pageCache"]["readaheadSize"] = pageCache.readaheadSize;
+    config["pageCache"]["directIoThreshold"] = pageCache.directIoThreshold;
+    config["pageCache"]["prefetchSize"] = pageCache.prefetchSize;
+    config["pageCache"]["sampleRate"] = pageCache.sampleRate;
+
+    config["admission"]["enabled"] = admission.enabled;
+    config["admission"]["maxInFlight"] = admission.maxInFlight;
+    config["admission"]["retryAfter"] = admission.retryAfter;
+    for (const auto& [name, properties] : { std::make_pair("head", &admission.head), std::make_pair("get", &admission.get), std::make_pair("put", &admission.put), std::make_pair("admin", &admission.admin) })
+    {
+        config["admission"][name]["concurrency"] = properties->concurrency;
+        config["admission"][name]["queueSize"] = properties->queueSize;
+        config["admission"][name]["maxQueueTime"] = properties->maxQueueTime;
+    }
+
+    config["bandwidth"]["enabled"] = bandwidth.enabled;
+    config["bandwidth"]["egressRate"] = bandwidth.egressRate;
+    config["bandwidth"]["quantum"] = bandwidth.quantum;
+    config["bandwidth"]["threshold"] = bandwidth.threshold;
+
+    config["affinity"]["io"] = affinity.io;
+    config["affinity"]["disk"] = affinity.disk;
+    config["affinity"]["background"] = affinity.background;
+
+    config["scrub"]["enabled"] = scrub.enabled;
+    config["scrub"]["rate"] = scrub.rate;
+    config["scrub"]["interval"] = scrub.interval;
+    config["scrub"]["ioPriority"] = scrub.ioPriority;
+    config["scrub"]["quarantine"] = scrub.quarantine;
+
+    config["import"]["threads"] = bulkImport.threads;
+    config["import"]["rate"] = bulkImport.rate;
+    config["import"]["ioPriority"] = bulkImport.ioPriority;
+    config["import"]["hardlink"] = bulkImport.hardlink;
+
+    config["prefetch"]["enabled"] = prefetch.enabled;
+    config["prefetch"]["window"] = prefetch.window;
+    config["prefetch"]["horizon"] = prefetch.horizon;
+    config["prefetch"]["maxPackages"] = prefetch.maxPackages;
+    config["prefetch"]["maxSuccessors"] = prefetch.maxSuccessors;
+    config["prefetch"]["minSupport"] = prefetch.minSupport;
+    config["prefetch"]["minConfidence"] = prefetch.minConfidence;
+    config["prefetch"]["maxBytes"] = prefetch.maxBytes;
+    config["prefetch"]["bufferSize"] = prefetch.bufferSize;
+    config["prefetch"]["flushInterval"] = prefetch.flushInterval;
+
+    toml::array windows;
+    for (uint32_t window : popularity.windows)
+    {
+        windows.emplace_back(window);
+    }
+    config["popularity"]["enabled"] = popularity.enabled;
+    config["popularity"]["windows"] = windows;
+    config["popularity"]["capacity"] = popularity.capacity;
+    config["popularity"]["sketchWidth"] = popularity.sketchWidth;
+    config["popularity"]["bufferSize"] = popularity.bufferSize;
+    config["popularity"]["flushInterval"] = popularity.flushInterval;
 
     config["upload"]["path"] = upload.directory;
 
@@ -111,6 +223,15 @@ void Options::save()
     }
 }
 
+// A typo must not silently fall back to another priority, like the CPU lists of the affinity section
+static void ValidateIoPriority(const std::string& section, const std::string& ioPriority)
+{
+    if (!IoPriorityFromString(ioPriority).has_value())
+    {
+        throw std::runtime_error(fmt::format("Invalid I/O priority \"{}\" in [{}], expected \"normal\", \"low\" or \"idle\"", ioPriority, section));
+    }
+}
+
 void Options::load()
 {
     if (!std::filesystem::exists(configFile))
@@ -142,15 +263,169 @@ void Options::load()
         get_toml_value(webTable, "bind", web.bindAddress);
         get_toml_value(webTable, "port", web.port);
         get_toml_value(webTable, "threads", web.threads);
+        get_toml_value(webTable, "workers", web.workers);
         get_toml_value(webTable, "logPath", web.logPath);
         get_toml_value(webTable, "maxConnectionNum", web.maxConnectionNum);
         get_toml_value(webTable, "maxUploadSize", web.maxUploadSize);
+        get_toml_value(webTable, "maxMemoryBodySize", web.maxMemoryBodySize);
+        get_toml_value(webTable, "memoryBudget", web.memoryBudget);
+        get_toml_value(webTable, "drainTimeout", web.drainTimeout);
     }
 
     if (config.contains("cache") && config.at("cache").is<toml::table>())
     {
         toml::table& cacheTable = toml::find<toml::table>(config, "cache");
         get_toml_value(cacheTable, "path", cache.directory);
+        get_toml_value(cacheTable, "index", cache.indexFile);
+        get_toml_value(cacheTable, "capacity", cache.capacity);
+
+        if (cacheTable.find("tiers") != cacheTable.end())
+        {
+            for (toml::value& tierValue : cacheTable["tiers"].as_array())
+            {
+                CacheProperties::TierProperties tier;
+                get_toml_value(tierValue.as_table(), "path", tier.directory);
+                get_toml_value(tierValue.as_table(), "capacity", tier.capacity);
+                if (tier.directory.empty())
+                {
+                    throw std::runtime_error("Cache tier is missing its path.");
+                }
+                cache.tiers.emplace_back(std::move(tier));
+            }
+        }
+    }
+
+    if (config.contains("tiering") && config.at("tiering").is<toml::table>())
+    {
+        toml::table& tieringTable = toml::find<toml::table>(config, "tiering");
+        get_toml_value(tieringTable, "promoteOnRead", tiering.promoteOnRead);
+        get_toml_value(tieringTable, "highWatermark", tiering.highWatermark);
+        get_toml_value(tieringTable, "lowWatermark", tiering.lowWatermark);
+        get_toml_value(tieringTable, "migrationRate", tiering.migrationRate);
+        get_toml_value(tieringTable, "interval", tiering.interval);
+        get_toml_value(tieringTable, "ioPriority", tiering.ioPriority);
+        ValidateIoPriority("tiering", tiering.ioPriority);
+    }
+
+    if (config.contains("scanner") && config.at("scanner").is<toml::table>())
+    {
+        toml::table& scannerTable = toml::find<toml::table>(config, "scanner");
+        get_toml_value(scannerTable, "threads", scanner.threads);
+        get_toml_value(scannerTable, "ioPriority", scanner.ioPriority);
+        ValidateIoPriority("scanner", scanner.ioPriority);
+        get_toml_value(scannerTable, "progressInterval", scanner.progressInterval);
+    }
+
+    if (config.contains("timing") && config.at("timing").is<toml::table>())
+    {
+        toml::table& timingTable = toml::find<toml::table>(config, "timing");
+        get_toml_value(timingTable, "enabled", timing.enabled);
+        get_toml_value(timingTable, "slowRequestThreshold", timing.slowRequestThreshold);
+        get_toml_value(timingTable, "slowRequestLogSize", timing.slowRequestLogSize);
+    }
+
+    if (config.contains("accessLog") && config.at("accessLog").is<toml::table>())
+    {
+        toml::table& accessLogTable = toml::find<toml::table>(config, "accessLog");
+        get_toml_value(accessLogTable, "path", accessLog.path);
+        get_toml_value(accessLogTable, "maxFileSize", accessLog.maxFileSize);
+        get_toml_value(accessLogTable, "maxFiles", accessLog.maxFiles);
+        get_toml_value(accessLogTable, "bufferSize", accessLog.bufferSize);
+        get_toml_value(accessLogTable, "flushInterval", accessLog.flushInterval);
+    }
+
+    if (config.contains("pageCache") && config.at("pageCache").is<toml::table>())
+    {
+        toml::table& pageCacheTable = toml::find<toml::table>(config, "pageCache");
+        get_toml_value(pageCacheTable, "dropUploads", pageCache.dropUploads);
+        get_toml_value(pageCacheTable, "readaheadThreshold", pageCache.readaheadThreshold);
+        get_toml_value(pageCacheTable, "readaheadSize", pageCache.readaheadSize);
+        get_toml_value(pageCacheTable, "directIoThreshold", pageCache.directIoThreshold);
+        get_toml_value(pageCacheTable, "prefetchSize", pageCache.prefetchSize);
+        get_toml_value(pageCacheTable, "sampleRate", pageCache.sampleRate);
+    }
+
+    if (config.contains("admission") && config.at("admission").is<toml::table>())
+    {
+        toml::table& admissionTable = toml::find<toml::table>(config, "admission");
+        get_toml_value(admissionTable, "enabled", admission.enabled);
+        get_toml_value(admissionTable, "maxInFlight", admission.maxInFlight);
+        get_toml_value(admissionTable, "retryAfter", admission.retryAfter);
+
+        for (const auto& [name, properties] : { std::make_pair("head", &admission.head), std::make_pair("get", &admission.get), std::make_pair("put", &admission.put), std::make_pair("admin", &admission.admin) })
+        {
+            if (admissionTable.find(name) != admissionTable.end() && admissionTable[name].is_table())
+            {
+                toml::table& classTable = admissionTable[name].as_table();
+                get_toml_value(classTable, "concurrency", properties->concurrency);
+                get_toml_value(classTable, "queueSize", properties->queueSize);
+                get_toml_value(classTable, "maxQueueTime", properties->maxQueueTime);
+            }
+        }
+    }
+
+    if (config.contains("bandwidth") && config.at("bandwidth").is<toml::table>())
+    {
+        toml::table& bandwidthTable = toml::find<toml::table>(config, "bandwidth");
+        get_toml_value(bandwidthTable, "enabled", bandwidth.enabled);
+        get_toml_value(bandwidthTable, "egressRate", bandwidth.egressRate);
+        get_toml_value(bandwidthTable, "quantum", bandwidth.quantum);
+        get_toml_value(bandwidthTable, "threshold", bandwidth.threshold);
+    }
+
+    if (config.contains("affinity") && config.at("affinity").is<toml::table>())
+    {
+        toml::table& affinityTable = toml::find<toml::table>(config, "affinity");
+        get_toml_value(affinityTable, "io", affinity.io);
+        get_toml_value(affinityTable, "disk", affinity.disk);
+        get_toml_value(affinityTable, "background", affinity.background);
+    }
+
+    if (config.contains("scrub") && config.at("scrub").is<toml::table>())
+    {
+        toml::table& scrubTable = toml::find<toml::table>(config, "scrub");
+        get_toml_value(scrubTable, "enabled", scrub.enabled);
+        get_toml_value(scrubTable, "rate", scrub.rate);
+        get_toml_value(scrubTable, "interval", scrub.interval);
+        get_toml_value(scrubTable, "ioPriority", scrub.ioPriority);
+        ValidateIoPriority("scrub", scrub.ioPriority);
+        get_toml_value(scrubTable, "quarantine", scrub.quarantine);
+    }
+
+    if (config.contains("import") && config.at("import").is<toml::table>())
+    {
+        toml::table& importTable = toml::find<toml::table>(config, "import");
+        get_toml_value(importTable, "threads", bulkImport.threads);
+        get_toml_value(importTable, "rate", bulkImport.rate);
+        get_toml_value(importTable, "ioPriority", bulkImport.ioPriority);
+        ValidateIoPriority("import", bulkImport.ioPriority);
+        get_toml_value(importTable, "hardlink", bulkImport.hardlink);
+    }
+
+    if (config.contains("prefetch") && config.at("prefetch").is<toml::table>())
+    {
+        toml::table& prefetchTable = toml::find<toml::table>(config, "prefetch");
+        get_toml_value(prefetchTable, "enabled", prefetch.enabled);
+        get_toml_value(prefetchTable, "window", prefetch.window);
+        get_toml_value(prefetchTable, "horizon", prefetch.horizon);
+        get_toml_value(prefetchTable, "maxPackages", prefetch.maxPackages);
+        get_toml_value(prefetchTable, "maxSuccessors", prefetch.maxSuccessors);
+        get_toml_value(prefetchTable, "minSupport", prefetch.minSupport);
+        get_toml_value(prefetchTable, "minConfidence", prefetch.minConfidence);
+        get_toml_value(prefetchTable, "maxBytes", prefetch.maxBytes);
+        get_toml_value(prefetchTable, "bufferSize", prefetch.bufferSize);
+        get_toml_value(prefetchTable, "flushInterval", prefetch.flushInterval);
+    }
+
+    if (config.contains("popularity") && config.at("popularity").is<toml::table>())
+    {
+        toml::table& popularityTable = toml::find<toml::table>(config, "popularity");
+        get_toml_value(popularityTable, "enabled", popularity.enabled);
+        get_toml_value(popularityTable, "windows", popularity.windows);
+        get_toml_value(popularityTable, "capacity", popularity.capacity);
+        get_toml_value(popularityTable, "sketchWidth", popularity.sketchWidth);
+        get_toml_value(popularityTable, "bufferSize", popularity.bufferSize);
+        get_toml_value(popularityTable, "flushInterval", popularity.flushInterval);
     }
 
     if (config.contains("upload") && config.at("upload").is<toml::table>())
@@ -177,6 +452,7 @@ Options::WebProperties::WebProperties()
     : bindAddress("0.0.0.0")
     , port(80)
     , threads(4)
+    , workers(1)
 #ifdef _WIN32
     , logPath("C:\\.vcpkg.cache\\log.txt")
 #else
@@ -184,18 +460,147 @@ Options::WebProperties::WebProperties()
 #endif // _WIN32
     , maxConnectionNum(100000)
     , maxUploadSize(1024 * 1024 * 1024) // 1GB
+    , maxMemoryBodySize(1024 * 1024) // 1MB
+    , memoryBudget(512 * 1024 * 1024) // 512MB
+    , drainTimeout(30)
 {
 }
 
 Options::CacheProperties::CacheProperties()
 #ifdef _WIN32
     : directory("C:\\.vcpkg.cache\\cache")
+    , indexFile("C:\\.vcpkg.cache\\index.bin")
 #else
     : directory("/var/vcpkg.cache/cache")
+    , indexFile("/var/vcpkg.cache/index.bin")
+#endif // _WIN32
+    , capacity(0)
+{
+}
+
+Options::CacheProperties::TierProperties::TierProperties()
+    : capacity(0)
+{
+}
+
+Options::TieringProperties::TieringProperties()
+    : promoteOnRead(true)
+    , highWatermark(90)
+    , lowWatermark(80)
+    , migrationRate(64 * 1024 * 1024) // 64MB/s
+    , interval(60)
+    , ioPriority("idle")
+{
+}
+
+Options::ScannerProperties::ScannerProperties()
+    : threads(0) // Picked from the number of cores
+    , ioPriority("low")
+    , progressInterval(5)
+{
+}
+
+Options::TimingProperties::TimingProperties()
+    : enabled(false)
+    , slowRequestThreshold(1000)
+    , slowRequestLogSize(256)
+{
+}
+
+Options::AccessLogProperties::AccessLogProperties()
+    : path() // Disabled unless configured
+    , maxFileSize(100 * 1024 * 1024) // 100MB
+    , maxFiles(5)
+    , bufferSize(4096)
+    , flushInterval(500)
+{
+}
+
+Options::PageCacheProperties::PageCacheProperties()
+    : dropUploads(true)
+    , readaheadThreshold(16 * 1024 * 1024) // 16MB
+    , readaheadSize(32 * 1024 * 1024) // 32MB
+    , directIoThreshold(0)
+    , prefetchSize(256 * 1024 * 1024) // 256MB
+    , sampleRate(64)
+{
+}
+
+Options::AdmissionProperties::AdmissionProperties()
+    : enabled(false)
+    , maxInFlight(0)
+    , retryAfter(1)
+    , head(0, 1024, 1000) // Cheap and gating every build, only limited if configured
+    , get(64, 1024, 5000)
+    , put(0, 64, 30000) // Bodies are already received when admitted, only limited if configured
+    , admin(8, 64, 2000)
+{
+}
+
+Options::AdmissionProperties::ClassProperties::ClassProperties(uint32_t concurrency, uint32_t queueSize, uint32_t maxQueueTime)
+    : concurrency(concurrency)
+    , queueSize(queueSize)
+    , maxQueueTime(maxQueueTime)
+{
+}
+
+Options::BandwidthProperties::BandwidthProperties()
+    : enabled(true)
+    , egressRate(0)
+    , quantum(256 * 1024) // 256KB
+    , threshold(8 * 1024 * 1024) // 8MB
+{
+}
+
+Options::AffinityProperties::AffinityProperties()
+{
+}
+
+Options::ScrubProperties::ScrubProperties()
+    : enabled(false)
+    , rate(16 * 1024 * 1024) // 16MB/s
+    , interval(24 * 60 * 60) // 1 day
+    , ioPriority("idle")
+#ifdef _WIN32
+    , quarantine("C:\\.vcpkg.cache\\quarantine")
+#else
+    , quarantine("/var/vcpkg.cache/quarantine")
 #endif // _WIN32
 {
 }
 
+Options::ImportProperties::ImportProperties()
+    : threads(0) // Picked from the number of cores
+    , rate(0)
+    , ioPriority("low")
+    , hardlink(false)
+{
+}
+
+Options::PrefetchProperties::PrefetchProperties()
+    : enabled(false)
+    , window(10)
+    , horizon(60)
+    , maxPackages(8192)
+    , maxSuccessors(16)
+    , minSupport(3)
+    , minConfidence(50)
+    , maxBytes(256 * 1024 * 1024) // 256MB
+    , bufferSize(1024)
+    , flushInterval(50)
+{
+}
+
+Options::PopularityProperties::PopularityProperties()
+    : enabled(false)
+    , windows{ 300, 3600, 86400 } // 5 minutes, 1 hour, 1 day
+    , capacity(100)
+    , sketchWidth(2048)
+    , bufferSize(1024)
+    , flushInterval(100)
+{
+}
+
 Options::UploadProperties::UploadProperties()
 #ifdef _WIN32
     : directory("C:\\.vcpkg.cache\\upload")
@@ -12,11 +12,13 @@ public:
 
     std::string configFile;
     std::string persistenceFile;
+    std::string lockFile; // Held by the running instance, next to the persistence file
     bool saveConfigFile;
 #ifndef _WIN32
     bool runAsDaemon;
 #endif // _WIN32
     bool sendTermSignal;
+    bool restart; // Take over from the running instance once listening, rather than failing to start
 
     struct WebProperties
     {
@@ -25,9 +27,13 @@ public:
         std::string bindAddress;
         uint16_t port;
         uint16_t threads;
+        uint16_t workers; // Processes sharing the port, each with its own threads, 1 to serve from a single process
         std::string logPath;
         uint32_t maxConnectionNum;
         uint32_t maxUploadSize;
+        uint32_t maxMemoryBodySize; // Bytes, larger request bodies are spooled to the upload directory
+        uint64_t memoryBudget; // Bytes in-flight request and response bodies may hold at once, 0 for unlimited
+        uint32_t drainTimeout; // Seconds given to the open connections to complete once asked to stop by a new instance
     } web;
 
     struct CacheProperties
@@ -35,8 +41,165 @@ public:
         CacheProperties();
 
         std::string directory;
+        std::string indexFile;
+        uint64_t capacity; // Capacity of the fastest tier (directory) in bytes, 0 for unlimited
+
+        struct TierProperties
+        {
+            TierProperties();
+
+            std::string directory;
+            uint64_t capacity; // Bytes, 0 for unlimited
+        };
+
+        // Slower tiers, ordered from the fastest to the slowest
+        std::vector<TierProperties> tiers;
     } cache;
 
+    struct TieringProperties
+    {
+        TieringProperties();
+
+        bool promoteOnRead;
+        uint32_t highWatermark; // Percentage of the tier capacity which triggers demotion
+        uint32_t lowWatermark;  // Percentage of the tier capacity demotion brings usage back to
+        uint64_t migrationRate; // Bytes per second, 0 for unlimited
+        uint32_t interval;      // Seconds between two capacity checks
+        std::string ioPriority;
+    } tiering;
+
+    struct ScannerProperties
+    {
+        ScannerProperties();
+
+        uint16_t threads;
+        std::string ioPriority;
+        uint32_t progressInterval;
+    } scanner;
+
+    struct TimingProperties
+    {
+        TimingProperties();
+
+        bool enabled;
+        uint32_t slowRequestThreshold; // Milliseconds
+        uint32_t slowRequestLogSize;
+    } timing;
+
+    struct AccessLogProperties
+    {
+        AccessLogProperties();
+
+        std::string path; // Empty to disable the access log
+        uint64_t maxFileSize; // Bytes
+        uint32_t maxFiles;
+        uint32_t bufferSize; // Records per thread
+        uint32_t flushInterval; // Milliseconds
+    } accessLog;
+
+    struct PageCacheProperties
+    {
+        PageCacheProperties();
+
+        bool dropUploads; // Drop uploads from the page cache once written
+        uint64_t readaheadThreshold; // Bytes, downloads at least this large are read ahead, 0 to disable
+        uint64_t readaheadSize; // Bytes
+        uint64_t directIoThreshold; // Bytes, packages at least this large bypass the page cache, 0 to disable
+        uint64_t prefetchSize; // Bytes of recently read packages prefetched once the index is ready, 0 to disable
+        uint32_t sampleRate; // One download out of this many is checked against the page cache, 0 to disable
+    } pageCache;
+
+    struct AdmissionProperties
+    {
+        AdmissionProperties();
+
+        struct ClassProperties
+        {
+            ClassProperties(uint32_t concurrency, uint32_t queueSize, uint32_t maxQueueTime);
+
+            uint32_t concurrency; // Requests handled at once, 0 for unlimited
+            uint32_t queueSize; // Requests waiting for a slot, beyond which they are shed
+            uint32_t maxQueueTime; // Milliseconds a request may wait before it is shed
+        };
+
+        bool enabled;
+        uint32_t maxInFlight; // Requests handled at once over the GET, PUT and admin classes, 0 for unlimited
+        uint32_t retryAfter; // Seconds, sent to the clients of shed requests
+        ClassProperties head;
+        ClassProperties get;
+        ClassProperties put;
+        ClassProperties admin;
+    } admission;
+
+    struct BandwidthProperties
+    {
+        BandwidthProperties();
+
+        bool enabled;
+        uint64_t egressRate; // Bytes per second sent by every download together, 0 to send every download right away with sendfile()
+        uint64_t quantum; // Bytes each client may send per scheduling round
+        uint64_t threshold; // Bytes, smaller packages are sent right away and only charged to the egress rate
+    } bandwidth;
+
+    struct AffinityProperties
+    {
+        AffinityProperties();
+
+        // CPU lists such as "0-7,16-23" or "node:0", empty to leave the threads to the scheduler
+        std::string io; // Event loops, one CPU each, spread over the workers
+        std::string disk; // Scanner, tier migrations, index rebuild and prefetch
+        std::string background; // Main loop, persistence, access log writer, bandwidth scheduler
+    } affinity;
+
+    struct ScrubProperties
+    {
+        ScrubProperties();
+
+        bool enabled;
+        uint64_t rate; // Bytes read per second, 0 for unlimited
+        uint32_t interval; // Seconds between the end of a pass and the start of the next one
+        std::string ioPriority; // "normal", "low" or "idle"
+        std::string quarantine; // Where corrupt packages are moved
+    } scrub;
+
+    struct ImportProperties
+    {
+        ImportProperties();
+
+        uint16_t threads; // 0 to pick from the number of cores
+        uint64_t rate; // Bytes copied per second, 0 for unlimited
+        std::string ioPriority; // "normal", "low" or "idle"
+        bool hardlink; // Link the packages instead of copying them when the source is on the same file system
+    } bulkImport;
+
+    struct PrefetchProperties
+    {
+        PrefetchProperties();
+
+        bool enabled;
+        uint32_t window; // Seconds, a package requested by the same client within this time after another one follows it
+        uint32_t horizon; // Seconds, a prefetched package requested within this time is a hit, otherwise it is wasted
+        uint32_t maxPackages; // Packages whose successors are tracked
+        uint32_t maxSuccessors; // Successors tracked per package
+        uint32_t minSupport; // Times a successor must have followed a package to be prefetched with it
+        uint32_t minConfidence; // Percentage of the requests of a package a successor must have followed
+        uint64_t maxBytes; // Bytes prefetched per requested package
+        uint32_t bufferSize; // Requests per thread
+        uint32_t flushInterval; // Milliseconds
+    } prefetch;
+
+    struct PopularityProperties
+    {
+        PopularityProperties();
+
+        bool enabled;
+        std::vector<uint32_t> windows; // Seconds, the top packages are reported over each of them
+        uint32_t capacity; // Keys tracked per dimension, bucket and ranking, the most that can be listed
+        uint32_t sketchWidth; // Counters per row of the count-min sketches
+        uint32_t bufferSize; // Requests per thread
+        uint32_t flushInterval; // Milliseconds
+    } popularity;
+
     struct UploadProperties
     {
         UploadProperties();
@@ -0,0 +1,534 @@
+#include <packageimporter.hpp>
+
+#include <storagetiers.hpp>
+#include <ziparchive.hpp>
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif // __linux__
+
+// Amount of data copied between two rate limiter checks
+static constexpr uint64_t ImportChunkSize = 1024 * 1024;
+
+// The walk of the source waits for the workers beyond this many packages
+static constexpr size_t MaxQueuedPackages = 4096;
+
+static int64_t ToUnixTime(std::filesystem::file_time_type time)
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::file_clock::to_sys(time).time_since_epoch()).count();
+}
+
+struct PackageImporter::ImportState
+{
+    struct Candidate
+    {
+        std::filesystem::path path;
+        uint64_t size;
+    };
+
+    explicit ImportState(const std::filesystem::path& source)
+        : source(source)
+        , start(std::chrono::steady_clock::now())
+        , walking(true)
+        , listed(false)
+        , finishedWorkers(0)
+        , found(0)
+        , foundBytes(0)
+        , imported(0)
+        , importedBytes(0)
+        , present(0)
+        , failed(0)
+        , linked(0)
+        , cloned(0)
+        , copied(0)
+    {
+    }
+
+    Progress Snapshot(bool completed) const
+    {
+        return Progress
+        {
+            found.load(),
+            foundBytes.load(),
+            imported.load(),
+            importedBytes.load(),
+            present.load(),
+            failed.load(),
+            linked.load(),
+            cloned.load(),
+            copied.load(),
+            std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start),
+            listed,
+            completed
+        };
+    }
+
+    const std::filesystem::path source;
+    const std::chrono::steady_clock::time_point start;
+
+    std::mutex mutex;
+    std::condition_variable condition; // Packages queued, the walk completed or a worker finished
+    std::condition_variable space; // Packages taken from the queue
+    std::deque<Candidate> queue;
+    bool walking;
+    bool listed;
+    uint32_t finishedWorkers;
+
+    std::atomic<uint64_t> found;
+    std::atomic<uint64_t> foundBytes;
+    std::atomic<uint64_t> imported;
+    std::atomic<uint64_t> importedBytes;
+    std::atomic<uint64_t> present;
+    std::atomic<uint64_t> failed;
+    std::atomic<uint64_t> linked;
+    std::atomic<uint64_t> cloned;
+    std::atomic<uint64_t> copied;
+};
+
+PackageImporter::PackageImporter(const StorageTiers& storageTiers, const Settings& settings, Indexer indexer, std::chrono::milliseconds progressInterval)
+    : m_StorageTiers(storageTiers)
+    , m_Settings(settings)
+    , m_Indexer(std::move(indexer))
+    , m_ProgressInterval(progressInterval)
+    , m_Stop(false)
+{
+    if (m_Settings.threads == 0)
+    {
+        // Copies are bound by the disks, more threads than cores only help hide the latency of small packages
+        m_Settings.threads = std::max(4u, std::thread::hardware_concurrency());
+    }
+}
+
+PackageImporter::Progress PackageImporter::Import(const std::filesystem::path& source, const std::function<void(const Progress&)>& onProgress)
+{
+    ImportState state(source);
+
+    std::vector<std::thread> workers;
+    workers.reserve(m_Settings.threads);
+    for (uint32_t i = 0; i < m_Settings.threads; ++i)
+    {
+        workers.emplace_back([this, &state, i]()
+        {
+            ThreadPlacement::Apply(ThreadRole::DISK);
+            SetCurrentThreadIoPriority(m_Settings.ioPriority);
+            RunWorker(state, i);
+
+            {
+                std::lock_guard<std::mutex> lock(state.mutex);
+                ++state.finishedWorkers;
+            }
+            state.condition.notify_all();
+        });
+    }
+
+    // The packages are imported while the rest of the source is walked
+    std::chrono::steady_clock::time_point nextReport = std::chrono::steady_clock::now() + m_ProgressInterval;
+    const auto report = [&]()
+    {
+        if (onProgress && std::chrono::steady_clock::now() >= nextReport)
+        {
+            onProgress(state.Snapshot(false));
+            nextReport = std::chrono::steady_clock::now() + m_ProgressInterval;
+        }
+    };
+
+    std::error_code error;
+    for (std::filesystem::recursive_directory_iterator it(source, std::filesystem::directory_options::skip_permission_denied, error), end; !error && it != end && !m_Stop; it.increment(error))
+    {
+        std::error_code entryError;
+        if (!it->is_regular_file(entryError) || it->path().extension() != ".zip")
+        {
+            continue;
+        }
+
+        const uint64_t size = it->file_size(entryError);
+        if (entryError)
+        {
+            std::cerr << "Error reading " << it->path().string() << ": " << entryError.message() << std::endl;
+            ++state.failed;
+            continue;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(state.mutex);
+            while (state.queue.size() >= MaxQueuedPackages && !m_Stop)
+            {
+                if (!state.space.wait_for(lock, m_ProgressInterval, [&state, this]() { return state.queue.size() < MaxQueuedPackages || m_Stop; }))
+                {
+                    lock.unlock();
+                    report();
+                    lock.lock();
+                }
+            }
+            state.queue.push_back(ImportState::Candidate{ it->path(), size });
+        }
+        state.condition.notify_one();
+
+        ++state.found;
+        state.foundBytes += size;
+        report();
+    }
+
+    if (error)
+    {
+        std::cerr << "Error walking " << source.string() << ": " << error.message() << std::endl;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.walking = false;
+        state.listed = !error && !m_Stop;
+    }
+    state.condition.notify_all();
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(state.mutex);
+            if (state.condition.wait_for(lock, m_ProgressInterval, [&state, this]() { return state.finishedWorkers == m_Settings.threads; }))
+            {
+                break;
+            }
+        }
+
+        if (onProgress)
+        {
+            onProgress(state.Snapshot(false));
+        }
+    }
+
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+
+    return state.Snapshot(!error && !m_Stop);
+}
+
+void PackageImporter::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_ThrottleMutex);
+        m_Stop = true;
+    }
+    m_ThrottleCondition.notify_all();
+}
+
+void PackageImporter::RunWorker(ImportState& state, uint32_t worker)
+{
+    while (true)
+    {
+        ImportState::Candidate candidate;
+        {
+            std::unique_lock<std::mutex> lock(state.mutex);
+
+            // Woken up by the walk once it ends, including when the import is stopped
+            state.condition.wait(lock, [&state]() { return !state.queue.empty() || !state.walking; });
+            if (m_Stop || state.queue.empty())
+            {
+                return;
+            }
+
+            candidate = std::move(state.queue.front());
+            state.queue.pop_front();
+        }
+        state.space.notify_one();
+
+        try
+        {
+            ImportPackage(state, worker, candidate.path, candidate.size);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Error importing " << candidate.path.string() << ": " << e.what() << std::endl;
+            ++state.failed;
+        }
+    }
+}
+
+void PackageImporter::ImportPackage(ImportState& state, uint32_t worker, const std::filesystem::path& path, uint64_t size)
+{
+    const std::optional<PackageKey> key = ResolveKey(state.source, path, size);
+    if (!key.has_value())
+    {
+        std::cerr << "Skipping " << path.string() << ": not a vcpkg package" << std::endl;
+        ++state.failed;
+        return;
+    }
+
+    // Imported by a previous run, or uploaded since; registered again in case the run was interrupted before indexing it
+    if (const std::optional<PackageIndex::Entry> entry = m_StorageTiers.Probe(key->triplet, key->name, key->version, key->sha))
+    {
+        if (entry->tier == 0)
+        {
+            m_Indexer(key.value(), entry->size, entry->modifiedTime);
+        }
+        ++state.present;
+        return;
+    }
+
+    const std::filesystem::path destination = m_StorageTiers.GetPackagePath(0, key->triplet, key->name, key->version, key->sha);
+
+    // The scanner only picks up .zip files, so a copy interrupted by a crash is never indexed.
+    // One per worker, the same package may be found twice in the source.
+    std::filesystem::path temporary = destination;
+    temporary += fmt::format(".importing.{}", worker);
+
+    std::error_code error;
+    std::optional<Transfer> transfer;
+    int64_t modifiedTime = 0;
+    try
+    {
+        std::filesystem::create_directories(destination.parent_path());
+
+        // Left behind by an interrupted import, hard links cannot overwrite it
+        std::filesystem::remove(temporary, error);
+
+        transfer = TransferPackage(path, temporary);
+        if (!transfer.has_value())
+        {
+            std::filesystem::remove(temporary, error);
+            if (!m_Stop)
+            {
+                std::cerr << "Error importing " << path.string() << ": failed to copy it to " << destination.string() << std::endl;
+                ++state.failed;
+            }
+            return;
+        }
+
+        // Keeps the Last-Modified of the package, links share it already
+        const std::filesystem::file_time_type sourceTime = std::filesystem::last_write_time(path);
+        if (transfer != Transfer::LINKED)
+        {
+            std::filesystem::last_write_time(temporary, sourceTime);
+        }
+        modifiedTime = ToUnixTime(sourceTime);
+
+        std::filesystem::rename(temporary, destination);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Error importing " << path.string() << ": " << e.what() << std::endl;
+        std::filesystem::remove(temporary, error);
+        ++state.failed;
+        return;
+    }
+
+    m_Indexer(key.value(), size, modifiedTime);
+
+    ++state.imported;
+    state.importedBytes += size;
+    switch (transfer.value())
+    {
+    case Transfer::LINKED:
+        ++state.linked;
+        break;
+    case Transfer::CLONED:
+        ++state.cloned;
+        break;
+    case Transfer::COPIED:
+        ++state.copied;
+        break;
+    }
+}
+
+std::optional<PackageKey> PackageImporter::ResolveKey(const std::filesystem::path& source, const std::filesystem::path& path, uint64_t size) const
+{
+    // triplet/name/version/sha.zip, as stored by this server
+    const std::string relativePath = path.lexically_relative(source).generic_string();
+    const std::string_view packagePath = std::string_view(relativePath).substr(0, relativePath.size() - 4);
+    if (std::count(packagePath.begin(), packagePath.end(), '/') == 3)
+    {
+        std::optional<PackageKey> key = PackageKey::Parse(packagePath);
+        if (key.has_value() && key->IsValid())
+        {
+            return key;
+        }
+    }
+
+    // xx/sha.zip, as stored by the vcpkg files provider, keyed from the package paragraph
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+    {
+        return std::nullopt;
+    }
+
+    const std::optional<std::string> control = ZipArchive::ReadFile(size, [&file](uint64_t offset, char* buffer, size_t count)
+    {
+        file.clear();
+        file.seekg(static_cast<std::streamoff>(offset));
+        file.read(buffer, static_cast<std::streamsize>(count));
+        return static_cast<size_t>(file.gcount()) == count;
+    }, "CONTROL");
+
+    std::optional<PackageKey> key = control.has_value() ? PackageKey::FromControlFile(control.value(), path.stem().string()) : std::nullopt;
+    if (!key.has_value() || !key->IsValid())
+    {
+        return std::nullopt;
+    }
+
+    return key;
+}
+
+std::optional<PackageImporter::Transfer> PackageImporter::TransferPackage(const std::filesystem::path& source, const std::filesystem::path& destination)
+{
+    if (m_Settings.hardlink)
+    {
+        // Fails across file systems, the package is copied instead
+        std::error_code error;
+        std::filesystem::create_hard_link(source, destination, error);
+        if (!error)
+        {
+            return Transfer::LINKED;
+        }
+    }
+
+    bool cloned = false;
+    if (!CopyPackage(source, destination, cloned))
+    {
+        return std::nullopt;
+    }
+
+    return cloned ? Transfer::CLONED : Transfer::COPIED;
+}
+
+#ifdef __linux__
+bool PackageImporter::CopyPackage(const std::filesystem::path& source, const std::filesystem::path& destination, bool& cloned)
+{
+    const int sourceFd = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (sourceFd < 0)
+    {
+        return false;
+    }
+
+    const int destinationFd = ::open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (destinationFd < 0)
+    {
+        ::close(sourceFd);
+        return false;
+    }
+
+    // A source on the same copy-on-write file system (btrfs, XFS) only needs its extents to be shared
+    cloned = ::ioctl(destinationFd, FICLONE, sourceFd) == 0;
+    bool success = cloned;
+    if (!success)
+    {
+        bool useReadWrite = false;
+        std::vector<char> buffer;
+
+        while (true)
+        {
+            ssize_t copied = -1;
+            if (!useReadWrite)
+            {
+                // Lets the kernel (or the NFS server with server-side copy) move the data without a round trip through user space
+                copied = ::copy_file_range(sourceFd, nullptr, destinationFd, nullptr, ImportChunkSize, 0);
+                if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+                {
+                    useReadWrite = true;
+                    buffer.resize(ImportChunkSize);
+                }
+            }
+
+            if (useReadWrite)
+            {
+                copied = ::read(sourceFd, buffer.data(), buffer.size());
+                for (ssize_t written = 0; copied > 0 && written < copied; )
+                {
+                    const ssize_t result = ::write(destinationFd, buffer.data() + written, copied - written);
+                    if (result < 0)
+                    {
+                        copied = -1;
+                        break;
+                    }
+                    written += result;
+                }
+            }
+
+            if (copied <= 0)
+            {
+                success = copied == 0;
+                break;
+            }
+
+            if (!Throttle(copied))
+            {
+                break;
+            }
+        }
+    }
+
+    // The package must be on disk before it is renamed into place, an import resumed after a crash would skip it
+    success = success && ::fdatasync(destinationFd) == 0;
+
+    // Keeps the import from evicting the packages a running server reads over and over
+    ::posix_fadvise(sourceFd, 0, 0, POSIX_FADV_DONTNEED);
+    ::posix_fadvise(destinationFd, 0, 0, POSIX_FADV_DONTNEED);
+
+    ::close(destinationFd);
+    ::close(sourceFd);
+    return success;
+}
+#else
+bool PackageImporter::CopyPackage(const std::filesystem::path& source, const std::filesystem::path& destination, bool& cloned)
+{
+    cloned = false;
+
+    std::ifstream input(source, std::ios::binary);
+    std::ofstream output(destination, std::ios::binary | std::ios::trunc);
+    if (!input.is_open() || !output.is_open())
+    {
+        return false;
+    }
+
+    std::vector<char> buffer(ImportChunkSize);
+    while (input)
+    {
+        input.read(buffer.data(), buffer.size());
+        const std::streamsize copied = input.gcount();
+        if (copied <= 0)
+        {
+            break;
+        }
+
+        if (!output.write(buffer.data(), copied) || !Throttle(copied))
+        {
+            return false;
+        }
+    }
+
+    output.flush();
+    return !input.bad() && output.good();
+}
+#endif // __linux__
+
+bool PackageImporter::Throttle(uint64_t bytes)
+{
+    if (m_Settings.rate == 0)
+    {
+        return !m_Stop;
+    }
+
+    // Token bucket without burst: every chunk pushes back the time the next one may start, whichever worker copies it
+    std::unique_lock<std::mutex> lock(m_ThrottleMutex);
+    const std::chrono::steady_clock::time_point start = std::max(m_NextTransfer, std::chrono::steady_clock::now());
+    m_NextTransfer = start + std::chrono::microseconds(bytes * 1000000 / m_Settings.rate);
+
+    m_ThrottleCondition.wait_until(lock, start, [this]() { return m_Stop.load(); });
+    return !m_Stop;
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <packagekey.hpp>
+#include <threadutils.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+
+class StorageTiers;
+
+/**
+ * @brief Parallel import of the packages of an existing cache into the first storage tier
+ *
+ * Reads the layout of this server (triplet/name/version/sha.zip), as well as the one of the vcpkg files
+ * provider (xx/sha.zip) whose packages are keyed from the CONTROL file of their archive. The source is
+ * walked by the calling thread while a pool of worker threads transfers the packages: hard links when
+ * requested, then reflinks, copy_file_range() and plain copies, whichever the file systems allow.
+ *
+ * Every package is written to a temporary file renamed once complete, so an interrupted import never
+ * leaves a partial package behind. Packages already stored by any tier are skipped, which makes running
+ * the same import again resume it. Copies are rate-limited, run at a lower I/O priority and are dropped
+ * from the page cache, so a server can keep serving requests from the same disks meanwhile.
+ */
+class PackageImporter final
+{
+public:
+    struct Settings
+    {
+        uint32_t threads; // 0 picks a default based on the hardware
+        uint64_t rate; // Bytes copied per second, 0 for unlimited
+        IoPriority ioPriority;
+        bool hardlink; // Link the packages when the source is on the same file system as the first tier
+    };
+
+    /**
+     * @brief Import counters, reported periodically while the import runs and once it completes
+     */
+    struct Progress
+    {
+        uint64_t found; // Packages found in the source so far
+        uint64_t foundBytes;
+        uint64_t imported;
+        uint64_t importedBytes;
+        uint64_t present; // Already stored, skipped
+        uint64_t failed;
+        uint64_t linked;
+        uint64_t cloned;
+        uint64_t copied;
+        std::chrono::milliseconds elapsed;
+        bool listed; // The whole source has been walked
+        bool completed;
+    };
+
+    /**
+     * @brief Called with every package imported, or already stored in the first tier, to add it to the package index
+     */
+    using Indexer = std::function<void(const PackageKey& key, uint64_t size, int64_t modifiedTime)>;
+
+    /**
+     * @brief Constructor
+     * @param storageTiers Tiers checked for the packages already stored, packages are imported into the first one
+     * @param indexer Called concurrently from the worker threads
+     * @param progressInterval Interval between two progress reports
+     */
+    PackageImporter(const StorageTiers& storageTiers, const Settings& settings, Indexer indexer, std::chrono::milliseconds progressInterval = std::chrono::seconds(1));
+
+    /**
+     * @brief Import every package of a directory
+     * @param source Directory to import
+     * @param onProgress Called periodically from the calling thread while the import runs
+     * @return Final counters
+     */
+    Progress Import(const std::filesystem::path& source, const std::function<void(const Progress&)>& onProgress = {});
+
+    /**
+     * @brief Abort the running import, which then returns with completed set to false
+     */
+    void Stop();
+
+    uint32_t GetThreadCount() const { return m_Settings.threads; }
+
+private:
+    struct ImportState;
+
+    enum class Transfer
+    {
+        LINKED,
+        CLONED,
+        COPIED
+    };
+
+    void RunWorker(ImportState& state, uint32_t worker);
+
+    void ImportPackage(ImportState& state, uint32_t worker, const std::filesystem::path& path, uint64_t size);
+
+    /**
+     * @brief Key of a package file, from its path or from the CONTROL file of its archive
+     */
+    std::optional<PackageKey> ResolveKey(const std::filesystem::path& source, const std::filesystem::path& path, uint64_t size) const;
+
+    /**
+     * @brief Link or copy a package, reflinking it when the file systems allow it
+     * @return How the package was transferred, or std::nullopt on failure
+     */
+    std::optional<Transfer> TransferPackage(const std::filesystem::path& source, const std::filesystem::path& destination);
+
+    bool CopyPackage(const std::filesystem::path& source, const std::filesystem::path& destination, bool& cloned);
+
+    /**
+     * @brief Wait until copying the given amount of bytes fits in the rate, shared by the worker threads
+     * @return false if the import is stopping
+     */
+    bool Throttle(uint64_t bytes);
+
+private:
+    const StorageTiers& m_StorageTiers;
+    Settings m_Settings;
+    const Indexer m_Indexer;
+    const std::chrono::milliseconds m_ProgressInterval;
+
+    std::atomic<bool> m_Stop;
+    std::mutex m_ThrottleMutex;
+    std::condition_variable m_ThrottleCondition;
+    std::chrono::steady_clock::time_point m_NextTransfer;
+};
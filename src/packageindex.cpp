@@ -0,0 +1,711 @@
+#include <packageindex.hpp>
+
+#include <sharedstate.hpp>
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+struct PackageIndex::Header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t totalSize;
+    uint64_t rootId;
+    uint32_t clean;
+    uint32_t reserved;
+    uint64_t tierSize[PackageIndex::MaxTiers];
+    uint64_t checksum;
+};
+
+struct PackageIndex::Record
+{
+    uint64_t shaHash; // 0 marks an empty slot
+    uint64_t keyHash;
+    uint64_t size;
+    int64_t modifiedTime;
+    int64_t lastAccess;
+    uint16_t pathLength; // 0 when the path did not fit in the record
+    uint8_t tier;
+    uint8_t reserved[21];
+    char path[192]; // triplet/name/version/sha.zip, not null terminated
+};
+
+static constexpr char IndexMagic[8] = { 'V', 'H', 'C', 'I', 'N', 'D', 'E', 'X' };
+static constexpr uint32_t IndexVersion = 2;
+static constexpr uint64_t HeaderSize = 4096;
+static constexpr uint64_t InitialCapacity = 1 << 16;
+static constexpr uint64_t MaxLoadPercent = 70;
+static constexpr uint64_t SpotCheckCount = 16;
+static constexpr uint64_t SpotCheckWindow = 4096;
+
+static constexpr uint64_t FnvOffsetBasis = 14695981039346656037ull;
+static constexpr uint64_t FnvPrime = 1099511628211ull;
+
+static uint64_t HashAppend(uint64_t hash, std::string_view value)
+{
+    for (const char c : value)
+    {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= FnvPrime;
+    }
+    return hash;
+}
+
+static uint64_t HashFinalize(uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+
+    // 0 is reserved to mark empty slots
+    return hash == 0 ? 1 : hash;
+}
+
+static uint16_t WritePath(char* out, size_t capacity, std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha)
+{
+    const size_t length = triplet.size() + name.size() + version.size() + sha.size() + 3 + 4;
+    if (length > capacity)
+    {
+        return 0;
+    }
+
+    char* cursor = out;
+    for (const std::string_view part : { triplet, std::string_view("/"), name, std::string_view("/"), version, std::string_view("/"), sha, std::string_view(".zip") })
+    {
+        std::memcpy(cursor, part.data(), part.size());
+        cursor += part.size();
+    }
+
+    return static_cast<uint16_t>(length);
+}
+
+/**
+ * @brief Locks the index for writing, in this process and, when the index is shared, in every worker
+ */
+class PackageIndex::WriteLock final
+{
+public:
+    explicit WriteLock(const PackageIndex& index)
+        : m_Index(index)
+    {
+        m_Index.m_Mutex.lock();
+        if (!m_Index.m_SharedState)
+        {
+            return;
+        }
+
+        m_Index.m_SharedState->LockIndex();
+        try
+        {
+            m_Index.Remap();
+        }
+        catch (...)
+        {
+            m_Index.m_SharedState->UnlockIndex();
+            m_Index.m_Mutex.unlock();
+            throw;
+        }
+    }
+
+    ~WriteLock()
+    {
+        if (m_Index.m_SharedState)
+        {
+            m_Index.m_SharedState->UnlockIndex();
+        }
+        m_Index.m_Mutex.unlock();
+    }
+
+    WriteLock(const WriteLock&) = delete;
+    WriteLock& operator=(const WriteLock&) = delete;
+
+private:
+    const PackageIndex& m_Index;
+};
+
+/**
+ * @brief Locks the index for reading, in this process and, when the index is shared, in every worker
+ */
+class PackageIndex::ReadLock final
+{
+public:
+    explicit ReadLock(const PackageIndex& index)
+        : m_Index(index)
+    {
+        m_Index.m_Mutex.lock_shared();
+        if (!m_Index.m_SharedState)
+        {
+            return;
+        }
+
+        m_Index.m_SharedState->LockIndexShared();
+        while (m_Index.m_File.IsOpen() && m_Index.m_Generation != m_Index.m_SharedState->GetIndexGeneration())
+        {
+            // Another worker replaced or resized the file, the other threads of this process must not read it while it is remapped
+            m_Index.m_SharedState->UnlockIndexShared();
+            m_Index.m_Mutex.unlock_shared();
+
+            {
+                WriteLock lock(m_Index);
+            }
+
+            m_Index.m_Mutex.lock_shared();
+            m_Index.m_SharedState->LockIndexShared();
+        }
+    }
+
+    ~ReadLock()
+    {
+        if (m_Index.m_SharedState)
+        {
+            m_Index.m_SharedState->UnlockIndexShared();
+        }
+        m_Index.m_Mutex.unlock_shared();
+    }
+
+    ReadLock(const ReadLock&) = delete;
+    ReadLock& operator=(const ReadLock&) = delete;
+
+private:
+    const PackageIndex& m_Index;
+};
+
+PackageIndex::PackageIndex(const std::filesystem::path& path, SharedState* sharedState)
+    : m_Path(path)
+    , m_RootId(0)
+    , m_SharedState(sharedState)
+    , m_Attached(false)
+    , m_Generation(0)
+{
+    static_assert(sizeof(Header) <= HeaderSize, "Index header does not fit in its page");
+    static_assert(sizeof(Record) == 256, "Index records are expected to be 256 bytes");
+}
+
+PackageIndex::~PackageIndex()
+{
+    Close();
+}
+
+bool PackageIndex::Open(const std::vector<std::filesystem::path>& directories)
+{
+    WriteLock lock(*this);
+
+    uint64_t rootHash = FnvOffsetBasis;
+    for (const std::filesystem::path& directory : directories)
+    {
+        rootHash = HashAppend(rootHash, std::filesystem::absolute(directory).lexically_normal().generic_string());
+        rootHash = HashAppend(rootHash, "|");
+    }
+    m_RootId = HashFinalize(rootHash);
+
+    if (m_Path.has_parent_path() && !std::filesystem::exists(m_Path.parent_path()))
+    {
+        std::filesystem::create_directories(m_Path.parent_path());
+    }
+
+    if (!m_File.Open(m_Path))
+    {
+        throw std::runtime_error(fmt::format("Failed to open package index \"{}\"", m_Path.string()));
+    }
+
+    const bool valid = IsValid(directories);
+    if (!valid && !Reset(InitialCapacity))
+    {
+        throw std::runtime_error(fmt::format("Failed to initialize package index \"{}\"", m_Path.string()));
+    }
+
+    // Until Close() is called, the file no longer describes a clean shutdown
+    GetHeader().clean = 0;
+    m_File.Flush();
+
+    if (m_SharedState)
+    {
+        m_Generation = m_SharedState->IncreaseIndexGeneration();
+    }
+
+    return valid;
+}
+
+void PackageIndex::Attach()
+{
+    WriteLock lock(*this);
+
+    if (!m_File.Open(m_Path) || !m_File.IsOpen())
+    {
+        throw std::runtime_error(fmt::format("Failed to attach to package index \"{}\"", m_Path.string()));
+    }
+
+    m_Attached = true;
+    if (m_SharedState)
+    {
+        m_Generation = m_SharedState->GetIndexGeneration();
+    }
+}
+
+void PackageIndex::Close(bool clean)
+{
+    WriteLock lock(*this);
+
+    if (!m_File.IsOpen())
+    {
+        return;
+    }
+
+    // Only the worker which opened the index knows whether it is complete
+    if (m_Attached)
+    {
+        m_File.Close();
+        m_Attached = false;
+        return;
+    }
+
+    Header& header = GetHeader();
+    header.clean = clean ? 1 : 0;
+    header.checksum = ComputeChecksum(header);
+
+    m_File.Flush();
+    m_File.Close();
+}
+
+void PackageIndex::Clear()
+{
+    WriteLock lock(*this);
+
+    if (!Reset(InitialCapacity))
+    {
+        throw std::runtime_error(fmt::format("Failed to reset package index \"{}\"", m_Path.string()));
+    }
+}
+
+std::optional<PackageIndex::Entry> PackageIndex::Find(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha) const
+{
+    uint64_t shaHash;
+    uint64_t keyHash;
+    ComputeHashes(triplet, name, version, sha, shaHash, keyHash);
+
+    ReadLock lock(*this);
+
+    const Record* record = m_File.IsOpen() ? FindRecord(shaHash, keyHash) : nullptr;
+    if (!record)
+    {
+        return std::nullopt;
+    }
+
+    return Entry{ record->size, record->modifiedTime, std::atomic_ref<int64_t>(const_cast<Record*>(record)->lastAccess).load(std::memory_order_relaxed), record->tier };
+}
+
+std::optional<PackageIndex::Entry> PackageIndex::FindBySha(std::string_view sha, std::string& relativePath) const
+{
+    const uint64_t shaHash = HashFinalize(HashAppend(FnvOffsetBasis, sha));
+
+    ReadLock lock(*this);
+
+    if (!m_File.IsOpen())
+    {
+        return std::nullopt;
+    }
+
+    // Records are placed from the hash of their sha, so every package with this sha is on the same probe sequence
+    const Record* records = GetRecords();
+    const uint64_t mask = GetHeader().capacity - 1;
+    for (uint64_t slot = shaHash & mask; records[slot].shaHash != 0; slot = (slot + 1) & mask)
+    {
+        const Record& record = records[slot];
+        if (record.shaHash != shaHash)
+        {
+            continue;
+        }
+
+        // Records whose path did not fit cannot be resolved, and hash collisions are told apart by the path
+        std::string_view path(record.path, record.pathLength);
+        if (!path.ends_with(".zip"))
+        {
+            continue;
+        }
+        path.remove_suffix(4);
+        if (!path.ends_with(sha) || path.size() <= sha.size() || path[path.size() - sha.size() - 1] != '/')
+        {
+            continue;
+        }
+
+        relativePath.assign(record.path, record.pathLength);
+        return Entry{ record.size, record.modifiedTime, std::atomic_ref<int64_t>(const_cast<Record&>(record).lastAccess).load(std::memory_order_relaxed), record.tier };
+    }
+
+    return std::nullopt;
+}
+
+void PackageIndex::Insert(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha, uint64_t size, int64_t modifiedTime, uint8_t tier)
+{
+    uint64_t shaHash;
+    uint64_t keyHash;
+    ComputeHashes(triplet, name, version, sha, shaHash, keyHash);
+
+    WriteLock lock(*this);
+
+    if (Record* existing = FindRecord(shaHash, keyHash))
+    {
+        Header& header = GetHeader();
+        header.totalSize = header.totalSize - existing->size + size;
+        header.tierSize[existing->tier] -= existing->size;
+        header.tierSize[tier] += size;
+        existing->size = size;
+        existing->modifiedTime = modifiedTime;
+        existing->tier = tier;
+        return;
+    }
+
+    if ((GetHeader().count + 1) * 100 > GetHeader().capacity * MaxLoadPercent && !Grow())
+    {
+        throw std::runtime_error(fmt::format("Failed to grow package index \"{}\"", m_Path.string()));
+    }
+
+    Record record;
+    std::memset(&record, 0, sizeof(record));
+    record.shaHash = shaHash;
+    record.keyHash = keyHash;
+    record.size = size;
+    record.modifiedTime = modifiedTime;
+    record.tier = tier;
+    record.pathLength = WritePath(record.path, sizeof(record.path), triplet, name, version, sha);
+
+    Header& header = GetHeader();
+    Place(GetRecords(), header.capacity, record);
+    ++header.count;
+    header.totalSize += size;
+    header.tierSize[tier] += size;
+}
+
+void PackageIndex::Touch(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha, int64_t time)
+{
+    uint64_t shaHash;
+    uint64_t keyHash;
+    ComputeHashes(triplet, name, version, sha, shaHash, keyHash);
+
+    // Reads are frequent, so the access time is updated atomically under the shared lock
+    ReadLock lock(*this);
+
+    if (Record* record = m_File.IsOpen() ? FindRecord(shaHash, keyHash) : nullptr)
+    {
+        std::atomic_ref<int64_t>(record->lastAccess).store(time, std::memory_order_relaxed);
+    }
+}
+
+bool PackageIndex::SetTier(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha, uint8_t tier)
+{
+    uint64_t shaHash;
+    uint64_t keyHash;
+    ComputeHashes(triplet, name, version, sha, shaHash, keyHash);
+
+    WriteLock lock(*this);
+
+    Record* record = FindRecord(shaHash, keyHash);
+    if (!record)
+    {
+        return false;
+    }
+
+    Header& header = GetHeader();
+    header.tierSize[record->tier] -= record->size;
+    header.tierSize[tier] += record->size;
+    record->tier = tier;
+    return true;
+}
+
+bool PackageIndex::Remove(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha)
+{
+    uint64_t shaHash;
+    uint64_t keyHash;
+    ComputeHashes(triplet, name, version, sha, shaHash, keyHash);
+
+    WriteLock lock(*this);
+
+    Record* record = FindRecord(shaHash, keyHash);
+    if (!record)
+    {
+        return false;
+    }
+
+    Header& header = GetHeader();
+    Record* records = GetRecords();
+    const uint64_t mask = header.capacity - 1;
+
+    header.totalSize -= record->size;
+    header.tierSize[record->tier] -= record->size;
+    --header.count;
+
+    // Backward shift deletion keeps probe sequences intact without tombstones
+    uint64_t hole = static_cast<uint64_t>(record - records);
+    uint64_t slot = hole;
+    while (true)
+    {
+        slot = (slot + 1) & mask;
+        if (records[slot].shaHash == 0)
+        {
+            break;
+        }
+
+        const uint64_t home = records[slot].shaHash & mask;
+        const bool canMove = (hole <= slot) ? (home <= hole || home > slot) : (home <= hole && home > slot);
+        if (canMove)
+        {
+            records[hole] = records[slot];
+            hole = slot;
+        }
+    }
+
+    std::memset(&records[hole], 0, sizeof(Record));
+    return true;
+}
+
+void PackageIndex::ForEach(const std::function<void(std::string_view relativePath, const Entry& entry)>& visitor) const
+{
+    ReadLock lock(*this);
+
+    if (!m_File.IsOpen())
+    {
+        return;
+    }
+
+    const Record* records = GetRecords();
+    const uint64_t capacity = GetHeader().capacity;
+    for (uint64_t slot = 0; slot < capacity; ++slot)
+    {
+        const Record& record = records[slot];
+        if (record.shaHash != 0)
+        {
+            visitor(std::string_view(record.path, record.pathLength), Entry{ record.size, record.modifiedTime, std::atomic_ref<int64_t>(const_cast<Record&>(record).lastAccess).load(std::memory_order_relaxed), record.tier });
+        }
+    }
+}
+
+uint64_t PackageIndex::GetPackageCount() const
+{
+    ReadLock lock(*this);
+    return m_File.IsOpen() ? GetHeader().count : 0;
+}
+
+uint64_t PackageIndex::GetTotalSize() const
+{
+    ReadLock lock(*this);
+    return m_File.IsOpen() ? GetHeader().totalSize : 0;
+}
+
+uint64_t PackageIndex::GetTierSize(size_t tier) const
+{
+    ReadLock lock(*this);
+    return m_File.IsOpen() && tier < MaxTiers ? GetHeader().tierSize[tier] : 0;
+}
+
+PackageIndex::Header& PackageIndex::GetHeader() const
+{
+    return *reinterpret_cast<Header*>(m_File.GetData());
+}
+
+PackageIndex::Record* PackageIndex::GetRecords() const
+{
+    return reinterpret_cast<Record*>(m_File.GetData() + HeaderSize);
+}
+
+bool PackageIndex::IsValid(const std::vector<std::filesystem::path>& directories) const
+{
+    if (m_File.GetSize() < HeaderSize)
+    {
+        return false;
+    }
+
+    const Header& header = GetHeader();
+    if (std::memcmp(header.magic, IndexMagic, sizeof(IndexMagic)) != 0 || header.version != IndexVersion || header.recordSize != sizeof(Record))
+    {
+        return false;
+    }
+
+    if (header.capacity == 0 || (header.capacity & (header.capacity - 1)) != 0 || m_File.GetSize() != HeaderSize + header.capacity * sizeof(Record))
+    {
+        return false;
+    }
+
+    if (!header.clean || header.rootId != m_RootId || header.count > header.capacity || header.checksum != ComputeChecksum(header))
+    {
+        return false;
+    }
+
+    // Spot check a handful of packages to catch changes made to the cache directory while the server was down
+    const Record* records = GetRecords();
+    const uint64_t stride = std::max<uint64_t>(1, header.capacity / SpotCheckCount);
+    for (uint64_t start = 0; start < header.capacity; start += stride)
+    {
+        const uint64_t end = std::min(header.capacity, start + std::min(stride, SpotCheckWindow));
+        for (uint64_t slot = start; slot < end; ++slot)
+        {
+            const Record& record = records[slot];
+            if (record.shaHash == 0)
+            {
+                continue;
+            }
+
+            if (record.tier >= directories.size())
+            {
+                return false;
+            }
+
+            // An unreadable or stale network volume makes the index stale too, rather than failing the startup
+            std::error_code error;
+            if (record.pathLength > 0 && (!std::filesystem::exists(directories[record.tier] / std::string_view(record.path, record.pathLength), error) || error))
+            {
+                return false;
+            }
+            break;
+        }
+    }
+
+    return true;
+}
+
+bool PackageIndex::Reset(uint64_t capacity)
+{
+    if (!m_File.Resize(0) || !m_File.Resize(HeaderSize + capacity * sizeof(Record)))
+    {
+        return false;
+    }
+
+    Header& header = GetHeader();
+    std::memcpy(header.magic, IndexMagic, sizeof(IndexMagic));
+    header.version = IndexVersion;
+    header.recordSize = sizeof(Record);
+    header.capacity = capacity;
+    header.count = 0;
+    header.totalSize = 0;
+    header.rootId = m_RootId;
+    header.clean = 0;
+    std::fill(std::begin(header.tierSize), std::end(header.tierSize), 0);
+    header.checksum = 0;
+
+    if (m_SharedState)
+    {
+        m_Generation = m_SharedState->IncreaseIndexGeneration();
+    }
+
+    return true;
+}
+
+bool PackageIndex::Grow()
+{
+    const Header& header = GetHeader();
+    const uint64_t capacity = header.capacity * 2;
+
+    std::filesystem::path growPath = m_Path;
+    growPath += ".tmp";
+
+    {
+        MappedFile grown;
+        if (!grown.Open(growPath) || !grown.Resize(0) || !grown.Resize(HeaderSize + capacity * sizeof(Record)))
+        {
+            return false;
+        }
+
+        Header& grownHeader = *reinterpret_cast<Header*>(grown.GetData());
+        grownHeader = header;
+        grownHeader.capacity = capacity;
+
+        Record* grownRecords = reinterpret_cast<Record*>(grown.GetData() + HeaderSize);
+        const Record* records = GetRecords();
+        for (uint64_t slot = 0; slot < header.capacity; ++slot)
+        {
+            if (records[slot].shaHash != 0)
+            {
+                Place(grownRecords, capacity, records[slot]);
+            }
+        }
+    }
+
+    m_File.Close();
+    std::filesystem::rename(growPath, m_Path);
+
+    if (!m_File.Open(m_Path))
+    {
+        return false;
+    }
+
+    // The other workers still map the replaced file
+    if (m_SharedState)
+    {
+        m_Generation = m_SharedState->IncreaseIndexGeneration();
+    }
+
+    return true;
+}
+
+void PackageIndex::Remap() const
+{
+    const uint64_t generation = m_SharedState->GetIndexGeneration();
+    if (!m_File.IsOpen() || m_Generation == generation)
+    {
+        return;
+    }
+
+    if (!m_File.Open(m_Path))
+    {
+        throw std::runtime_error(fmt::format("Failed to remap package index \"{}\"", m_Path.string()));
+    }
+    m_Generation = generation;
+}
+
+PackageIndex::Record* PackageIndex::FindRecord(uint64_t shaHash, uint64_t keyHash) const
+{
+    Record* records = GetRecords();
+    const uint64_t mask = GetHeader().capacity - 1;
+
+    for (uint64_t slot = shaHash & mask; records[slot].shaHash != 0; slot = (slot + 1) & mask)
+    {
+        if (records[slot].shaHash == shaHash && records[slot].keyHash == keyHash)
+        {
+            return &records[slot];
+        }
+    }
+
+    return nullptr;
+}
+
+void PackageIndex::Place(Record* records, uint64_t capacity, const Record& record)
+{
+    const uint64_t mask = capacity - 1;
+
+    uint64_t slot = record.shaHash & mask;
+    while (records[slot].shaHash != 0)
+    {
+        slot = (slot + 1) & mask;
+    }
+
+    records[slot] = record;
+}
+
+void PackageIndex::ComputeHashes(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha, uint64_t& shaHash, uint64_t& keyHash)
+{
+    shaHash = HashFinalize(HashAppend(FnvOffsetBasis, sha));
+
+    uint64_t hash = HashAppend(FnvOffsetBasis, triplet);
+    hash = HashAppend(hash, "/");
+    hash = HashAppend(hash, name);
+    hash = HashAppend(hash, "/");
+    hash = HashAppend(hash, version);
+    hash = HashAppend(hash, "/");
+    keyHash = HashFinalize(HashAppend(hash, sha));
+}
+
+uint64_t PackageIndex::ComputeChecksum(const Header& header)
+{
+    const std::string_view bytes(reinterpret_cast<const char*>(&header), offsetof(Header, checksum));
+    return HashFinalize(HashAppend(FnvOffsetBasis, bytes));
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <mappedfile.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class SharedState;
+
+/**
+ * @brief Persistent, memory-mapped index of the packages stored in the cache directory
+ *
+ * The index is an open-addressing hash table of fixed-size records kept in a single file. It is
+ * updated as packages are written and removed, and flagged as clean when closed so that the next
+ * start can trust it instead of walking the whole cache directory.
+ *
+ * With worker processes, the primary worker opens the index and the other workers attach to the same
+ * file. Every access then also takes the index lock of the SharedState, and a worker remaps the file when
+ * another one replaced or resized it.
+ */
+class PackageIndex final
+{
+public:
+    /**
+     * @brief Information stored for every package
+     */
+    struct Entry
+    {
+        uint64_t size;
+        int64_t modifiedTime; // Seconds since epoch
+        int64_t lastAccess;   // Seconds since epoch, 0 if never read
+        uint8_t tier;         // Storage tier holding the package
+    };
+
+    /**
+     * @brief Maximum number of storage tiers tracked by the index
+     */
+    static constexpr size_t MaxTiers = 8;
+
+    /**
+     * @brief Constructor
+     * @param path Location of the index file
+     * @param sharedState State shared with the other worker processes, nullptr for a single process
+     */
+    explicit PackageIndex(const std::filesystem::path& path, SharedState* sharedState = nullptr);
+    ~PackageIndex();
+
+    /**
+     * @brief Map the index file and validate its content
+     * @param directories Directory of every storage tier described by the index, hottest first
+     * @return true if the existing index can be used as-is, false if it was reset and must be rebuilt
+     */
+    bool Open(const std::vector<std::filesystem::path>& directories);
+
+    /**
+     * @brief Map an index already opened by the primary worker, without validating it
+     */
+    void Attach();
+
+    /**
+     * @brief Flush the index to disk and unmap it
+     * @param clean Whether the index fully describes the cache directory and can be trusted on the next Open(),
+     *              ignored by an attached index, which is only unmapped
+     */
+    void Close(bool clean = true);
+
+    /**
+     * @brief Remove every package from the index
+     */
+    void Clear();
+
+    /**
+     * @brief Look up a package
+     * @return The package entry, or std::nullopt if it is not in the index
+     */
+    std::optional<Entry> Find(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha) const;
+
+    /**
+     * @brief Look up a package from its sha alone, for URLs that do not carry the rest of the key
+     * @param relativePath Set to the package path relative to the cache directory (triplet/name/version/sha.zip)
+     * @return The package entry, or std::nullopt if it is not in the index
+     */
+    std::optional<Entry> FindBySha(std::string_view sha, std::string& relativePath) const;
+
+    /**
+     * @brief Add a package, or update it if it is already present
+     */
+    void Insert(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha, uint64_t size, int64_t modifiedTime, uint8_t tier = 0);
+
+    /**
+     * @brief Record that a package was read
+     * @param time Seconds since epoch
+     */
+    void Touch(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha, int64_t time);
+
+    /**
+     * @brief Record that a package moved to another storage tier
+     * @return true if the package was in the index
+     */
+    bool SetTier(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha, uint8_t tier);
+
+    /**
+     * @brief Remove a package
+     * @return true if the package was in the index
+     */
+    bool Remove(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha);
+
+    /**
+     * @brief Visit every package in the index
+     * @param visitor Called with the package path relative to the cache directory and its entry
+     */
+    void ForEach(const std::function<void(std::string_view relativePath, const Entry& entry)>& visitor) const;
+
+    uint64_t GetPackageCount() const;
+    uint64_t GetTotalSize() const;
+    uint64_t GetTierSize(size_t tier) const;
+
+    const std::filesystem::path& GetPath() const { return m_Path; }
+
+private:
+    struct Header;
+    struct Record;
+    class ReadLock;
+    class WriteLock;
+
+    Header& GetHeader() const;
+    Record* GetRecords() const;
+
+    bool IsValid(const std::vector<std::filesystem::path>& directories) const;
+    bool Reset(uint64_t capacity);
+    bool Grow();
+
+    /**
+     * @brief Map the index file again if another worker replaced or resized it, with m_Mutex locked for writing
+     */
+    void Remap() const;
+
+    Record* FindRecord(uint64_t shaHash, uint64_t keyHash) const;
+    static void Place(Record* records, uint64_t capacity, const Record& record);
+
+    static void ComputeHashes(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha, uint64_t& shaHash, uint64_t& keyHash);
+    static uint64_t ComputeChecksum(const Header& header);
+
+private:
+    std::filesystem::path m_Path;
+    uint64_t m_RootId;
+
+    SharedState* m_SharedState;
+    bool m_Attached;
+
+    mutable MappedFile m_File;
+    mutable uint64_t m_Generation; // Generation of the shared index file currently mapped
+    mutable std::shared_mutex m_Mutex;
+};
@@ -0,0 +1,241 @@
+#include <packagekey.hpp>
+
+#include <fmt/core.h>
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+
+static bool IsValidPathComponent(const std::string& component)
+{
+    if (component.empty() || component.size() > 128 || component == "." || component == "..")
+    {
+        return false;
+    }
+
+    return std::none_of(component.begin(), component.end(), [](char c)
+    {
+        return c == '/' || c == '\\' || c == '\0';
+    });
+}
+
+static PackageKey PackageKeyFromJson(const nlohmann::json& json)
+{
+    if (json.is_string())
+    {
+        const std::optional<PackageKey> key = PackageKey::Parse(json.get<std::string>());
+        if (!key.has_value())
+        {
+            throw std::runtime_error(fmt::format("Invalid package key \"{}\".", json.get<std::string>()));
+        }
+        return key.value();
+    }
+
+    if (!json.is_object())
+    {
+        throw std::runtime_error("Package keys must be objects or triplet/name/version/sha strings.");
+    }
+
+    return PackageKey
+    {
+        json.value("triplet", ""),
+        json.value("name", ""),
+        json.value("version", ""),
+        json.value("sha", "")
+    };
+}
+
+template<typename Function>
+static void ForEachLine(std::string_view body, Function&& function)
+{
+    while (!body.empty())
+    {
+        const size_t end = body.find('\n');
+        std::string_view line = body.substr(0, end);
+        body.remove_prefix(end == std::string_view::npos ? body.size() : end + 1);
+
+        while (!line.empty() && std::isspace(static_cast<unsigned char>(line.back())))
+        {
+            line.remove_suffix(1);
+        }
+        while (!line.empty() && std::isspace(static_cast<unsigned char>(line.front())))
+        {
+            line.remove_prefix(1);
+        }
+
+        if (!line.empty())
+        {
+            function(line);
+        }
+    }
+}
+
+bool PackageKey::IsValid() const
+{
+    const bool validSha = !sha.empty() && sha.size() <= 128 && std::all_of(sha.begin(), sha.end(), [](char c)
+    {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '-';
+    });
+
+    return validSha && IsValidPathComponent(triplet) && IsValidPathComponent(name) && IsValidPathComponent(version);
+}
+
+std::string PackageKey::ToString() const
+{
+    return fmt::format("{}/{}/{}/{}", triplet, name, version, sha);
+}
+
+std::optional<PackageKey> PackageKey::Parse(std::string_view str)
+{
+    if (!str.empty() && str.front() == '/')
+    {
+        str.remove_prefix(1);
+    }
+
+    PackageKey key;
+    std::string* parts[] = { &key.triplet, &key.name, &key.version };
+    for (std::string* part : parts)
+    {
+        const size_t separator = str.find('/');
+        if (separator == std::string_view::npos)
+        {
+            return std::nullopt;
+        }
+
+        *part = str.substr(0, separator);
+        str.remove_prefix(separator + 1);
+    }
+
+    if (str.empty() || str.find('/') != std::string_view::npos)
+    {
+        return std::nullopt;
+    }
+
+    key.sha = str;
+    return key;
+}
+
+std::optional<PackageKey> PackageKey::FromControlFile(std::string_view control, std::string_view sha)
+{
+    PackageKey key;
+    key.sha = sha;
+
+    std::optional<std::string> abi;
+    bool firstParagraph = true;
+    ForEachLine(control, [&key, &abi, &firstParagraph](std::string_view line)
+    {
+        // Continuation lines of multi-line fields do not match any of the fields below
+        const size_t separator = line.find(": ");
+        if (!firstParagraph || separator == std::string_view::npos)
+        {
+            return;
+        }
+
+        const std::string_view field = line.substr(0, separator);
+        const std::string_view value = line.substr(separator + 2);
+        if (field == "Package")
+        {
+            // Feature paragraphs repeat the Package field, only the core paragraph describes the archive
+            if (!key.name.empty())
+            {
+                firstParagraph = false;
+                return;
+            }
+            key.name = value;
+        }
+        else if (field == "Version")
+        {
+            key.version = value;
+        }
+        else if (field == "Architecture")
+        {
+            key.triplet = value;
+        }
+        else if (field == "Abi")
+        {
+            abi = std::string(value);
+        }
+    });
+
+    if ((abi.has_value() && abi.value() != sha) || !key.IsValid())
+    {
+        return std::nullopt;
+    }
+
+    return key;
+}
+
+PackageListFormat PackageListFormatFromContentType(std::string_view contentType)
+{
+    if (contentType.find("ndjson") != std::string_view::npos || contentType.find("jsonl") != std::string_view::npos)
+    {
+        return PackageListFormat::NDJSON;
+    }
+
+    if (contentType.find("json") != std::string_view::npos)
+    {
+        return PackageListFormat::JSON;
+    }
+
+    return PackageListFormat::TEXT;
+}
+
+std::vector<PackageKey> ParsePackageList(std::string_view body, PackageListFormat format)
+{
+    std::vector<PackageKey> keys;
+
+    switch (format)
+    {
+    case PackageListFormat::JSON:
+    {
+        const nlohmann::json json = nlohmann::json::parse(body.begin(), body.end(), nullptr, false);
+        if (json.is_discarded())
+        {
+            throw std::runtime_error("Request body must be valid JSON.");
+        }
+
+        // Either a bare array or {"packages": [...]}
+        const nlohmann::json& packages = json.is_object() && json.contains("packages") ? json.at("packages") : json;
+        if (!packages.is_array())
+        {
+            throw std::runtime_error("Request body must be an array of packages.");
+        }
+
+        keys.reserve(packages.size());
+        for (const nlohmann::json& package : packages)
+        {
+            keys.emplace_back(PackageKeyFromJson(package));
+        }
+        break;
+    }
+    case PackageListFormat::NDJSON:
+    {
+        ForEachLine(body, [&keys](std::string_view line)
+        {
+            const nlohmann::json json = nlohmann::json::parse(line.begin(), line.end(), nullptr, false);
+            if (json.is_discarded())
+            {
+                throw std::runtime_error(fmt::format("Invalid JSON line \"{}\".", line));
+            }
+            keys.emplace_back(PackageKeyFromJson(json));
+        });
+        break;
+    }
+    case PackageListFormat::TEXT:
+    {
+        ForEachLine(body, [&keys](std::string_view line)
+        {
+            const std::optional<PackageKey> key = PackageKey::Parse(line);
+            if (!key.has_value())
+            {
+                throw std::runtime_error(fmt::format("Invalid package key \"{}\".", line));
+            }
+            keys.emplace_back(key.value());
+        });
+        break;
+    }
+    }
+
+    return keys;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @brief Identifies a package of the cache, stored as triplet/name/version/sha.zip
+ */
+struct PackageKey
+{
+    std::string triplet;
+    std::string name;
+    std::string version;
+    std::string sha;
+
+    /**
+     * @brief Check that every part can safely be used as a path component
+     */
+    bool IsValid() const;
+
+    /**
+     * @brief Format as triplet/name/version/sha
+     */
+    std::string ToString() const;
+
+    /**
+     * @brief Parse triplet/name/version/sha
+     */
+    static std::optional<PackageKey> Parse(std::string_view str);
+
+    /**
+     * @brief Build the key of a package from the CONTROL file vcpkg stores at the root of its archive
+     *
+     * The triplet comes from the Architecture field, the name from Package and the version from Version.
+     * When the file has an Abi field, it must match the sha.
+     */
+    static std::optional<PackageKey> FromControlFile(std::string_view control, std::string_view sha);
+};
+
+/**
+ * @brief Encodings accepted for a list of package keys
+ */
+enum class PackageListFormat
+{
+    JSON,   // [{"triplet": ..., "name": ..., "version": ..., "sha": ...}, "triplet/name/version/sha", ...]
+    NDJSON, // One JSON object or string per line
+    TEXT    // One triplet/name/version/sha per line
+};
+
+/**
+ * @brief Pick the encoding of a list of package keys from the Content-Type of a request
+ */
+PackageListFormat PackageListFormatFromContentType(std::string_view contentType);
+
+/**
+ * @brief Parse a list of package keys
+ * @throws std::runtime_error if the body is malformed
+ */
+std::vector<PackageKey> ParsePackageList(std::string_view body, PackageListFormat format);
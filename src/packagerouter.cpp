@@ -0,0 +1,198 @@
+#include <packagerouter.hpp>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+
+// PACKAGE_ROUTER_NO_SIMD forces the scalar classification, so that the tests cover both
+#if !defined(PACKAGE_ROUTER_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define PACKAGE_ROUTER_SSE2 1
+#endif
+
+// Number of bytes classified at once
+static constexpr size_t BlockSize = 16;
+
+// A package URL has at most one slash before each of its four segments
+static constexpr size_t MaxSlashes = 4;
+
+static constexpr std::string_view ZipExtension = ".zip";
+
+enum CharClass : uint8_t
+{
+    SEGMENT = 1 << 0, // Allowed in a segment
+    SLASH = 1 << 1,
+    HEX = 1 << 2      // Allowed in a sha
+};
+
+static constexpr std::array<uint8_t, 256> BuildCharClasses()
+{
+    std::array<uint8_t, 256> classes{};
+    for (int c = '0'; c <= '9'; ++c)
+    {
+        classes[c] = SEGMENT | HEX;
+    }
+    for (int c = 'a'; c <= 'z'; ++c)
+    {
+        classes[c] = c <= 'f' ? SEGMENT | HEX : SEGMENT;
+    }
+    for (int c = 'A'; c <= 'Z'; ++c)
+    {
+        classes[c] = SEGMENT;
+    }
+    for (const char c : { '-', '_', '.', '+', '~' })
+    {
+        classes[static_cast<uint8_t>(c)] = SEGMENT;
+    }
+    classes['/'] = SLASH;
+    return classes;
+}
+
+static constexpr std::array<uint8_t, 256> CharClasses = BuildCharClasses();
+
+/**
+ * @brief One bit per byte of a block, set when the byte belongs to the class
+ */
+struct BlockMasks
+{
+    uint32_t valid; // Allowed anywhere in the path
+    uint32_t slash;
+    uint32_t hex;
+};
+
+static BlockMasks ClassifyTail(const char* data, size_t length)
+{
+    BlockMasks masks{ 0, 0, 0 };
+    for (size_t i = 0; i < length; ++i)
+    {
+        const uint8_t charClass = CharClasses[static_cast<uint8_t>(data[i])];
+        masks.valid |= (charClass != 0 ? 1u : 0u) << i;
+        masks.slash |= ((charClass & SLASH) != 0 ? 1u : 0u) << i;
+        masks.hex |= ((charClass & HEX) != 0 ? 1u : 0u) << i;
+    }
+    return masks;
+}
+
+#ifdef PACKAGE_ROUTER_SSE2
+static __m128i InRange(__m128i chars, char first, char last)
+{
+    // Signed comparisons, bytes above 0x7f are negative and never in range
+    return _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8(static_cast<char>(first - 1))), _mm_cmplt_epi8(chars, _mm_set1_epi8(static_cast<char>(last + 1))));
+}
+
+static __m128i Equal(__m128i chars, char c)
+{
+    return _mm_cmpeq_epi8(chars, _mm_set1_epi8(c));
+}
+
+static BlockMasks ClassifyBlock(const char* data)
+{
+    const __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+
+    const __m128i digit = InRange(chars, '0', '9');
+    const __m128i lower = InRange(chars, 'a', 'z');
+    const __m128i upper = InRange(chars, 'A', 'Z');
+    const __m128i hexLetter = InRange(chars, 'a', 'f');
+    const __m128i slash = Equal(chars, '/');
+    const __m128i punctuation = _mm_or_si128(_mm_or_si128(Equal(chars, '-'), Equal(chars, '_')), _mm_or_si128(_mm_or_si128(Equal(chars, '.'), Equal(chars, '+')), Equal(chars, '~')));
+
+    const __m128i valid = _mm_or_si128(_mm_or_si128(_mm_or_si128(digit, lower), _mm_or_si128(upper, punctuation)), slash);
+
+    return BlockMasks
+    {
+        static_cast<uint32_t>(_mm_movemask_epi8(valid)),
+        static_cast<uint32_t>(_mm_movemask_epi8(slash)),
+        static_cast<uint32_t>(_mm_movemask_epi8(_mm_or_si128(digit, hexLetter)))
+    };
+}
+#else
+static BlockMasks ClassifyBlock(const char* data)
+{
+    return ClassifyTail(data, BlockSize);
+}
+#endif // PACKAGE_ROUTER_SSE2
+
+static bool IsValidSegment(std::string_view segment)
+{
+    return !segment.empty() && segment.size() <= PackageRouter::MaxSegmentLength && segment != "." && segment != "..";
+}
+
+std::optional<PackageRoute> PackageRouter::Parse(std::string_view path)
+{
+    // The sha-only layout is the only one with an extension, and a sha never contains a dot
+    const bool shaOnly = path.ends_with(ZipExtension);
+    if (shaOnly)
+    {
+        path.remove_suffix(ZipExtension.size());
+    }
+
+    if (path.empty() || path.front() != '/' || path.size() > MaxSlashes * (MaxSegmentLength + 1))
+    {
+        return std::nullopt;
+    }
+
+    std::array<size_t, MaxSlashes> slashes;
+    size_t slashCount = 0;
+
+    // Position following the last character that cannot be part of a sha
+    size_t hexStart = 0;
+
+    for (size_t offset = 0; offset < path.size(); offset += BlockSize)
+    {
+        const size_t length = std::min(BlockSize, path.size() - offset);
+        const BlockMasks masks = length == BlockSize ? ClassifyBlock(path.data() + offset) : ClassifyTail(path.data() + offset, length);
+
+        const uint32_t blockMask = (1u << length) - 1;
+        if (masks.valid != blockMask)
+        {
+            return std::nullopt;
+        }
+
+        for (uint32_t slash = masks.slash; slash != 0; slash &= slash - 1)
+        {
+            if (slashCount == MaxSlashes)
+            {
+                return std::nullopt;
+            }
+            slashes[slashCount++] = offset + std::countr_zero(slash);
+        }
+
+        const uint32_t nonHex = ~masks.hex & blockMask;
+        if (nonHex != 0)
+        {
+            hexStart = offset + std::bit_width(nonHex);
+        }
+    }
+
+    // The sha is the last segment, it must be hexadecimal from the last slash on
+    const size_t shaStart = slashes[slashCount - 1] + 1;
+    if (hexStart != shaStart || shaStart == path.size() || path.size() - shaStart > MaxSegmentLength)
+    {
+        return std::nullopt;
+    }
+
+    PackageRoute route;
+    route.sha = path.substr(shaStart);
+
+    if (shaOnly)
+    {
+        return slashCount == 1 ? std::optional<PackageRoute>(route) : std::nullopt;
+    }
+
+    if (slashCount != MaxSlashes)
+    {
+        return std::nullopt;
+    }
+
+    route.triplet = path.substr(slashes[0] + 1, slashes[1] - slashes[0] - 1);
+    route.name = path.substr(slashes[1] + 1, slashes[2] - slashes[1] - 1);
+    route.version = path.substr(slashes[2] + 1, slashes[3] - slashes[2] - 1);
+
+    if (!IsValidSegment(route.triplet) || !IsValidSegment(route.name) || !IsValidSegment(route.version))
+    {
+        return std::nullopt;
+    }
+
+    return route;
+}
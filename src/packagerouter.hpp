@@ -0,0 +1,46 @@
+#pragma once
+
+#include <optional>
+#include <string_view>
+
+/**
+ * @brief Segments of a package URL, viewing the path they were parsed from
+ */
+struct PackageRoute
+{
+    std::string_view triplet; // Empty for the sha-only layout
+    std::string_view name;
+    std::string_view version;
+    std::string_view sha;
+
+    /**
+     * @brief Whether the URL only carries the sha, as in vcpkg's "{sha}.zip" URL template
+     */
+    bool IsShaOnly() const { return triplet.empty(); }
+};
+
+/**
+ * @brief Parser of the package URLs, used ahead of Drogon's generic router
+ *
+ * Accepts the two layouts vcpkg uses with an HTTP binary source:
+ * - /{triplet}/{name}/{version}/{sha}
+ * - /{sha}.zip
+ *
+ * The path is classified in a single pass, 16 bytes at a time when SSE2 is available. Only canonical
+ * paths are accepted: lowercase hexadecimal sha, and triplet, name and version made of letters,
+ * digits and "-_.+~". Anything else is left to the generic router, which keeps handling it as before.
+ */
+class PackageRouter final
+{
+public:
+    /**
+     * @brief Maximum length of each segment, the same limit as PackageKey::IsValid()
+     */
+    static constexpr size_t MaxSegmentLength = 128;
+
+    /**
+     * @brief Parse the path of a request
+     * @return Views of the segments, or std::nullopt if the path is not a canonical package URL
+     */
+    static std::optional<PackageRoute> Parse(std::string_view path);
+};
@@ -0,0 +1,111 @@
+#include <packagestream.hpp>
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+PackageStream::PackageStream(std::vector<PackageKey> keys, Resolver resolver)
+    : m_Keys(std::move(keys))
+    , m_Resolver(std::move(resolver))
+    , m_NextKey(0)
+    , m_Finished(false)
+    , m_HeaderOffset(0)
+    , m_Remaining(0)
+{
+}
+
+size_t PackageStream::Read(char* buffer, size_t length)
+{
+    // Drogon passes a null buffer when the client disconnects before the end of the stream
+    if (buffer == nullptr)
+    {
+        m_File.close();
+        m_Finished = true;
+        return 0;
+    }
+
+    size_t written = 0;
+    while (written < length)
+    {
+        if (m_HeaderOffset < m_Header.size())
+        {
+            const size_t count = std::min(length - written, m_Header.size() - m_HeaderOffset);
+            std::memcpy(buffer + written, m_Header.data() + m_HeaderOffset, count);
+            m_HeaderOffset += count;
+            written += count;
+            continue;
+        }
+
+        if (m_Remaining > 0)
+        {
+            m_File.read(buffer + written, static_cast<std::streamsize>(std::min<uint64_t>(length - written, m_Remaining)));
+            const std::streamsize count = m_File.gcount();
+            if (count <= 0)
+            {
+                // The header already announced the size, the only way to report the error is to cut the stream before "END"
+                std::cerr << "Bulk download aborted, package " << m_Keys[m_NextKey - 1].ToString() << " is shorter than announced" << std::endl;
+                m_File.close();
+                m_Finished = true;
+                m_Remaining = 0;
+                break;
+            }
+
+            m_Remaining -= count;
+            written += count;
+            continue;
+        }
+
+        if (!NextPackage())
+        {
+            break;
+        }
+    }
+
+    return written;
+}
+
+bool PackageStream::NextPackage()
+{
+    m_File.close();
+    m_Header.clear();
+    m_HeaderOffset = 0;
+
+    if (m_Finished)
+    {
+        return false;
+    }
+
+    if (m_NextKey == m_Keys.size())
+    {
+        m_Header = "END\n";
+        m_Finished = true;
+        return true;
+    }
+
+    const PackageKey& key = m_Keys[m_NextKey++];
+    if (!key.IsValid())
+    {
+        m_Header = fmt::format("400 0 {}\n", key.ToString());
+        return true;
+    }
+
+    const std::optional<std::filesystem::path> path = m_Resolver(key);
+    if (path.has_value())
+    {
+        m_File.open(path.value(), std::ios::binary | std::ios::ate);
+    }
+
+    if (!m_File.is_open())
+    {
+        m_Header = fmt::format("404 0 {}\n", key.ToString());
+        return true;
+    }
+
+    // The size is taken from the opened file rather than the index, the frame must match what is read
+    m_Remaining = static_cast<uint64_t>(m_File.tellg());
+    m_File.seekg(0, std::ios::beg);
+    m_Header = fmt::format("200 {} {}\n", m_Remaining, key.ToString());
+    return true;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <packagekey.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Produces the body of a bulk download, one frame per requested package
+ *
+ * Every frame starts with a "<status> <size> <triplet/name/version/sha>\n" header line, followed by
+ * the size bytes of the package when the status is 200. Missing packages get a 404 frame and invalid
+ * keys a 400 frame, both without content. The stream ends with an "END\n" line, so that clients can
+ * tell a complete download from a connection that dropped between two frames.
+ *
+ * Packages are resolved and opened one at a time while the response is sent, so only one file is
+ * open per download.
+ */
+class PackageStream final
+{
+public:
+    /**
+     * @brief Locates a package, returning std::nullopt if it does not exist
+     */
+    using Resolver = std::function<std::optional<std::filesystem::path>(const PackageKey& key)>;
+
+    PackageStream(std::vector<PackageKey> keys, Resolver resolver);
+
+    /**
+     * @brief Fill a buffer with the next bytes of the stream
+     * @param buffer Buffer to fill, or nullptr when the connection is closed early
+     * @param length Size of the buffer
+     * @return Number of bytes written, 0 once the stream is complete
+     */
+    size_t Read(char* buffer, size_t length);
+
+private:
+    /**
+     * @brief Open the next package and prepare its frame header
+     * @return false once every package was sent
+     */
+    bool NextPackage();
+
+private:
+    std::vector<PackageKey> m_Keys;
+    Resolver m_Resolver;
+
+    size_t m_NextKey;
+    bool m_Finished;
+
+    std::string m_Header;
+    size_t m_HeaderOffset;
+
+    std::ifstream m_File;
+    uint64_t m_Remaining;
+};
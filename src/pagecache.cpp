@@ -0,0 +1,396 @@
+#include <pagecache.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <vector>
+
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif // __linux__
+
+// Alignment of the buffers, offsets and sizes used with O_DIRECT
+static constexpr size_t DirectIoAlignment = 4096;
+
+// Portion of a package mapped at once to measure its residency
+static constexpr uint64_t ResidencyWindow = 64 * 1024 * 1024;
+
+#ifdef __linux__
+/**
+ * @brief File descriptor closed when going out of scope
+ */
+class FileDescriptor final
+{
+public:
+    explicit FileDescriptor(int fd) : m_Fd(fd) {}
+    ~FileDescriptor()
+    {
+        if (m_Fd >= 0)
+        {
+            close(m_Fd);
+        }
+    }
+
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+    int Get() const { return m_Fd; }
+    bool IsValid() const { return m_Fd >= 0; }
+
+private:
+    int m_Fd;
+};
+
+/**
+ * @brief Buffer aligned for O_DIRECT
+ */
+struct AlignedBuffer
+{
+    struct Deleter
+    {
+        void operator()(char* data) const { std::free(data); }
+    };
+
+    static std::unique_ptr<char, Deleter> Allocate(size_t size)
+    {
+        void* data = nullptr;
+        if (posix_memalign(&data, DirectIoAlignment, size) != 0)
+        {
+            return nullptr;
+        }
+        return std::unique_ptr<char, Deleter>(static_cast<char*>(data));
+    }
+};
+
+static bool WriteAll(int fd, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        const ssize_t written = write(fd, data, size);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+static bool WriteDirect(int fd, std::string_view data)
+{
+    std::unique_ptr<char, AlignedBuffer::Deleter> buffer = AlignedBuffer::Allocate(PageCache::DirectIoBufferSize);
+    if (!buffer)
+    {
+        return false;
+    }
+
+    // Whole blocks go through O_DIRECT, the unaligned tail is written normally
+    const size_t alignedSize = data.size() - data.size() % DirectIoAlignment;
+    for (size_t offset = 0; offset < alignedSize; offset += PageCache::DirectIoBufferSize)
+    {
+        const size_t length = std::min(PageCache::DirectIoBufferSize, alignedSize - offset);
+        std::memcpy(buffer.get(), data.data() + offset, length);
+        if (!WriteAll(fd, buffer.get(), length))
+        {
+            return false;
+        }
+    }
+
+    if (alignedSize == data.size())
+    {
+        return true;
+    }
+
+    const int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) < 0)
+    {
+        return false;
+    }
+    return WriteAll(fd, data.data() + alignedSize, data.size() - alignedSize);
+}
+
+static bool WritePackageFile(const std::filesystem::path& path, std::string_view data, bool directIo, bool dropPages)
+{
+    FileDescriptor file(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | (directIo ? O_DIRECT : 0), 0644));
+    if (!file.IsValid())
+    {
+        return false;
+    }
+
+    if (!(directIo ? WriteDirect(file.Get(), data) : WriteAll(file.Get(), data.data(), data.size())))
+    {
+        return false;
+    }
+
+    if (dropPages)
+    {
+        // Only clean pages can be dropped, so they are written back first
+        sync_file_range(file.Get(), 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(file.Get(), 0, 0, POSIX_FADV_DONTNEED);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Sequential reader of a package opened with O_DIRECT
+ */
+class DirectReader final
+{
+public:
+    explicit DirectReader(int fd)
+        : m_File(fd)
+        , m_Buffer(AlignedBuffer::Allocate(PageCache::DirectIoBufferSize))
+        , m_Offset(0)
+        , m_Position(0)
+        , m_Length(0)
+        , m_End(false)
+    {
+    }
+
+    bool IsValid() const { return m_File.IsValid() && m_Buffer; }
+
+    size_t Read(char* out, size_t size)
+    {
+        if (out == nullptr || size == 0)
+        {
+            return 0;
+        }
+
+        if (m_Position == m_Length)
+        {
+            if (m_End)
+            {
+                return 0;
+            }
+
+            // Full buffers keep the file offset aligned, only the last read is short
+            ssize_t length;
+            do
+            {
+                length = pread(m_File.Get(), m_Buffer.get(), PageCache::DirectIoBufferSize, static_cast<off_t>(m_Offset));
+            } while (length < 0 && errno == EINTR);
+
+            if (length <= 0)
+            {
+                m_End = true;
+                return 0;
+            }
+
+            m_Offset += static_cast<uint64_t>(length);
+            m_Position = 0;
+            m_Length = static_cast<size_t>(length);
+            m_End = m_Length < PageCache::DirectIoBufferSize;
+        }
+
+        const size_t length = std::min(size, m_Length - m_Position);
+        std::memcpy(out, m_Buffer.get() + m_Position, length);
+        m_Position += length;
+        return length;
+    }
+
+private:
+    FileDescriptor m_File;
+    std::unique_ptr<char, AlignedBuffer::Deleter> m_Buffer;
+    uint64_t m_Offset;
+    size_t m_Position;
+    size_t m_Length;
+    bool m_End;
+};
+#endif // __linux__
+
+PageCache::PageCache(bool dropUploads, uint64_t readaheadThreshold, uint64_t readaheadSize, uint64_t directIoThreshold, uint32_t sampleRate)
+    : m_DropUploads(dropUploads)
+    , m_ReadaheadThreshold(readaheadThreshold)
+    , m_ReadaheadSize(readaheadSize)
+    , m_DirectIoThreshold(directIoThreshold)
+    , m_SampleRate(sampleRate)
+{
+}
+
+bool PageCache::WritePackage(const std::filesystem::path& path, std::string_view data) const
+{
+#ifdef __linux__
+    // Falls back to a normal write when the file system does not support O_DIRECT
+    if (IsDirectIo(data.size()) && WritePackageFile(path, data, true, true))
+    {
+        return true;
+    }
+
+    return WritePackageFile(path, data, false, m_DropUploads);
+#else
+    std::ofstream file(path, std::ios::binary);
+    if (!file.is_open())
+    {
+        return false;
+    }
+
+    file.write(data.data(), data.size());
+    file.close();
+    return !file.fail();
+#endif // __linux__
+}
+
+bool PageCache::IsDirectIo(uint64_t size) const
+{
+#ifdef __linux__
+    return m_DirectIoThreshold > 0 && size >= m_DirectIoThreshold;
+#else
+    return false;
+#endif // __linux__
+}
+
+std::function<size_t(char*, size_t)> PageCache::OpenDirectReader(const std::string& path) const
+{
+#ifdef __linux__
+    std::shared_ptr<DirectReader> reader = std::make_shared<DirectReader>(open(path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT));
+    if (!reader->IsValid())
+    {
+        return {};
+    }
+
+    return [reader](char* out, size_t size)
+    {
+        return reader->Read(out, size);
+    };
+#else
+    return {};
+#endif // __linux__
+}
+
+std::function<size_t(char*, size_t)> PageCache::OpenReader(const std::string& path) const
+{
+    std::shared_ptr<std::ifstream> file = std::make_shared<std::ifstream>(path, std::ios::binary);
+    if (!file->is_open())
+    {
+        return {};
+    }
+
+    return [file](char* out, size_t size) -> size_t
+    {
+        if (out == nullptr || size == 0)
+        {
+            return 0;
+        }
+
+        file->read(out, static_cast<std::streamsize>(size));
+        return static_cast<size_t>(file->gcount());
+    };
+}
+
+void PageCache::OnRead(const std::string& path, uint64_t size) const
+{
+#ifdef __linux__
+    if (m_ReadaheadThreshold == 0 || size < m_ReadaheadThreshold)
+    {
+        return;
+    }
+
+    // The hint applies to the file, so it also benefits the descriptor sendfile() reads from
+    FileDescriptor file(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (file.IsValid())
+    {
+        posix_fadvise(file.Get(), 0, static_cast<off_t>(std::min(size, m_ReadaheadSize)), POSIX_FADV_WILLNEED);
+    }
+#endif // __linux__
+}
+
+void PageCache::Prefetch(const std::string& path) const
+{
+#ifdef __linux__
+    FileDescriptor file(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (file.IsValid())
+    {
+        posix_fadvise(file.Get(), 0, 0, POSIX_FADV_WILLNEED);
+    }
+#endif // __linux__
+}
+
+void PageCache::Evict(const std::string& path) const
+{
+#ifdef __linux__
+    FileDescriptor file(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (file.IsValid())
+    {
+        posix_fadvise(file.Get(), 0, 0, POSIX_FADV_DONTNEED);
+    }
+#endif // __linux__
+}
+
+bool PageCache::ShouldSample() const
+{
+#ifdef __linux__
+    if (m_SampleRate == 0)
+    {
+        return false;
+    }
+
+    thread_local uint32_t downloads = 0;
+    return ++downloads % m_SampleRate == 0;
+#else
+    return false;
+#endif // __linux__
+}
+
+std::optional<PageCache::Residency> PageCache::GetResidency(const std::string& path) const
+{
+#ifdef __linux__
+    FileDescriptor file(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (!file.IsValid())
+    {
+        return std::nullopt;
+    }
+
+    const off_t size = lseek(file.Get(), 0, SEEK_END);
+    if (size <= 0)
+    {
+        return std::nullopt;
+    }
+
+    const uint64_t pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    thread_local std::vector<unsigned char> pages;
+    pages.resize(ResidencyWindow / pageSize);
+
+    // Mapping a file does not read it, mincore() only reports the pages already cached
+    Residency residency{ static_cast<uint64_t>(size), 0 };
+    for (uint64_t offset = 0; offset < residency.size; offset += ResidencyWindow)
+    {
+        const uint64_t length = std::min(ResidencyWindow, residency.size - offset);
+        void* data = mmap(nullptr, length, PROT_READ, MAP_SHARED, file.Get(), static_cast<off_t>(offset));
+        if (data == MAP_FAILED)
+        {
+            return std::nullopt;
+        }
+
+        const int result = mincore(data, length, pages.data());
+        munmap(data, length);
+        if (result != 0)
+        {
+            return std::nullopt;
+        }
+
+        const uint64_t pageCount = (length + pageSize - 1) / pageSize;
+        for (uint64_t page = 0; page < pageCount; ++page)
+        {
+            if (pages[page] & 1)
+            {
+                residency.resident += std::min(pageSize, length - page * pageSize);
+            }
+        }
+    }
+
+    return residency;
+#else
+    return std::nullopt;
+#endif // __linux__
+}
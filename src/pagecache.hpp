@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+
+/**
+ * @brief Page cache policies for the package files
+ *
+ * Keeps large uploads and one-off downloads from evicting the packages that are read over and over:
+ * - Uploads are flushed and dropped from the page cache once written (POSIX_FADV_DONTNEED)
+ * - Large downloads get their first bytes read ahead (POSIX_FADV_WILLNEED), sendfile() reads the rest
+ * - Packages above a size threshold can be written and read with O_DIRECT, bypassing the page cache
+ * - The most recently read packages can be prefetched, e.g. after a restart
+ *
+ * Downloads are sampled with mincore() to measure how much of the packages read was already resident.
+ * Only Linux applies the policies, other platforms write and read packages normally.
+ */
+class PageCache final
+{
+public:
+    /**
+     * @brief Portion of a package found in the page cache
+     */
+    struct Residency
+    {
+        uint64_t size;
+        uint64_t resident;
+    };
+
+    /**
+     * @brief Size of the buffer used to copy packages read or written with O_DIRECT
+     */
+    static constexpr size_t DirectIoBufferSize = 1024 * 1024;
+
+    /**
+     * @brief Constructor
+     * @param dropUploads Drop uploaded packages from the page cache once they are written
+     * @param readaheadThreshold Downloads of packages at least this large are read ahead, 0 to disable
+     * @param readaheadSize Number of bytes read ahead
+     * @param directIoThreshold Packages at least this large bypass the page cache, 0 to disable
+     * @param sampleRate One download out of this many is sampled, 0 to disable
+     */
+    PageCache(bool dropUploads, uint64_t readaheadThreshold, uint64_t readaheadSize, uint64_t directIoThreshold, uint32_t sampleRate);
+
+    /**
+     * @brief Write an uploaded package, applying the upload policy
+     * @return false if the file could not be created or written
+     */
+    bool WritePackage(const std::filesystem::path& path, std::string_view data) const;
+
+    /**
+     * @brief Whether a package of this size is read with O_DIRECT, see OpenDirectReader()
+     */
+    bool IsDirectIo(uint64_t size) const;
+
+    /**
+     * @brief Open a package with O_DIRECT, for a streamed response
+     * @return A callback filling a buffer with the next bytes of the package and returning their count (0 at
+     *         the end, or when called with nullptr), or an empty function if the file system does not support O_DIRECT
+     */
+    std::function<size_t(char*, size_t)> OpenDirectReader(const std::string& path) const;
+
+    /**
+     * @brief Open a package for a streamed response, reading it through the page cache
+     * @return A callback with the same contract as OpenDirectReader(), or an empty function if the file cannot be opened
+     */
+    std::function<size_t(char*, size_t)> OpenReader(const std::string& path) const;
+
+    /**
+     * @brief Apply the download policy to a package about to be sent with sendfile()
+     */
+    void OnRead(const std::string& path, uint64_t size) const;
+
+    /**
+     * @brief Start reading a whole package into the page cache, without waiting for it
+     */
+    void Prefetch(const std::string& path) const;
+
+    /**
+     * @brief Drop a package from the page cache, once read by a background task which should not evict the hot packages
+     */
+    void Evict(const std::string& path) const;
+
+    /**
+     * @brief Check if the calling thread must sample its current download
+     */
+    bool ShouldSample() const;
+
+    /**
+     * @brief Measure how much of a package is in the page cache
+     * @return The residency, or std::nullopt if it cannot be measured
+     */
+    std::optional<Residency> GetResidency(const std::string& path) const;
+
+private:
+    const bool m_DropUploads;
+    const uint64_t m_ReadaheadThreshold;
+    const uint64_t m_ReadaheadSize;
+    const uint64_t m_DirectIoThreshold;
+    const uint32_t m_SampleRate;
+};
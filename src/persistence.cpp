@@ -1,13 +1,52 @@
 #include <persistence.hpp>
 
+#include <threadutils.hpp>
+
 #include <fstream>
 #include <iostream>
+#include <optional>
+
+/**
+ * @brief Holds the lock of the persistence file shared by the worker processes
+ */
+class SharedPersistenceLock final
+{
+public:
+    explicit SharedPersistenceLock(SharedState& sharedState)
+        : m_SharedState(sharedState)
+    {
+        m_SharedState.LockPersistence();
+    }
+
+    ~SharedPersistenceLock()
+    {
+        m_SharedState.UnlockPersistence();
+    }
+
+    SharedPersistenceLock(const SharedPersistenceLock&) = delete;
+    SharedPersistenceLock& operator=(const SharedPersistenceLock&) = delete;
+
+private:
+    SharedState& m_SharedState;
+};
 
 PersistenceInfo::PersistenceInfo()
-    : m_ShouldContinue(true)
+    : m_Counters(&m_LocalCounters)
+    , m_ShouldContinue(true)
+    , m_SharedState(nullptr)
+    , m_KeysGeneration(0)
+    , m_ObservedCounters(0)
+    , m_ApiKeysReloaded(false)
+    , m_Writable(true)
+    , m_LoadedDownloads(0)
+    , m_LoadedTotalRequests(0)
+    , m_LoadedUploads(0)
     , m_UpdateThread(std::bind(&PersistenceInfo::UpdateThread, this))
     , m_LastWrite(std::chrono::system_clock::now() + std::chrono::years(1))
 {
+    m_LocalCounters.downloads = 0;
+    m_LocalCounters.totalRequests = 0;
+    m_LocalCounters.uploads = 0;
 }
 
 PersistenceInfo::~PersistenceInfo()
@@ -23,6 +62,14 @@ void PersistenceInfo::UpdateOrAddApiKey(const ApiKey& apiKey)
 {
     std::lock_guard<std::mutex> lock(m_Mutex);
 
+    // The keys saved by the other workers since the last reload must not be overwritten
+    std::optional<SharedPersistenceLock> sharedLock;
+    if (m_SharedState)
+    {
+        sharedLock.emplace(*m_SharedState);
+        ReloadApiKeys();
+    }
+
     bool foundKey = false;
     for (ApiKey& existingKey : m_ApiKeys)
     {
@@ -39,9 +86,62 @@ void PersistenceInfo::UpdateOrAddApiKey(const ApiKey& apiKey)
         m_ApiKeys.push_back(apiKey);
     }
 
+    // Saved right away, so the other workers can reload it
+    if (m_SharedState)
+    {
+        Save();
+        m_KeysGeneration = m_SharedState->IncreaseKeysGeneration();
+        return;
+    }
+
     UpdateLastWrite();
 }
 
+std::vector<ApiKey> PersistenceInfo::GetApiKeys() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_ApiKeys;
+}
+
+void PersistenceInfo::Share(SharedState* sharedState)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    // Added rather than stored, the other workers may already be counting requests. A restarted primary worker
+    // finds them already loaded by the one it replaces.
+    PersistenceCounters& counters = sharedState->GetPersistenceCounters();
+    if (sharedState->IsPrimary() && sharedState->ClaimPersistenceCounters())
+    {
+        counters.downloads += m_LocalCounters.downloads;
+        counters.totalRequests += m_LocalCounters.totalRequests;
+        counters.uploads += m_LocalCounters.uploads;
+    }
+
+    m_Counters = &counters;
+    m_SharedState = sharedState;
+    m_KeysGeneration = sharedState->GetKeysGeneration();
+}
+
+void PersistenceInfo::SetWritable(bool writable)
+{
+    m_Writable = writable;
+    if (m_SharedState)
+    {
+        m_SharedState->SetPersistenceWritable(writable);
+    }
+}
+
+bool PersistenceInfo::IsWritable() const
+{
+    return m_SharedState ? m_SharedState->IsPersistenceWritable() : m_Writable.load();
+}
+
+void PersistenceInfo::SetApiKeysChangedCallback(std::function<void()> callback)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_ApiKeysChanged = std::move(callback);
+}
+
 void PersistenceInfo::Save(nlohmann::json& json) const
 {
     nlohmann::json apiKeys = nlohmann::json::array();
@@ -54,9 +154,9 @@ void PersistenceInfo::Save(nlohmann::json& json) const
 
     json = nlohmann::json
     {
-        { "downloads", m_Downloads.load()},
-        { "totalRequests", m_TotalRequests.load()},
-        { "uploads", m_Uploads.load() },
+        { "downloads", m_Counters->downloads.load()},
+        { "totalRequests", m_Counters->totalRequests.load()},
+        { "uploads", m_Counters->uploads.load() },
         { "apiKeys", apiKeys }
     };
 }
@@ -74,21 +174,45 @@ void PersistenceInfo::Save() const
     }
 }
 
+void PersistenceInfo::Flush()
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    // The secondary workers never save the counters
+    if (!IsWritable() || (m_SharedState && !m_SharedState->IsPrimary()))
+    {
+        return;
+    }
+
+    if (m_SharedState)
+    {
+        SharedPersistenceLock sharedLock(*m_SharedState);
+        ReloadApiKeys();
+        Save();
+    }
+    else
+    {
+        Save();
+    }
+
+    m_LastWrite = std::chrono::system_clock::now() + std::chrono::years(1);
+}
+
 void PersistenceInfo::Load(const nlohmann::json& json)
 {
     try
     {
         if (json.contains("downloads"))
         {
-            m_Downloads = json.at("downloads").get<uint32_t>();
+            m_Counters->downloads = json.at("downloads").get<uint32_t>();
         }
         if (json.contains("totalRequests"))
         {
-            m_TotalRequests = json.at("totalRequests").get<uint32_t>();
+            m_Counters->totalRequests = json.at("totalRequests").get<uint32_t>();
         }
         if (json.contains("uploads"))
         {
-            m_Uploads = json.at("uploads").get<uint32_t>();
+            m_Counters->uploads = json.at("uploads").get<uint32_t>();
         }
 
         if (json.contains("apiKeys"))
@@ -100,6 +224,10 @@ void PersistenceInfo::Load(const nlohmann::json& json)
                 m_ApiKeys.emplace_back(std::move(apiKey));
             }
         }
+
+        m_LoadedDownloads = m_Counters->downloads;
+        m_LoadedTotalRequests = m_Counters->totalRequests;
+        m_LoadedUploads = m_Counters->uploads;
     }
     catch (const nlohmann::json::exception& e)
     {
@@ -119,26 +247,158 @@ void PersistenceInfo::Load()
     }
 }
 
+void PersistenceInfo::Reload()
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    std::ifstream file(m_Path);
+    if (!file.is_open())
+    {
+        return;
+    }
+
+    try
+    {
+        nlohmann::json json;
+        file >> json;
+
+        const uint32_t downloads = json.value("downloads", m_LoadedDownloads);
+        const uint32_t totalRequests = json.value("totalRequests", m_LoadedTotalRequests);
+        const uint32_t uploads = json.value("uploads", m_LoadedUploads);
+
+        std::vector<ApiKey> apiKeys;
+        if (json.contains("apiKeys"))
+        {
+            for (const nlohmann::json& apiKey : json.at("apiKeys"))
+            {
+                apiKeys.emplace_back(apiKey);
+            }
+        }
+
+        // Adjusted rather than stored, the other workers keep counting requests meanwhile
+        m_Counters->downloads += downloads - m_LoadedDownloads;
+        m_Counters->totalRequests += totalRequests - m_LoadedTotalRequests;
+        m_Counters->uploads += uploads - m_LoadedUploads;
+        m_LoadedDownloads = downloads;
+        m_LoadedTotalRequests = totalRequests;
+        m_LoadedUploads = uploads;
+
+        m_ApiKeys = std::move(apiKeys);
+        m_ApiKeysReloaded = true;
+        UpdateLastWrite();
+    }
+    catch (const nlohmann::json::exception& e)
+    {
+        std::cerr << "Persistence loading error: " << e.what() << std::endl;
+        return;
+    }
+
+    // The other workers reload the keys from the file as well
+    if (m_SharedState)
+    {
+        SharedPersistenceLock sharedLock(*m_SharedState);
+        m_KeysGeneration = m_SharedState->IncreaseKeysGeneration();
+    }
+}
+
 void PersistenceInfo::UpdateLastWrite() const
 {
     m_LastWrite = std::chrono::system_clock::now();
 }
 
+void PersistenceInfo::ReloadApiKeys()
+{
+    const uint64_t generation = m_SharedState->GetKeysGeneration();
+    if (generation == m_KeysGeneration)
+    {
+        return;
+    }
+
+    // The counters of the file are older than the shared ones, only the keys are reloaded
+    std::ifstream file(m_Path);
+    if (!file.is_open())
+    {
+        return;
+    }
+
+    try
+    {
+        nlohmann::json json;
+        file >> json;
+
+        std::vector<ApiKey> apiKeys;
+        if (json.contains("apiKeys"))
+        {
+            for (const nlohmann::json& apiKey : json.at("apiKeys"))
+            {
+                apiKeys.emplace_back(apiKey);
+            }
+        }
+
+        m_ApiKeys = std::move(apiKeys);
+        m_KeysGeneration = generation;
+        m_ApiKeysReloaded = true;
+    }
+    catch (const nlohmann::json::exception& e)
+    {
+        std::cerr << "Persistence loading error: " << e.what() << std::endl;
+    }
+}
+
 void PersistenceInfo::UpdateThread()
 {
+    ThreadPlacement::Apply(ThreadRole::BACKGROUND);
+
     while (m_ShouldContinue)
     {
         std::this_thread::sleep_for(std::chrono::seconds(1));
 
-        if (m_LastWrite < std::chrono::system_clock::now() && std::chrono::system_clock::now() - m_LastWrite > std::chrono::seconds(5))
+        std::function<void()> apiKeysChanged;
         {
             std::lock_guard<std::mutex> lock(m_Mutex);
 
-            Save();
+            if (m_SharedState)
+            {
+                SharedPersistenceLock sharedLock(*m_SharedState);
+                ReloadApiKeys();
+
+                // Every worker increases the shared counters, the primary one saves them once they stop changing
+                const uint64_t counters = static_cast<uint64_t>(m_Counters->downloads) + m_Counters->totalRequests + m_Counters->uploads;
+                if (!m_SharedState->IsPrimary())
+                {
+                    m_LastWrite = std::chrono::system_clock::now() + std::chrono::years(1);
+                }
+                else if (counters != m_ObservedCounters)
+                {
+                    m_ObservedCounters = counters;
+                    UpdateLastWrite();
+                }
+                else if (IsWritable() && m_LastWrite < std::chrono::system_clock::now() && std::chrono::system_clock::now() - m_LastWrite > std::chrono::seconds(5))
+                {
+                    Save();
+                    m_LastWrite = std::chrono::system_clock::now() + std::chrono::years(1);
+                }
+            }
+            else if (m_Writable && m_LastWrite < std::chrono::system_clock::now() && std::chrono::system_clock::now() - m_LastWrite > std::chrono::seconds(5))
+            {
+                Save();
 
-            //Until there is another update that needs to be saved, we'll make sure
-            //the last write is in the future
-            m_LastWrite = std::chrono::system_clock::now() + std::chrono::years(1);
+                //Until there is another update that needs to be saved, we'll make sure
+                //the last write is in the future
+                m_LastWrite = std::chrono::system_clock::now() + std::chrono::years(1);
+            }
+
+            if (m_ApiKeysReloaded)
+            {
+                m_ApiKeysReloaded = false;
+                apiKeysChanged = m_ApiKeysChanged;
+            }
+        }
+
+        // Outside of m_Mutex, the policy engine locks its own mutex before this one
+        if (apiKeysChanged)
+        {
+            apiKeysChanged();
         }
     }
 }
\ No newline at end of file
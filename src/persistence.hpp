@@ -1,12 +1,15 @@
 #pragma once
 
 #include <apikey.hpp>
+#include <sharedstate.hpp>
 
 #include <nlohmann/json.hpp>
 
 #include <chrono>
+#include <functional>
 #include <mutex>
 #include <thread>
+#include <vector>
 
 class PersistenceInfo final
 {
@@ -14,23 +17,53 @@ public:
     PersistenceInfo();
     ~PersistenceInfo();
 
-    uint32_t GetDownloads() const { return m_Downloads; }
-    uint32_t GetTotalRequests() const { return m_TotalRequests; }
-    uint32_t GetUploads() const { return m_Uploads; }
+    uint32_t GetDownloads() const { return m_Counters->downloads; }
+    uint32_t GetTotalRequests() const { return m_Counters->totalRequests; }
+    uint32_t GetUploads() const { return m_Counters->uploads; }
 
-    void IncreaseDownloads() { ++m_Downloads; UpdateLastWrite(); }
-    void IncreaseTotalRequests() { ++m_TotalRequests; UpdateLastWrite(); }
-    void IncreaseUploads() { ++m_Uploads; UpdateLastWrite(); }
+    void IncreaseDownloads() { ++m_Counters->downloads; UpdateLastWrite(); }
+    void IncreaseTotalRequests() { ++m_Counters->totalRequests; UpdateLastWrite(); }
+    void IncreaseUploads() { ++m_Counters->uploads; UpdateLastWrite(); }
 
     void UpdateOrAddApiKey(const ApiKey& apiKey);
-    const std::vector<ApiKey>& GetApiKeys() const { return m_ApiKeys; }
+    std::vector<ApiKey> GetApiKeys() const;
+
+    /**
+     * @brief Share the counters and the API keys with the other worker processes, once loaded
+     *
+     * The counters loaded by the primary worker are added to the shared ones, and only the primary worker
+     * saves them. A worker changing an API key saves it right away, and the other workers reload the keys
+     * from the file within a second, then call the function set with SetApiKeysChangedCallback().
+     */
+    void Share(SharedState* sharedState);
+
+    /**
+     * @brief Set the function called after reloading the API keys saved by another worker process
+     */
+    void SetApiKeysChangedCallback(std::function<void()> callback);
+
+    /**
+     * @brief Allow or forbid saving the file, forbidden while a previous instance still owns it
+     */
+    void SetWritable(bool writable);
+    bool IsWritable() const;
 
     void Save() const;
     void Save(nlohmann::json& json) const;
 
+    /**
+     * @brief Save the file now rather than after the usual delay, if this process may save it
+     */
+    void Flush();
+
     void Load();
     void Load(const nlohmann::json& json);
 
+    /**
+     * @brief Load the file saved by the previous instance on exit, keeping what was counted since Load()
+     */
+    void Reload();
+
     const std::string& GetPersistencePath() const { return m_Path; }
     void SetPersistencePath(const std::string& path) { m_Path = path; }
 
@@ -38,12 +71,28 @@ private:
     void UpdateLastWrite() const;
     void UpdateThread();
 
+    /**
+     * @brief Reload the API keys if another worker saved a change to them, with m_Mutex and the persistence lock held
+     */
+    void ReloadApiKeys();
+
 private:
-    std::atomic<uint32_t> m_Downloads;
-    std::atomic<uint32_t> m_TotalRequests;
-    std::atomic<uint32_t> m_Uploads;
+    PersistenceCounters m_LocalCounters;
+    PersistenceCounters* m_Counters; // m_LocalCounters, or the counters shared by the workers
     std::atomic<bool> m_ShouldContinue;
 
+    SharedState* m_SharedState;
+    uint64_t m_KeysGeneration; // Generation of the shared API keys last loaded
+    uint64_t m_ObservedCounters; // Sum of the shared counters seen by the primary worker
+    bool m_ApiKeysReloaded;
+    std::function<void()> m_ApiKeysChanged;
+    std::atomic<bool> m_Writable; // Unused once shared, the workers use the flag of the shared state
+
+    // Counters read from the file, the rest was counted by this instance
+    uint32_t m_LoadedDownloads;
+    uint32_t m_LoadedTotalRequests;
+    uint32_t m_LoadedUploads;
+
     std::string m_Path;
     mutable std::chrono::system_clock::time_point m_LastWrite;
     std::thread m_UpdateThread;
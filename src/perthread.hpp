@@ -0,0 +1,101 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief One object per thread using an instance, such as the producer side of a ring buffer or a counter shard
+ *
+ * The objects of the last few instances used by a thread are cached in thread-local storage, so the hot path neither
+ * locks nor allocates even when a thread alternates between several instances. Past the cache, the object created
+ * earlier for the thread is found again under the lock, so every thread gets at most one object per instance. The
+ * objects are destroyed with the instance.
+ */
+template <typename T>
+class PerThread final
+{
+public:
+    PerThread()
+        : m_Id(NextId++)
+    {
+    }
+
+    PerThread(const PerThread&) = delete;
+    PerThread& operator=(const PerThread&) = delete;
+
+    /**
+     * @brief Object of the calling thread
+     * @param create Called under the lock to create the object on the first use by the thread, returns a std::unique_ptr<T>
+     */
+    template <typename Factory>
+    T& Get(Factory&& create)
+    {
+        // Keyed by id rather than address, a new instance could reuse the address of a destroyed one
+        thread_local std::array<CacheEntry, CacheSize> cache{};
+        thread_local size_t nextEntry = 0;
+
+        for (const CacheEntry& entry : cache)
+        {
+            if (entry.id == m_Id)
+            {
+                return *entry.object;
+            }
+        }
+
+        T* object = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            T*& owned = m_ByThread[std::this_thread::get_id()];
+            if (owned == nullptr)
+            {
+                m_Objects.emplace_back(create());
+                owned = m_Objects.back().get();
+            }
+            object = owned;
+        }
+
+        cache[nextEntry] = CacheEntry{ m_Id, object };
+        nextEntry = (nextEntry + 1) % CacheSize;
+        return *object;
+    }
+
+    /**
+     * @brief Objects of every thread, which stay valid as long as the instance
+     */
+    std::vector<T*> GetAll() const
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        std::vector<T*> objects;
+        objects.reserve(m_Objects.size());
+        for (const std::unique_ptr<T>& object : m_Objects)
+        {
+            objects.push_back(object.get());
+        }
+
+        return objects;
+    }
+
+private:
+    struct CacheEntry
+    {
+        uint64_t id = 0;
+        T* object = nullptr;
+    };
+
+    static constexpr size_t CacheSize = 4;
+    static inline std::atomic<uint64_t> NextId{ 1 };
+
+    const uint64_t m_Id;
+
+    std::vector<std::unique_ptr<T>> m_Objects;
+    std::unordered_map<std::thread::id, T*> m_ByThread; // A thread whose id is reused takes over the object of the exited one
+    mutable std::mutex m_Mutex;
+};
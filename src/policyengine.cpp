@@ -39,7 +39,7 @@ bool PolicyEngine::RevokeApiKey(const std::string& apiKey)
     return false;
 }
 
-bool PolicyEngine::ValidateApiKey(const std::string& apiKey, AccessPermission requestedPermission) const
+bool PolicyEngine::ValidateApiKey(std::string_view apiKey, AccessPermission requestedPermission) const
 {
     std::lock_guard<std::recursive_mutex> lock(m_Mutex);
 
@@ -62,7 +62,7 @@ bool PolicyEngine::ValidateApiKey(const std::string& apiKey, AccessPermission re
     return false;
 }
 
-bool PolicyEngine::ValidateApiKey(const std::string& apiKey) const
+bool PolicyEngine::ValidateApiKey(std::string_view apiKey) const
 {
     std::lock_guard<std::recursive_mutex> lock(m_Mutex);
 
@@ -108,6 +108,8 @@ void PolicyEngine::Load()
 {
     std::lock_guard<std::recursive_mutex> lock(m_Mutex);
 
+    // Also called when another worker process changed the keys, which replace the ones known here
+    m_ApiKeys.clear();
     for (const ApiKey& apiKey : m_PersistenceInfo.GetApiKeys())
     {
         m_ApiKeys.emplace(apiKey.GetKey(), apiKey);
@@ -138,7 +140,7 @@ bool PolicyEngine::IsExpired(const ApiKey& key) const
     return key.GetExpiry().has_value() && key.GetExpiry().value() > std::chrono::system_clock::now();
 }
 
-bool PolicyEngine::IsExpired(const std::string& apiKey) const
+bool PolicyEngine::IsExpired(std::string_view apiKey) const
 {
     std::lock_guard<std::recursive_mutex> lock(m_Mutex);
     const auto iter = m_ApiKeys.find(apiKey);
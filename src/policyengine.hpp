@@ -8,6 +8,7 @@
 #include <optional>
 #include <unordered_map>
 #include <string>
+#include <string_view>
 
 class PolicyEngine final
 {
@@ -40,7 +41,7 @@ public:
      * @param requestedPermission The permission requested with the API key
      * @return bool indicating if the key is valid and has appropriate permissions
      */
-    bool ValidateApiKey(const std::string& apiKey, AccessPermission requestedPermission) const;
+    bool ValidateApiKey(std::string_view apiKey, AccessPermission requestedPermission) const;
 
     /**
      * @brief Validate an API key from HTTP header
@@ -48,7 +49,7 @@ public:
      * @param apiKey The API key from the request header
      * @return bool Indicating whether the key is valid
      */
-    bool ValidateApiKey(const std::string& apiKey) const;
+    bool ValidateApiKey(std::string_view apiKey) const;
 
     /**
      * @brief Validate if an API key is expired
@@ -56,7 +57,7 @@ public:
      * @param apiKey The API key from the request header
      * @return bool Indicating whether an API key is expired
      */
-    bool IsExpired(const std::string& apiKey) const;
+    bool IsExpired(std::string_view apiKey) const;
 
     /**
      * @brief Clean up expired API keys
@@ -103,7 +104,17 @@ private:
     bool IsMethodAllowed(AccessPermission permission, const std::string& httpMethod);
 
 private:
-    std::unordered_map<std::string, ApiKey> m_ApiKeys;
+    /**
+     * @brief Hash accepting any string type, so keys from request headers are looked up without a copy
+     */
+    struct StringHash
+    {
+        using is_transparent = void;
+
+        size_t operator()(std::string_view str) const { return std::hash<std::string_view>{}(str); }
+    };
+
+    std::unordered_map<std::string, ApiKey, StringHash, std::equal_to<>> m_ApiKeys;
     PersistenceInfo& m_PersistenceInfo;
     mutable std::recursive_mutex m_Mutex;
 };
\ No newline at end of file
@@ -0,0 +1,605 @@
+#include <popularity.hpp>
+
+#include <filters/authfilter.hpp>
+#include <threadutils.hpp>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+// Buckets per window, the window slides by one bucket at a time
+static constexpr size_t BucketCount = 12;
+
+// Rows of the count-min sketches, each one hashed with its own seed
+static constexpr size_t SketchDepth = 4;
+
+enum class Ranking
+{
+    REQUESTS,
+    BYTES,
+    COUNT
+};
+
+static std::string_view ToString(PopularityDimension dimension)
+{
+    switch (dimension)
+    {
+    case PopularityDimension::PACKAGE:
+        return "packages";
+    case PopularityDimension::TRIPLET:
+        return "triplets";
+    case PopularityDimension::API_KEY:
+        return "api_keys";
+    default:
+        return "unknown";
+    }
+}
+
+static uint64_t Mix(uint64_t value)
+{
+    // splitmix64 finalizer, spreads the bits of std::hash which may be the identity
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9ull;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111ebull;
+    value ^= value >> 31;
+    return value;
+}
+
+static size_t CopyTruncated(char* destination, size_t capacity, std::string_view source)
+{
+    const size_t length = std::min(capacity, source.size());
+    std::memcpy(destination, source.data(), length);
+    return length;
+}
+
+/**
+ * @brief Short hash of an API key in hexadecimal, enough to tell the keys apart without disclosing any part of them
+ * @return Characters written, the whole capacity
+ */
+static size_t FormatApiKeyHash(char* destination, size_t capacity, std::string_view apiKey)
+{
+    // FNV-1a rather than std::hash, so a key keeps its hash across builds and restarts
+    uint64_t hash = 14695981039346656037ull;
+    for (const char c : apiKey)
+    {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 1099511628211ull;
+    }
+    hash = Mix(hash);
+
+    static constexpr char Digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < capacity; ++i)
+    {
+        destination[i] = Digits[(hash >> (60 - 4 * (i % 16))) & 0xf];
+    }
+    return capacity;
+}
+
+struct TransparentHash
+{
+    using is_transparent = void;
+
+    size_t operator()(std::string_view str) const { return std::hash<std::string_view>{}(str); }
+};
+
+/**
+ * @brief Count-min sketch shared by the dimensions, which are part of the hashed key
+ */
+class CountMinSketch final
+{
+public:
+    explicit CountMinSketch(size_t width)
+        : m_Mask(width - 1)
+        , m_Counters(SketchDepth * width, 0)
+    {
+    }
+
+    void Add(PopularityDimension dimension, std::string_view key, uint64_t weight)
+    {
+        const uint64_t hash = Hash(dimension, key);
+        for (size_t row = 0; row < SketchDepth; ++row)
+        {
+            m_Counters[Index(hash, row)] += weight;
+        }
+    }
+
+    uint64_t Estimate(PopularityDimension dimension, std::string_view key) const
+    {
+        const uint64_t hash = Hash(dimension, key);
+        uint64_t estimate = UINT64_MAX;
+        for (size_t row = 0; row < SketchDepth; ++row)
+        {
+            estimate = std::min(estimate, m_Counters[Index(hash, row)]);
+        }
+        return estimate;
+    }
+
+    void Clear()
+    {
+        std::fill(m_Counters.begin(), m_Counters.end(), 0);
+    }
+
+private:
+    static uint64_t Hash(PopularityDimension dimension, std::string_view key)
+    {
+        return std::hash<std::string_view>{}(key) ^ Mix(static_cast<uint64_t>(dimension) + 1);
+    }
+
+    size_t Index(uint64_t hash, size_t row) const
+    {
+        return row * (m_Mask + 1) + (Mix(hash + row * 0x9e3779b97f4a7c15ull) & m_Mask);
+    }
+
+private:
+    const size_t m_Mask;
+    std::vector<uint64_t> m_Counters;
+};
+
+/**
+ * @brief Weighted space-saving summary, keeps the keys most likely to be the heaviest
+ *
+ * The entries form a min-heap on their count, so the lightest one is replaced in O(log capacity) once
+ * the summary is full. A new key inherits the count of the entry it replaces, which is what guarantees
+ * that a heavy key is never missed, its real weight is estimated from the sketches.
+ */
+class SpaceSaving final
+{
+public:
+    explicit SpaceSaving(size_t capacity)
+        : m_Capacity(capacity)
+    {
+        m_Entries.reserve(capacity);
+        m_Positions.reserve(capacity);
+    }
+
+    void Add(std::string_view key, uint64_t weight)
+    {
+        if (const auto it = m_Positions.find(key); it != m_Positions.end())
+        {
+            m_Entries[it->second].count += weight;
+            SiftDown(it->second);
+        }
+        else if (m_Entries.size() < m_Capacity)
+        {
+            m_Entries.push_back(Entry{ std::string(key), weight });
+            m_Positions.emplace(m_Entries.back().key, m_Entries.size() - 1);
+            SiftUp(m_Entries.size() - 1);
+        }
+        else if (!m_Entries.empty())
+        {
+            m_Positions.erase(m_Entries.front().key);
+            m_Entries.front().key = key;
+            m_Entries.front().count += weight;
+            m_Positions.emplace(m_Entries.front().key, 0);
+            SiftDown(0);
+        }
+    }
+
+    template<typename Function>
+    void ForEachKey(Function&& function) const
+    {
+        for (const Entry& entry : m_Entries)
+        {
+            function(entry.key);
+        }
+    }
+
+    void Clear()
+    {
+        m_Entries.clear();
+        m_Positions.clear();
+    }
+
+private:
+    struct Entry
+    {
+        std::string key;
+        uint64_t count;
+    };
+
+    void Swap(size_t first, size_t second)
+    {
+        std::swap(m_Entries[first], m_Entries[second]);
+        m_Positions.find(m_Entries[first].key)->second = first;
+        m_Positions.find(m_Entries[second].key)->second = second;
+    }
+
+    void SiftUp(size_t position)
+    {
+        while (position > 0)
+        {
+            const size_t parent = (position - 1) / 2;
+            if (m_Entries[parent].count <= m_Entries[position].count)
+            {
+                break;
+            }
+            Swap(parent, position);
+            position = parent;
+        }
+    }
+
+    void SiftDown(size_t position)
+    {
+        while (true)
+        {
+            const size_t left = position * 2 + 1;
+            const size_t right = left + 1;
+            size_t smallest = position;
+
+            if (left < m_Entries.size() && m_Entries[left].count < m_Entries[smallest].count)
+            {
+                smallest = left;
+            }
+            if (right < m_Entries.size() && m_Entries[right].count < m_Entries[smallest].count)
+            {
+                smallest = right;
+            }
+            if (smallest == position)
+            {
+                break;
+            }
+            Swap(position, smallest);
+            position = smallest;
+        }
+    }
+
+private:
+    const size_t m_Capacity;
+    std::vector<Entry> m_Entries;
+    std::unordered_map<std::string, size_t, TransparentHash, std::equal_to<>> m_Positions;
+};
+
+struct PopularityTracker::Ring
+{
+    explicit Ring(size_t capacity)
+        : events(capacity)
+        , head(0)
+        , tail(0)
+        , dropped(0)
+    {
+    }
+
+    std::vector<Event> events;
+
+    // Written by the owning thread only
+    alignas(64) std::atomic<uint64_t> head;
+    std::atomic<uint64_t> dropped;
+
+    // Written by the aggregator thread only
+    alignas(64) std::atomic<uint64_t> tail;
+};
+
+struct PopularityTracker::Window
+{
+    struct Bucket
+    {
+        Bucket(size_t capacity, size_t sketchWidth)
+            : index(-1)
+            , requests(0)
+            , bytes(0)
+            , requestSketch(sketchWidth)
+            , byteSketch(sketchWidth)
+        {
+            for (size_t i = 0; i < summaries.size(); ++i)
+            {
+                summaries[i] = std::make_unique<SpaceSaving>(capacity);
+            }
+        }
+
+        SpaceSaving& GetSummary(PopularityDimension dimension, Ranking ranking)
+        {
+            return *summaries[static_cast<size_t>(dimension) * static_cast<size_t>(Ranking::COUNT) + static_cast<size_t>(ranking)];
+        }
+
+        const SpaceSaving& GetSummary(PopularityDimension dimension, Ranking ranking) const
+        {
+            return *summaries[static_cast<size_t>(dimension) * static_cast<size_t>(Ranking::COUNT) + static_cast<size_t>(ranking)];
+        }
+
+        void Reset(int64_t newIndex)
+        {
+            index = newIndex;
+            requests = 0;
+            bytes = 0;
+            requestSketch.Clear();
+            byteSketch.Clear();
+            for (std::unique_ptr<SpaceSaving>& summary : summaries)
+            {
+                summary->Clear();
+            }
+        }
+
+        int64_t index; // Time since the epoch in bucket lengths, -1 while unused
+        uint64_t requests;
+        uint64_t bytes;
+        CountMinSketch requestSketch;
+        CountMinSketch byteSketch;
+        std::array<std::unique_ptr<SpaceSaving>, static_cast<size_t>(PopularityDimension::COUNT) * static_cast<size_t>(Ranking::COUNT)> summaries;
+    };
+
+    Window(std::chrono::seconds windowLength, size_t capacity, size_t sketchWidth)
+        : length(windowLength)
+        , bucketLength(std::max<int64_t>(windowLength.count() / static_cast<int64_t>(BucketCount), 1))
+    {
+        buckets.reserve(BucketCount);
+        for (size_t i = 0; i < BucketCount; ++i)
+        {
+            buckets.emplace_back(capacity, sketchWidth);
+        }
+    }
+
+    int64_t GetIndex(std::chrono::system_clock::time_point now) const
+    {
+        return std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count() / bucketLength;
+    }
+
+    Bucket& GetBucket(int64_t index)
+    {
+        Bucket& bucket = buckets[static_cast<size_t>(index) % BucketCount];
+        if (bucket.index != index)
+        {
+            // Held a bucket which left the window
+            bucket.Reset(index);
+        }
+        return bucket;
+    }
+
+    bool IsLive(const Bucket& bucket, int64_t current) const
+    {
+        return bucket.index >= 0 && bucket.index > current - static_cast<int64_t>(BucketCount) && bucket.index <= current;
+    }
+
+    std::chrono::seconds length;
+    int64_t bucketLength; // In seconds
+    std::vector<Bucket> buckets;
+};
+
+PopularityTracker::PopularityTracker(const std::vector<std::chrono::seconds>& windows, size_t capacity, size_t sketchWidth, size_t bufferSize, std::chrono::milliseconds flushInterval)
+    : m_Capacity(std::max<size_t>(capacity, 1))
+    , m_BufferSize(std::bit_ceil(std::max<size_t>(bufferSize, 64)))
+    , m_FlushInterval(flushInterval)
+    , m_ShouldContinue(true)
+{
+    const size_t width = std::bit_ceil(std::max<size_t>(sketchWidth, 64));
+    for (const std::chrono::seconds& window : windows)
+    {
+        if (window.count() > 0)
+        {
+            m_Windows.emplace_back(std::make_unique<Window>(window, m_Capacity, width));
+        }
+    }
+
+    m_Thread = std::thread(&PopularityTracker::AggregatorThread, this);
+}
+
+PopularityTracker::~PopularityTracker()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_ShouldContinue = false;
+    }
+    m_Condition.notify_all();
+
+    if (m_Thread.joinable())
+    {
+        m_Thread.join();
+    }
+}
+
+void PopularityTracker::Record(const drogon::HttpRequestPtr& req, std::string_view triplet, std::string_view name, std::string_view version, uint64_t bytes)
+{
+    Ring& ring = GetRing();
+
+    const uint64_t head = ring.head.load(std::memory_order_relaxed);
+    if (head - ring.tail.load(std::memory_order_acquire) >= ring.events.size())
+    {
+        // Never block a request on the statistics, they are estimates anyway
+        ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+    }
+
+    Event& event = ring.events[head & (ring.events.size() - 1)];
+    event.bytes = bytes;
+
+    size_t length = CopyTruncated(event.package, sizeof(event.package), triplet);
+    event.tripletLength = static_cast<uint8_t>(length);
+    length += CopyTruncated(event.package + length, sizeof(event.package) - length, "/");
+    length += CopyTruncated(event.package + length, sizeof(event.package) - length, name);
+    length += CopyTruncated(event.package + length, sizeof(event.package) - length, "/");
+    length += CopyTruncated(event.package + length, sizeof(event.package) - length, version);
+    event.packageLength = static_cast<uint8_t>(length);
+
+    // Only a hash of the key, which is published by the statistics
+    const std::optional<std::string_view> apiKey = ApiKeyFilter::ExtractApiKey(req);
+    event.apiKeyLength = static_cast<uint8_t>(apiKey ? FormatApiKeyHash(event.apiKey, sizeof(event.apiKey), apiKey.value()) : 0);
+
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+nlohmann::json PopularityTracker::GetTop(size_t count) const
+{
+    count = std::min(count, m_Capacity);
+
+    struct Candidate
+    {
+        std::string_view key;
+        uint64_t requests;
+        uint64_t bytes;
+    };
+
+    nlohmann::json windows = nlohmann::json::array();
+    uint64_t dropped = 0;
+    for (const Ring* ring : m_Rings.GetAll())
+    {
+        dropped += ring->dropped.load(std::memory_order_relaxed);
+    }
+
+    std::lock_guard<std::mutex> lock(m_WindowsMutex);
+    const std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
+
+    for (const std::unique_ptr<Window>& window : m_Windows)
+    {
+        const int64_t current = window->GetIndex(now);
+
+        std::vector<const Window::Bucket*> live;
+        uint64_t requests = 0;
+        uint64_t bytes = 0;
+        for (const Window::Bucket& bucket : window->buckets)
+        {
+            if (window->IsLive(bucket, current))
+            {
+                live.push_back(&bucket);
+                requests += bucket.requests;
+                bytes += bucket.bytes;
+            }
+        }
+
+        nlohmann::json result;
+        result["window_seconds"] = window->length.count();
+        result["requests"] = requests;
+        result["bytes"] = bytes;
+
+        for (size_t d = 0; d < static_cast<size_t>(PopularityDimension::COUNT); ++d)
+        {
+            const PopularityDimension dimension = static_cast<PopularityDimension>(d);
+
+            // A key heavy over the window is among the heaviest of at least one of its buckets
+            std::unordered_set<std::string_view> keys;
+            for (const Window::Bucket* bucket : live)
+            {
+                for (size_t r = 0; r < static_cast<size_t>(Ranking::COUNT); ++r)
+                {
+                    bucket->GetSummary(dimension, static_cast<Ranking>(r)).ForEachKey([&keys](const std::string& key) { keys.insert(key); });
+                }
+            }
+
+            std::vector<Candidate> candidates;
+            candidates.reserve(keys.size());
+            for (std::string_view key : keys)
+            {
+                Candidate candidate{ key, 0, 0 };
+                for (const Window::Bucket* bucket : live)
+                {
+                    candidate.requests += bucket->requestSketch.Estimate(dimension, key);
+                    candidate.bytes += bucket->byteSketch.Estimate(dimension, key);
+                }
+                candidates.push_back(candidate);
+            }
+
+            nlohmann::json& dimensionResult = result[std::string(ToString(dimension))];
+            for (size_t r = 0; r < static_cast<size_t>(Ranking::COUNT); ++r)
+            {
+                const Ranking ranking = static_cast<Ranking>(r);
+                const auto weight = [ranking](const Candidate& candidate) { return ranking == Ranking::REQUESTS ? candidate.requests : candidate.bytes; };
+
+                const size_t listed = std::min(count, candidates.size());
+                std::partial_sort(candidates.begin(), candidates.begin() + listed, candidates.end(), [&weight](const Candidate& a, const Candidate& b)
+                {
+                    return weight(a) != weight(b) ? weight(a) > weight(b) : a.key < b.key;
+                });
+
+                nlohmann::json top = nlohmann::json::array();
+                for (size_t i = 0; i < listed && weight(candidates[i]) > 0; ++i)
+                {
+                    top.push_back({ { "key", candidates[i].key }, { "requests", candidates[i].requests }, { "bytes", candidates[i].bytes } });
+                }
+                dimensionResult[ranking == Ranking::REQUESTS ? "by_requests" : "by_bytes"] = std::move(top);
+            }
+        }
+
+        windows.push_back(std::move(result));
+    }
+
+    return nlohmann::json
+    {
+        { "windows", std::move(windows) },
+        { "dropped", dropped }
+    };
+}
+
+PopularityTracker::Ring& PopularityTracker::GetRing()
+{
+    return m_Rings.Get([this]() { return std::make_unique<Ring>(m_BufferSize); });
+}
+
+void PopularityTracker::AggregatorThread()
+{
+    ThreadPlacement::Apply(ThreadRole::BACKGROUND);
+
+    while (true)
+    {
+        bool shouldContinue;
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_Condition.wait_for(lock, m_FlushInterval, [this]() { return !m_ShouldContinue; });
+            shouldContinue = m_ShouldContinue;
+        }
+
+        if (!shouldContinue)
+        {
+            break;
+        }
+
+        Drain();
+    }
+}
+
+void PopularityTracker::Drain()
+{
+    const std::vector<Ring*> rings = m_Rings.GetAll();
+
+    std::lock_guard<std::mutex> lock(m_WindowsMutex);
+    const std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
+
+    std::vector<Window::Bucket*> buckets;
+    buckets.reserve(m_Windows.size());
+    for (const std::unique_ptr<Window>& window : m_Windows)
+    {
+        buckets.push_back(&window->GetBucket(window->GetIndex(now)));
+    }
+
+    for (Ring* ring : rings)
+    {
+        const uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        const uint64_t head = ring->head.load(std::memory_order_acquire);
+
+        for (uint64_t position = tail; position != head; ++position)
+        {
+            const Event& event = ring->events[position & (ring->events.size() - 1)];
+
+            const std::array<std::string_view, static_cast<size_t>(PopularityDimension::COUNT)> keys
+            {
+                std::string_view(event.package, event.packageLength),
+                std::string_view(event.package, std::min(event.tripletLength, event.packageLength)),
+                event.apiKeyLength > 0 ? std::string_view(event.apiKey, event.apiKeyLength) : std::string_view("anonymous")
+            };
+
+            for (Window::Bucket* bucket : buckets)
+            {
+                ++bucket->requests;
+                bucket->bytes += event.bytes;
+
+                for (size_t d = 0; d < keys.size(); ++d)
+                {
+                    const PopularityDimension dimension = static_cast<PopularityDimension>(d);
+                    bucket->requestSketch.Add(dimension, keys[d], 1);
+                    bucket->GetSummary(dimension, Ranking::REQUESTS).Add(keys[d], 1);
+
+                    if (event.bytes > 0)
+                    {
+                        bucket->byteSketch.Add(dimension, keys[d], event.bytes);
+                        bucket->GetSummary(dimension, Ranking::BYTES).Add(keys[d], event.bytes);
+                    }
+                }
+            }
+        }
+
+        ring->tail.store(head, std::memory_order_release);
+    }
+}
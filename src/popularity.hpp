@@ -0,0 +1,107 @@
+#pragma once
+
+#include <perthread.hpp>
+
+#include <drogon/HttpRequest.h>
+#include <nlohmann/json.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief What the requests are grouped by
+ */
+enum class PopularityDimension
+{
+    PACKAGE, // triplet/name/version
+    TRIPLET,
+    API_KEY, // Hash of the key, or "anonymous"
+    COUNT
+};
+
+/**
+ * @brief Tracks which packages, triplets and API keys drive the traffic, over sliding windows
+ *
+ * The package handlers push each request into a ring buffer owned by their thread, which neither
+ * allocates nor takes a lock, like the access log. A background thread drains the rings into the
+ * windows. Each window is split into buckets, and every bucket holds a count-min sketch of the requests
+ * and one of the bytes, shared by the dimensions, plus a space-saving summary of the heaviest keys of
+ * each dimension and ranking. A window is queried by merging the candidates of its buckets and
+ * estimating each of them from the sketches, so memory stays bounded however many keys are seen.
+ * Estimates may be slightly above the real counts, never below, and the window slides one bucket at a
+ * time.
+ */
+class PopularityTracker final
+{
+public:
+    /**
+     * @brief Constructor
+     * @param windows Length of every window
+     * @param capacity Keys kept by each space-saving summary, the most that can be listed
+     * @param sketchWidth Counters per row of the count-min sketches, rounded up to a power of two
+     * @param bufferSize Requests buffered per thread, rounded up to a power of two
+     * @param flushInterval Interval between two drains of the buffers
+     */
+    PopularityTracker(const std::vector<std::chrono::seconds>& windows, size_t capacity, size_t sketchWidth, size_t bufferSize, std::chrono::milliseconds flushInterval);
+    ~PopularityTracker();
+
+    /**
+     * @brief Called from the package handlers, records a request
+     * @param bytes Size of the package sent or received, 0 for HEAD requests and misses
+     */
+    void Record(const drogon::HttpRequestPtr& req, std::string_view triplet, std::string_view name, std::string_view version, uint64_t bytes);
+
+    /**
+     * @brief Get the heaviest keys of every dimension over every window, by requests and by bytes
+     * @param count Keys listed per dimension and ranking, up to the capacity
+     */
+    nlohmann::json GetTop(size_t count) const;
+
+private:
+    static constexpr size_t PackageLength = 160;
+    static constexpr size_t ApiKeyHashLength = 8;
+
+    struct Event
+    {
+        uint64_t bytes;
+        uint8_t tripletLength;
+        uint8_t packageLength;
+        uint8_t apiKeyLength;
+        char package[PackageLength]; // triplet/name/version, truncated beyond that
+        char apiKey[ApiKeyHashLength]; // Hexadecimal
+    };
+
+    struct Ring;
+    struct Window;
+
+    Ring& GetRing();
+
+    void AggregatorThread();
+
+    /**
+     * @brief Move the requests of every ring to the windows
+     */
+    void Drain();
+
+private:
+    const size_t m_Capacity;
+    const size_t m_BufferSize;
+    const std::chrono::milliseconds m_FlushInterval;
+
+    PerThread<Ring> m_Rings;
+
+    std::vector<std::unique_ptr<Window>> m_Windows;
+    mutable std::mutex m_WindowsMutex;
+
+    std::atomic<bool> m_ShouldContinue;
+    std::mutex m_Mutex;
+    std::condition_variable m_Condition;
+    std::thread m_Thread;
+};
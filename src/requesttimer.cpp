@@ -0,0 +1,169 @@
+#include <requesttimer.hpp>
+
+#include <responsecache.hpp>
+
+#include <fmt/core.h>
+
+#include <array>
+#include <memory>
+#include <string_view>
+
+static constexpr std::array<std::string_view, static_cast<size_t>(RequestPhase::COUNT)> PhaseNames{ "receive", "route", "filter", "lookup", "open", "read", "write", "commit", "respond" };
+
+static const std::string TimingAttribute{ "requestTiming" };
+
+namespace
+{
+    struct RequestTiming
+    {
+        int64_t start; // Microseconds since epoch
+        int64_t lastMark;
+        std::array<int64_t, static_cast<size_t>(RequestPhase::COUNT)> phases{};
+    };
+}
+
+static int64_t GetMicroseconds()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static RequestTiming* FindTiming(const drogon::HttpRequestPtr& req)
+{
+    const std::shared_ptr<RequestTiming>& timing = req->attributes()->get<std::shared_ptr<RequestTiming>>(TimingAttribute);
+    return timing.get();
+}
+
+RequestTimer::RequestTimer(bool enabled, std::chrono::milliseconds slowRequestThreshold, size_t slowRequestLogSize)
+    : m_Enabled(enabled)
+    , m_SlowRequestThreshold(std::chrono::duration_cast<std::chrono::microseconds>(slowRequestThreshold))
+    , m_NextSlowRequest(0)
+{
+    m_SlowRequests.reserve(slowRequestLogSize);
+}
+
+void RequestTimer::OnRequest(const drogon::HttpRequestPtr& req) const
+{
+    if (!m_Enabled)
+    {
+        return;
+    }
+
+    // The creation date is taken when the first bytes of the request are parsed
+    const int64_t start = req->creationDate().microSecondsSinceEpoch();
+    std::shared_ptr<RequestTiming> timing = std::make_shared<RequestTiming>(RequestTiming{ start, start });
+    req->attributes()->insert(TimingAttribute, timing);
+
+    Mark(req, RequestPhase::RECEIVE);
+}
+
+void RequestTimer::Mark(const drogon::HttpRequestPtr& req, RequestPhase phase) const
+{
+    if (!m_Enabled)
+    {
+        return;
+    }
+
+    if (RequestTiming* timing = FindTiming(req))
+    {
+        const int64_t now = GetMicroseconds();
+        timing->phases[static_cast<size_t>(phase)] += now - timing->lastMark;
+        timing->lastMark = now;
+    }
+}
+
+void RequestTimer::OnResponse(const drogon::HttpRequestPtr& req, const drogon::HttpResponsePtr& resp)
+{
+    if (!m_Enabled)
+    {
+        return;
+    }
+
+    RequestTiming* timing = FindTiming(req);
+    if (!timing)
+    {
+        return;
+    }
+
+    Mark(req, RequestPhase::RESPOND);
+    const int64_t total = timing->lastMark - timing->start;
+
+    // Shared responses are sent to other requests as well, they must not carry the timing of this one
+    if (!req->getHeader("X-Server-Timing").empty() && !ResponseCache::IsShared(resp))
+    {
+        std::string header;
+        for (size_t phase = 0; phase < PhaseNames.size(); ++phase)
+        {
+            if (timing->phases[phase] > 0)
+            {
+                header += fmt::format("{};dur={:.3f}, ", PhaseNames[phase], timing->phases[phase] / 1000.0);
+            }
+        }
+        header += fmt::format("total;dur={:.3f}", total / 1000.0);
+
+        resp->addHeader("Server-Timing", std::move(header));
+    }
+
+    // The timings are in microseconds, like the stored threshold
+    if (total < m_SlowRequestThreshold.count() || m_SlowRequests.capacity() == 0)
+    {
+        return;
+    }
+
+    SlowRequest slowRequest
+    {
+        timing->start,
+        req->methodString(),
+        req->getPath(),
+        req->peerAddr().toIp(),
+        static_cast<int>(resp->getStatusCode()),
+        total,
+        std::vector<int64_t>(timing->phases.begin(), timing->phases.end())
+    };
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (m_SlowRequests.size() < m_SlowRequests.capacity())
+    {
+        m_SlowRequests.emplace_back(std::move(slowRequest));
+    }
+    else
+    {
+        m_SlowRequests[m_NextSlowRequest] = std::move(slowRequest);
+    }
+    m_NextSlowRequest = (m_NextSlowRequest + 1) % m_SlowRequests.capacity();
+}
+
+nlohmann::json RequestTimer::GetSlowRequests() const
+{
+    nlohmann::json requests = nlohmann::json::array();
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    // Once the buffer is full, the next slot to overwrite holds the oldest request
+    const size_t first = m_SlowRequests.size() < m_SlowRequests.capacity() ? 0 : m_NextSlowRequest;
+    for (size_t i = 0; i < m_SlowRequests.size(); ++i)
+    {
+        const SlowRequest& slowRequest = m_SlowRequests[(first + i) % m_SlowRequests.size()];
+
+        nlohmann::json phases;
+        for (size_t phase = 0; phase < PhaseNames.size(); ++phase)
+        {
+            if (slowRequest.phases[phase] > 0)
+            {
+                phases[std::string(PhaseNames[phase])] = slowRequest.phases[phase] / 1000.0;
+            }
+        }
+
+        requests.push_back(
+        {
+            { "time", slowRequest.time / 1000000 },
+            { "method", slowRequest.method },
+            { "path", slowRequest.path },
+            { "peer", slowRequest.peer },
+            { "status", slowRequest.statusCode },
+            { "total_ms", slowRequest.total / 1000.0 },
+            { "phases_ms", phases }
+        });
+    }
+
+    return requests;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <drogon/HttpRequest.h>
+#include <drogon/HttpResponse.h>
+#include <nlohmann/json.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Phases of a request, in the order they happen
+ */
+enum class RequestPhase
+{
+    RECEIVE, // Request received and parsed, until the pre-routing advice
+    ROUTE,   // Routing, until the API key filter starts
+    FILTER,  // API key validation
+    LOOKUP,  // Package index or file system lookup
+    OPEN,    // Opening (or creating) the package file
+    READ,    // Reading the package file
+    WRITE,   // Writing the uploaded package
+    COMMIT,  // Updating the package index and storage tiers after an upload
+    RESPOND, // Building the response, until its headers are sent
+    COUNT
+};
+
+/**
+ * @brief Per-request phase timing, reported through a Server-Timing header and a slow request log
+ *
+ * When enabled, every request carries a small timing record in its attributes, and each call to
+ * Mark() charges the time elapsed since the previous mark to a phase. Requests sent with an
+ * "X-Server-Timing" header get the phases back in a Server-Timing response header, and requests
+ * slower than the threshold are kept in a fixed-size ring buffer. When disabled, Mark() only tests a
+ * flag.
+ */
+class RequestTimer final
+{
+public:
+    /**
+     * @brief Constructor
+     * @param enabled Whether requests are timed
+     * @param slowRequestThreshold Requests at least this slow are added to the slow request log
+     * @param slowRequestLogSize Number of slow requests kept
+     */
+    RequestTimer(bool enabled, std::chrono::milliseconds slowRequestThreshold, size_t slowRequestLogSize);
+
+    /**
+     * @brief Called from the pre-routing advice, attaches the timing record to the request
+     */
+    void OnRequest(const drogon::HttpRequestPtr& req) const;
+
+    /**
+     * @brief Charge the time since the previous mark to a phase
+     */
+    void Mark(const drogon::HttpRequestPtr& req, RequestPhase phase) const;
+
+    /**
+     * @brief Called from the pre-sending advice, adds the Server-Timing header and logs slow requests
+     */
+    void OnResponse(const drogon::HttpRequestPtr& req, const drogon::HttpResponsePtr& resp);
+
+    /**
+     * @brief Get the slow request log, oldest first
+     */
+    nlohmann::json GetSlowRequests() const;
+
+    bool IsEnabled() const { return m_Enabled; }
+
+private:
+    struct SlowRequest
+    {
+        int64_t time; // Microseconds since epoch
+        std::string method;
+        std::string path;
+        std::string peer;
+        int statusCode;
+        int64_t total;
+        std::vector<int64_t> phases;
+    };
+
+    const bool m_Enabled;
+    const std::chrono::microseconds m_SlowRequestThreshold; // Converted once, the timings are compared in microseconds
+
+    std::vector<SlowRequest> m_SlowRequests;
+    size_t m_NextSlowRequest;
+    mutable std::mutex m_Mutex;
+};
@@ -0,0 +1,77 @@
+#include <responsecache.hpp>
+
+#include <string>
+#include <vector>
+
+namespace
+{
+    struct CachedResponse
+    {
+        drogon::HttpStatusCode statusCode;
+        std::string key;
+        drogon::HttpResponsePtr response;
+    };
+}
+
+// A handful of responses per thread, a linear search is faster than hashing the key
+static thread_local std::vector<CachedResponse> CachedResponses;
+
+drogon::HttpResponsePtr ResponseCache::Find(drogon::HttpStatusCode statusCode, std::string_view key)
+{
+    for (const CachedResponse& cached : CachedResponses)
+    {
+        if (cached.statusCode == statusCode && cached.key == key)
+        {
+            return cached.response;
+        }
+    }
+
+    return nullptr;
+}
+
+drogon::HttpResponsePtr ResponseCache::Add(drogon::HttpStatusCode statusCode, std::string_view key, drogon::HttpResponsePtr resp)
+{
+    // Drogon never caches 404s per route, so they can safely keep their rendered headers like its own 404 page.
+    // Other status codes returned by a handler with an expiry would be replayed by the router for every request
+    if (statusCode == drogon::k404NotFound)
+    {
+        resp->setExpiredTime(0);
+    }
+
+    CachedResponses.push_back(CachedResponse{ statusCode, std::string(key), resp });
+    return resp;
+}
+
+drogon::HttpResponsePtr ResponseCache::Get(drogon::HttpStatusCode statusCode, std::string_view body, drogon::ContentType contentType)
+{
+    if (drogon::HttpResponsePtr resp = Find(statusCode, body))
+    {
+        return resp;
+    }
+
+    drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
+    resp->setStatusCode(statusCode);
+    if (!body.empty())
+    {
+        resp->setBody(std::string(body));
+    }
+    if (contentType != drogon::CT_NONE)
+    {
+        resp->setContentTypeCode(contentType);
+    }
+
+    return Add(statusCode, body, std::move(resp));
+}
+
+bool ResponseCache::IsShared(const drogon::HttpResponsePtr& resp)
+{
+    for (const CachedResponse& cached : CachedResponses)
+    {
+        if (cached.response == resp)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <drogon/HttpResponse.h>
+
+#include <string_view>
+
+/**
+ * @brief Per-thread error responses, built once and sent again to every request hitting the same error
+ *
+ * Error paths (invalid hashes, missing packages, rejected API keys) are hit at high rates, and building
+ * a new response and body for each of them shows up as allocator pressure. A cached response is shared
+ * by every request of an IO thread, so it must not be modified once returned: the pre-sending advices
+ * check IsShared() before adding headers.
+ */
+class ResponseCache final
+{
+public:
+    /**
+     * @brief Get the response of the calling thread for a status code and key, or nullptr if it was not added yet
+     */
+    static drogon::HttpResponsePtr Find(drogon::HttpStatusCode statusCode, std::string_view key);
+
+    /**
+     * @brief Share a response for a status code and key on the calling thread
+     * @return The response
+     */
+    static drogon::HttpResponsePtr Add(drogon::HttpStatusCode statusCode, std::string_view key, drogon::HttpResponsePtr resp);
+
+    /**
+     * @brief Get a response with a plain body, creating it on the first call of the calling thread
+     * @param contentType Content type of the body, CT_NONE to keep the default
+     */
+    static drogon::HttpResponsePtr Get(drogon::HttpStatusCode statusCode, std::string_view body, drogon::ContentType contentType = drogon::CT_NONE);
+
+    /**
+     * @brief Whether a response comes from the cache, and must be sent as-is
+     */
+    static bool IsShared(const drogon::HttpResponsePtr& resp);
+};
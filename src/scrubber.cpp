@@ -0,0 +1,418 @@
+#include <scrubber.hpp>
+
+#include <packageindex.hpp>
+#include <packagekey.hpp>
+#include <pagecache.hpp>
+#include <storagetiers.hpp>
+#include <ziparchive.hpp>
+
+#include <fmt/core.h>
+
+#include <fstream>
+#include <iostream>
+
+// Packages modified more recently may still be written by an upload
+static constexpr std::chrono::seconds MinPackageAge{ 60 };
+
+// Findings listed by /status, the oldest ones are dropped first
+static constexpr size_t MaxFindings = 32;
+
+static int64_t GetUnixTime()
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static std::string_view ToString(ZipArchive::Status status)
+{
+    switch (status)
+    {
+    case ZipArchive::Status::VALID:
+        return "valid";
+    case ZipArchive::Status::CORRUPT:
+        return "corrupt";
+    case ZipArchive::Status::UNSUPPORTED:
+        return "unsupported";
+    case ZipArchive::Status::UNREADABLE:
+        return "unreadable";
+    default:
+        return "unknown";
+    }
+}
+
+Scrubber::Scrubber(StorageTiers& storageTiers, PackageIndex* packageIndex, const PageCache& pageCache, const std::filesystem::path& quarantineDirectory, uint64_t rate, std::chrono::seconds interval, IoPriority ioPriority)
+    : m_StorageTiers(storageTiers)
+    , m_PackageIndex(packageIndex)
+    , m_PageCache(pageCache)
+    , m_QuarantineDirectory(quarantineDirectory)
+    , m_Rate(rate)
+    , m_Interval(interval)
+    , m_IoPriority(ioPriority)
+    , m_Scrubbing(false)
+    , m_Passes(0)
+    , m_PassStarted(0)
+    , m_PassCompleted(0)
+    , m_PassPackages(0)
+    , m_PassBytes(0)
+    , m_CheckedPackages(0)
+    , m_CheckedBytes(0)
+    , m_TotalPackages(0)
+    , m_TotalBytes(0)
+    , m_Corrupt(0)
+    , m_Quarantined(0)
+    , m_Unsupported(0)
+    , m_Errors(0)
+    , m_ShouldContinue(false)
+{
+}
+
+Scrubber::~Scrubber()
+{
+    Stop();
+}
+
+void Scrubber::Start()
+{
+    if (m_Thread.joinable())
+    {
+        return;
+    }
+
+    m_ShouldContinue = true;
+    m_Thread = std::thread(&Scrubber::ScrubThread, this);
+}
+
+void Scrubber::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_ShouldContinue = false;
+    }
+    m_Condition.notify_all();
+
+    if (m_Thread.joinable())
+    {
+        m_Thread.join();
+    }
+}
+
+nlohmann::json Scrubber::GetStats() const
+{
+    nlohmann::json stats;
+    stats["state"] = m_Scrubbing ? "scrubbing" : "waiting";
+    stats["rate_bytes_per_second"] = m_Rate;
+    stats["passes"] = m_Passes.load();
+    stats["last_pass_completed"] = m_PassCompleted.load();
+    stats["current_pass"]["started"] = m_PassStarted.load();
+    stats["current_pass"]["packages"] = m_CheckedPackages.load();
+    stats["current_pass"]["packages_total"] = m_PassPackages.load();
+    stats["current_pass"]["bytes"] = m_CheckedBytes.load();
+    stats["current_pass"]["bytes_total"] = m_PassBytes.load();
+    stats["checked_packages"] = m_TotalPackages.load();
+    stats["checked_bytes"] = m_TotalBytes.load();
+    stats["corrupt"] = m_Corrupt.load();
+    stats["quarantined"] = m_Quarantined.load();
+    stats["unsupported"] = m_Unsupported.load();
+    stats["errors"] = m_Errors.load();
+
+    nlohmann::json findings = nlohmann::json::array();
+    {
+        std::lock_guard<std::mutex> lock(m_FindingsMutex);
+        for (const Finding& finding : m_Findings)
+        {
+            findings.push_back({ { "package", finding.package }, { "problem", finding.problem }, { "action", finding.action }, { "time", finding.time } });
+        }
+    }
+    stats["findings"] = std::move(findings);
+
+    return stats;
+}
+
+void Scrubber::Export(std::string& out) const
+{
+    out += "# HELP vcpkg_cache_scrub_passes_total Complete scrubbing passes over the stored packages\n";
+    out += "# TYPE vcpkg_cache_scrub_passes_total counter\n";
+    out += fmt::format("vcpkg_cache_scrub_passes_total {}\n", m_Passes.load());
+    out += "# HELP vcpkg_cache_scrub_checked_bytes_total Bytes of packages read by the scrubber\n";
+    out += "# TYPE vcpkg_cache_scrub_checked_bytes_total counter\n";
+    out += fmt::format("vcpkg_cache_scrub_checked_bytes_total {}\n", m_TotalBytes.load());
+    out += "# HELP vcpkg_cache_scrub_packages_total Packages checked by the scrubber, by result\n";
+    out += "# TYPE vcpkg_cache_scrub_packages_total counter\n";
+    out += fmt::format("vcpkg_cache_scrub_packages_total{{result=\"checked\"}} {}\n", m_TotalPackages.load());
+    out += fmt::format("vcpkg_cache_scrub_packages_total{{result=\"corrupt\"}} {}\n", m_Corrupt.load());
+    out += fmt::format("vcpkg_cache_scrub_packages_total{{result=\"quarantined\"}} {}\n", m_Quarantined.load());
+    out += fmt::format("vcpkg_cache_scrub_packages_total{{result=\"unsupported\"}} {}\n", m_Unsupported.load());
+    out += fmt::format("vcpkg_cache_scrub_packages_total{{result=\"error\"}} {}\n", m_Errors.load());
+    out += "# HELP vcpkg_cache_scrub_pass_progress_ratio Portion of the bytes of the current pass already checked\n";
+    out += "# TYPE vcpkg_cache_scrub_pass_progress_ratio gauge\n";
+    const uint64_t passBytes = m_PassBytes.load();
+    out += fmt::format("vcpkg_cache_scrub_pass_progress_ratio {}\n", passBytes > 0 ? static_cast<double>(m_CheckedBytes.load()) / static_cast<double>(passBytes) : 0.0);
+}
+
+void Scrubber::ScrubThread()
+{
+    ThreadPlacement::Apply(ThreadRole::DISK);
+    SetCurrentThreadIoPriority(m_IoPriority);
+
+    while (RunPass())
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        if (m_Condition.wait_for(lock, m_Interval, [this]() { return !m_ShouldContinue; }))
+        {
+            break;
+        }
+    }
+}
+
+bool Scrubber::RunPass()
+{
+    const std::vector<Candidate> candidates = CollectCandidates();
+
+    uint64_t passBytes = 0;
+    for (const Candidate& candidate : candidates)
+    {
+        passBytes += candidate.size;
+    }
+
+    m_CheckedPackages = 0;
+    m_CheckedBytes = 0;
+    m_PassPackages = candidates.size();
+    m_PassBytes = passBytes;
+    m_PassStarted = GetUnixTime();
+    m_Scrubbing = true;
+
+    for (const Candidate& candidate : candidates)
+    {
+        if (!m_ShouldContinue)
+        {
+            m_Scrubbing = false;
+            return false;
+        }
+
+        Scrub(candidate);
+    }
+
+    m_Scrubbing = false;
+    ++m_Passes;
+    m_PassCompleted = GetUnixTime();
+    return m_ShouldContinue;
+}
+
+std::vector<Scrubber::Candidate> Scrubber::CollectCandidates() const
+{
+    std::vector<Candidate> candidates;
+
+    const auto addCandidate = [&candidates](std::string_view relativePath, uint64_t size, uint8_t tier)
+    {
+        if (relativePath.size() > 4 && relativePath.substr(relativePath.size() - 4) == ".zip")
+        {
+            if (std::optional<PackageKey> key = PackageKey::Parse(relativePath.substr(0, relativePath.size() - 4)))
+            {
+                candidates.push_back(Candidate{ std::move(key->triplet), std::move(key->name), std::move(key->version), std::move(key->sha), size, tier });
+            }
+        }
+    };
+
+    if (m_PackageIndex)
+    {
+        m_PackageIndex->ForEach([&addCandidate](std::string_view relativePath, const PackageIndex::Entry& entry)
+        {
+            addCandidate(relativePath, entry.size, entry.tier);
+        });
+        return candidates;
+    }
+
+    for (size_t tier = 0; tier < m_StorageTiers.GetTierCount(); ++tier)
+    {
+        const std::filesystem::path& directory = m_StorageTiers.GetDirectory(tier);
+
+        std::error_code error;
+        for (std::filesystem::recursive_directory_iterator it(directory, error), end; !error && it != end; it.increment(error))
+        {
+            if (it.depth() == 3 && it->is_regular_file(error))
+            {
+                // Removed since it was listed, skipped rather than ending the walk of the tier
+                std::error_code sizeError;
+                const uint64_t size = it->file_size(sizeError);
+                if (!sizeError)
+                {
+                    addCandidate(it->path().lexically_relative(directory).generic_string(), size, static_cast<uint8_t>(tier));
+                }
+            }
+        }
+    }
+
+    return candidates;
+}
+
+void Scrubber::Scrub(const Candidate& candidate)
+{
+    if (candidate.tier >= m_StorageTiers.GetTierCount())
+    {
+        return;
+    }
+
+    const std::filesystem::path path = m_StorageTiers.GetPackagePath(candidate.tier, candidate.triplet, candidate.name, candidate.version, candidate.sha);
+
+    // Migrated, replaced or deleted since the pass started
+    std::error_code error;
+    const uint64_t size = std::filesystem::file_size(path, error);
+    if (error)
+    {
+        return;
+    }
+    const std::filesystem::file_time_type modifiedTime = std::filesystem::last_write_time(path, error);
+    if (error || std::filesystem::file_time_type::clock::now() - modifiedTime < MinPackageAge)
+    {
+        return;
+    }
+
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+    {
+        return;
+    }
+
+    const std::optional<PageCache::Residency> residency = m_PageCache.GetResidency(path.string());
+
+    const ZipArchive::Verification verification = ZipArchive::Verify(size, [this, &file](uint64_t offset, char* buffer, size_t count)
+    {
+        if (!Throttle(count))
+        {
+            return false;
+        }
+
+        file.clear();
+        file.seekg(static_cast<std::streamoff>(offset));
+        file.read(buffer, static_cast<std::streamsize>(count));
+        return static_cast<size_t>(file.gcount()) == count;
+    });
+    file.close();
+
+    // Only the packages read by the scrubber, the ones already in memory are served from there
+    if (residency && residency->resident == 0)
+    {
+        m_PageCache.Evict(path.string());
+    }
+
+    ++m_CheckedPackages;
+    m_CheckedBytes += candidate.size > 0 ? candidate.size : size;
+    ++m_TotalPackages;
+    m_TotalBytes += size;
+
+    if (!m_ShouldContinue)
+    {
+        return;
+    }
+
+    switch (verification.status)
+    {
+    case ZipArchive::Status::VALID:
+        break;
+
+    case ZipArchive::Status::UNSUPPORTED:
+        ++m_Unsupported;
+        break;
+
+    case ZipArchive::Status::UNREADABLE:
+        ++m_Errors;
+        AddFinding(candidate, verification.problem, std::string(ToString(verification.status)));
+        std::cerr << "Error scrubbing " << path.string() << ": " << verification.problem << std::endl;
+        break;
+
+    case ZipArchive::Status::CORRUPT:
+    {
+        // Rewritten by an upload while it was checked
+        const uint64_t currentSize = std::filesystem::file_size(path, error);
+        if (error || currentSize != size)
+        {
+            break;
+        }
+        const std::filesystem::file_time_type currentModifiedTime = std::filesystem::last_write_time(path, error);
+        if (error || currentModifiedTime != modifiedTime)
+        {
+            break;
+        }
+
+        ++m_Corrupt;
+        Quarantine(candidate, path, verification.problem);
+        break;
+    }
+    }
+}
+
+void Scrubber::Quarantine(const Candidate& candidate, const std::filesystem::path& path, const std::string& problem)
+{
+    // Timestamped, the same package may be uploaded and corrupted again
+    std::filesystem::path destination = m_QuarantineDirectory / candidate.triplet / candidate.name / candidate.version / fmt::format("{}.{}.zip", candidate.sha, GetUnixTime());
+
+    std::error_code error;
+    std::filesystem::create_directories(destination.parent_path(), error);
+    std::filesystem::rename(path, destination, error);
+    if (error)
+    {
+        // Another file system, the package is copied before being removed. Kept in place if it cannot be copied, so
+        // nothing is lost while the quarantine directory is full or unwritable.
+        error.clear();
+        std::filesystem::copy_file(path, destination, std::filesystem::copy_options::overwrite_existing, error);
+        if (error)
+        {
+            ++m_Errors;
+            AddFinding(candidate, problem, "quarantine failed");
+            std::cerr << "Failed to quarantine corrupt package " << path.string() << " (" << problem << "), kept in place: " << error.message() << std::endl;
+
+            std::error_code removeError;
+            std::filesystem::remove(destination, removeError);
+            return;
+        }
+
+        // Already gone, moved to another tier by a migration
+        if (!std::filesystem::remove(path, error) && !error)
+        {
+            return;
+        }
+    }
+
+    if (error)
+    {
+        ++m_Errors;
+        AddFinding(candidate, problem, "removal failed");
+        std::cerr << "Failed to quarantine corrupt package " << path.string() << " (" << problem << "): " << error.message() << std::endl;
+        return;
+    }
+
+    if (m_PackageIndex)
+    {
+        m_PackageIndex->Remove(candidate.triplet, candidate.name, candidate.version, candidate.sha);
+    }
+
+    ++m_Quarantined;
+    AddFinding(candidate, problem, "quarantined");
+    std::cerr << "Corrupt package " << path.string() << " (" << problem << ") moved to " << destination.string() << std::endl;
+}
+
+void Scrubber::AddFinding(const Candidate& candidate, const std::string& problem, const std::string& action)
+{
+    std::lock_guard<std::mutex> lock(m_FindingsMutex);
+    m_Findings.push_back(Finding{ fmt::format("{}/{}/{}/{}", candidate.triplet, candidate.name, candidate.version, candidate.sha), problem, action, GetUnixTime() });
+    if (m_Findings.size() > MaxFindings)
+    {
+        m_Findings.pop_front();
+    }
+}
+
+bool Scrubber::Throttle(uint64_t bytes)
+{
+    if (m_Rate == 0)
+    {
+        return m_ShouldContinue;
+    }
+
+    // Token bucket without burst: every read pushes back the time the next one may start
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    const std::chrono::steady_clock::time_point start = std::max(m_NextRead, now);
+    m_NextRead = start + std::chrono::microseconds(bytes * 1000000 / m_Rate);
+
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_Condition.wait_until(lock, start, [this]() { return !m_ShouldContinue; });
+    return m_ShouldContinue;
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <threadutils.hpp>
+
+#include <nlohmann/json.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class PackageIndex;
+class PageCache;
+class StorageTiers;
+
+/**
+ * @brief Background integrity check of the stored packages
+ *
+ * Walks every package of every tier at a limited rate and with a low I/O priority, so it yields to the
+ * requests, and verifies its zip structure and the CRC-32 of every file it holds. A corrupt package (bit
+ * rot, or a file truncated by a crash during its upload) is moved to the quarantine directory and removed
+ * from the index, so it is reported missing and vcpkg uploads it again. Packages modified recently, or
+ * while they were checked, are left alone, they may be in the middle of an upload.
+ *
+ * A pass starts once the index is ready, and the next one the configured interval after it completes.
+ * Packages the page cache did not hold before they were checked are dropped from it afterwards.
+ */
+class Scrubber final
+{
+public:
+    /**
+     * @brief Constructor
+     * @param storageTiers Tiers holding the packages
+     * @param packageIndex Index to walk and remove corrupt packages from, or nullptr to walk the tiers on disk
+     * @param pageCache Keeps the checked packages from evicting the hot ones
+     * @param quarantineDirectory Where corrupt packages are moved
+     * @param rate Bytes read per second, 0 for unlimited
+     * @param interval Time between the end of a pass and the start of the next one
+     * @param ioPriority I/O priority of the scrubbing thread
+     */
+    Scrubber(StorageTiers& storageTiers, PackageIndex* packageIndex, const PageCache& pageCache, const std::filesystem::path& quarantineDirectory, uint64_t rate, std::chrono::seconds interval, IoPriority ioPriority);
+    ~Scrubber();
+
+    /**
+     * @brief Start the scrubbing thread, once the package index is complete
+     */
+    void Start();
+
+    /**
+     * @brief Stop the scrubbing thread, interrupting the current pass
+     */
+    void Stop();
+
+    /**
+     * @brief Get the progress of the current pass and the findings
+     */
+    nlohmann::json GetStats() const;
+
+    /**
+     * @brief Append the scrubber metrics to a Prometheus text exposition
+     */
+    void Export(std::string& out) const;
+
+private:
+    struct Candidate
+    {
+        std::string triplet;
+        std::string name;
+        std::string version;
+        std::string sha;
+        uint64_t size; // As indexed, 0 when walking the tiers on disk
+        uint8_t tier;
+    };
+
+    struct Finding
+    {
+        std::string package;
+        std::string problem;
+        std::string action;
+        int64_t time; // Seconds since epoch
+    };
+
+    void ScrubThread();
+
+    /**
+     * @brief Check every package once
+     * @return false if the thread is stopping
+     */
+    bool RunPass();
+
+    std::vector<Candidate> CollectCandidates() const;
+
+    void Scrub(const Candidate& candidate);
+
+    /**
+     * @brief Move a corrupt package out of its tier and drop it from the index
+     */
+    void Quarantine(const Candidate& candidate, const std::filesystem::path& path, const std::string& problem);
+
+    void AddFinding(const Candidate& candidate, const std::string& problem, const std::string& action);
+
+    /**
+     * @brief Wait until reading the given amount of bytes fits in the rate
+     * @return false if the thread is stopping
+     */
+    bool Throttle(uint64_t bytes);
+
+private:
+    StorageTiers& m_StorageTiers;
+    PackageIndex* m_PackageIndex;
+    const PageCache& m_PageCache;
+    const std::filesystem::path m_QuarantineDirectory;
+    const uint64_t m_Rate;
+    const std::chrono::seconds m_Interval;
+    const IoPriority m_IoPriority;
+
+    std::chrono::steady_clock::time_point m_NextRead;
+
+    std::atomic<bool> m_Scrubbing;
+    std::atomic<uint64_t> m_Passes;
+    std::atomic<int64_t> m_PassStarted; // Seconds since epoch, 0 before the first pass
+    std::atomic<int64_t> m_PassCompleted; // Seconds since epoch, 0 before the first complete pass
+    std::atomic<uint64_t> m_PassPackages;
+    std::atomic<uint64_t> m_PassBytes;
+    std::atomic<uint64_t> m_CheckedPackages; // In the current pass
+    std::atomic<uint64_t> m_CheckedBytes; // In the current pass
+    std::atomic<uint64_t> m_TotalPackages;
+    std::atomic<uint64_t> m_TotalBytes;
+    std::atomic<uint64_t> m_Corrupt;
+    std::atomic<uint64_t> m_Quarantined;
+    std::atomic<uint64_t> m_Unsupported;
+    std::atomic<uint64_t> m_Errors;
+
+    std::deque<Finding> m_Findings;
+    mutable std::mutex m_FindingsMutex;
+
+    std::atomic<bool> m_ShouldContinue;
+    std::mutex m_Mutex;
+    std::condition_variable m_Condition;
+    std::thread m_Thread;
+};
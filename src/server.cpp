@@ -1,132 +1,748 @@
 #include <server.hpp>
 
+#include <accesslog.hpp>
+#include <admissioncontroller.hpp>
+#include <coaccessprefetcher.hpp>
+#include <conditionalrequest.hpp>
+#include <downloadscheduler.hpp>
 #include <filters/authfilter.hpp>
+#include <instancelock.hpp>
+#include <memorybudget.hpp>
+#include <metrics.hpp>
+#include <packageindex.hpp>
+#include <packagerouter.hpp>
+#include <packagestream.hpp>
+#include <pagecache.hpp>
+#include <popularity.hpp>
 #include <policyengine.hpp>
+#include <requesttimer.hpp>
+#include <responsecache.hpp>
+#include <scrubber.hpp>
+#include <storagetiers.hpp>
+#include <threadutils.hpp>
 #include <version.hpp>
+#include <ziparchive.hpp>
 
 #include <drogon/HttpResponse.h>
 #include <fmt/core.h>
 #include <fmt/chrono.h>
 
 #include <algorithm>
+#include <charconv>
+#include <chrono>
 #include <fstream>
 #include <iomanip>
+#include <iterator>
+#include <iostream>
 #include <sstream>
 
-BinaryCacheServer::BinaryCacheServer(const std::string& cacheDir, const std::string& persistenceFile)
-    : m_CacheDir(cacheDir) 
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <signal.h>
+#include <unistd.h>
+#endif // _WIN32
+
+// Largest number of packages accepted by a single batch check
+static constexpr size_t MaxBatchSize = 100000;
+
+// Packages probed on the tiers by one task of the probe pool, before the package index is ready
+static constexpr size_t ProbeChunkSize = 256;
+
+// Packages never change for a given sha, so caches can keep them as long as they are allowed to (one year)
+static constexpr int64_t PackageMaxAge = 365 * 24 * 60 * 60;
+
+// Delay between two attempts to take the instance lock from the previous instance
+static constexpr std::chrono::milliseconds TakeOverInterval{ 100 };
+
+// Seconds a client should wait before changing an API key again, while the previous instance owns the persistence file
+static constexpr int64_t KeysRetryAfter = 5;
+
+// Age after which the totals reported by /status without a package index are counted again
+static constexpr std::chrono::seconds CacheTotalsMaxAge{ 60 };
+
+// Process to signal to stop this instance, written to the instance lock
+static int64_t GetInstanceOwner(const SharedState* sharedState)
+{
+#ifdef _WIN32
+    return _getpid();
+#else
+    // The supervisor stops the workers in order
+    return sharedState ? getppid() : getpid();
+#endif // _WIN32
+}
+
+// A key saved now would be overwritten by the previous instance when it saves the persistence file on exit
+static drogon::HttpResponsePtr CreateKeysUnavailableResponse()
+{
+    const nlohmann::json error
+    {
+        { "error", "Service unavailable" },
+        { "message", "API keys cannot be changed until the previous instance exited" }
+    };
+
+    drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
+    resp->setStatusCode(drogon::k503ServiceUnavailable);
+    resp->setBody(nlohmann::to_string(error));
+    resp->setContentTypeCode(drogon::CT_APPLICATION_JSON);
+    resp->addHeader("Retry-After", std::to_string(KeysRetryAfter));
+    return resp;
+}
+
+// Every worker process writes and rotates its own access log, they would otherwise rotate each other's files
+static std::filesystem::path GetAccessLogPath(const std::filesystem::path& path, const SharedState* sharedState)
+{
+    if (!sharedState)
+    {
+        return path;
+    }
+
+    return path.parent_path() / fmt::format("{}.worker{}{}", path.stem().string(), SharedState::GetWorkerId(), path.extension().string());
+}
+
+struct ImportedPackage
+{
+    PackageKey key;
+    uint64_t size;
+    int64_t modifiedTime;
+};
+
+template<typename T>
+static bool ParseInteger(std::string_view str, T& value)
 {
-    // Create cache directory if it doesn't exist
-    if (!std::filesystem::exists(m_CacheDir)) 
+    const std::from_chars_result result = std::from_chars(str.data(), str.data() + str.size(), value);
+    return !str.empty() && result.ec == std::errc() && result.ptr == str.data() + str.size();
+}
+
+/**
+ * @brief Parse the packages sent by the import command, one "triplet/name/version/sha size modifiedTime" per line
+ * @throws std::runtime_error if a line is malformed
+ */
+static std::vector<ImportedPackage> ParseImportedPackages(std::string_view body)
+{
+    std::vector<ImportedPackage> packages;
+    while (!body.empty())
     {
-        std::filesystem::create_directories(m_CacheDir);
+        const size_t end = body.find('\n');
+        const std::string_view line = body.substr(0, end);
+        body.remove_prefix(end == std::string_view::npos ? body.size() : end + 1);
+        if (line.empty())
+        {
+            continue;
+        }
+
+        const size_t sizeStart = line.find(' ');
+        const size_t timeStart = sizeStart == std::string_view::npos ? std::string_view::npos : line.find(' ', sizeStart + 1);
+
+        if (timeStart == std::string_view::npos)
+        {
+            throw std::runtime_error(fmt::format("Invalid imported package \"{}\".", line));
+        }
+
+        const std::optional<PackageKey> key = PackageKey::Parse(line.substr(0, sizeStart));
+        ImportedPackage package{};
+        if (!key.has_value()
+            || !ParseInteger(line.substr(sizeStart + 1, timeStart - sizeStart - 1), package.size)
+            || !ParseInteger(line.substr(timeStart + 1), package.modifiedTime))
+        {
+            throw std::runtime_error(fmt::format("Invalid imported package \"{}\".", line));
+        }
+
+        package.key = key.value();
+        packages.push_back(std::move(package));
     }
 
+    return packages;
+}
+
+/**
+ * @brief Response of a batch check, in the format of its request
+ */
+static drogon::HttpResponsePtr CreateCheckResponse(PackageListFormat format, const std::vector<PackageKey>& keys, const std::vector<std::optional<PackageIndex::Entry>>& entries)
+{
+    drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
+    resp->setStatusCode(drogon::k200OK);
+
+    if (format == PackageListFormat::JSON)
+    {
+        size_t presentCount = 0;
+        nlohmann::json packages = nlohmann::json::array();
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            nlohmann::json package
+            {
+                { "triplet", keys[i].triplet },
+                { "name", keys[i].name },
+                { "version", keys[i].version },
+                { "sha", keys[i].sha },
+                { "present", entries[i].has_value() },
+                { "size", entries[i].has_value() ? entries[i]->size : 0 }
+            };
+
+            if (!keys[i].IsValid())
+            {
+                package["error"] = "Invalid package key";
+            }
+
+            presentCount += entries[i].has_value() ? 1 : 0;
+            packages.push_back(std::move(package));
+        }
+
+        const nlohmann::json response
+        {
+            { "packages", std::move(packages) },
+            { "present", presentCount },
+            { "missing", keys.size() - presentCount }
+        };
+
+        resp->setBody(nlohmann::to_string(response));
+        resp->setContentTypeCode(drogon::CT_APPLICATION_JSON);
+    }
+    else
+    {
+        std::string body;
+        body.reserve(keys.size() * 128);
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            const int status = !keys[i].IsValid() ? 400 : entries[i].has_value() ? 200 : 404;
+            body += fmt::format("{} {} {}\n", status, entries[i].has_value() ? entries[i]->size : 0, keys[i].ToString());
+        }
+
+        resp->setBody(std::move(body));
+        resp->setContentTypeCode(drogon::CT_TEXT_PLAIN);
+    }
+
+    return resp;
+}
+
+static void PrintScanProgress(const CacheScanner::Progress& progress)
+{
+    std::cout << "  Scanned " << progress.directories << " directories, " << progress.packages << " packages ("
+              << progress.bytes / (1024 * 1024) << " MB) in " << progress.elapsed.count() / 1000.0 << "s";
+    if (progress.errors > 0)
+    {
+        std::cout << ", " << progress.errors << " errors";
+    }
+    std::cout << std::endl;
+}
+
+BinaryCacheServer::BinaryCacheServer(const Options& options)
+    : m_IndexReady(false)
+    , m_SharedState(SharedState::Get())
+    , m_ShuttingDown(false)
+    , m_IndexOpen(false)
+    , m_Scanner(options.scanner.threads, IoPriorityFromString(options.scanner.ioPriority).value_or(IoPriority::NORMAL), std::chrono::seconds(options.scanner.progressInterval))
+    , m_CacheTotalsScanning(false)
+{
+    m_ProbeQueue = std::make_unique<trantor::ConcurrentTaskQueue>(m_Scanner.GetThreadCount(), "probe");
+
     m_PolicyEngine = std::make_shared<PolicyEngine>(m_PersistenceInfo);
+    m_Metrics = std::make_shared<Metrics>();
+    m_CacheControl = fmt::format("{}, max-age={}, immutable", options.permissions.requireAuthForRead ? "private" : "public", PackageMaxAge);
+    m_RequestTimer = std::make_shared<RequestTimer>(options.timing.enabled, std::chrono::milliseconds(options.timing.slowRequestThreshold), options.timing.slowRequestLogSize);
+
+    if (!options.accessLog.path.empty())
+    {
+        m_AccessLog = std::make_shared<AccessLog>(GetAccessLogPath(options.accessLog.path, m_SharedState), options.accessLog.maxFileSize, options.accessLog.maxFiles, options.accessLog.bufferSize, std::chrono::milliseconds(options.accessLog.flushInterval));
+    }
+
+    if (options.admission.enabled)
+    {
+        const auto toLimits = [](const Options::AdmissionProperties::ClassProperties& properties)
+        {
+            return AdmissionController::ClassLimits{ properties.concurrency, properties.queueSize, std::chrono::milliseconds(properties.maxQueueTime) };
+        };
+        m_AdmissionController = std::make_shared<AdmissionController>(
+            std::array<AdmissionController::ClassLimits, static_cast<size_t>(RequestClass::COUNT)>{ toLimits(options.admission.head), toLimits(options.admission.get), toLimits(options.admission.put), toLimits(options.admission.admin) },
+            options.admission.maxInFlight, std::chrono::seconds(options.admission.retryAfter));
+    }
+
+    if (options.web.memoryBudget > 0)
+    {
+        m_MemoryBudget = std::make_shared<MemoryBudget>(options.web.memoryBudget, options.web.maxMemoryBodySize, std::chrono::seconds(options.admission.retryAfter));
+    }
 
-    m_PersistenceInfo.SetPersistencePath(persistenceFile);
+    m_PersistenceInfo.SetPersistencePath(options.persistenceFile);
     m_PersistenceInfo.Load();
 
+    if (m_SharedState)
+    {
+        m_PersistenceInfo.Share(m_SharedState);
+        m_PersistenceInfo.SetApiKeysChangedCallback([policyEngine = m_PolicyEngine]()
+        {
+            policyEngine->Load();
+        });
+    }
+
     m_PolicyEngine->Load();
+
+    if (!options.cache.indexFile.empty())
+    {
+        m_PackageIndex = std::make_unique<PackageIndex>(options.cache.indexFile, m_SharedState);
+    }
+
+    // Creates the directory of every tier
+    m_StorageTiers = std::make_unique<StorageTiers>(options, m_PackageIndex.get());
+
+    m_PageCache = std::make_unique<PageCache>(options.pageCache.dropUploads, options.pageCache.readaheadThreshold, options.pageCache.readaheadSize, options.pageCache.directIoThreshold, options.pageCache.sampleRate);
+    m_PrefetchSize = options.pageCache.prefetchSize;
+
+    // Without a cap, every download keeps being sent with sendfile(), with its Content-Length and Range support
+    if (options.bandwidth.enabled && options.bandwidth.egressRate > 0)
+    {
+        // The workers each schedule their own downloads, so each one gets its share of the rate
+        uint64_t egressRate = options.bandwidth.egressRate;
+        if (m_SharedState)
+        {
+            egressRate = std::max<uint64_t>(egressRate / std::max<uint32_t>(m_SharedState->GetWorkerCount(), 1), 1);
+        }
+        m_DownloadScheduler = std::make_unique<DownloadScheduler>(egressRate, options.bandwidth.quantum, options.bandwidth.threshold);
+    }
+
+    if (options.prefetch.enabled)
+    {
+        const CoAccessPrefetcher::Settings settings
+        {
+            std::chrono::seconds(options.prefetch.window),
+            std::chrono::seconds(options.prefetch.horizon),
+            options.prefetch.maxPackages,
+            options.prefetch.maxSuccessors,
+            options.prefetch.minSupport,
+            options.prefetch.minConfidence,
+            options.prefetch.maxBytes,
+            options.prefetch.bufferSize,
+            std::chrono::milliseconds(options.prefetch.flushInterval)
+        };
+        m_Prefetcher = std::make_unique<CoAccessPrefetcher>(settings, *m_PageCache, [this](std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha) -> std::optional<CoAccessPrefetcher::Target>
+        {
+            const std::optional<PackageIndex::Entry> entry = FindPackage(triplet, name, version, sha);
+            if (!entry.has_value() || entry->tier >= m_StorageTiers->GetTierCount())
+            {
+                return std::nullopt;
+            }
+            return CoAccessPrefetcher::Target{ m_StorageTiers->GetPackagePath(entry->tier, triplet, name, version, sha).string(), entry->size };
+        });
+    }
+
+    if (options.popularity.enabled)
+    {
+        std::vector<std::chrono::seconds> windows;
+        for (uint32_t window : options.popularity.windows)
+        {
+            windows.emplace_back(window);
+        }
+        m_Popularity = std::make_unique<PopularityTracker>(windows, options.popularity.capacity, options.popularity.sketchWidth, options.popularity.bufferSize, std::chrono::milliseconds(options.popularity.flushInterval));
+    }
+
+    if (m_SharedState && !m_SharedState->IsPrimary())
+    {
+        // The primary worker owns the instance lock, the index and the persistence file
+        if (m_PackageIndex)
+        {
+            m_IndexThread = std::thread(&BinaryCacheServer::AttachIndex, this);
+        }
+        return;
+    }
+
+    // Started once the index is ready, by the instance which owns it
+    if (options.scrub.enabled)
+    {
+        m_Scrubber = std::make_unique<Scrubber>(*m_StorageTiers, m_PackageIndex.get(), *m_PageCache, options.scrub.quarantine, options.scrub.rate,
+                                                std::chrono::seconds(options.scrub.interval), IoPriorityFromString(options.scrub.ioPriority).value_or(IoPriority::IDLE));
+    }
+
+    m_InstanceLock = std::make_unique<InstanceLock>(options.lockFile);
+    if (m_InstanceLock->TryLock(GetInstanceOwner(m_SharedState)))
+    {
+        m_PersistenceInfo.SetWritable(true);
+        if (m_PackageIndex)
+        {
+            OpenIndex();
+        }
+        else if (m_Scrubber)
+        {
+            m_Scrubber->Start();
+        }
+    }
+    else if (options.restart)
+    {
+        // The previous instance saves both files on exit, uploads are served from the file system meanwhile
+        m_PersistenceInfo.SetWritable(false);
+        m_IndexThread = std::thread(&BinaryCacheServer::TakeOver, this);
+    }
+    else
+    {
+        throw std::runtime_error(fmt::format("Another instance holds \"{}\", start with --restart to take over from it", options.lockFile));
+    }
+}
+
+BinaryCacheServer::~BinaryCacheServer()
+{
+    m_ShuttingDown = true;
+
+    // Look packages up in the index closed below
+    m_ProbeQueue.reset();
+    m_Prefetcher.reset();
+    if (m_Scrubber)
+    {
+        m_Scrubber->Stop();
+    }
+
+    m_StorageTiers->Stop();
+    m_Scanner.Stop();
+    if (m_IndexThread.joinable())
+    {
+        m_IndexThread.join();
+    }
+
+    std::thread cacheTotalsThread;
+    {
+        std::lock_guard<std::mutex> lock(m_CacheTotalsMutex);
+        cacheTotalsThread = std::move(m_CacheTotalsThread);
+    }
+    if (cacheTotalsThread.joinable())
+    {
+        cacheTotalsThread.join();
+    }
+
+    if (m_PackageIndex)
+    {
+        // An index that was not fully rebuilt must be rebuilt again on the next start
+        m_PackageIndex->Close(m_IndexReady);
+    }
+
+    // Saved before the instance lock is released, a new instance taking over loads it right away
+    m_PersistenceInfo.Flush();
 }
 
 void BinaryCacheServer::CheckPackage(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback, const std::string& triplet, const std::string& name, const std::string& version, const std::string& sha) const 
 {
-    m_PersistenceInfo.IncreaseTotalRequests();
+    // Validate SHA
+    if (!IsValidHash(sha)) 
+    {
+        m_PersistenceInfo.IncreaseTotalRequests();
+        callback(ResponseCache::Get(drogon::k400BadRequest, "Invalid SHA format"));
+        return;
+    }
+
+    HeadPackage(req, std::move(callback), triplet, name, version, sha);
+}
 
+void BinaryCacheServer::GetPackage(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback, const std::string& triplet, const std::string& name, const std::string& version, const std::string& sha) const 
+{
     // Validate SHA
     if (!IsValidHash(sha)) 
     {
-        drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
-        resp->setStatusCode(drogon::k400BadRequest);
-        resp->setBody("Invalid SHA format");
+        m_PersistenceInfo.IncreaseTotalRequests();
+        callback(ResponseCache::Get(drogon::k400BadRequest, "Invalid SHA format"));
+        return;
+    }
+
+    DownloadPackage(req, std::move(callback), triplet, name, version, sha);
+}
+
+void BinaryCacheServer::PutPackage(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback, const std::string& triplet, const std::string& name, const std::string& version, const std::string& sha) 
+{
+    if (!IsValidHash(sha)) 
+    {
+        m_PersistenceInfo.IncreaseTotalRequests();
+        callback(ResponseCache::Get(drogon::k400BadRequest, "Invalid SHA format"));
+        return;
+    }
+
+    UploadPackage(req, std::move(callback), triplet, name, version, sha);
+}
+
+bool BinaryCacheServer::RoutePackageRequest(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>& callback)
+{
+    const drogon::HttpMethod method = req->getMethod();
+    if ((method != drogon::Head && method != drogon::Get && method != drogon::Put) || !m_ApiKeyFilter)
+    {
+        return false;
+    }
+
+    // Views of the request path, valid as long as the request
+    const std::optional<PackageRoute> route = PackageRouter::Parse(req->getPath());
+    if (!route.has_value())
+    {
+        return false;
+    }
+
+    if (drogon::HttpResponsePtr resp = m_ApiKeyFilter->Authorize(req))
+    {
         callback(resp);
+        return true;
+    }
+
+    if (route->IsShaOnly())
+    {
+        RouteShaOnlyRequest(req, std::move(callback), route->sha);
+    }
+    else if (method == drogon::Head)
+    {
+        HeadPackage(req, std::move(callback), route->triplet, route->name, route->version, route->sha);
+    }
+    else if (method == drogon::Get)
+    {
+        DownloadPackage(req, std::move(callback), route->triplet, route->name, route->version, route->sha);
+    }
+    else
+    {
+        UploadPackage(req, std::move(callback), route->triplet, route->name, route->version, route->sha);
+    }
+
+    return true;
+}
+
+void BinaryCacheServer::RouteShaOnlyRequest(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback, std::string_view sha)
+{
+    if (req->getMethod() == drogon::Put)
+    {
+        // vcpkg stores the package paragraph in the CONTROL file at the root of the archive
+        const std::optional<std::string> control = ZipArchive(req->getBody()).ReadFile("CONTROL");
+        const std::optional<PackageKey> key = control.has_value() ? PackageKey::FromControlFile(control.value(), sha) : std::nullopt;
+        if (!key.has_value())
+        {
+            m_PersistenceInfo.IncreaseTotalRequests();
+            callback(ResponseCache::Get(drogon::k400BadRequest, "Package archive has no valid CONTROL file"));
+            return;
+        }
+
+        UploadPackage(req, std::move(callback), key->triplet, key->name, key->version, key->sha);
+        return;
+    }
+
+    // Without the package index, finding a sha would mean walking every tier
+    if (!m_PackageIndex)
+    {
+        m_PersistenceInfo.IncreaseTotalRequests();
+        callback(ResponseCache::Get(drogon::k404NotFound, "Package not found"));
+        return;
+    }
+
+    if (!IsReady())
+    {
+        m_PersistenceInfo.IncreaseTotalRequests();
+        callback(ResponseCache::Get(drogon::k503ServiceUnavailable, "Package index is not ready"));
+        return;
+    }
+
+    // Reused by every request of the thread, turned into "/triplet/name/version/sha" so it parses as a package URL
+    thread_local std::string packagePath;
+    const std::optional<PackageIndex::Entry> entry = m_PackageIndex->FindBySha(sha, packagePath);
+    m_RequestTimer->Mark(req, RequestPhase::LOOKUP);
+
+    if (!entry.has_value())
+    {
+        m_PersistenceInfo.IncreaseTotalRequests();
+        callback(ResponseCache::Get(drogon::k404NotFound, "Package not found"));
         return;
     }
 
+    packagePath.insert(packagePath.begin(), '/');
+    packagePath.resize(packagePath.size() - 4);
+
+    const std::optional<PackageRoute> route = PackageRouter::Parse(packagePath);
+    if (!route.has_value() || route->IsShaOnly())
+    {
+        m_PersistenceInfo.IncreaseTotalRequests();
+        callback(ResponseCache::Get(drogon::k500InternalServerError, "Invalid package path in the index"));
+        return;
+    }
+
+    if (req->getMethod() == drogon::Head)
+    {
+        HeadPackage(req, std::move(callback), route->triplet, route->name, route->version, route->sha);
+    }
+    else
+    {
+        DownloadPackage(req, std::move(callback), route->triplet, route->name, route->version, route->sha);
+    }
+}
+
+void BinaryCacheServer::HeadPackage(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback, std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha) const 
+{
+    m_PersistenceInfo.IncreaseTotalRequests();
+
     // Check if package exists
-    const std::filesystem::path packagePath = GetPackagePath(triplet, name, version, sha);
-    if (std::filesystem::exists(packagePath)) 
+    const std::optional<PackageIndex::Entry> entry = FindPackage(triplet, name, version, sha);
+    m_RequestTimer->Mark(req, RequestPhase::LOOKUP);
+
+    if (m_Popularity)
     {
+        m_Popularity->Record(req, triplet, name, version, 0);
+    }
+
+    if (entry.has_value()) 
+    {
+        if (m_Prefetcher)
+        {
+            m_Prefetcher->Record(req, triplet, name, version, sha);
+        }
+
+        const std::string etag = ConditionalRequest::FormatETag(sha, entry.value());
+        if (ConditionalRequest::IsNotModified(req, etag, entry->modifiedTime))
+        {
+            callback(ConditionalRequest::CreateNotModifiedResponse(etag, entry->modifiedTime, m_CacheControl));
+            return;
+        }
+
         drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
         resp->setStatusCode(drogon::k200OK);
         
         // Add content length header
-        const uint64_t fileSize = std::filesystem::file_size(packagePath);
-        resp->addHeader("Content-Length", std::to_string(fileSize));
-        resp->addHeader("Content-Type", "application/zip");
+        resp->addHeader("Content-Length", std::to_string(entry->size));
+        resp->setContentTypeCode(drogon::CT_APPLICATION_ZIP);
+        ConditionalRequest::AddValidators(resp, etag, entry->modifiedTime, m_CacheControl);
         
         callback(resp);
     } 
     else 
     {
-        drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
-        resp->setStatusCode(drogon::k404NotFound);
-        callback(resp);
+        callback(ResponseCache::Get(drogon::k404NotFound, ""));
     }
 }
 
-void BinaryCacheServer::GetPackage(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback, const std::string& triplet, const std::string& name, const std::string& version, const std::string& sha) const 
+void BinaryCacheServer::DownloadPackage(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback, std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha) const 
 {
     m_PersistenceInfo.IncreaseTotalRequests();
     m_PersistenceInfo.IncreaseDownloads();
 
-    // Validate SHA
-    if (!IsValidHash(sha)) 
+    std::optional<PackageIndex::Entry> entry = FindPackage(triplet, name, version, sha);
+    m_RequestTimer->Mark(req, RequestPhase::LOOKUP);
+
+    if (m_Popularity)
     {
-        drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
-        resp->setStatusCode(drogon::k400BadRequest);
-        resp->setBody("Invalid SHA format");
-        callback(resp);
+        m_Popularity->Record(req, triplet, name, version, entry.has_value() ? entry->size : 0);
+    }
+
+    if (!entry.has_value()) 
+    {
+        callback(ResponseCache::Get(drogon::k404NotFound, "Package not found"));
         return;
     }
 
-    // Get package path
-    const std::filesystem::path packagePath = GetPackagePath(triplet, name, version, sha);
-    
-    if (!std::filesystem::exists(packagePath)) 
+    if (m_Prefetcher)
     {
-        drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
-        resp->setStatusCode(drogon::k404NotFound);
-        resp->setBody("Package not found");
-        callback(resp);
+        m_Prefetcher->Record(req, triplet, name, version, sha);
+    }
+
+    // Revalidations are answered before the file is opened
+    std::string etag = ConditionalRequest::FormatETag(sha, entry.value());
+    if (ConditionalRequest::IsNotModified(req, etag, entry->modifiedTime))
+    {
+        callback(ConditionalRequest::CreateNotModifiedResponse(etag, entry->modifiedTime, m_CacheControl));
         return;
     }
 
-    // Read file
     try 
     {
-        std::ifstream file(packagePath, std::ios::binary | std::ios::ate);
-        if (!file.is_open()) 
+        // Reused by every request of the thread, so building the paths does not allocate once they are long enough
+        thread_local std::string packagePath;
+        thread_local std::string attachmentName;
+
+        attachmentName.clear();
+        fmt::format_to(std::back_inserter(attachmentName), "{}-{}-{}.zip", name, version, triplet);
+
+        const std::chrono::steady_clock::time_point openStart = std::chrono::steady_clock::now();
+        m_StorageTiers->GetPackagePath(packagePath, entry->tier, triplet, name, version, sha);
+
+        // Measured before the download brings the package in
+        if (m_PageCache->ShouldSample())
         {
-            drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
-            resp->setStatusCode(drogon::k500InternalServerError);
-            resp->setBody("Failed to open package file");
+            if (const std::optional<PageCache::Residency> residency = m_PageCache->GetResidency(packagePath))
+            {
+                m_Metrics->ObservePageCache(entry->lastAccess != 0, residency->size, residency->resident);
+            }
+        }
+
+        // Packages above the O_DIRECT threshold are streamed without going through the page cache, when their
+        // buffer fits in the memory budget. Otherwise sendfile() needs no buffer at all
+        std::shared_ptr<MemoryBudget::Reservation> reservation;
+        std::function<size_t(char*, size_t)> reader;
+        if (m_PageCache->IsDirectIo(entry->size) && (!m_MemoryBudget || (reservation = m_MemoryBudget->TryReserve(PageCache::DirectIoBufferSize))))
+        {
+            reader = m_PageCache->OpenDirectReader(packagePath);
+        }
+
+        // Large packages are paced by the download scheduler, which needs a reader rather than sendfile()
+        const bool scheduled = m_DownloadScheduler && m_DownloadScheduler->IsScheduled(entry->size);
+        if (scheduled && !reader)
+        {
+            m_PageCache->OnRead(packagePath, entry->size);
+            reader = m_PageCache->OpenReader(packagePath);
+        }
+
+        if (reader)
+        {
+            m_Metrics->ObserveDiskOperation(DiskOperation::READ, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - openStart));
+            m_RequestTimer->Mark(req, RequestPhase::OPEN);
+
+            // The reservation is released with the reader, once the stream is done
+            std::function<size_t(char*, size_t)> body = [reader = std::move(reader), reservation = std::move(reservation)](char* buffer, size_t length)
+            {
+                return reader(buffer, length);
+            };
+
+            drogon::HttpResponsePtr resp;
+            if (scheduled)
+            {
+                resp = m_DownloadScheduler->Schedule(req, std::move(body), entry->size);
+                resp->setContentTypeCode(drogon::CT_APPLICATION_ZIP);
+                resp->addHeader("Content-Disposition", fmt::format("attachment; filename=\"{}\"", attachmentName));
+            }
+            else
+            {
+                resp = drogon::HttpResponse::newStreamResponse(body, attachmentName, drogon::CT_APPLICATION_ZIP, "", req);
+                if (m_DownloadScheduler)
+                {
+                    m_DownloadScheduler->Charge(entry->size);
+                }
+            }
+            ConditionalRequest::AddValidators(resp, etag, entry->modifiedTime, m_CacheControl);
+            m_Metrics->AddBytesSent(MetricsRoute::GET, entry->size);
             callback(resp);
+
+            m_StorageTiers->OnRead(triplet, name, version, sha, entry.value());
             return;
         }
 
-        std::streamsize size = file.tellg();
-        file.seekg(0, std::ios::beg);
+        // The file is sent with sendfile() after the headers, rather than copied into the response body
+        m_PageCache->OnRead(packagePath, entry->size);
+        drogon::HttpResponsePtr resp = drogon::HttpResponse::newFileResponse(packagePath, attachmentName, drogon::CT_APPLICATION_ZIP, "", req);
+        if (resp->statusCode() == drogon::k404NotFound)
+        {
+            // The package may have been migrated to another tier since it was looked up
+            entry = FindPackage(triplet, name, version, sha);
+            if (entry.has_value())
+            {
+                m_StorageTiers->GetPackagePath(packagePath, entry->tier, triplet, name, version, sha);
+                resp = drogon::HttpResponse::newFileResponse(packagePath, attachmentName, drogon::CT_APPLICATION_ZIP, "", req);
+            }
+        }
+        m_Metrics->ObserveDiskOperation(DiskOperation::READ, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - openStart));
+        m_RequestTimer->Mark(req, RequestPhase::OPEN);
 
-        std::vector<char> buffer(size);
-        if (!file.read(buffer.data(), size)) 
+        if (!entry.has_value() || resp->statusCode() == drogon::k404NotFound) 
         {
-            drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
-            resp->setStatusCode(drogon::k500InternalServerError);
-            resp->setBody("Failed to read package file");
-            callback(resp);
+            callback(ResponseCache::Get(drogon::k500InternalServerError, "Failed to open package file"));
             return;
         }
 
-        // Create response with file content
-        drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
-        resp->setStatusCode(drogon::k200OK);
-        resp->setBody(std::string(buffer.begin(), buffer.end()));
-        resp->addHeader("Content-Type", "application/zip");
-        resp->addHeader("Content-Disposition", "attachment; filename=\"" + name + "-" + version + "-" + triplet + ".zip\"");
-        
+        // The entry read again after a migration has the same content, but the index may have been rebuilt since
+        etag = ConditionalRequest::FormatETag(sha, entry.value());
+        ConditionalRequest::AddValidators(resp, etag, entry->modifiedTime, m_CacheControl);
+
+        // Sent right away, but it still takes its share of the egress rate
+        if (m_DownloadScheduler)
+        {
+            m_DownloadScheduler->Charge(entry->size);
+        }
+
+        Metrics::SetSendfileSize(req, entry->size);
         callback(resp);
+
+        m_StorageTiers->OnRead(triplet, name, version, sha, entry.value());
     } 
     catch (const std::exception& e) 
     {
@@ -137,31 +753,28 @@ void BinaryCacheServer::GetPackage(const drogon::HttpRequestPtr& req, std::funct
     }
 }
 
-void BinaryCacheServer::PutPackage(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback, const std::string& triplet, const std::string& name, const std::string& version, const std::string& sha) 
+void BinaryCacheServer::UploadPackage(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback, std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha) 
 {
     m_PersistenceInfo.IncreaseTotalRequests();
     m_PersistenceInfo.IncreaseUploads();
 
-    if (!IsValidHash(sha)) 
+    const std::string_view body = req->getBody();
+    if (body.empty()) 
     {
-        drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
-        resp->setStatusCode(drogon::k400BadRequest);
-        resp->setBody("Invalid SHA format");
-        callback(resp);
+        callback(ResponseCache::Get(drogon::k400BadRequest, "Empty request body"));
         return;
     }
 
-    const std::string_view body = req->getBody();
-    if (body.empty()) 
+    if (m_Popularity)
     {
-        drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
-        resp->setStatusCode(drogon::k400BadRequest);
-        resp->setBody("Empty request body");
-        callback(resp);
-        return;
+        m_Popularity->Record(req, triplet, name, version, body.size());
     }
 
     const std::filesystem::path packagePath = GetPackagePath(triplet, name, version, sha);
+
+    // Uploads always go to the fastest tier, a copy on a slower tier becomes stale
+    const std::optional<PackageIndex::Entry> previous = FindPackage(triplet, name, version, sha);
+    m_RequestTimer->Mark(req, RequestPhase::LOOKUP);
     
     try 
     {
@@ -172,18 +785,33 @@ void BinaryCacheServer::PutPackage(const drogon::HttpRequestPtr& req, std::funct
             std::filesystem::create_directories(parentPath);
         }
 
-        std::ofstream file(packagePath, std::ios::binary);
-        if (!file.is_open()) 
+        m_RequestTimer->Mark(req, RequestPhase::OPEN);
+
+        // Creates the file and writes it, then drops it from the page cache if the policy says so
+        const std::chrono::steady_clock::time_point writeStart = std::chrono::steady_clock::now();
+        if (!m_PageCache->WritePackage(packagePath, body))
         {
             drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
             resp->setStatusCode(drogon::k500InternalServerError);
-            resp->setBody("Failed to create package file");
+            resp->setBody("Failed to write package file");
             callback(resp);
             return;
         }
+        m_Metrics->ObserveDiskOperation(DiskOperation::WRITE, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - writeStart));
+        m_RequestTimer->Mark(req, RequestPhase::WRITE);
+
+        if (m_PackageIndex)
+        {
+            // The time of the file, rather than the current time, so the ETag is the same after the index is rebuilt from disk
+            std::error_code error;
+            const std::filesystem::file_time_type modifiedTime = std::filesystem::last_write_time(packagePath, error);
+            const int64_t unixTime = error ? std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count()
+                                           : std::chrono::duration_cast<std::chrono::seconds>(std::chrono::file_clock::to_sys(modifiedTime).time_since_epoch()).count();
+            IndexPackage(triplet, name, version, sha, body.size(), unixTime);
+        }
 
-        file.write(body.data(), body.size());
-        file.close();
+        m_StorageTiers->OnWrite(triplet, name, version, sha, previous.has_value() ? std::optional<uint8_t>(previous->tier) : std::nullopt);
+        m_RequestTimer->Mark(req, RequestPhase::COMMIT);
 
         // Success response
         drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
@@ -191,10 +819,10 @@ void BinaryCacheServer::PutPackage(const drogon::HttpRequestPtr& req, std::funct
         
         nlohmann::json json;
         json["status"] = "success";
-        json["triplet"] = triplet;
-        json["name"] = name;
-        json["version"] = version;
-        json["sha"] = sha;
+        json["triplet"] = std::string(triplet);
+        json["name"] = std::string(name);
+        json["version"] = std::string(version);
+        json["sha"] = std::string(sha);
         json["size"] = body.size();
         json["message"] = "Package uploaded successfully";
         
@@ -212,46 +840,448 @@ void BinaryCacheServer::PutPackage(const drogon::HttpRequestPtr& req, std::funct
     }
 }
 
-void BinaryCacheServer::GetStatus(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback) const 
+void BinaryCacheServer::CheckPackages(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback) const
+{
+    m_PersistenceInfo.IncreaseTotalRequests();
+
+    const PackageListFormat format = PackageListFormatFromContentType(req->getHeader("Content-Type"));
+
+    std::vector<PackageKey> keys;
+    try
+    {
+        keys = ParsePackageList(req->getBody(), format);
+    }
+    catch (const std::exception& e)
+    {
+        const nlohmann::json error
+        {
+            { "error", "Invalid request" },
+            { "message", e.what() }
+        };
+
+        drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
+        resp->setStatusCode(drogon::k400BadRequest);
+        resp->setBody(nlohmann::to_string(error));
+        resp->setContentTypeCode(drogon::CT_APPLICATION_JSON);
+        callback(resp);
+        return;
+    }
+
+    if (keys.size() > MaxBatchSize)
+    {
+        const nlohmann::json error
+        {
+            { "error", "Payload too large" },
+            { "message", fmt::format("At most {} packages can be checked at once", MaxBatchSize) }
+        };
+
+        drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
+        resp->setStatusCode(drogon::k413RequestEntityTooLarge);
+        resp->setBody(nlohmann::to_string(error));
+        resp->setContentTypeCode(drogon::CT_APPLICATION_JSON);
+        callback(resp);
+        return;
+    }
+
+    if (m_PackageIndex && IsReady())
+    {
+        const std::vector<std::optional<PackageIndex::Entry>> entries = FindPackages(keys);
+        m_RequestTimer->Mark(req, RequestPhase::LOOKUP);
+        callback(CreateCheckResponse(format, keys, entries));
+        return;
+    }
+
+    // Until then every package is probed on the tiers, up to one stat() per tier, which must neither block the event
+    // loop nor run one after the other: the chunks are spread over the probe pool and the last one done responds
+    struct ProbeBatch
+    {
+        std::vector<PackageKey> keys;
+        std::vector<std::optional<PackageIndex::Entry>> entries;
+        std::atomic<size_t> remaining;
+        std::function<void(const drogon::HttpResponsePtr&)> callback;
+    };
+
+    const size_t chunkCount = (keys.size() + ProbeChunkSize - 1) / ProbeChunkSize;
+    if (chunkCount == 0)
+    {
+        callback(CreateCheckResponse(format, keys, {}));
+        return;
+    }
+
+    std::shared_ptr<ProbeBatch> batch = std::make_shared<ProbeBatch>();
+    batch->entries.resize(keys.size());
+    batch->keys = std::move(keys);
+    batch->remaining = chunkCount;
+    batch->callback = std::move(callback);
+
+    for (size_t chunk = 0; chunk < chunkCount; ++chunk)
+    {
+        m_ProbeQueue->runTaskInQueue([this, req, batch, format, chunk]()
+        {
+            const size_t end = std::min(batch->keys.size(), (chunk + 1) * ProbeChunkSize);
+            for (size_t i = chunk * ProbeChunkSize; i < end; ++i)
+            {
+                const PackageKey& key = batch->keys[i];
+                if (key.IsValid())
+                {
+                    batch->entries[i] = FindPackage(key.triplet, key.name, key.version, key.sha);
+                }
+            }
+
+            if (batch->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                m_RequestTimer->Mark(req, RequestPhase::LOOKUP);
+                batch->callback(CreateCheckResponse(format, batch->keys, batch->entries));
+            }
+        });
+    }
+}
+
+void BinaryCacheServer::GetPackages(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback) const
+{
+    m_PersistenceInfo.IncreaseTotalRequests();
+
+    std::vector<PackageKey> keys;
+    try
+    {
+        keys = ParsePackageList(req->getBody(), PackageListFormatFromContentType(req->getHeader("Content-Type")));
+    }
+    catch (const std::exception& e)
+    {
+        const nlohmann::json error
+        {
+            { "error", "Invalid request" },
+            { "message", e.what() }
+        };
+
+        drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
+        resp->setStatusCode(drogon::k400BadRequest);
+        resp->setBody(nlohmann::to_string(error));
+        resp->setContentTypeCode(drogon::CT_APPLICATION_JSON);
+        callback(resp);
+        return;
+    }
+
+    if (keys.size() > MaxBatchSize)
+    {
+        const nlohmann::json error
+        {
+            { "error", "Payload too large" },
+            { "message", fmt::format("At most {} packages can be downloaded at once", MaxBatchSize) }
+        };
+
+        drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
+        resp->setStatusCode(drogon::k413RequestEntityTooLarge);
+        resp->setBody(nlohmann::to_string(error));
+        resp->setContentTypeCode(drogon::CT_APPLICATION_JSON);
+        callback(resp);
+        return;
+    }
+
+    // Packages are looked up as the stream reaches them, which also picks up tier migrations done meanwhile
+    std::shared_ptr<PackageStream> stream = std::make_shared<PackageStream>(std::move(keys), [this](const PackageKey& key) -> std::optional<std::filesystem::path>
+    {
+        const std::optional<PackageIndex::Entry> entry = FindPackage(key.triplet, key.name, key.version, key.sha);
+        if (!entry.has_value())
+        {
+            return std::nullopt;
+        }
+
+        m_PersistenceInfo.IncreaseDownloads();
+        m_StorageTiers->OnRead(key.triplet, key.name, key.version, key.sha, entry.value());
+        return m_StorageTiers->GetPackagePath(entry->tier, key.triplet, key.name, key.version, key.sha);
+    });
+
+    DownloadScheduler* scheduler = m_DownloadScheduler.get();
+    drogon::HttpResponsePtr resp = drogon::HttpResponse::newStreamResponse([stream, metrics = m_Metrics, scheduler](char* buffer, size_t length)
+    {
+        const size_t count = stream->Read(buffer, length);
+        metrics->AddBytesSent(MetricsRoute::DOWNLOAD, count);
+        if (scheduler)
+        {
+            scheduler->Charge(count);
+        }
+        return count;
+    }, "", drogon::CT_CUSTOM, "application/x-vcpkg-package-stream");
+
+    callback(resp);
+}
+
+void BinaryCacheServer::GetStatus(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback) const 
+{
+    m_PersistenceInfo.IncreaseTotalRequests();
+
+    try 
+    {
+        const nlohmann::json stats = GetCacheStats();
+        
+        drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
+        resp->setStatusCode(drogon::k200OK);
+        resp->setBody(nlohmann::to_string(stats));
+        resp->setContentTypeCode(drogon::CT_APPLICATION_JSON);
+        
+        callback(resp);
+    } 
+    catch (const std::exception& e) 
+    {
+        drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
+        resp->setStatusCode(drogon::k500InternalServerError);
+        resp->setBody(std::string("Error getting status: ") + e.what());
+        callback(resp);
+    }
+}
+
+void BinaryCacheServer::ExportMetrics(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback) const
+{
+    m_PersistenceInfo.IncreaseTotalRequests();
+
+    std::string body;
+    body.reserve(64 * 1024);
+    m_Metrics->Export(body);
+
+    body += "# HELP vcpkg_cache_packages Packages in the cache\n";
+    body += "# TYPE vcpkg_cache_packages gauge\n";
+    body += fmt::format("vcpkg_cache_packages {}\n", m_PackageIndex ? m_PackageIndex->GetPackageCount() : 0);
+    body += "# HELP vcpkg_cache_size_bytes Size of the packages in the cache\n";
+    body += "# TYPE vcpkg_cache_size_bytes gauge\n";
+    body += fmt::format("vcpkg_cache_size_bytes {}\n", m_PackageIndex ? m_PackageIndex->GetTotalSize() : 0);
+    body += "# HELP vcpkg_cache_index_ready Whether the package index is built\n";
+    body += "# TYPE vcpkg_cache_index_ready gauge\n";
+    body += fmt::format("vcpkg_cache_index_ready {}\n", IsReady() ? 1 : 0);
+
+    if (m_AdmissionController)
+    {
+        m_AdmissionController->Export(body);
+    }
+
+    if (m_MemoryBudget)
+    {
+        m_MemoryBudget->Export(body);
+    }
+
+    if (m_Prefetcher)
+    {
+        m_Prefetcher->Export(body);
+    }
+
+    if (m_Scrubber)
+    {
+        m_Scrubber->Export(body);
+    }
+
+    if (m_AccessLog)
+    {
+        body += "# HELP vcpkg_cache_access_log_records_total Access log records written\n";
+        body += "# TYPE vcpkg_cache_access_log_records_total counter\n";
+        body += fmt::format("vcpkg_cache_access_log_records_total {}\n", m_AccessLog->GetWrittenCount());
+        body += "# HELP vcpkg_cache_access_log_dropped_total Access log records dropped because a buffer was full\n";
+        body += "# TYPE vcpkg_cache_access_log_dropped_total counter\n";
+        body += fmt::format("vcpkg_cache_access_log_dropped_total {}\n", m_AccessLog->GetDroppedCount());
+    }
+
+    // Persisted across restarts, so exported as gauges rather than counters that must only go up
+    body += "# HELP vcpkg_cache_persisted_requests Requests handled since the persistence file was created, by type\n";
+    body += "# TYPE vcpkg_cache_persisted_requests gauge\n";
+    body += fmt::format("vcpkg_cache_persisted_requests{{type=\"total\"}} {}\n", m_PersistenceInfo.GetTotalRequests());
+    body += fmt::format("vcpkg_cache_persisted_requests{{type=\"upload\"}} {}\n", m_PersistenceInfo.GetUploads());
+    body += fmt::format("vcpkg_cache_persisted_requests{{type=\"download\"}} {}\n", m_PersistenceInfo.GetDownloads());
+
+    drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
+    resp->setStatusCode(drogon::k200OK);
+    resp->setBody(std::move(body));
+    resp->setContentTypeString("text/plain; version=0.0.4; charset=utf-8");
+
+    callback(resp);
+}
+
+void BinaryCacheServer::GetLiveness(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback) const
+{
+    const nlohmann::json response
+    {
+        { "status", "alive" }
+    };
+
+    drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
+    resp->setStatusCode(drogon::k200OK);
+    resp->setBody(nlohmann::to_string(response));
+    resp->setContentTypeCode(drogon::CT_APPLICATION_JSON);
+
+    callback(resp);
+}
+
+void BinaryCacheServer::GetReadiness(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback) const
+{
+    const bool ready = IsReady();
+
+    nlohmann::json response
+    {
+        { "status", ready ? "ready" : "starting" }
+    };
+
+    if (m_PackageIndex)
+    {
+        response["indexed_packages"] = m_PackageIndex->GetPackageCount();
+    }
+
+    drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
+    resp->setStatusCode(ready ? drogon::k200OK : drogon::k503ServiceUnavailable);
+    resp->setBody(nlohmann::to_string(response));
+    resp->setContentTypeCode(drogon::CT_APPLICATION_JSON);
+
+    callback(resp);
+}
+
+void BinaryCacheServer::GetSlowRequests(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback) const
+{
+    const nlohmann::json response
+    {
+        { "enabled", m_RequestTimer->IsEnabled() },
+        { "requests", m_RequestTimer->GetSlowRequests() }
+    };
+
+    drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
+    resp->setStatusCode(drogon::k200OK);
+    resp->setBody(nlohmann::to_string(response));
+    resp->setContentTypeCode(drogon::CT_APPLICATION_JSON);
+
+    callback(resp);
+}
+
+void BinaryCacheServer::GetPopularity(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback) const
+{
+    size_t count = 10;
+    if (const std::string& countParam = req->getParameter("count"); !countParam.empty())
+    {
+        try
+        {
+            count = std::stoul(countParam);
+        }
+        catch (const std::exception&)
+        {
+            callback(ResponseCache::Get(drogon::k400BadRequest, "Invalid count"));
+            return;
+        }
+    }
+
+    nlohmann::json response = m_Popularity ? m_Popularity->GetTop(count) : nlohmann::json::object();
+    response["enabled"] = m_Popularity != nullptr;
+
+    drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
+    resp->setStatusCode(drogon::k200OK);
+    resp->setBody(nlohmann::to_string(response));
+    resp->setContentTypeCode(drogon::CT_APPLICATION_JSON);
+
+    callback(resp);
+}
+
+void BinaryCacheServer::ImportPackages(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback)
 {
-    m_PersistenceInfo.IncreaseTotalRequests();
-
-    try 
+    std::vector<ImportedPackage> packages;
+    try
     {
-        const nlohmann::json stats = GetCacheStats();
-        
+        packages = ParseImportedPackages(req->getBody());
+    }
+    catch (const std::exception& e)
+    {
+        const nlohmann::json error
+        {
+            { "error", "Invalid request" },
+            { "message", e.what() }
+        };
+
         drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
-        resp->setStatusCode(drogon::k200OK);
-        resp->setBody(nlohmann::to_string(stats));
+        resp->setStatusCode(drogon::k400BadRequest);
+        resp->setBody(nlohmann::to_string(error));
         resp->setContentTypeCode(drogon::CT_APPLICATION_JSON);
-        
         callback(resp);
-    } 
-    catch (const std::exception& e) 
+        return;
+    }
+
+    // The import command already read the size and modification time of every package it wrote to the
+    // first tier, nothing is read from the disks on the IO thread
+    uint64_t indexed = 0;
+    uint64_t invalid = 0;
+    for (const ImportedPackage& package : packages)
     {
-        drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
-        resp->setStatusCode(drogon::k500InternalServerError);
-        resp->setBody(std::string("Error getting status: ") + e.what());
-        callback(resp);
+        const PackageKey& key = package.key;
+        if (!key.IsValid())
+        {
+            ++invalid;
+            continue;
+        }
+
+        if (m_PackageIndex)
+        {
+            IndexPackage(key.triplet, key.name, key.version, key.sha, package.size, package.modifiedTime);
+        }
+
+        // The import may have filled the first tier above its high watermark
+        m_StorageTiers->OnWrite(key.triplet, key.name, key.version, key.sha, std::nullopt);
+        ++indexed;
     }
+
+    const nlohmann::json response
+    {
+        { "indexed", indexed },
+        { "invalid", invalid }
+    };
+
+    drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
+    resp->setStatusCode(drogon::k200OK);
+    resp->setBody(nlohmann::to_string(response));
+    resp->setContentTypeCode(drogon::CT_APPLICATION_JSON);
+
+    callback(resp);
 }
 
 void BinaryCacheServer::SetCacheDirectory(const std::string& dir) 
 {
-    m_CacheDir = dir;
-    if (!std::filesystem::exists(m_CacheDir)) 
+    if (m_IndexThread.joinable())
+    {
+        m_IndexThread.join();
+    }
+
+    if (m_Scrubber)
+    {
+        m_Scrubber->Stop();
+    }
+    m_StorageTiers->Stop();
+    m_StorageTiers->SetDirectory(0, dir);
+
+    if (m_PackageIndex)
     {
-        std::filesystem::create_directories(m_CacheDir);
+        m_IndexOpen = false;
+        m_PackageIndex->Close(m_IndexReady);
+        if (m_SharedState && !m_SharedState->IsPrimary())
+        {
+            m_IndexThread = std::thread(&BinaryCacheServer::AttachIndex, this);
+        }
+        else
+        {
+            OpenIndex();
+        }
     }
 }
 
-std::shared_ptr<ApiKeyFilter> BinaryCacheServer::CreateApiKeyFilter(bool requireAuthForRead, bool requireAuthForWrite, bool requireAuthForStatus) const
+std::string BinaryCacheServer::GetCacheDirectory() const
+{
+    return m_StorageTiers->GetDirectory(0).string();
+}
+
+std::shared_ptr<ApiKeyFilter> BinaryCacheServer::CreateApiKeyFilter(bool requireAuthForRead, bool requireAuthForWrite, bool requireAuthForStatus)
 {
-    return std::make_shared<ApiKeyFilter>(m_PolicyEngine, requireAuthForRead, requireAuthForWrite, requireAuthForStatus);
+    m_ApiKeyFilter = std::make_shared<ApiKeyFilter>(m_PolicyEngine, m_Metrics, m_RequestTimer, requireAuthForRead, requireAuthForWrite, requireAuthForStatus);
+    return m_ApiKeyFilter;
 }
 
 void BinaryCacheServer::CreateKey(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback)
 {
+    if (!m_PersistenceInfo.IsWritable())
+    {
+        callback(CreateKeysUnavailableResponse());
+        return;
+    }
+
     try 
     {
         // Parse request body
@@ -371,6 +1401,12 @@ void BinaryCacheServer::GetKeyInfo(const drogon::HttpRequestPtr& req, std::funct
 
 void BinaryCacheServer::RevokeKey(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback, const std::string& key)
 {
+    if (!m_PersistenceInfo.IsWritable())
+    {
+        callback(CreateKeysUnavailableResponse());
+        return;
+    }
+
     try 
     {
         const bool revoked = m_PolicyEngine->RevokeApiKey(key);
@@ -443,18 +1479,314 @@ void BinaryCacheServer::Kill(const drogon::HttpRequestPtr& req, std::function<vo
     drogon::HttpResponsePtr resp = drogon::HttpResponse::newHttpResponse();
     resp->setStatusCode(drogon::k200OK);
 
+#ifndef _WIN32
+    // The supervisor stops every worker, a worker quitting on its own would be restarted
+    if (m_SharedState)
+    {
+        kill(getppid(), SIGTERM);
+        callback(resp);
+        return;
+    }
+#endif // _WIN32
+
     drogon::app().quit();
 
     callback(resp);
 }
 
-std::filesystem::path BinaryCacheServer::GetPackagePath(const std::string& triplet, const std::string& name, const std::string& version, const std::string& sha) const 
+std::filesystem::path BinaryCacheServer::GetPackagePath(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha) const 
+{
+    return m_StorageTiers->GetPackagePath(0, triplet, name, version, sha);
+}
+
+std::optional<PackageIndex::Entry> BinaryCacheServer::FindPackage(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha) const
+{
+    // Until the index is fully built, a miss in the index does not mean the package is missing
+    if (m_PackageIndex && IsReady())
+    {
+        return m_PackageIndex->Find(triplet, name, version, sha);
+    }
+
+    return m_StorageTiers->Probe(triplet, name, version, sha);
+}
+
+std::vector<std::optional<PackageIndex::Entry>> BinaryCacheServer::FindPackages(const std::vector<PackageKey>& keys) const
+{
+    std::vector<std::optional<PackageIndex::Entry>> entries(keys.size());
+
+    // Index lookups are a hash lookup under a shared lock, so even the largest batches are cheaper inline than spread over
+    // short-lived threads which would block the event loop while they start and join
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        if (keys[i].IsValid())
+        {
+            entries[i] = FindPackage(keys[i].triplet, keys[i].name, keys[i].version, keys[i].sha);
+        }
+    }
+
+    return entries;
+}
+
+void BinaryCacheServer::RebuildIndex()
+{
+    ThreadPlacement::Apply(ThreadRole::DISK);
+
+    m_PackageIndex->Clear();
+
+    // Slowest tier first, so that a package left on two tiers by an interrupted migration is indexed on the fastest one
+    for (size_t tier = m_StorageTiers->GetTierCount(); tier-- > 0; )
+    {
+        const std::filesystem::path& directory = m_StorageTiers->GetDirectory(tier);
+        std::cout << "Rebuilding package index " << m_PackageIndex->GetPath().string() << " from " << directory.string() << std::endl;
+
+        const CacheScanner::Progress result = m_Scanner.Scan(directory, [this, tier](const CacheScanner::Package& package)
+        {
+            m_PackageIndex->Insert(package.triplet, package.name, package.version, package.sha, package.size, package.modifiedTime, static_cast<uint8_t>(tier));
+        }, &PrintScanProgress);
+
+        PrintScanProgress(result);
+        if (!result.completed)
+        {
+            std::cout << "Package index rebuild interrupted" << std::endl;
+            return;
+        }
+    }
+
+    // Uploads received during the scan were inserted directly, the index is now complete
+    SetIndexReady();
+    std::cout << "Package index rebuilt with " << m_PackageIndex->GetPackageCount() << " packages" << std::endl;
+
+    m_StorageTiers->Start();
+    if (m_Scrubber)
+    {
+        m_Scrubber->Start();
+    }
+}
+
+void BinaryCacheServer::RequestCacheTotals() const
+{
+    std::lock_guard<std::mutex> lock(m_CacheTotalsMutex);
+    if (m_ShuttingDown || m_CacheTotalsScanning || (m_CacheTotals.has_value() && std::chrono::steady_clock::now() - m_CacheTotals->scannedAt < CacheTotalsMaxAge))
+    {
+        return;
+    }
+
+    // The previous scan has completed, only its thread is left to join
+    if (m_CacheTotalsThread.joinable())
+    {
+        m_CacheTotalsThread.join();
+    }
+
+    m_CacheTotalsScanning = true;
+    m_CacheTotalsThread = std::thread([this]()
+    {
+        ThreadPlacement::Apply(ThreadRole::DISK);
+
+        CacheTotals totals{ 0, 0, {} };
+        bool completed = true;
+        for (const std::filesystem::path& directory : m_StorageTiers->GetDirectories())
+        {
+            std::error_code error;
+            if (std::filesystem::exists(directory, error))
+            {
+                const CacheScanner::Progress result = m_Scanner.Scan(directory, [](const CacheScanner::Package&) {});
+                totals.packages += result.packages;
+                totals.bytes += result.bytes;
+                completed = completed && result.completed;
+            }
+        }
+        totals.scannedAt = std::chrono::steady_clock::now();
+
+        std::lock_guard<std::mutex> lock(m_CacheTotalsMutex);
+        if (completed)
+        {
+            m_CacheTotals = totals;
+        }
+        m_CacheTotalsScanning = false;
+    });
+}
+
+void BinaryCacheServer::PrefetchHotPackages() const
+{
+    struct Candidate
+    {
+        std::string relativePath;
+        int64_t lastAccess;
+        uint64_t size;
+        uint8_t tier;
+    };
+
+    ThreadPlacement::Apply(ThreadRole::DISK);
+
+    // The index keeps the time of the last read across restarts
+    std::vector<Candidate> candidates;
+    m_PackageIndex->ForEach([&candidates](std::string_view relativePath, const PackageIndex::Entry& entry)
+    {
+        if (entry.lastAccess != 0 && !relativePath.empty())
+        {
+            candidates.push_back(Candidate{ std::string(relativePath), entry.lastAccess, entry.size, entry.tier });
+        }
+    });
+
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate& lhs, const Candidate& rhs)
+    {
+        return lhs.lastAccess > rhs.lastAccess;
+    });
+
+    uint64_t prefetchedSize = 0;
+    size_t prefetchedCount = 0;
+    for (const Candidate& candidate : candidates)
+    {
+        if (prefetchedSize + candidate.size > m_PrefetchSize || candidate.tier >= m_StorageTiers->GetTierCount())
+        {
+            continue;
+        }
+
+        m_PageCache->Prefetch((m_StorageTiers->GetDirectory(candidate.tier) / candidate.relativePath).string());
+        prefetchedSize += candidate.size;
+        ++prefetchedCount;
+    }
+
+    std::cout << "Prefetching " << prefetchedCount << " recently read packages (" << prefetchedSize / (1024 * 1024) << " MB)" << std::endl;
+}
+
+void BinaryCacheServer::OpenIndex()
+{
+    m_IndexReady = false;
+
+    if (LoadIndex())
+    {
+        if (m_PrefetchSize > 0)
+        {
+            m_IndexThread = std::thread(&BinaryCacheServer::PrefetchHotPackages, this);
+        }
+    }
+    else
+    {
+        m_IndexThread = std::thread(&BinaryCacheServer::RebuildIndex, this);
+    }
+}
+
+bool BinaryCacheServer::LoadIndex()
+{
+    const bool valid = m_PackageIndex->Open(m_StorageTiers->GetDirectories());
+    if (m_SharedState)
+    {
+        m_SharedState->SetIndexState(SharedState::IndexState::OPEN);
+    }
+
+    // Before the index is flagged as ready, so lookups never miss these packages
+    ApplyPendingPackages();
+
+    if (valid)
+    {
+        SetIndexReady();
+        std::cout << "Package index loaded with " << m_PackageIndex->GetPackageCount() << " packages" << std::endl;
+        m_StorageTiers->Start();
+        if (m_Scrubber)
+        {
+            m_Scrubber->Start();
+        }
+    }
+
+    return valid;
+}
+
+void BinaryCacheServer::AttachIndex()
+{
+    // The primary worker validates or resets the index file before anyone may map it
+    if (m_SharedState->GetIndexState() == SharedState::IndexState::CLOSED)
+    {
+        std::cout << "Waiting for the primary worker to open the package index" << std::endl;
+        while (m_SharedState->GetIndexState() == SharedState::IndexState::CLOSED)
+        {
+            if (m_ShuttingDown)
+            {
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    m_PackageIndex->Attach();
+    ApplyPendingPackages();
+    std::cout << "Package index attached with " << m_PackageIndex->GetPackageCount() << " packages" << std::endl;
+}
+
+void BinaryCacheServer::TakeOver()
+{
+    ThreadPlacement::Apply(ThreadRole::DISK);
+    std::cout << "Waiting for the previous instance to drain its connections and exit" << std::endl;
+    while (!m_InstanceLock->TryLock(GetInstanceOwner(m_SharedState)))
+    {
+        if (m_ShuttingDown)
+        {
+            return;
+        }
+        std::this_thread::sleep_for(TakeOverInterval);
+    }
+
+    // Counted by the previous instance until it exited
+    m_PersistenceInfo.Reload();
+    m_PersistenceInfo.SetWritable(true);
+    std::cout << "Took over from the previous instance" << std::endl;
+
+    if (!m_PackageIndex)
+    {
+        return;
+    }
+
+    // Closed cleanly by the previous instance, the index is loaded as is rather than rebuilt
+    if (LoadIndex())
+    {
+        if (m_PrefetchSize > 0)
+        {
+            PrefetchHotPackages();
+        }
+    }
+    else
+    {
+        RebuildIndex();
+    }
+}
+
+void BinaryCacheServer::IndexPackage(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha, uint64_t size, int64_t modifiedTime)
+{
+    if (!m_IndexOpen.load(std::memory_order_acquire))
+    {
+        std::lock_guard<std::mutex> lock(m_PendingMutex);
+        if (!m_IndexOpen.load(std::memory_order_relaxed))
+        {
+            m_PendingPackages.push_back(PendingPackage{ std::string(triplet), std::string(name), std::string(version), std::string(sha), size, modifiedTime });
+            return;
+        }
+    }
+
+    m_PackageIndex->Insert(triplet, name, version, sha, size, modifiedTime);
+}
+
+void BinaryCacheServer::ApplyPendingPackages()
+{
+    std::lock_guard<std::mutex> lock(m_PendingMutex);
+    for (const PendingPackage& package : m_PendingPackages)
+    {
+        m_PackageIndex->Insert(package.triplet, package.name, package.version, package.sha, package.size, package.modifiedTime);
+    }
+
+    m_PendingPackages.clear();
+    m_IndexOpen.store(true, std::memory_order_release);
+}
+
+void BinaryCacheServer::SetIndexReady()
 {
-    // Store packages in the vcpkg structure: triplet/name/version/sha.zip
-    return m_CacheDir / triplet / name / version / (sha + ".zip");
+    m_IndexReady.store(true, std::memory_order_release);
+    if (m_SharedState)
+    {
+        m_SharedState->SetIndexState(SharedState::IndexState::READY);
+    }
 }
 
-bool BinaryCacheServer::IsValidHash(const std::string& hash) const 
+bool BinaryCacheServer::IsValidHash(std::string_view hash) 
 {
     // Hash should be alphanumeric and reasonable length (e.g., SHA256 = 64 chars)
     if (hash.empty() || hash.length() > 128) 
@@ -474,31 +1806,103 @@ nlohmann::json BinaryCacheServer::GetCacheStats() const
     
     stats["service"] = "vcpkg-http-cache";
     stats["version"] = VERSION;
-    stats["cache_directory"] = m_CacheDir.string();
+    stats["cache_directory"] = GetCacheDirectory();
     
     // Count packages
     uint64_t packageCount = 0;
     uint64_t totalSize = 0;
     
-    if (std::filesystem::exists(m_CacheDir)) 
+    if (m_PackageIndex)
+    {
+        packageCount = m_PackageIndex->GetPackageCount();
+        totalSize = m_PackageIndex->GetTotalSize();
+    }
+    else
     {
-        for (const std::filesystem::directory_entry& entry : std::filesystem::recursive_directory_iterator(m_CacheDir))
+        // From the last background scan, zero until the first one completes
+        RequestCacheTotals();
+
+        std::lock_guard<std::mutex> lock(m_CacheTotalsMutex);
+        if (m_CacheTotals.has_value())
         {
-            if (entry.is_regular_file() && entry.path().extension() == ".zip") 
-            {
-                ++packageCount;
-                totalSize += std::filesystem::file_size(entry.path());
-            }
+            packageCount = m_CacheTotals->packages;
+            totalSize = m_CacheTotals->bytes;
+            stats["totals_age_seconds"] = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - m_CacheTotals->scannedAt).count();
         }
+        stats["totals_scanning"] = m_CacheTotalsScanning;
     }
     
+    stats["index_ready"] = IsReady();
     stats["package_count"] = packageCount;
     stats["total_size_bytes"] = totalSize;
     stats["total_size_mb"] = std::round(static_cast<double>((totalSize) / (1024.0 * 1024.0)) * 100.0) / 100.0;
     
+    if (m_StorageTiers->GetTierCount() > 1)
+    {
+        for (size_t tier = 0; tier < m_StorageTiers->GetTierCount(); ++tier)
+        {
+            nlohmann::json tierStats;
+            tierStats["directory"] = m_StorageTiers->GetDirectory(tier).string();
+            tierStats["capacity_bytes"] = m_StorageTiers->GetCapacity(tier);
+            if (m_PackageIndex)
+            {
+                tierStats["used_bytes"] = m_PackageIndex->GetTierSize(tier);
+            }
+            stats["tiers"].push_back(tierStats);
+        }
+
+        stats["migrations"]["promoted"] = m_StorageTiers->GetPromotedCount();
+        stats["migrations"]["demoted"] = m_StorageTiers->GetDemotedCount();
+        stats["migrations"]["migrated_bytes"] = m_StorageTiers->GetMigratedBytes();
+    }
+
     stats["statistics"]["total_requests"] = m_PersistenceInfo.GetTotalRequests();
     stats["statistics"]["uploads"] = m_PersistenceInfo.GetUploads();
     stats["statistics"]["downloads"] = m_PersistenceInfo.GetDownloads();
+
+    if (m_SharedState)
+    {
+        stats["workers"]["count"] = m_SharedState->GetWorkerCount();
+        stats["workers"]["worker_id"] = SharedState::GetWorkerId();
+        stats["workers"]["primary"] = m_SharedState->IsPrimary();
+    }
+
+    // Empty for the roles left to the scheduler
+    for (size_t role = 0; role < static_cast<size_t>(ThreadRole::COUNT); ++role)
+    {
+        stats["affinity"][ToString(static_cast<ThreadRole>(role))] = ThreadPlacement::GetCpus(static_cast<ThreadRole>(role));
+    }
+
+    if (m_AdmissionController)
+    {
+        stats["admission"] = m_AdmissionController->GetStats();
+    }
+
+    if (m_MemoryBudget)
+    {
+        stats["memory"] = m_MemoryBudget->GetStats();
+    }
+
+    if (m_DownloadScheduler)
+    {
+        stats["bandwidth"] = m_DownloadScheduler->GetStats();
+    }
+
+    if (m_Prefetcher)
+    {
+        stats["prefetch"] = m_Prefetcher->GetStats();
+    }
+
+    if (m_Scrubber)
+    {
+        stats["scrub"] = m_Scrubber->GetStats();
+    }
+
+    if (m_AccessLog)
+    {
+        stats["accessLog"]["records"] = m_AccessLog->GetWrittenCount();
+        stats["accessLog"]["dropped"] = m_AccessLog->GetDroppedCount();
+    }
     
     return stats;
 }
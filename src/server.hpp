@@ -1,17 +1,42 @@
 #pragma once
 
+#include <cachescanner.hpp>
+#include <options.hpp>
+#include <packageindex.hpp>
+#include <packagekey.hpp>
 #include <persistence.hpp>
+#include <sharedstate.hpp>
 
 #include <drogon/HttpController.h>
 #include <drogon/HttpTypes.h>
 #include <nlohmann/json.hpp>
+#include <trantor/utils/ConcurrentTaskQueue.h>
 
+#include <atomic>
+#include <chrono>
 #include <filesystem>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
+class AccessLog;
+class AdmissionController;
+class CoAccessPrefetcher;
 class ApiKeyFilter;
+class DownloadScheduler;
+class InstanceLock;
+class MemoryBudget;
+class Metrics;
+class PageCache;
 class PolicyEngine;
+class PopularityTracker;
+class RequestTimer;
+class Scrubber;
+class StorageTiers;
 
 class BinaryCacheServer : public drogon::HttpController<BinaryCacheServer, false> 
 {
@@ -26,9 +51,33 @@ public:
     // PUT request to upload a binary package
     ADD_METHOD_TO(BinaryCacheServer::PutPackage, "/{triplet}/{name}/{version}/{sha}", drogon::Put, "ApiKeyFilter");
     
+    // POST request to check if a list of binary packages exist
+    ADD_METHOD_TO(BinaryCacheServer::CheckPackages, "/api/packages/check", drogon::Post, "ApiKeyFilter");
+
+    // POST request to download a list of binary packages as a single stream
+    ADD_METHOD_TO(BinaryCacheServer::GetPackages, "/api/packages/download", drogon::Post, "ApiKeyFilter");
+    
     // GET server status
     ADD_METHOD_TO(BinaryCacheServer::GetStatus, "/status", drogon::Get, "ApiKeyFilter");
 
+    // GET server metrics in the Prometheus text format
+    ADD_METHOD_TO(BinaryCacheServer::ExportMetrics, "/metrics", drogon::Get, "ApiKeyFilter");
+
+    // GET liveness probe, succeeds as soon as the server accepts requests
+    ADD_METHOD_TO(BinaryCacheServer::GetLiveness, "/health/live", drogon::Get);
+
+    // GET readiness probe, succeeds once the package index is ready
+    ADD_METHOD_TO(BinaryCacheServer::GetReadiness, "/health/ready", drogon::Get);
+
+    // GET the requests slower than the configured threshold
+    ADD_METHOD_TO(BinaryCacheServer::GetSlowRequests, "/internal/slow-requests", drogon::Get, "drogon::LocalHostFilter");
+
+    // GET the most requested packages, triplets and API keys over the recent windows
+    ADD_METHOD_TO(BinaryCacheServer::GetPopularity, "/internal/popularity", drogon::Get, "drogon::LocalHostFilter");
+
+    // POST the packages copied into the cache directory by an import, to add them to the package index
+    ADD_METHOD_TO(BinaryCacheServer::ImportPackages, "/internal/import", drogon::Post, "drogon::LocalHostFilter");
+
     // GET method to terminate server via IPC
     ADD_METHOD_TO(BinaryCacheServer::Kill, "/internal/kill", drogon::Get, "drogon::LocalHostFilter");
 
@@ -48,9 +97,10 @@ public:
 
     /**
      * @brief Constructor
-     * @param cacheDir Directory to store cached binary packages
+     * @param options Server options (cache directory, persistence file, package index, scanner)
      */
-    explicit BinaryCacheServer(const std::string& cacheDir, const std::string& persistenceFile);
+    explicit BinaryCacheServer(const Options& options);
+    ~BinaryCacheServer();
 
     /**
      * @brief Check if a package exists (HEAD request)
@@ -85,6 +135,48 @@ public:
      */
     void PutPackage(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback, const std::string& triplet, const std::string& name, const std::string& version, const std::string& sha);
 
+    /**
+     * @brief Serve a package request ahead of the generic router, called from the pre-routing advice
+     *
+     * Handles HEAD, GET and PUT requests on canonical package URLs (see PackageRouter), including the
+     * sha-only layout that the generic routes do not cover. The API key filter is applied the same way.
+     *
+     * @param req HTTP request
+     * @param callback Callback function, only consumed when the request is handled
+     * @return false if the request must go through the generic router
+     */
+    bool RoutePackageRequest(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>& callback);
+
+    /**
+     * @brief Check if a list of packages exist (POST request)
+     *
+     * Request body, selected by the Content-Type:
+     * - application/json: [{"triplet": "x64-linux", "name": "zlib", "version": "1.3", "sha": "..."}, ...]
+     * - application/x-ndjson: one such object per line
+     * - text/plain: one triplet/name/version/sha per line
+     *
+     * JSON requests get a JSON response with "present" and "size" for every package, in request order.
+     * Other requests get one "<status> <size> <triplet/name/version/sha>" line per package, with status
+     * 200, 404 or 400 (invalid key) and size 0 for missing packages.
+     * Until the package index is ready, the packages are probed on the tiers by a pool of threads and the
+     * response is sent once they are all done.
+     *
+     * @param req HTTP request
+     * @param callback Callback function
+     */
+    void CheckPackages(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback) const;
+
+    /**
+     * @brief Download a list of packages as a single stream (POST request)
+     *
+     * Accepts the same request bodies as CheckPackages(). The response is a sequence of frames, see
+     * PackageStream for the format.
+     *
+     * @param req HTTP request
+     * @param callback Callback function
+     */
+    void GetPackages(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback) const;
+
     /**
      * @brief Get server status
      * @param req HTTP request
@@ -92,6 +184,57 @@ public:
      */
     void GetStatus(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback) const;
 
+    /**
+     * @brief Get server metrics in the Prometheus text format
+     * @param req HTTP request
+     * @param callback Callback function
+     */
+    void ExportMetrics(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback) const;
+
+    /**
+     * @brief Liveness probe, always succeeds while the server is able to answer
+     * @param req HTTP request
+     * @param callback Callback function
+     */
+    void GetLiveness(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback) const;
+
+    /**
+     * @brief Readiness probe, returns 503 until the package index has been built
+     * @param req HTTP request
+     * @param callback Callback function
+     */
+    void GetReadiness(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback) const;
+
+    /**
+     * @brief Get the slow request log, with the time spent in every phase of each request
+     * @param req HTTP request
+     * @param callback Callback function
+     */
+    void GetSlowRequests(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback) const;
+
+    /**
+     * @brief Get the heaviest packages, triplets and API keys by requests and by bytes, over every window
+     * @param req HTTP request, the count parameter sets the number of keys listed (10 by default)
+     * @param callback Callback function
+     */
+    void GetPopularity(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback) const;
+
+    /**
+     * @brief Add packages written to the first tier by another process to the package index
+     *
+     * Called by the import command while this server runs, with one "triplet/name/version/sha size modifiedTime"
+     * per line. The sizes and modification times are the ones the import command read, so nothing is read from the
+     * file system on the IO thread.
+     * @param req HTTP request
+     * @param callback Callback function
+     */
+    void ImportPackages(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback);
+
+    /**
+     * @brief Check if the package index is built and used to answer lookups, by this worker or by the primary one
+     */
+    bool IsReady() const { return !m_PackageIndex || m_IndexReady.load(std::memory_order_acquire) || (m_SharedState && m_IndexOpen.load(std::memory_order_acquire) && m_SharedState->GetIndexState() == SharedState::IndexState::READY); }
+
     /**
      * @brief Set the cache directory
      * @param dir Directory path
@@ -102,13 +245,38 @@ public:
      * @brief Get the cache directory
      * @return Cache directory path
      */
-    std::string GetCacheDirectory() const { return m_CacheDir.string(); }
+    std::string GetCacheDirectory() const;
+
+    /**
+     * @brief Get the request metrics, fed by the pre-routing and pre-sending advices
+     */
+    const std::shared_ptr<Metrics>& GetMetrics() const { return m_Metrics; }
+
+    /**
+     * @brief Get the request phase timer, fed by the pre-routing and pre-sending advices
+     */
+    const std::shared_ptr<RequestTimer>& GetRequestTimer() const { return m_RequestTimer; }
 
     /**
-     * @brief Creates an instance of the ApiKeyFilter
+     * @brief Get the access log, fed by the pre-sending advice, or nullptr if it is disabled
+     */
+    const std::shared_ptr<AccessLog>& GetAccessLog() const { return m_AccessLog; }
+
+    /**
+     * @brief Get the admission control, fed by the pre-routing and pre-sending advices, or nullptr if it is disabled
+     */
+    const std::shared_ptr<AdmissionController>& GetAdmissionController() const { return m_AdmissionController; }
+
+    /**
+     * @brief Get the memory budget of the request and response bodies, fed by the advices, or nullptr if it is unlimited
+     */
+    const std::shared_ptr<MemoryBudget>& GetMemoryBudget() const { return m_MemoryBudget; }
+
+    /**
+     * @brief Creates an instance of the ApiKeyFilter, also applied by RoutePackageRequest()
      * @return std::shared_ptr instance of ApiKeyFilter
      */
-    std::shared_ptr<ApiKeyFilter> CreateApiKeyFilter(bool requireAuthForRead = false, bool requireAuthForWrite = false, bool requireAuthForStatus = false) const;
+    std::shared_ptr<ApiKeyFilter> CreateApiKeyFilter(bool requireAuthForRead = false, bool requireAuthForWrite = false, bool requireAuthForStatus = false);
 
     /**
      * @brief Create a new API key
@@ -146,21 +314,107 @@ private:
     void Kill(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback) const;
 
     /**
-     * @brief Get the file path for a given package
+     * @brief Answer a HEAD request for a package, once its sha is validated
+     */
+    void HeadPackage(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback, std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha) const;
+
+    /**
+     * @brief Answer a GET request for a package, once its sha is validated
+     */
+    void DownloadPackage(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback, std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha) const;
+
+    /**
+     * @brief Answer a PUT request for a package, once its sha is validated
+     */
+    void UploadPackage(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback, std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha);
+
+    /**
+     * @brief Answer a request using the sha-only URL layout, resolving the rest of the package key
+     *
+     * Downloads and checks look the sha up in the package index, uploads read the CONTROL file of the archive.
+     */
+    void RouteShaOnlyRequest(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback, std::string_view sha);
+
+    /**
+     * @brief Get the file path of a package on the fastest tier, where uploads are written
      * @param triplet Target triplet
      * @param name Package name
      * @param version Package version
      * @param sha Package SHA hash
      * @return Full file path
      */
-    std::filesystem::path GetPackagePath(const std::string& triplet, const std::string& name, const std::string& version, const std::string& sha) const;
+    std::filesystem::path GetPackagePath(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha) const;
+
+    /**
+     * @brief Look up a package, through the package index when it is enabled
+     * @return The package size and storage tier, or std::nullopt if the package does not exist
+     */
+    std::optional<PackageIndex::Entry> FindPackage(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha) const;
+
+    /**
+     * @brief Look up a list of packages
+     * @return The entry of every package in the same order, std::nullopt for missing packages and invalid keys
+     */
+    std::vector<std::optional<PackageIndex::Entry>> FindPackages(const std::vector<PackageKey>& keys) const;
+
+    /**
+     * @brief Repopulate the package index from the content of every storage tier
+     *
+     * Runs on a background thread. Lookups are answered from the file system until it completes.
+     */
+    void RebuildIndex();
+
+    /**
+     * @brief Open the package index and start rebuilding it in the background if it cannot be trusted
+     */
+    void OpenIndex();
+
+    /**
+     * @brief Open the package index and add the packages uploaded before it was opened
+     * @return true if the index could be trusted and is ready, false if it must be rebuilt
+     */
+    bool LoadIndex();
+
+    /**
+     * @brief Attach to the package index opened by the primary worker, waiting for it to be opened
+     *
+     * Runs on a background thread, the primary worker may be waiting for a previous instance to exit.
+     */
+    void AttachIndex();
+
+    /**
+     * @brief Wait for the previous instance to exit, then load the persistence file and the package index it saved
+     *
+     * Runs on a background thread. Lookups are answered from the file system until the index is loaded.
+     */
+    void TakeOver();
+
+    /**
+     * @brief Add an uploaded package to the package index, or keep it until the index is opened
+     */
+    void IndexPackage(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha, uint64_t size, int64_t modifiedTime);
+
+    /**
+     * @brief Add the packages uploaded before the index was opened, from then on uploads are added directly
+     */
+    void ApplyPendingPackages();
+
+    /**
+     * @brief Record that the package index is complete, for this process and the other workers
+     */
+    void SetIndexReady();
+
+    /**
+     * @brief Prefetch the most recently read packages into the page cache, up to the configured size
+     */
+    void PrefetchHotPackages() const;
 
     /**
      * @brief Validate hash format
      * @param hash Hash string to validate
      * @return true if valid, false otherwise
      */
-    bool IsValidHash(const std::string& hash) const;
+    static bool IsValidHash(std::string_view hash);
 
     /**
      * @brief Get cache statistics
@@ -168,6 +422,11 @@ private:
      */
     nlohmann::json GetCacheStats() const;
 
+    /**
+     * @brief Count the packages of the tiers in the background, when there is no package index and the last count is missing or outdated
+     */
+    void RequestCacheTotals() const;
+
     /**
      * @brief Convert ApiKey to JSON object
      */
@@ -178,9 +437,64 @@ private:
      */
     void SendExceptionAsJson(const drogon::HttpRequestPtr& req, std::function<void(const drogon::HttpResponsePtr&)>&& callback, const std::exception& e) const;
 
+    // Gives the microbenchmarks and the tests access to the internals
+    friend struct BenchmarkAccess;
+    friend struct TestAccess;
+
 private:
-    std::filesystem::path m_CacheDir;
+    std::unique_ptr<PackageIndex> m_PackageIndex;
+    std::unique_ptr<StorageTiers> m_StorageTiers;
+    std::unique_ptr<PageCache> m_PageCache;
+    std::unique_ptr<DownloadScheduler> m_DownloadScheduler;
+    std::unique_ptr<PopularityTracker> m_Popularity; // nullptr when disabled
+    std::unique_ptr<CoAccessPrefetcher> m_Prefetcher; // nullptr when disabled
+    std::unique_ptr<Scrubber> m_Scrubber; // nullptr when disabled and in the secondary workers
+    uint64_t m_PrefetchSize;
+    std::atomic<bool> m_IndexReady;
+    SharedState* m_SharedState; // nullptr unless started by the supervisor
+    std::unique_ptr<InstanceLock> m_InstanceLock; // nullptr in the secondary workers
+    std::atomic<bool> m_ShuttingDown;
+    std::thread m_IndexThread;
+
+    struct PendingPackage
+    {
+        std::string triplet;
+        std::string name;
+        std::string version;
+        std::string sha;
+        uint64_t size;
+        int64_t modifiedTime;
+    };
+
+    // Uploads received before the package index was opened or attached
+    std::atomic<bool> m_IndexOpen;
+    std::vector<PendingPackage> m_PendingPackages;
+    std::mutex m_PendingMutex;
+    CacheScanner m_Scanner;
+    std::unique_ptr<trantor::ConcurrentTaskQueue> m_ProbeQueue; // Batch checks made before the package index is ready
+
+    struct CacheTotals
+    {
+        uint64_t packages;
+        uint64_t bytes;
+        std::chrono::steady_clock::time_point scannedAt;
+    };
+
+    // Totals reported without a package index, scanned off the IO threads since the tiers may be slow network volumes
+    mutable std::optional<CacheTotals> m_CacheTotals;
+    mutable bool m_CacheTotalsScanning;
+    mutable std::thread m_CacheTotalsThread;
+    mutable std::mutex m_CacheTotalsMutex;
 
     mutable PersistenceInfo m_PersistenceInfo;
     std::shared_ptr<PolicyEngine> m_PolicyEngine;
+    std::shared_ptr<Metrics> m_Metrics;
+    std::shared_ptr<RequestTimer> m_RequestTimer;
+    std::shared_ptr<AccessLog> m_AccessLog;
+    std::shared_ptr<AdmissionController> m_AdmissionController;
+    std::shared_ptr<MemoryBudget> m_MemoryBudget;
+    std::shared_ptr<ApiKeyFilter> m_ApiKeyFilter;
+
+    // Cache-Control of the package responses, private when reading requires an API key
+    std::string m_CacheControl;
 };
\ No newline at end of file
@@ -0,0 +1,210 @@
+#include <sharedstate.hpp>
+
+#include <fmt/core.h>
+
+#include <cerrno>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif // _WIN32
+
+SharedState* SharedState::s_Instance = nullptr;
+uint32_t SharedState::s_WorkerId = 0;
+
+#ifndef _WIN32
+static int InitializeMutex(pthread_mutex_t& mutex)
+{
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+    // A worker dying with the mutex held would otherwise block the others forever
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+#endif // __linux__
+    const int result = pthread_mutex_init(&mutex, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+    return result;
+}
+
+static void LockMutex(pthread_mutex_t& mutex, [[maybe_unused]] const char* name)
+{
+    const int result = pthread_mutex_lock(&mutex);
+#ifdef __linux__
+    if (result == EOWNERDEAD)
+    {
+        // What the worker protected with it is checked by the supervisor when it reaps that worker
+        std::cerr << "A worker exited while holding the " << name << " lock" << std::endl;
+        pthread_mutex_consistent(&mutex);
+    }
+#endif // __linux__
+}
+#endif // _WIN32
+
+SharedState::SharedState(uint32_t workerCount)
+    : m_WorkerCount(workerCount)
+    , m_IndexWriter(0)
+    , m_IndexGeneration(0)
+    , m_IndexState(IndexState::CLOSED)
+    , m_KeysGeneration(0)
+    , m_PersistenceCountersClaimed(false)
+    , m_PersistenceWritable(false)
+{
+    static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free, "Shared counters must not rely on process-local locks");
+
+    m_PersistenceCounters.downloads = 0;
+    m_PersistenceCounters.totalRequests = 0;
+    m_PersistenceCounters.uploads = 0;
+
+    for (std::atomic<uint32_t>& readers : m_IndexReaders)
+    {
+        readers = 0;
+    }
+
+#ifndef _WIN32
+    const int indexResult = InitializeMutex(m_IndexLock);
+    const int persistenceResult = InitializeMutex(m_PersistenceLock);
+    if (indexResult != 0 || persistenceResult != 0)
+    {
+        throw std::runtime_error(fmt::format("Failed to initialize the locks shared by the workers ({}, {})", indexResult, persistenceResult));
+    }
+#endif // _WIN32
+}
+
+SharedState* SharedState::Create(uint32_t workerCount)
+{
+#ifdef _WIN32
+    return nullptr;
+#else
+    if (workerCount > MaxWorkerCount)
+    {
+        throw std::runtime_error(fmt::format("At most {} worker processes are supported, {} requested", MaxWorkerCount, workerCount));
+    }
+
+    // Anonymous, so the mapping is only inherited by the workers forked afterwards
+    void* memory = ::mmap(nullptr, sizeof(SharedState), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        return nullptr;
+    }
+
+    try
+    {
+        return new (memory) SharedState(workerCount);
+    }
+    catch (...)
+    {
+        ::munmap(memory, sizeof(SharedState));
+        throw;
+    }
+#endif // _WIN32
+}
+
+void SharedState::Destroy(SharedState* state)
+{
+#ifndef _WIN32
+    if (!state)
+    {
+        return;
+    }
+
+    pthread_mutex_destroy(&state->m_IndexLock);
+    pthread_mutex_destroy(&state->m_PersistenceLock);
+    state->~SharedState();
+    ::munmap(state, sizeof(SharedState));
+#endif // _WIN32
+}
+
+void SharedState::SetWorker(SharedState* state, uint32_t workerId)
+{
+    s_Instance = state;
+    s_WorkerId = workerId;
+}
+
+bool SharedState::ReleaseWorker(uint32_t workerId)
+{
+    // Its readers are gone with it
+    m_IndexReaders[workerId].store(0, std::memory_order_seq_cst);
+
+    // Nothing opens the index again until the replacement of the primary worker does
+    if (workerId == 0)
+    {
+        SetPersistenceWritable(false);
+        SetIndexState(IndexState::CLOSED);
+    }
+
+#ifdef __linux__
+    return m_IndexWriter.load(std::memory_order_seq_cst) != workerId + 1;
+#else
+    return false;
+#endif // __linux__
+}
+
+void SharedState::LockIndex()
+{
+#ifndef _WIN32
+    LockMutex(m_IndexLock, "index");
+    m_IndexWriter.store(s_WorkerId + 1, std::memory_order_seq_cst);
+
+    // New readers wait on the mutex, the ones already reading are short
+    for (uint32_t workerId = 0; workerId < m_WorkerCount; ++workerId)
+    {
+        while (m_IndexReaders[workerId].load(std::memory_order_seq_cst) != 0)
+        {
+            std::this_thread::yield();
+        }
+    }
+#endif // _WIN32
+}
+
+void SharedState::UnlockIndex()
+{
+#ifndef _WIN32
+    m_IndexWriter.store(0, std::memory_order_seq_cst);
+    pthread_mutex_unlock(&m_IndexLock);
+#endif // _WIN32
+}
+
+void SharedState::LockIndexShared()
+{
+#ifndef _WIN32
+    std::atomic<uint32_t>& readers = m_IndexReaders[s_WorkerId];
+    while (true)
+    {
+        readers.fetch_add(1, std::memory_order_seq_cst);
+        if (m_IndexWriter.load(std::memory_order_seq_cst) == 0)
+        {
+            return;
+        }
+
+        // Backs off and waits for the writer to release the mutex
+        readers.fetch_sub(1, std::memory_order_seq_cst);
+        LockMutex(m_IndexLock, "index");
+        pthread_mutex_unlock(&m_IndexLock);
+    }
+#endif // _WIN32
+}
+
+void SharedState::UnlockIndexShared()
+{
+#ifndef _WIN32
+    m_IndexReaders[s_WorkerId].fetch_sub(1, std::memory_order_seq_cst);
+#endif // _WIN32
+}
+
+void SharedState::LockPersistence()
+{
+#ifndef _WIN32
+    LockMutex(m_PersistenceLock, "persistence");
+#endif // _WIN32
+}
+
+void SharedState::UnlockPersistence()
+{
+#ifndef _WIN32
+    pthread_mutex_unlock(&m_PersistenceLock);
+#endif // _WIN32
+}
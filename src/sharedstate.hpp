@@ -0,0 +1,159 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif // _WIN32
+
+/**
+ * @brief Counters of the persistence file, shared by the worker processes
+ */
+struct PersistenceCounters
+{
+    std::atomic<uint32_t> downloads;
+    std::atomic<uint32_t> totalRequests;
+    std::atomic<uint32_t> uploads;
+};
+
+/**
+ * @brief State shared by the worker processes started by the Supervisor
+ *
+ * The state lives in an anonymous shared mapping created by the supervisor before it forks the workers,
+ * so every worker sees the same locks and counters. Worker 0 is the primary: it opens and rebuilds the
+ * package index, runs the tier migrations and saves the persistence counters, while the other workers
+ * attach to the index it opened. Writes to the index are serialized across the workers by a robust
+ * process-shared mutex, while each worker counts its readers in its own slot, so the supervisor can release
+ * the locks of a worker which died. The generation of the index tells a worker to remap it after another
+ * worker grew or reset the file.
+ *
+ * A process started without a supervisor has no shared state, Get() returns nullptr.
+ */
+class SharedState final
+{
+public:
+    /**
+     * @brief Progress of the package index, as seen by every worker
+     */
+    enum class IndexState : uint32_t
+    {
+        CLOSED, // Not opened by the primary worker yet
+        OPEN,   // Opened, being rebuilt
+        READY,  // Fully describes the storage tiers
+    };
+
+    static constexpr uint32_t MaxWorkerCount = 64;
+
+    /**
+     * @brief Create the shared state of a set of workers, before forking them
+     * @return The shared state, or nullptr if shared memory is not available on this platform
+     */
+    static SharedState* Create(uint32_t workerCount);
+
+    /**
+     * @brief Unmap a shared state, once every worker using it exited
+     */
+    static void Destroy(SharedState* state);
+
+    /**
+     * @brief Called in a worker right after the fork, makes the state available through Get()
+     */
+    static void SetWorker(SharedState* state, uint32_t workerId);
+
+    /**
+     * @brief Get the shared state of this worker, nullptr if this process was not started by a supervisor
+     */
+    static SharedState* Get() { return s_Instance; }
+
+    /**
+     * @brief Release the locks held by a worker which exited, called by the supervisor once it reaped it
+     * @return false if the worker may have left the index half written, or if its locks cannot be released on
+     *         this platform, the other workers must then be restarted too
+     */
+    bool ReleaseWorker(uint32_t workerId);
+
+    static uint32_t GetWorkerId() { return s_WorkerId; }
+    bool IsPrimary() const { return s_WorkerId == 0; }
+    uint32_t GetWorkerCount() const { return m_WorkerCount; }
+
+    /**
+     * @brief Lock the package index for writing, in every worker
+     */
+    void LockIndex();
+    void UnlockIndex();
+
+    /**
+     * @brief Lock the package index for reading, in every worker
+     */
+    void LockIndexShared();
+    void UnlockIndexShared();
+
+    /**
+     * @brief Get the generation of the index file, increased whenever it is replaced or resized
+     */
+    uint64_t GetIndexGeneration() const { return m_IndexGeneration.load(std::memory_order_acquire); }
+
+    /**
+     * @brief Record that the index file was replaced or resized, with the index locked for writing
+     * @return The new generation
+     */
+    uint64_t IncreaseIndexGeneration() { return m_IndexGeneration.fetch_add(1, std::memory_order_acq_rel) + 1; }
+
+    IndexState GetIndexState() const { return m_IndexState.load(std::memory_order_acquire); }
+    void SetIndexState(IndexState state) { m_IndexState.store(state, std::memory_order_release); }
+
+    /**
+     * @brief Lock the persistence file, in every worker
+     */
+    void LockPersistence();
+    void UnlockPersistence();
+
+    /**
+     * @brief Get the generation of the API keys, increased whenever a worker saves a change to them
+     */
+    uint64_t GetKeysGeneration() const { return m_KeysGeneration.load(std::memory_order_acquire); }
+
+    /**
+     * @brief Record that the API keys were saved, with the persistence file locked
+     * @return The new generation
+     */
+    uint64_t IncreaseKeysGeneration() { return m_KeysGeneration.fetch_add(1, std::memory_order_acq_rel) + 1; }
+
+    PersistenceCounters& GetPersistenceCounters() { return m_PersistenceCounters; }
+
+    /**
+     * @brief Claim the loading of the persistence counters, so a restarted primary worker does not count them twice
+     * @return true the first time only
+     */
+    bool ClaimPersistenceCounters() { return !m_PersistenceCountersClaimed.exchange(true, std::memory_order_acq_rel); }
+
+    /**
+     * @brief Whether the workers may save the persistence file, false until the primary worker owns the instance lock
+     */
+    bool IsPersistenceWritable() const { return m_PersistenceWritable.load(std::memory_order_acquire); }
+    void SetPersistenceWritable(bool writable) { m_PersistenceWritable.store(writable, std::memory_order_release); }
+
+private:
+    explicit SharedState(uint32_t workerCount);
+
+private:
+    static SharedState* s_Instance;
+    static uint32_t s_WorkerId;
+
+    const uint32_t m_WorkerCount;
+
+#ifndef _WIN32
+    pthread_mutex_t m_IndexLock;
+    pthread_mutex_t m_PersistenceLock;
+#endif // _WIN32
+
+    std::atomic<uint32_t> m_IndexWriter; // Id of the worker holding the index for writing plus one, 0 if none
+    std::atomic<uint32_t> m_IndexReaders[MaxWorkerCount];
+    std::atomic<uint64_t> m_IndexGeneration;
+    std::atomic<IndexState> m_IndexState;
+    std::atomic<uint64_t> m_KeysGeneration;
+    PersistenceCounters m_PersistenceCounters;
+    std::atomic<bool> m_PersistenceCountersClaimed;
+    std::atomic<bool> m_PersistenceWritable;
+};
@@ -0,0 +1,516 @@
+#include <storagetiers.hpp>
+
+#include <options.hpp>
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <iostream>
+#include <string_view>
+#include <vector>
+
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif // __linux__
+
+// Amount of data copied between two rate limiter checks
+static constexpr uint64_t MigrationChunkSize = 1024 * 1024;
+
+// Promotions requested while this many are already queued are dropped, the next read will request them again
+static constexpr size_t MaxPendingPromotions = 1024;
+
+static int64_t GetUnixTime()
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static bool SplitPackagePath(std::string_view relativePath, std::array<std::string, 4>& parts)
+{
+    // Index paths are triplet/name/version/sha.zip
+    for (size_t i = 0; i < 3; ++i)
+    {
+        const size_t separator = relativePath.find('/');
+        if (separator == std::string_view::npos)
+        {
+            return false;
+        }
+
+        parts[i] = relativePath.substr(0, separator);
+        relativePath.remove_prefix(separator + 1);
+    }
+
+    if (relativePath.size() <= 4 || relativePath.substr(relativePath.size() - 4) != ".zip")
+    {
+        return false;
+    }
+
+    parts[3] = relativePath.substr(0, relativePath.size() - 4);
+    return true;
+}
+
+StorageTiers::Tier::Tier(const std::filesystem::path& directory, uint64_t capacity)
+    : directory(directory)
+    , prefix((directory / "").string())
+    , capacity(capacity)
+{
+}
+
+StorageTiers::StorageTiers(const Options& options, PackageIndex* packageIndex)
+    : m_PackageIndex(packageIndex)
+    , m_PromoteOnRead(options.tiering.promoteOnRead)
+    , m_HighWatermark(options.tiering.highWatermark)
+    , m_LowWatermark(std::min(options.tiering.lowWatermark, options.tiering.highWatermark))
+    , m_MigrationRate(options.tiering.migrationRate)
+    , m_Interval(std::max<uint32_t>(1, options.tiering.interval))
+    , m_IoPriority(IoPriorityFromString(options.tiering.ioPriority).value_or(IoPriority::IDLE))
+    , m_CheckRequested(false)
+    , m_ShouldContinue(false)
+    , m_PromotedCount(0)
+    , m_DemotedCount(0)
+    , m_MigratedBytes(0)
+{
+    m_Tiers.push_back(Tier{ options.cache.directory, options.cache.capacity });
+    for (const Options::CacheProperties::TierProperties& tier : options.cache.tiers)
+    {
+        m_Tiers.push_back(Tier{ tier.directory, tier.capacity });
+    }
+
+    if (m_Tiers.size() > PackageIndex::MaxTiers)
+    {
+        throw std::runtime_error(fmt::format("At most {} cache tiers are supported ({} configured).", PackageIndex::MaxTiers, m_Tiers.size()));
+    }
+
+    for (const Tier& tier : m_Tiers)
+    {
+        if (!std::filesystem::exists(tier.directory))
+        {
+            std::filesystem::create_directories(tier.directory);
+        }
+    }
+}
+
+StorageTiers::~StorageTiers()
+{
+    Stop();
+}
+
+void StorageTiers::Start()
+{
+    // A single tier has nothing to migrate, and migrations rely on the index for usage and access times
+    if (m_Tiers.size() < 2 || !m_PackageIndex || m_Thread.joinable())
+    {
+        return;
+    }
+
+    m_ShouldContinue = true;
+    m_Thread = std::thread(&StorageTiers::MigrationThread, this);
+}
+
+void StorageTiers::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_ShouldContinue = false;
+        m_Promotions.clear();
+        m_PendingPromotions.clear();
+    }
+    m_Condition.notify_all();
+
+    if (m_Thread.joinable())
+    {
+        m_Thread.join();
+    }
+}
+
+std::optional<PackageIndex::Entry> StorageTiers::Probe(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha) const
+{
+    for (size_t tier = 0; tier < m_Tiers.size(); ++tier)
+    {
+        const std::filesystem::path packagePath = GetPackagePath(tier, triplet, name, version, sha);
+
+        std::error_code error;
+        const uint64_t size = std::filesystem::file_size(packagePath, error);
+        if (error)
+        {
+            continue;
+        }
+
+        const std::filesystem::file_time_type modifiedTime = std::filesystem::last_write_time(packagePath, error);
+        const int64_t unixTime = error ? 0 : std::chrono::duration_cast<std::chrono::seconds>(std::chrono::file_clock::to_sys(modifiedTime).time_since_epoch()).count();
+
+        return PackageIndex::Entry{ size, unixTime, 0, static_cast<uint8_t>(tier) };
+    }
+
+    return std::nullopt;
+}
+
+void StorageTiers::OnRead(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha, const PackageIndex::Entry& entry)
+{
+    if (m_PackageIndex)
+    {
+        m_PackageIndex->Touch(triplet, name, version, sha, GetUnixTime());
+    }
+
+    if (entry.tier == 0 || !m_PromoteOnRead || !m_ShouldContinue)
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (m_Promotions.size() >= MaxPendingPromotions || !m_PendingPromotions.insert(fmt::format("{}/{}/{}/{}", triplet, name, version, sha)).second)
+        {
+            return;
+        }
+
+        m_Promotions.push_back(Migration{ std::string(triplet), std::string(name), std::string(version), std::string(sha), entry.size, entry.tier, 0 });
+    }
+    m_Condition.notify_one();
+}
+
+void StorageTiers::OnWrite(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha, std::optional<uint8_t> previousTier)
+{
+    if (previousTier.has_value() && previousTier.value() != 0 && previousTier.value() < m_Tiers.size())
+    {
+        std::error_code error;
+        std::filesystem::remove(GetPackagePath(previousTier.value(), triplet, name, version, sha), error);
+    }
+
+    if (m_ShouldContinue && IsAboveHighWatermark(0))
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_CheckRequested = true;
+        }
+        m_Condition.notify_one();
+    }
+}
+
+std::filesystem::path StorageTiers::GetPackagePath(size_t tier, std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha) const
+{
+    // Every tier uses the vcpkg structure: triplet/name/version/sha.zip
+    return m_Tiers[tier].directory / triplet / name / version / fmt::format("{}.zip", sha);
+}
+
+void StorageTiers::GetPackagePath(std::string& out, size_t tier, std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha) const
+{
+    constexpr char Separator = static_cast<char>(std::filesystem::path::preferred_separator);
+
+    out.assign(m_Tiers[tier].prefix);
+    out.append(triplet);
+    out += Separator;
+    out.append(name);
+    out += Separator;
+    out.append(version);
+    out += Separator;
+    out.append(sha);
+    out.append(".zip");
+}
+
+void StorageTiers::SetDirectory(size_t tier, const std::filesystem::path& directory)
+{
+    m_Tiers[tier] = Tier(directory, m_Tiers[tier].capacity);
+    if (!std::filesystem::exists(directory))
+    {
+        std::filesystem::create_directories(directory);
+    }
+}
+
+std::vector<std::filesystem::path> StorageTiers::GetDirectories() const
+{
+    std::vector<std::filesystem::path> directories;
+    directories.reserve(m_Tiers.size());
+    for (const Tier& tier : m_Tiers)
+    {
+        directories.push_back(tier.directory);
+    }
+    return directories;
+}
+
+void StorageTiers::MigrationThread()
+{
+    ThreadPlacement::Apply(ThreadRole::DISK);
+    SetCurrentThreadIoPriority(m_IoPriority);
+
+    std::chrono::steady_clock::time_point nextCheck = std::chrono::steady_clock::now();
+    while (true)
+    {
+        std::optional<Migration> promotion;
+        bool checkCapacity = false;
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_Condition.wait_until(lock, nextCheck, [this]() { return !m_ShouldContinue || m_CheckRequested || !m_Promotions.empty(); });
+            if (!m_ShouldContinue)
+            {
+                break;
+            }
+
+            if (!m_Promotions.empty())
+            {
+                promotion = std::move(m_Promotions.front());
+                m_Promotions.pop_front();
+            }
+
+            checkCapacity = m_CheckRequested || std::chrono::steady_clock::now() >= nextCheck;
+            m_CheckRequested = false;
+        }
+
+        if (checkCapacity)
+        {
+            // Demote from the fastest tier down so that a cascade settles in a single pass
+            for (size_t tier = 0; tier + 1 < m_Tiers.size() && m_ShouldContinue; ++tier)
+            {
+                Demote(tier);
+            }
+            nextCheck = std::chrono::steady_clock::now() + m_Interval;
+        }
+
+        if (promotion.has_value())
+        {
+            // Promoting into a full tier would only trigger a demotion of something more recently used
+            if (!IsAboveHighWatermark(promotion->to, promotion->size) && Migrate(promotion.value()))
+            {
+                ++m_PromotedCount;
+            }
+
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_PendingPromotions.erase(fmt::format("{}/{}/{}/{}", promotion->triplet, promotion->name, promotion->version, promotion->sha));
+        }
+    }
+}
+
+void StorageTiers::Demote(size_t tier)
+{
+    const uint64_t capacity = m_Tiers[tier].capacity;
+    if (!IsAboveHighWatermark(tier))
+    {
+        return;
+    }
+
+    struct Candidate
+    {
+        std::string relativePath;
+        int64_t lastUse;
+        uint64_t size;
+    };
+
+    std::vector<Candidate> candidates;
+    m_PackageIndex->ForEach([&candidates, tier](std::string_view relativePath, const PackageIndex::Entry& entry)
+    {
+        if (entry.tier == tier && !relativePath.empty())
+        {
+            candidates.push_back(Candidate{ std::string(relativePath), std::max(entry.lastAccess, entry.modifiedTime), entry.size });
+        }
+    });
+
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate& lhs, const Candidate& rhs)
+    {
+        return lhs.lastUse < rhs.lastUse;
+    });
+
+    const uint64_t target = capacity / 100 * m_LowWatermark;
+    uint64_t used = m_PackageIndex->GetTierSize(tier);
+    uint64_t demoted = 0;
+
+    for (const Candidate& candidate : candidates)
+    {
+        if (used <= target || !m_ShouldContinue)
+        {
+            break;
+        }
+
+        std::array<std::string, 4> parts;
+        if (!SplitPackagePath(candidate.relativePath, parts))
+        {
+            continue;
+        }
+
+        if (Migrate(Migration{ parts[0], parts[1], parts[2], parts[3], candidate.size, tier, tier + 1 }))
+        {
+            used -= std::min(used, candidate.size);
+            ++demoted;
+            ++m_DemotedCount;
+        }
+    }
+
+    if (demoted > 0)
+    {
+        std::cout << "Demoted " << demoted << " packages from " << m_Tiers[tier].directory.string() << " to " << m_Tiers[tier + 1].directory.string() << std::endl;
+    }
+}
+
+bool StorageTiers::Migrate(const Migration& migration)
+{
+    const std::filesystem::path source = GetPackagePath(migration.from, migration.triplet, migration.name, migration.version, migration.sha);
+    const std::filesystem::path destination = GetPackagePath(migration.to, migration.triplet, migration.name, migration.version, migration.sha);
+
+    // The scanner only picks up .zip files, so a copy interrupted by a crash is never indexed
+    std::filesystem::path temporary = destination;
+    temporary += ".migrating";
+
+    std::error_code error;
+    try
+    {
+        std::filesystem::create_directories(destination.parent_path());
+
+        if (!CopyPackage(source, temporary))
+        {
+            std::filesystem::remove(temporary, error);
+            return false;
+        }
+
+        std::filesystem::last_write_time(temporary, std::filesystem::last_write_time(source));
+        std::filesystem::rename(temporary, destination);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Error migrating " << source.string() << ": " << e.what() << std::endl;
+        std::filesystem::remove(temporary, error);
+        return false;
+    }
+
+    // Readers that resolved the old tier just before the switch retry through the index
+    m_PackageIndex->SetTier(migration.triplet, migration.name, migration.version, migration.sha, static_cast<uint8_t>(migration.to));
+    std::filesystem::remove(source, error);
+
+    m_MigratedBytes += migration.size;
+    return true;
+}
+
+#ifdef __linux__
+bool StorageTiers::CopyPackage(const std::filesystem::path& source, const std::filesystem::path& destination)
+{
+    const int sourceFd = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (sourceFd < 0)
+    {
+        return false;
+    }
+
+    const int destinationFd = ::open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (destinationFd < 0)
+    {
+        ::close(sourceFd);
+        return false;
+    }
+
+    // Tiers sharing a copy-on-write file system (btrfs, XFS) only need the extents to be shared
+    bool success = ::ioctl(destinationFd, FICLONE, sourceFd) == 0;
+    if (!success)
+    {
+        bool useReadWrite = false;
+        std::vector<char> buffer;
+
+        success = true;
+        while (true)
+        {
+            ssize_t copied = -1;
+            if (!useReadWrite)
+            {
+                // Lets the kernel (or the NFS server with server-side copy) move the data without a round trip through user space
+                copied = ::copy_file_range(sourceFd, nullptr, destinationFd, nullptr, MigrationChunkSize, 0);
+                if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+                {
+                    useReadWrite = true;
+                    buffer.resize(MigrationChunkSize);
+                }
+            }
+
+            if (useReadWrite)
+            {
+                copied = ::read(sourceFd, buffer.data(), buffer.size());
+                for (ssize_t written = 0; copied > 0 && written < copied; )
+                {
+                    const ssize_t result = ::write(destinationFd, buffer.data() + written, copied - written);
+                    if (result < 0)
+                    {
+                        copied = -1;
+                        break;
+                    }
+                    written += result;
+                }
+            }
+
+            if (copied <= 0)
+            {
+                success = copied == 0;
+                break;
+            }
+
+            if (!Throttle(copied))
+            {
+                success = false;
+                break;
+            }
+        }
+    }
+
+    // The original is deleted once the copy is in place, so the copy must be on disk first
+    success = success && ::fdatasync(destinationFd) == 0;
+
+    ::close(destinationFd);
+    ::close(sourceFd);
+    return success;
+}
+#else
+bool StorageTiers::CopyPackage(const std::filesystem::path& source, const std::filesystem::path& destination)
+{
+    std::ifstream input(source, std::ios::binary);
+    std::ofstream output(destination, std::ios::binary | std::ios::trunc);
+    if (!input.is_open() || !output.is_open())
+    {
+        return false;
+    }
+
+    std::vector<char> buffer(MigrationChunkSize);
+    while (input)
+    {
+        input.read(buffer.data(), buffer.size());
+        const std::streamsize copied = input.gcount();
+        if (copied <= 0)
+        {
+            break;
+        }
+
+        if (!output.write(buffer.data(), copied) || !Throttle(copied))
+        {
+            return false;
+        }
+    }
+
+    output.flush();
+    return !input.bad() && output.good();
+}
+#endif // __linux__
+
+bool StorageTiers::Throttle(uint64_t bytes)
+{
+    if (m_MigrationRate == 0)
+    {
+        return m_ShouldContinue;
+    }
+
+    // Token bucket without burst: every chunk pushes back the time the next one may start
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    m_NextTransfer = std::max(m_NextTransfer, now) + std::chrono::microseconds(bytes * 1000000 / m_MigrationRate);
+
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_Condition.wait_until(lock, m_NextTransfer, [this]() { return !m_ShouldContinue; });
+    return m_ShouldContinue;
+}
+
+bool StorageTiers::IsAboveHighWatermark(size_t tier, uint64_t extraBytes) const
+{
+    const uint64_t capacity = m_Tiers[tier].capacity;
+    if (capacity == 0 || !m_PackageIndex)
+    {
+        return false;
+    }
+
+    return m_PackageIndex->GetTierSize(tier) + extraBytes > capacity / 100 * m_HighWatermark;
+}
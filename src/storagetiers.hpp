@@ -0,0 +1,161 @@
+#pragma once
+
+#include <packageindex.hpp>
+#include <threadutils.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+struct Options;
+
+/**
+ * @brief Ordered set of storage tiers holding the packages, from the fastest to the slowest
+ *
+ * New uploads are written to the first tier. A background thread demotes the least recently used
+ * packages to the next tier when a tier goes above its high watermark, and promotes packages read
+ * from a slower tier back to the first one. Migrations are rate-limited so they do not compete with
+ * request handling for disk bandwidth. Tier usage and access times are tracked by the package index,
+ * so migrations only run while an index is available.
+ */
+class StorageTiers final
+{
+public:
+    /**
+     * @brief Constructor
+     * @param options Server options (cache directory and tiers, tiering settings)
+     * @param packageIndex Package index tracking tier usage, or nullptr if the index is disabled
+     */
+    StorageTiers(const Options& options, PackageIndex* packageIndex);
+    ~StorageTiers();
+
+    /**
+     * @brief Start the migration thread, once the package index is complete
+     */
+    void Start();
+
+    /**
+     * @brief Stop the migration thread, waiting for the current migration to finish
+     */
+    void Stop();
+
+    /**
+     * @brief Locate a package by probing every tier on disk, fastest first
+     * @return The package entry, or std::nullopt if no tier holds the package
+     */
+    std::optional<PackageIndex::Entry> Probe(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha) const;
+
+    /**
+     * @brief Record a read, and schedule a promotion if the package lives on a slower tier
+     */
+    void OnRead(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha, const PackageIndex::Entry& entry);
+
+    /**
+     * @brief Record an upload to the first tier, removing the stale copy from the tier previously holding the package
+     */
+    void OnWrite(std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha, std::optional<uint8_t> previousTier);
+
+    /**
+     * @brief Get the file path of a package on a tier
+     */
+    std::filesystem::path GetPackagePath(size_t tier, std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha) const;
+
+    /**
+     * @brief Write the file path of a package on a tier to a string, reusing its capacity
+     */
+    void GetPackagePath(std::string& out, size_t tier, std::string_view triplet, std::string_view name, std::string_view version, std::string_view sha) const;
+
+    /**
+     * @brief Change the directory of a tier, only allowed while the migration thread is stopped
+     */
+    void SetDirectory(size_t tier, const std::filesystem::path& directory);
+
+    size_t GetTierCount() const { return m_Tiers.size(); }
+    const std::filesystem::path& GetDirectory(size_t tier) const { return m_Tiers[tier].directory; }
+    std::vector<std::filesystem::path> GetDirectories() const;
+    uint64_t GetCapacity(size_t tier) const { return m_Tiers[tier].capacity; }
+
+    uint64_t GetPromotedCount() const { return m_PromotedCount; }
+    uint64_t GetDemotedCount() const { return m_DemotedCount; }
+    uint64_t GetMigratedBytes() const { return m_MigratedBytes; }
+
+private:
+    struct Tier
+    {
+        Tier(const std::filesystem::path& directory, uint64_t capacity);
+
+        std::filesystem::path directory;
+        std::string prefix; // Directory as a string ending with a separator, to build paths without temporaries
+        uint64_t capacity;
+    };
+
+    struct Migration
+    {
+        std::string triplet;
+        std::string name;
+        std::string version;
+        std::string sha;
+        uint64_t size;
+        size_t from;
+        size_t to;
+    };
+
+    void MigrationThread();
+
+    /**
+     * @brief Move the least recently used packages of a tier to the next one until it is back under its low watermark
+     */
+    void Demote(size_t tier);
+
+    /**
+     * @brief Copy a package to another tier, then switch the index over and delete the original
+     */
+    bool Migrate(const Migration& migration);
+
+    /**
+     * @brief Copy the content of a file, reflinking it when the file system allows it
+     */
+    bool CopyPackage(const std::filesystem::path& source, const std::filesystem::path& destination);
+
+    /**
+     * @brief Wait until transferring the given amount of bytes fits in the migration rate
+     * @return false if the migration thread is stopping
+     */
+    bool Throttle(uint64_t bytes);
+
+    bool IsAboveHighWatermark(size_t tier, uint64_t extraBytes = 0) const;
+
+private:
+    std::vector<Tier> m_Tiers;
+    PackageIndex* m_PackageIndex;
+
+    bool m_PromoteOnRead;
+    uint32_t m_HighWatermark;
+    uint32_t m_LowWatermark;
+    uint64_t m_MigrationRate;
+    std::chrono::seconds m_Interval;
+    IoPriority m_IoPriority;
+
+    std::mutex m_Mutex;
+    std::condition_variable m_Condition;
+    std::deque<Migration> m_Promotions;
+    std::unordered_set<std::string> m_PendingPromotions;
+    bool m_CheckRequested;
+    std::atomic<bool> m_ShouldContinue;
+    std::thread m_Thread;
+    std::chrono::steady_clock::time_point m_NextTransfer;
+
+    std::atomic<uint64_t> m_PromotedCount;
+    std::atomic<uint64_t> m_DemotedCount;
+    std::atomic<uint64_t> m_MigratedBytes;
+};
@@ -0,0 +1,253 @@
+#include <supervisor.hpp>
+
+#ifndef _WIN32
+
+#include <sharedstate.hpp>
+
+#include <fmt/core.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif // __linux__
+
+// Delay before starting a worker again, so a worker failing on start does not spin the supervisor
+static constexpr std::chrono::seconds RestartDelay{ 1 };
+
+static constexpr std::chrono::milliseconds ReapInterval{ 50 };
+
+Supervisor::Supervisor(uint32_t workerCount, std::chrono::seconds stopTimeout)
+    : m_WorkerCount(workerCount)
+    , m_StopTimeout(stopTimeout)
+    , m_SharedState(nullptr)
+    , m_Workers(workerCount, 0)
+{
+    sigemptyset(&m_Signals);
+    sigaddset(&m_Signals, SIGTERM);
+    sigaddset(&m_Signals, SIGINT);
+    sigaddset(&m_Signals, SIGCHLD);
+    sigaddset(&m_Signals, SIGUSR2);
+    sigemptyset(&m_PreviousMask);
+}
+
+std::optional<uint32_t> Supervisor::Run()
+{
+    // Signals are received with sigwaitinfo(), the workers restore the previous mask after the fork
+    if (sigprocmask(SIG_BLOCK, &m_Signals, &m_PreviousMask) != 0)
+    {
+        throw std::runtime_error(fmt::format("Failed to block the signals of the supervisor: {}", std::strerror(errno)));
+    }
+
+    while (true)
+    {
+        m_SharedState = SharedState::Create(m_WorkerCount);
+        if (!m_SharedState)
+        {
+            throw std::runtime_error("Failed to create the state shared by the workers");
+        }
+
+        std::cout << "Starting " << m_WorkerCount << " worker processes" << std::endl;
+        for (uint32_t workerId = 0; workerId < m_WorkerCount; ++workerId)
+        {
+            if (const std::optional<uint32_t> worker = Spawn(workerId))
+            {
+                return worker;
+            }
+        }
+
+        std::optional<uint32_t> worker;
+        const int signal = Supervise(worker);
+        if (worker.has_value())
+        {
+            return worker;
+        }
+
+        StopWorkers(signal != 0 ? signal : SIGTERM);
+
+        SharedState::Destroy(m_SharedState);
+        m_SharedState = nullptr;
+
+        if (signal != 0)
+        {
+            std::cout << "Every worker process stopped" << std::endl;
+            return std::nullopt;
+        }
+
+        std::this_thread::sleep_for(RestartDelay);
+    }
+}
+
+std::optional<uint32_t> Supervisor::Spawn(uint32_t workerId)
+{
+    const pid_t pid = fork();
+    if (pid < 0)
+    {
+        // Without every worker, the ones already started would serve a partial set
+        StopWorkers(SIGTERM);
+        throw std::runtime_error(fmt::format("Failed to start worker {}: {}", workerId, std::strerror(errno)));
+    }
+
+    if (pid == 0)
+    {
+        // Ctrl+C reaches the supervisor alone, which stops the workers in order
+        setpgid(0, 0);
+#ifdef __linux__
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif // __linux__
+        sigprocmask(SIG_SETMASK, &m_PreviousMask, nullptr);
+
+        SharedState::SetWorker(m_SharedState, workerId);
+        return workerId;
+    }
+
+    m_Workers[workerId] = pid;
+    std::cout << "Worker " << workerId << " started with pid " << pid << std::endl;
+    return std::nullopt;
+}
+
+int Supervisor::Supervise(std::optional<uint32_t>& worker)
+{
+    while (true)
+    {
+        siginfo_t info;
+        const int signal = sigwaitinfo(&m_Signals, &info);
+        if (signal < 0)
+        {
+            continue;
+        }
+
+        if (signal == SIGCHLD)
+        {
+            const std::vector<uint32_t> exited = ReapWorkers();
+            if (exited.empty())
+            {
+                continue;
+            }
+
+            bool released = true;
+            for (uint32_t workerId : exited)
+            {
+                released = m_SharedState->ReleaseWorker(workerId) && released;
+            }
+
+            if (!released)
+            {
+                std::cout << "Restarting every worker process" << std::endl;
+                return 0;
+            }
+
+            std::this_thread::sleep_for(RestartDelay);
+            for (uint32_t workerId : exited)
+            {
+                std::cout << "Restarting worker " << workerId << std::endl;
+                worker = Spawn(workerId);
+                if (worker.has_value())
+                {
+                    return 0;
+                }
+            }
+            continue;
+        }
+
+        if (signal == SIGUSR2)
+        {
+            std::cout << "Replaced by a new instance, draining the worker processes" << std::endl;
+            return SIGUSR2;
+        }
+
+        std::cout << "Stopping the worker processes" << std::endl;
+        return SIGTERM;
+    }
+}
+
+void Supervisor::StopWorkers(int signal)
+{
+    const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + m_StopTimeout;
+
+    for (uint32_t workerId = 1; workerId < m_WorkerCount; ++workerId)
+    {
+        if (m_Workers[workerId] != 0)
+        {
+            kill(m_Workers[workerId], signal);
+        }
+    }
+
+    for (uint32_t workerId = 1; workerId < m_WorkerCount; ++workerId)
+    {
+        WaitWorker(workerId, deadline);
+    }
+
+    // Last one to write to the index
+    if (m_Workers[0] != 0)
+    {
+        kill(m_Workers[0], signal);
+        WaitWorker(0, std::chrono::steady_clock::now() + m_StopTimeout);
+    }
+}
+
+void Supervisor::WaitWorker(uint32_t workerId, std::chrono::steady_clock::time_point deadline)
+{
+    const pid_t pid = m_Workers[workerId];
+    if (pid == 0)
+    {
+        return;
+    }
+
+    int status = 0;
+    while (waitpid(pid, &status, WNOHANG) == 0)
+    {
+        if (std::chrono::steady_clock::now() >= deadline)
+        {
+            std::cerr << "Worker " << workerId << " did not stop in time, killing it" << std::endl;
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            break;
+        }
+
+        std::this_thread::sleep_for(ReapInterval);
+    }
+
+    m_Workers[workerId] = 0;
+}
+
+std::vector<uint32_t> Supervisor::ReapWorkers()
+{
+    std::vector<uint32_t> exited;
+
+    int status = 0;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        for (uint32_t workerId = 0; workerId < m_WorkerCount; ++workerId)
+        {
+            if (m_Workers[workerId] != pid)
+            {
+                continue;
+            }
+
+            if (WIFSIGNALED(status))
+            {
+                std::cerr << "Worker " << workerId << " (pid " << pid << ") was killed by signal " << WTERMSIG(status) << std::endl;
+            }
+            else
+            {
+                std::cerr << "Worker " << workerId << " (pid " << pid << ") exited with status " << WEXITSTATUS(status) << std::endl;
+            }
+
+            m_Workers[workerId] = 0;
+            exited.push_back(workerId);
+        }
+    }
+
+    return exited;
+}
+
+#endif // _WIN32
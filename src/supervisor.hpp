@@ -0,0 +1,89 @@
+#pragma once
+
+#ifndef _WIN32
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include <signal.h>
+#include <sys/types.h>
+
+class SharedState;
+
+/**
+ * @brief Forks worker processes serving the same port with SO_REUSEPORT, and keeps them running
+ *
+ * Every worker runs its own Drogon application with its own event loops and allocator, while the
+ * package index and the persistence counters are shared through a SharedState. The kernel spreads the
+ * incoming connections between the listening sockets of the workers.
+ *
+ * A worker that exits on its own is started again alone, once the supervisor released the shared locks it
+ * held; a new primary worker rebuilds the index, which it finds not flagged as clean. A worker which died
+ * while writing to the index may have left it half written, so the supervisor then stops every other worker
+ * and starts a new set instead. On
+ * SIGTERM or SIGINT, the secondary workers are stopped first, so that the primary worker is the last one
+ * to write to the index and can flag it as clean. SIGUSR2, sent by a new instance taking over, is forwarded
+ * the same way so the workers drain their connections before exiting.
+ */
+class Supervisor final
+{
+public:
+    /**
+     * @brief Constructor
+     * @param workerCount Number of worker processes, worker 0 being the primary one
+     * @param stopTimeout Time given to the workers to drain their connections and exit before they are killed
+     */
+    Supervisor(uint32_t workerCount, std::chrono::seconds stopTimeout);
+
+    /**
+     * @brief Fork the workers and supervise them until the supervisor is asked to stop
+     * @return The id of the worker in a worker process, which continues to start its server, or
+     *         std::nullopt in the supervisor once every worker exited
+     */
+    std::optional<uint32_t> Run();
+
+private:
+    /**
+     * @brief Fork a worker
+     * @return The id of the worker in the worker process, std::nullopt in the supervisor
+     */
+    std::optional<uint32_t> Spawn(uint32_t workerId);
+
+    /**
+     * @brief Wait for a stop signal, restarting the workers which exit meanwhile
+     * @param worker Set to the id of the worker in a restarted worker process
+     * @return The signal to stop the workers with, SIGTERM or SIGUSR2, or 0 if every worker must be restarted
+     *         or if this is a restarted worker process
+     */
+    int Supervise(std::optional<uint32_t>& worker);
+
+    /**
+     * @brief Stop the workers still running, secondary workers first
+     * @param signal Signal sent to the workers, SIGUSR2 to let them drain their connections
+     */
+    void StopWorkers(int signal);
+
+    /**
+     * @brief Wait for a worker to exit, killing it once the deadline is reached
+     */
+    void WaitWorker(uint32_t workerId, std::chrono::steady_clock::time_point deadline);
+
+    /**
+     * @brief Reap the workers which exited, without blocking
+     * @return The ids of the workers which exited
+     */
+    std::vector<uint32_t> ReapWorkers();
+
+private:
+    const uint32_t m_WorkerCount;
+    const std::chrono::seconds m_StopTimeout;
+
+    SharedState* m_SharedState;
+    std::vector<pid_t> m_Workers; // 0 once a worker exited
+    sigset_t m_Signals;
+    sigset_t m_PreviousMask;
+};
+
+#endif // _WIN32
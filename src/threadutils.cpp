@@ -0,0 +1,242 @@
+#include <threadutils.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <fstream>
+#include <string_view>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Not exposed by glibc, see linux/ioprio.h
+static constexpr int IoPrioClassShift = 13;
+static constexpr int IoPrioClassBestEffort = 2;
+static constexpr int IoPrioClassIdle = 3;
+static constexpr int IoPrioWhoProcess = 1;
+
+// Not exposed by glibc either, see linux/mempolicy.h
+static constexpr int MpolLocal = 4;
+
+// CPUs an affinity mask can hold
+static constexpr uint32_t MaxCpuCount = CPU_SETSIZE;
+#else
+static constexpr uint32_t MaxCpuCount = 1024;
+#endif // __linux__
+
+std::array<std::vector<uint32_t>, static_cast<size_t>(ThreadRole::COUNT)> ThreadPlacement::s_Cpus;
+
+std::string ToString(IoPriority priority)
+{
+    switch (priority)
+    {
+    case IoPriority::NORMAL:
+        return "normal";
+    case IoPriority::LOW:
+        return "low";
+    case IoPriority::IDLE:
+        return "idle";
+    default:
+        return "unknown";
+    }
+}
+
+std::optional<IoPriority> IoPriorityFromString(const std::string& str)
+{
+    std::string lower = str;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+
+    if (lower == "normal")
+    {
+        return IoPriority::NORMAL;
+    }
+    if (lower == "low")
+    {
+        return IoPriority::LOW;
+    }
+    if (lower == "idle")
+    {
+        return IoPriority::IDLE;
+    }
+
+    return std::nullopt;
+}
+
+bool SetCurrentThreadIoPriority(IoPriority priority)
+{
+#ifdef __linux__
+    int value = 0;
+    switch (priority)
+    {
+    case IoPriority::NORMAL:
+        value = (IoPrioClassBestEffort << IoPrioClassShift) | 4;
+        break;
+    case IoPriority::LOW:
+        value = (IoPrioClassBestEffort << IoPrioClassShift) | 7;
+        break;
+    case IoPriority::IDLE:
+        value = IoPrioClassIdle << IoPrioClassShift;
+        break;
+    }
+
+    // With IOPRIO_WHO_PROCESS, a thread id targets that single thread
+    return syscall(SYS_ioprio_set, IoPrioWhoProcess, static_cast<int>(syscall(SYS_gettid)), value) == 0;
+#else
+    return false;
+#endif // __linux__
+}
+
+std::string ToString(ThreadRole role)
+{
+    switch (role)
+    {
+    case ThreadRole::IO:
+        return "io";
+    case ThreadRole::DISK:
+        return "disk";
+    case ThreadRole::BACKGROUND:
+        return "background";
+    default:
+        return "unknown";
+    }
+}
+
+static std::optional<uint32_t> ParseCpu(std::string_view str)
+{
+    uint32_t value = 0;
+    const std::from_chars_result result = std::from_chars(str.data(), str.data() + str.size(), value);
+    if (result.ec != std::errc() || result.ptr != str.data() + str.size())
+    {
+        return std::nullopt;
+    }
+    return value;
+}
+
+static std::optional<std::vector<uint32_t>> ParseCpuList(std::string_view str, bool allowNodes)
+{
+    std::vector<uint32_t> cpus;
+
+    while (!str.empty())
+    {
+        const size_t comma = str.find(',');
+        std::string_view token = str.substr(0, comma);
+        str = comma == std::string_view::npos ? std::string_view() : str.substr(comma + 1);
+
+        while (!token.empty() && std::isspace(static_cast<unsigned char>(token.front())))
+        {
+            token.remove_prefix(1);
+        }
+        while (!token.empty() && std::isspace(static_cast<unsigned char>(token.back())))
+        {
+            token.remove_suffix(1);
+        }
+        if (token.empty())
+        {
+            continue;
+        }
+
+        if (token.substr(0, 5) == "node:")
+        {
+            // The kernel lists the CPUs of a node in the same format
+            const std::optional<uint32_t> node = ParseCpu(token.substr(5));
+            if (!allowNodes || !node.has_value())
+            {
+                return std::nullopt;
+            }
+
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node.value()) + "/cpulist");
+            std::string nodeCpus;
+            if (!file.is_open() || !std::getline(file, nodeCpus))
+            {
+                return std::nullopt;
+            }
+
+            const std::optional<std::vector<uint32_t>> parsed = ParseCpuList(nodeCpus, false);
+            if (!parsed.has_value())
+            {
+                return std::nullopt;
+            }
+            cpus.insert(cpus.end(), parsed->begin(), parsed->end());
+            continue;
+        }
+
+        const size_t dash = token.find('-');
+        const std::optional<uint32_t> first = ParseCpu(token.substr(0, dash));
+        const std::optional<uint32_t> last = dash == std::string_view::npos ? first : ParseCpu(token.substr(dash + 1));
+
+        // Checked before expanding the range, which would otherwise never end for the largest value
+        if (!first.has_value() || !last.has_value() || last.value() < first.value() || last.value() >= MaxCpuCount)
+        {
+            return std::nullopt;
+        }
+
+        for (uint32_t cpu = first.value(); cpu <= last.value(); ++cpu)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+
+    return cpus;
+}
+
+std::optional<std::vector<uint32_t>> ParseCpuList(const std::string& str)
+{
+    return ParseCpuList(std::string_view(str), true);
+}
+
+bool SetCurrentThreadAffinity(const std::vector<uint32_t>& cpus)
+{
+#ifdef __linux__
+    if (cpus.empty())
+    {
+        return false;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (uint32_t cpu : cpus)
+    {
+        if (cpu >= CPU_SETSIZE)
+        {
+            return false;
+        }
+        CPU_SET(cpu, &set);
+    }
+
+    // With a thread id of 0, only the calling thread is affected
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    {
+        return false;
+    }
+
+    // Overrides an interleaved policy inherited from the process (numactl), buffers first touched by the thread
+    // are then allocated on its node. Fails on kernels without MPOL_LOCAL, where this is the default anyway.
+    syscall(SYS_set_mempolicy, MpolLocal, nullptr, 0);
+    return true;
+#else
+    return false;
+#endif // __linux__
+}
+
+void ThreadPlacement::Configure(ThreadRole role, std::vector<uint32_t> cpus)
+{
+    s_Cpus[static_cast<size_t>(role)] = std::move(cpus);
+}
+
+bool ThreadPlacement::Apply(ThreadRole role)
+{
+    return SetCurrentThreadAffinity(GetCpus(role));
+}
+
+bool ThreadPlacement::Apply(ThreadRole role, size_t index)
+{
+    const std::vector<uint32_t>& cpus = GetCpus(role);
+    if (cpus.empty())
+    {
+        return false;
+    }
+
+    return SetCurrentThreadAffinity({ cpus[index % cpus.size()] });
+}
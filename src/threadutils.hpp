@@ -0,0 +1,98 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+/**
+ * @brief I/O scheduling class for background threads
+ */
+enum class IoPriority
+{
+    NORMAL, // Same priority as request handling
+    LOW,    // Lowest best-effort level
+    IDLE    // Only gets disk time when nothing else needs it
+};
+
+/**
+ * @brief Kind of thread, each kind can be pinned to its own set of CPUs
+ */
+enum class ThreadRole
+{
+    IO,         // Drogon event loops, one CPU each
+    DISK,       // Directory scans, tier migrations, index rebuild and prefetch
+    BACKGROUND, // Main loop, persistence, access log writer, bandwidth scheduler
+    COUNT
+};
+
+/**
+ * @brief Convert IoPriority to string
+ */
+std::string ToString(IoPriority priority);
+
+/**
+ * @brief Convert string to IoPriority
+ */
+std::optional<IoPriority> IoPriorityFromString(const std::string& str);
+
+/**
+ * @brief Change the I/O priority of the calling thread
+ *
+ * Only has an effect on Linux, where it maps to ioprio_set(). Other platforms ignore it.
+ *
+ * @return true if the priority was applied
+ */
+bool SetCurrentThreadIoPriority(IoPriority priority);
+
+/**
+ * @brief Convert ThreadRole to string
+ */
+std::string ToString(ThreadRole role);
+
+/**
+ * @brief Parse a list of CPUs such as "0-7,16-23", where "node:1" stands for every CPU of NUMA node 1
+ * @return The CPUs in the order listed, empty for an empty string, or std::nullopt if the list is invalid
+ */
+std::optional<std::vector<uint32_t>> ParseCpuList(const std::string& str);
+
+/**
+ * @brief Restrict the calling thread to a set of CPUs, and allocate its memory on the NUMA node it runs on
+ *
+ * Only has an effect on Linux. Memory already allocated by the thread stays where it is, so threads are
+ * pinned before they allocate their buffers.
+ *
+ * @return true if the affinity was applied
+ */
+bool SetCurrentThreadAffinity(const std::vector<uint32_t>& cpus);
+
+/**
+ * @brief CPUs every thread role is pinned to
+ *
+ * Configured once at startup, before any thread is started, then each thread pins itself when it starts.
+ * A role without CPUs is left to the scheduler.
+ */
+class ThreadPlacement final
+{
+public:
+    static void Configure(ThreadRole role, std::vector<uint32_t> cpus);
+    static const std::vector<uint32_t>& GetCpus(ThreadRole role) { return s_Cpus[static_cast<size_t>(role)]; }
+
+    /**
+     * @brief Pin the calling thread to every CPU of its role
+     * @return true if the role is pinned and the affinity was applied
+     */
+    static bool Apply(ThreadRole role);
+
+    /**
+     * @brief Pin the calling thread to a single CPU of its role, the CPUs being used in turn
+     * @param index Index of the thread within its role
+     * @return true if the role is pinned and the affinity was applied
+     */
+    static bool Apply(ThreadRole role, size_t index);
+
+private:
+    static std::array<std::vector<uint32_t>, static_cast<size_t>(ThreadRole::COUNT)> s_Cpus;
+};
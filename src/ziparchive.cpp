@@ -0,0 +1,521 @@
+#include <ziparchive.hpp>
+
+#include <zlib.h>
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <vector>
+
+static constexpr uint32_t EndOfCentralDirectorySignature = 0x06054b50;
+static constexpr uint32_t CentralDirectorySignature = 0x02014b50;
+static constexpr uint32_t LocalFileHeaderSignature = 0x04034b50;
+static constexpr uint32_t Zip64LocatorSignature = 0x07064b50;
+
+static constexpr size_t EndOfCentralDirectorySize = 22;
+static constexpr size_t CentralDirectoryEntrySize = 46;
+static constexpr size_t LocalFileHeaderSize = 30;
+static constexpr size_t MaxCommentSize = 0xffff;
+static constexpr size_t Zip64LocatorSize = 20;
+
+// Larger central directories are not verified or searched rather than read into memory
+static constexpr uint32_t MaxStreamedDirectorySize = 64 * 1024 * 1024;
+
+// Chunks read and inflated at once by Verify()
+static constexpr size_t VerifyChunkSize = 256 * 1024;
+
+static constexpr uint16_t MethodStored = 0;
+static constexpr uint16_t MethodDeflated = 8;
+
+static constexpr uint16_t FlagEncrypted = 0x0001;
+
+static uint16_t ReadUInt16(const char* data)
+{
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    return static_cast<uint16_t>(bytes[0] | (bytes[1] << 8));
+}
+
+static uint32_t ReadUInt32(const char* data)
+{
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    return static_cast<uint32_t>(bytes[0]) | (static_cast<uint32_t>(bytes[1]) << 8) | (static_cast<uint32_t>(bytes[2]) << 16) | (static_cast<uint32_t>(bytes[3]) << 24);
+}
+
+// Position of the end of central directory record in the last bytes of an archive
+static std::optional<size_t> FindEndRecord(std::string_view tail)
+{
+    if (tail.size() < EndOfCentralDirectorySize)
+    {
+        return std::nullopt;
+    }
+
+    for (size_t position = tail.size() - EndOfCentralDirectorySize + 1; position-- > 0;)
+    {
+        // A signature inside the comment is not the record
+        const char* record = tail.data() + position;
+        if (ReadUInt32(record) == EndOfCentralDirectorySignature && position + EndOfCentralDirectorySize + ReadUInt16(record + 20) == tail.size())
+        {
+            return position;
+        }
+    }
+
+    return std::nullopt;
+}
+
+static std::optional<std::string> Extract(std::string_view compressed, uint16_t method, uint32_t uncompressedSize)
+{
+    if (method == MethodStored)
+    {
+        return compressed.size() == uncompressedSize ? std::optional<std::string>(std::string(compressed)) : std::nullopt;
+    }
+
+    if (method != MethodDeflated)
+    {
+        return std::nullopt;
+    }
+
+    std::string content(uncompressedSize, '\0');
+
+    z_stream stream{};
+    // Raw deflate data, without the zlib header
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+    {
+        return std::nullopt;
+    }
+
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(compressed.data()));
+    stream.avail_in = static_cast<uInt>(compressed.size());
+    stream.next_out = reinterpret_cast<Bytef*>(content.data());
+    stream.avail_out = uncompressedSize;
+
+    const int result = inflate(&stream, Z_FINISH);
+    const uLong inflatedSize = stream.total_out;
+    inflateEnd(&stream);
+
+    if (result != Z_STREAM_END || inflatedSize != uncompressedSize)
+    {
+        return std::nullopt;
+    }
+
+    return content;
+}
+
+ZipArchive::ZipArchive(std::string_view data)
+    : m_Data(data)
+    , m_EntryCount(0)
+    , m_Valid(false)
+{
+    if (data.size() < EndOfCentralDirectorySize)
+    {
+        return;
+    }
+
+    // The record is at the very end, only followed by an optional comment
+    const size_t lowest = data.size() - EndOfCentralDirectorySize - std::min(MaxCommentSize, data.size() - EndOfCentralDirectorySize);
+    for (size_t position = data.size() - EndOfCentralDirectorySize + 1; position-- > lowest;)
+    {
+        const char* record = data.data() + position;
+        if (ReadUInt32(record) != EndOfCentralDirectorySignature)
+        {
+            continue;
+        }
+
+        const uint16_t entryCount = ReadUInt16(record + 10);
+        const uint32_t directorySize = ReadUInt32(record + 12);
+        const uint32_t directoryOffset = ReadUInt32(record + 16);
+        const uint16_t commentSize = ReadUInt16(record + 20);
+
+        // A signature inside the comment is not the record
+        if (position + EndOfCentralDirectorySize + commentSize != data.size())
+        {
+            continue;
+        }
+
+        // Zip64 archives store 0xffff / 0xffffffff here and the real values elsewhere
+        if (entryCount == 0xffff || directoryOffset == 0xffffffff || static_cast<uint64_t>(directoryOffset) + directorySize > position)
+        {
+            return;
+        }
+
+        m_CentralDirectory = data.substr(directoryOffset, directorySize);
+        m_EntryCount = entryCount;
+        m_Valid = true;
+        return;
+    }
+}
+
+std::optional<std::string> ZipArchive::ReadFile(std::string_view name, uint64_t maxSize) const
+{
+    if (!m_Valid)
+    {
+        return std::nullopt;
+    }
+
+    std::string_view directory = m_CentralDirectory;
+    for (size_t i = 0; i < m_EntryCount; ++i)
+    {
+        if (directory.size() < CentralDirectoryEntrySize || ReadUInt32(directory.data()) != CentralDirectorySignature)
+        {
+            return std::nullopt;
+        }
+
+        const char* entry = directory.data();
+        const uint16_t method = ReadUInt16(entry + 10);
+        const uint32_t compressedSize = ReadUInt32(entry + 20);
+        const uint32_t uncompressedSize = ReadUInt32(entry + 24);
+        const uint16_t nameSize = ReadUInt16(entry + 28);
+        const size_t entrySize = CentralDirectoryEntrySize + nameSize + ReadUInt16(entry + 30) + ReadUInt16(entry + 32);
+        const uint32_t localHeaderOffset = ReadUInt32(entry + 42);
+
+        if (directory.size() < entrySize)
+        {
+            return std::nullopt;
+        }
+
+        if (directory.substr(CentralDirectoryEntrySize, nameSize) != name)
+        {
+            directory.remove_prefix(entrySize);
+            continue;
+        }
+
+        if (uncompressedSize > maxSize || m_Data.size() < LocalFileHeaderSize || localHeaderOffset > m_Data.size() - LocalFileHeaderSize)
+        {
+            return std::nullopt;
+        }
+
+        // The local header repeats the name, and may have an extra field of a different size
+        const char* localHeader = m_Data.data() + localHeaderOffset;
+        if (ReadUInt32(localHeader) != LocalFileHeaderSignature)
+        {
+            return std::nullopt;
+        }
+
+        const uint64_t dataOffset = static_cast<uint64_t>(localHeaderOffset) + LocalFileHeaderSize + ReadUInt16(localHeader + 26) + ReadUInt16(localHeader + 28);
+        if (dataOffset + compressedSize > m_Data.size())
+        {
+            return std::nullopt;
+        }
+
+        return Extract(m_Data.substr(dataOffset, compressedSize), method, uncompressedSize);
+    }
+
+    return std::nullopt;
+}
+
+std::optional<std::string> ZipArchive::ReadFile(uint64_t size, const Reader& read, std::string_view name, uint64_t maxSize)
+{
+    if (size < EndOfCentralDirectorySize)
+    {
+        return std::nullopt;
+    }
+
+    const uint64_t tailSize = std::min<uint64_t>(size, EndOfCentralDirectorySize + MaxCommentSize);
+    const uint64_t tailOffset = size - tailSize;
+    std::string tail(tailSize, '\0');
+    if (!read(tailOffset, tail.data(), tail.size()))
+    {
+        return std::nullopt;
+    }
+
+    const std::optional<size_t> recordPosition = FindEndRecord(tail);
+    if (!recordPosition)
+    {
+        return std::nullopt;
+    }
+
+    const char* record = tail.data() + recordPosition.value();
+    const uint16_t entryCount = ReadUInt16(record + 10);
+    const uint32_t directorySize = ReadUInt32(record + 12);
+    const uint32_t directoryOffset = ReadUInt32(record + 16);
+
+    // Zip64 archives store 0xffff / 0xffffffff here and the real values elsewhere
+    if (entryCount == 0xffff || directoryOffset == 0xffffffff || static_cast<uint64_t>(directoryOffset) + directorySize > tailOffset + recordPosition.value() || directorySize > MaxStreamedDirectorySize)
+    {
+        return std::nullopt;
+    }
+
+    std::string directory(directorySize, '\0');
+    if (!read(directoryOffset, directory.data(), directory.size()))
+    {
+        return std::nullopt;
+    }
+
+    std::string_view remaining = directory;
+    for (size_t i = 0; i < entryCount; ++i)
+    {
+        if (remaining.size() < CentralDirectoryEntrySize || ReadUInt32(remaining.data()) != CentralDirectorySignature)
+        {
+            return std::nullopt;
+        }
+
+        const char* entry = remaining.data();
+        const uint16_t method = ReadUInt16(entry + 10);
+        const uint32_t compressedSize = ReadUInt32(entry + 20);
+        const uint32_t uncompressedSize = ReadUInt32(entry + 24);
+        const uint16_t nameSize = ReadUInt16(entry + 28);
+        const size_t entrySize = CentralDirectoryEntrySize + nameSize + ReadUInt16(entry + 30) + ReadUInt16(entry + 32);
+        const uint32_t localHeaderOffset = ReadUInt32(entry + 42);
+
+        if (remaining.size() < entrySize)
+        {
+            return std::nullopt;
+        }
+
+        if (remaining.substr(CentralDirectoryEntrySize, nameSize) != name)
+        {
+            remaining.remove_prefix(entrySize);
+            continue;
+        }
+
+        // Deflate never doubles the size of its input
+        if (uncompressedSize > maxSize || compressedSize > 2 * maxSize || static_cast<uint64_t>(localHeaderOffset) + LocalFileHeaderSize > directoryOffset)
+        {
+            return std::nullopt;
+        }
+
+        char localHeader[LocalFileHeaderSize];
+        if (!read(localHeaderOffset, localHeader, sizeof(localHeader)) || ReadUInt32(localHeader) != LocalFileHeaderSignature)
+        {
+            return std::nullopt;
+        }
+
+        const uint64_t dataOffset = static_cast<uint64_t>(localHeaderOffset) + LocalFileHeaderSize + ReadUInt16(localHeader + 26) + ReadUInt16(localHeader + 28);
+        if (dataOffset + compressedSize > directoryOffset)
+        {
+            return std::nullopt;
+        }
+
+        std::string compressed(compressedSize, '\0');
+        if (!read(dataOffset, compressed.data(), compressed.size()))
+        {
+            return std::nullopt;
+        }
+
+        return Extract(compressed, method, uncompressedSize);
+    }
+
+    return std::nullopt;
+}
+
+ZipArchive::Verification ZipArchive::Verify(uint64_t size, const Reader& read)
+{
+    if (size < EndOfCentralDirectorySize)
+    {
+        return { Status::CORRUPT, "Too small to be a zip archive" };
+    }
+
+    // The end of central directory record, preceded by the Zip64 locator if any
+    const uint64_t tailSize = std::min<uint64_t>(size, EndOfCentralDirectorySize + MaxCommentSize + Zip64LocatorSize);
+    const uint64_t tailOffset = size - tailSize;
+    std::string tail(tailSize, '\0');
+    if (!read(tailOffset, tail.data(), tail.size()))
+    {
+        return { Status::UNREADABLE, "Failed to read the end of the archive" };
+    }
+
+    const std::optional<size_t> recordPosition = FindEndRecord(tail);
+    if (!recordPosition)
+    {
+        // What a truncated upload looks like
+        return { Status::CORRUPT, "End of central directory not found" };
+    }
+
+    const char* record = tail.data() + recordPosition.value();
+    const uint16_t entryCount = ReadUInt16(record + 10);
+    const uint32_t directorySize = ReadUInt32(record + 12);
+    const uint32_t directoryOffset = ReadUInt32(record + 16);
+
+    const bool hasZip64Locator = recordPosition.value() >= Zip64LocatorSize && ReadUInt32(record - Zip64LocatorSize) == Zip64LocatorSignature;
+    if (hasZip64Locator || entryCount == 0xffff || directorySize == 0xffffffff || directoryOffset == 0xffffffff)
+    {
+        return { Status::UNSUPPORTED, "Zip64 archive" };
+    }
+
+    const uint64_t recordOffset = tailOffset + recordPosition.value();
+    if (static_cast<uint64_t>(directoryOffset) + directorySize > recordOffset)
+    {
+        return { Status::CORRUPT, "Central directory extends beyond its end record" };
+    }
+
+    if (directorySize > MaxStreamedDirectorySize)
+    {
+        return { Status::UNSUPPORTED, fmt::format("Central directory of {} bytes", directorySize) };
+    }
+
+    std::string directory(directorySize, '\0');
+    if (!read(directoryOffset, directory.data(), directory.size()))
+    {
+        return { Status::UNREADABLE, "Failed to read the central directory" };
+    }
+
+    struct Item
+    {
+        std::string name;
+        uint64_t offset;
+        uint32_t crc;
+        uint32_t compressedSize;
+        uint32_t uncompressedSize;
+        uint16_t method;
+        uint16_t flags;
+    };
+
+    std::vector<Item> items;
+    items.reserve(entryCount);
+
+    std::string_view remaining = directory;
+    for (size_t i = 0; i < entryCount; ++i)
+    {
+        if (remaining.size() < CentralDirectoryEntrySize || ReadUInt32(remaining.data()) != CentralDirectorySignature)
+        {
+            return { Status::CORRUPT, fmt::format("Central directory entry {} of {} is invalid", i + 1, entryCount) };
+        }
+
+        const char* entry = remaining.data();
+        const uint16_t nameSize = ReadUInt16(entry + 28);
+        const size_t entrySize = CentralDirectoryEntrySize + nameSize + ReadUInt16(entry + 30) + ReadUInt16(entry + 32);
+        if (remaining.size() < entrySize)
+        {
+            return { Status::CORRUPT, fmt::format("Central directory entry {} of {} is truncated", i + 1, entryCount) };
+        }
+
+        Item item{ std::string(remaining.substr(CentralDirectoryEntrySize, nameSize)), ReadUInt32(entry + 42), ReadUInt32(entry + 16), ReadUInt32(entry + 20), ReadUInt32(entry + 24), ReadUInt16(entry + 10), ReadUInt16(entry + 8) };
+        if (item.compressedSize == 0xffffffff || item.uncompressedSize == 0xffffffff || item.offset == 0xffffffff)
+        {
+            return { Status::UNSUPPORTED, "Zip64 archive" };
+        }
+
+        items.push_back(std::move(item));
+        remaining.remove_prefix(entrySize);
+    }
+
+    // Read in the order of the archive, so a rotational disk reads it in one sweep
+    std::sort(items.begin(), items.end(), [](const Item& lhs, const Item& rhs) { return lhs.offset < rhs.offset; });
+
+    std::vector<char> input(VerifyChunkSize);
+    std::vector<char> output(VerifyChunkSize);
+
+    for (const Item& item : items)
+    {
+        if (item.flags & FlagEncrypted)
+        {
+            return { Status::UNSUPPORTED, fmt::format("\"{}\" is encrypted", item.name) };
+        }
+
+        if (item.method != MethodStored && item.method != MethodDeflated)
+        {
+            return { Status::UNSUPPORTED, fmt::format("\"{}\" uses compression method {}", item.name, item.method) };
+        }
+
+        if (item.offset + LocalFileHeaderSize > directoryOffset)
+        {
+            return { Status::CORRUPT, fmt::format("Local header of \"{}\" is beyond the central directory", item.name) };
+        }
+
+        char localHeader[LocalFileHeaderSize];
+        if (!read(item.offset, localHeader, sizeof(localHeader)))
+        {
+            return { Status::UNREADABLE, fmt::format("Failed to read the local header of \"{}\"", item.name) };
+        }
+
+        if (ReadUInt32(localHeader) != LocalFileHeaderSignature)
+        {
+            return { Status::CORRUPT, fmt::format("Local header of \"{}\" is invalid", item.name) };
+        }
+
+        const uint64_t dataOffset = item.offset + LocalFileHeaderSize + ReadUInt16(localHeader + 26) + ReadUInt16(localHeader + 28);
+        if (dataOffset + item.compressedSize > directoryOffset)
+        {
+            return { Status::CORRUPT, fmt::format("Data of \"{}\" extends into the central directory", item.name) };
+        }
+
+        if (item.method == MethodStored && item.compressedSize != item.uncompressedSize)
+        {
+            return { Status::CORRUPT, fmt::format("Sizes of the stored entry \"{}\" differ", item.name) };
+        }
+
+        uLong crc = crc32(0, nullptr, 0);
+        uint64_t produced = 0;
+        uint64_t position = dataOffset;
+        uint64_t left = item.compressedSize;
+
+        if (item.method == MethodStored)
+        {
+            while (left > 0)
+            {
+                const size_t chunk = static_cast<size_t>(std::min<uint64_t>(left, input.size()));
+                if (!read(position, input.data(), chunk))
+                {
+                    return { Status::UNREADABLE, fmt::format("Failed to read \"{}\"", item.name) };
+                }
+                crc = crc32(crc, reinterpret_cast<const Bytef*>(input.data()), static_cast<uInt>(chunk));
+                produced += chunk;
+                position += chunk;
+                left -= chunk;
+            }
+        }
+        else
+        {
+            z_stream stream{};
+            // Raw deflate data, without the zlib header
+            if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+            {
+                return { Status::UNREADABLE, "Failed to initialize zlib" };
+            }
+
+            int result = Z_OK;
+            while (result == Z_OK)
+            {
+                if (stream.avail_in == 0 && left > 0)
+                {
+                    const size_t chunk = static_cast<size_t>(std::min<uint64_t>(left, input.size()));
+                    if (!read(position, input.data(), chunk))
+                    {
+                        inflateEnd(&stream);
+                        return { Status::UNREADABLE, fmt::format("Failed to read \"{}\"", item.name) };
+                    }
+                    position += chunk;
+                    left -= chunk;
+                    stream.next_in = reinterpret_cast<Bytef*>(input.data());
+                    stream.avail_in = static_cast<uInt>(chunk);
+                }
+
+                // Z_BUF_ERROR once the input is exhausted before the end of the stream
+                stream.next_out = reinterpret_cast<Bytef*>(output.data());
+                stream.avail_out = static_cast<uInt>(output.size());
+                result = inflate(&stream, Z_NO_FLUSH);
+                if (result != Z_OK && result != Z_STREAM_END)
+                {
+                    break;
+                }
+
+                const size_t inflated = output.size() - stream.avail_out;
+                crc = crc32(crc, reinterpret_cast<const Bytef*>(output.data()), static_cast<uInt>(inflated));
+                produced += inflated;
+
+                // Stops early rather than inflating whatever a corrupted stream decodes to
+                if (produced > item.uncompressedSize)
+                {
+                    break;
+                }
+            }
+            inflateEnd(&stream);
+
+            if (result != Z_STREAM_END && produced <= item.uncompressedSize)
+            {
+                return { Status::CORRUPT, fmt::format("Compressed data of \"{}\" is invalid", item.name) };
+            }
+        }
+
+        if (produced != item.uncompressedSize)
+        {
+            return { Status::CORRUPT, fmt::format("\"{}\" has {} bytes instead of {}", item.name, produced, item.uncompressedSize) };
+        }
+
+        if (crc != item.crc)
+        {
+            return { Status::CORRUPT, fmt::format("CRC-32 of \"{}\" does not match", item.name) };
+        }
+    }
+
+    return { Status::VALID, std::string() };
+}
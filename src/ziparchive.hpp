@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+
+/**
+ * @brief Read-only view of a zip archive held in memory
+ *
+ * Only supports what is needed to look into the packages produced by vcpkg: the central directory,
+ * and stored or deflated entries. Zip64 archives are reported as invalid.
+ */
+class ZipArchive final
+{
+public:
+    /**
+     * @brief Largest entry ReadFile() accepts to extract by default
+     */
+    static constexpr uint64_t DefaultMaxFileSize = 1024 * 1024;
+
+    /**
+     * @brief Outcome of Verify()
+     */
+    enum class Status
+    {
+        VALID,
+        CORRUPT,
+        UNSUPPORTED, // Zip64, encrypted or using a compression method other than deflate, could not be checked
+        UNREADABLE   // The reader failed
+    };
+
+    struct Verification
+    {
+        Status status;
+        std::string problem; // Empty when valid
+    };
+
+    /**
+     * @brief Reads exactly size bytes at an offset of the archive, returns false on failure
+     */
+    using Reader = std::function<bool(uint64_t offset, char* buffer, size_t size)>;
+
+    /**
+     * @brief Check an archive too large to be held in memory, reading it in chunks
+     *
+     * Checks the central directory, the local header of every entry, and decompresses every entry to
+     * compare its size and CRC-32 with the ones stored in the central directory.
+     * @param size Size of the archive
+     */
+    static Verification Verify(uint64_t size, const Reader& read);
+
+    /**
+     * @brief Extract a file from an archive too large to be held in memory
+     *
+     * Only reads the central directory and the file itself.
+     * @param size Size of the archive
+     * @param name Path of the file within the archive
+     * @param maxSize Files larger than this are not extracted
+     * @return The uncompressed content, or std::nullopt if the file is missing, too large or corrupted
+     */
+    static std::optional<std::string> ReadFile(uint64_t size, const Reader& read, std::string_view name, uint64_t maxSize = DefaultMaxFileSize);
+
+    /**
+     * @brief Constructor, locates the central directory
+     * @param data Content of the archive, must outlive the ZipArchive
+     */
+    explicit ZipArchive(std::string_view data);
+
+    /**
+     * @brief Check that the end of central directory record was found and is consistent with the archive size
+     */
+    bool IsValid() const { return m_Valid; }
+
+    /**
+     * @brief Number of entries listed in the central directory
+     */
+    size_t GetEntryCount() const { return m_EntryCount; }
+
+    /**
+     * @brief Extract a file
+     * @param name Path of the file within the archive
+     * @param maxSize Files larger than this are not extracted
+     * @return The uncompressed content, or std::nullopt if the file is missing, too large or corrupted
+     */
+    std::optional<std::string> ReadFile(std::string_view name, uint64_t maxSize = DefaultMaxFileSize) const;
+
+private:
+    std::string_view m_Data;
+    std::string_view m_CentralDirectory;
+    size_t m_EntryCount;
+    bool m_Valid;
+};
@@ -0,0 +1,229 @@
+#include <options.hpp>
+#include <policyengine.hpp>
+#include <server.hpp>
+
+#include <catch2/catch_test_macros.hpp>
+#include <fmt/core.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+
+// Every allocation of the process goes through these, so a test can count the allocations of the code it runs
+static thread_local uint64_t AllocationCount = 0;
+
+void* operator new(size_t size)
+{
+    ++AllocationCount;
+
+    if (void* ptr = std::malloc(size > 0 ? size : 1))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+/**
+ * @brief Access to the server internals needed to set a test up, declared as a friend by the server
+ */
+struct TestAccess
+{
+    static std::string CreateApiKey(const BinaryCacheServer& server, AccessPermission permission)
+    {
+        return server.m_PolicyEngine->CreateApiKey("Test key", permission);
+    }
+};
+
+// Enough to reach the steady state: thread-local buffers grown, shared responses built
+static constexpr size_t WarmUpIterations = 16;
+static constexpr size_t MeasuredIterations = 1000;
+
+// Longest wait for the package index to be rebuilt from the test directory
+static constexpr std::chrono::seconds IndexReadyTimeout{ 30 };
+
+static const std::string Triplet{ "x64-linux" };
+static const std::string Name{ "zlib" };
+static const std::string Version{ "1.3.1" };
+static const std::string Sha{ "66672cc2e2ace73f33808e213287489112b3a9f1667f0f78b8af05003ebc262f" };
+static const std::string MissingSha{ "0000000000000000000000000000000000000000000000000000000000000000" };
+
+/**
+ * @brief Server with a single stored package and an API key, backed by a temporary directory
+ */
+class Environment final
+{
+public:
+    Environment()
+        : m_Directory(std::filesystem::temp_directory_path() / fmt::format("vcpkg-http-cache-tests-{:016x}", std::random_device()()))
+    {
+        Options options;
+        options.persistenceFile = (m_Directory / "persistence.json").string();
+        options.lockFile = (m_Directory / "persistence.json.lock").string();
+        options.cache.directory = (m_Directory / "cache").string();
+        options.cache.indexFile = (m_Directory / "index.bin").string();
+        options.upload.directory = (m_Directory / "upload").string();
+        options.scrub.enabled = false;
+        options.prefetch.enabled = false;
+        options.popularity.enabled = false;
+        options.bandwidth.enabled = false;
+        options.accessLog.path.clear();
+        options.pageCache.prefetchSize = 0;
+
+        // Found by the index rebuild
+        const std::filesystem::path packagePath = std::filesystem::path(options.cache.directory) / Triplet / Name / Version / (Sha + ".zip");
+        std::filesystem::create_directories(packagePath.parent_path());
+        std::ofstream(packagePath, std::ios::binary) << std::string(1024 * 1024, 'x');
+
+        m_Server = std::make_unique<BinaryCacheServer>(options);
+        m_Server->CreateApiKeyFilter(true, true, false);
+        m_ApiKey = TestAccess::CreateApiKey(*m_Server, AccessPermission::READWRITE);
+
+        const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + IndexReadyTimeout;
+        while (!m_Server->IsReady() && std::chrono::steady_clock::now() < deadline)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    ~Environment()
+    {
+        m_Server.reset();
+
+        std::error_code error;
+        std::filesystem::remove_all(m_Directory, error);
+    }
+
+    BinaryCacheServer& GetServer() const { return *m_Server; }
+    const std::string& GetApiKey() const { return m_ApiKey; }
+
+private:
+    std::filesystem::path m_Directory;
+    std::unique_ptr<BinaryCacheServer> m_Server;
+    std::string m_ApiKey;
+};
+
+static drogon::HttpRequestPtr CreateRequest(drogon::HttpMethod method, const std::string& sha, const std::string& apiKey)
+{
+    drogon::HttpRequestPtr req = drogon::HttpRequest::newHttpRequest();
+    req->setMethod(method);
+    req->setPath(fmt::format("/{}/{}/{}/{}", Triplet, Name, Version, sha));
+    req->addHeader("X-API-Key", apiKey);
+    return req;
+}
+
+/**
+ * @brief Allocations made by the measured runs of a path, once warmed up
+ */
+template <typename Path>
+static uint64_t CountSteadyStateAllocations(Path&& path)
+{
+    for (size_t i = 0; i < WarmUpIterations; ++i)
+    {
+        path();
+    }
+
+    const uint64_t start = AllocationCount;
+    for (size_t i = 0; i < MeasuredIterations; ++i)
+    {
+        path();
+    }
+    return AllocationCount - start;
+}
+
+/**
+ * @brief Send a request through the package routes of the server, as the pre-routing advice does
+ * @return Status code of the response, which every path tested here sends synchronously
+ */
+static drogon::HttpStatusCode Route(BinaryCacheServer& server, const drogon::HttpRequestPtr& req)
+{
+    drogon::HttpStatusCode status = drogon::kUnknown;
+
+    // Small enough to be stored within the std::function
+    std::function<void(const drogon::HttpResponsePtr&)> callback = [&status](const drogon::HttpResponsePtr& resp)
+    {
+        status = resp->statusCode();
+    };
+
+    if (!server.RoutePackageRequest(req, callback))
+    {
+        return drogon::kUnknown;
+    }
+    return status;
+}
+
+// Responses for stored packages carry their own headers (ETag, Last-Modified, Content-Length) and allocate them,
+// these tests cover the paths answered with a shared response
+
+TEST_CASE("Package index is rebuilt with the stored package", "[allocations]")
+{
+    const Environment environment;
+    REQUIRE(environment.GetServer().IsReady());
+
+    const drogon::HttpRequestPtr req = CreateRequest(drogon::Head, Sha, environment.GetApiKey());
+    REQUIRE(Route(environment.GetServer(), req) == drogon::k200OK);
+}
+
+TEST_CASE("HEAD request for a missing package does not allocate", "[allocations]")
+{
+    const Environment environment;
+    REQUIRE(environment.GetServer().IsReady());
+
+    const drogon::HttpRequestPtr req = CreateRequest(drogon::Head, MissingSha, environment.GetApiKey());
+
+    bool notFound = true;
+    const uint64_t allocations = CountSteadyStateAllocations([&]()
+    {
+        notFound = notFound && Route(environment.GetServer(), req) == drogon::k404NotFound;
+    });
+
+    REQUIRE(notFound);
+    REQUIRE(allocations == 0);
+}
+
+TEST_CASE("GET request for a missing package does not allocate", "[allocations]")
+{
+    const Environment environment;
+    REQUIRE(environment.GetServer().IsReady());
+
+    const drogon::HttpRequestPtr req = CreateRequest(drogon::Get, MissingSha, environment.GetApiKey());
+
+    bool notFound = true;
+    const uint64_t allocations = CountSteadyStateAllocations([&]()
+    {
+        notFound = notFound && Route(environment.GetServer(), req) == drogon::k404NotFound;
+    });
+
+    REQUIRE(notFound);
+    REQUIRE(allocations == 0);
+}
+
+TEST_CASE("Rejected request does not allocate", "[allocations]")
+{
+    const Environment environment;
+    const drogon::HttpRequestPtr req = CreateRequest(drogon::Head, Sha, "vcpkg_00000000000000000000000000000000");
+
+    bool rejected = true;
+    const uint64_t allocations = CountSteadyStateAllocations([&]()
+    {
+        rejected = rejected && Route(environment.GetServer(), req) == drogon::k401Unauthorized;
+    });
+
+    REQUIRE(rejected);
+    REQUIRE(allocations == 0);
+}
@@ -0,0 +1,140 @@
+#include <packagerouter.hpp>
+
+#include <catch2/catch_test_macros.hpp>
+
+#include <string>
+
+// Built twice, with the SSE2 classification and with PACKAGE_ROUTER_NO_SIMD, and both builds must agree
+
+static const std::string Sha{ "66672cc2e2ace73f33808e213287489112b3a9f1667f0f78b8af05003ebc262f" };
+
+TEST_CASE("Package URL with triplet, name, version and sha", "[packagerouter]")
+{
+    const std::string path = "/x64-linux/zlib/1.3.1/" + Sha;
+
+    const std::optional<PackageRoute> route = PackageRouter::Parse(path);
+    REQUIRE(route.has_value());
+    CHECK_FALSE(route->IsShaOnly());
+    CHECK(route->triplet == "x64-linux");
+    CHECK(route->name == "zlib");
+    CHECK(route->version == "1.3.1");
+    CHECK(route->sha == Sha);
+}
+
+TEST_CASE("Package URL with only the sha", "[packagerouter]")
+{
+    const std::string path = "/" + Sha + ".zip";
+
+    const std::optional<PackageRoute> route = PackageRouter::Parse(path);
+    REQUIRE(route.has_value());
+    CHECK(route->IsShaOnly());
+    CHECK(route->sha == Sha);
+
+    CHECK_FALSE(PackageRouter::Parse("/" + Sha).has_value());
+    CHECK_FALSE(PackageRouter::Parse("/zlib/" + Sha + ".zip").has_value());
+    CHECK_FALSE(PackageRouter::Parse("/.zip").has_value());
+}
+
+TEST_CASE("Paths around the block size", "[packagerouter]")
+{
+    // "/a/b/c/" is 7 bytes and "/" 1 byte, the sha makes up the rest of the path
+    for (size_t length = 8; length <= 40; ++length)
+    {
+        const std::string sha = Sha.substr(0, length - 7);
+        const std::string path = "/a/b/c/" + sha;
+        REQUIRE(path.size() == length);
+
+        const std::optional<PackageRoute> route = PackageRouter::Parse(path);
+        REQUIRE(route.has_value());
+        CHECK(route->version == "c");
+        CHECK(route->sha == sha);
+
+        // The routes view the path they were parsed from
+        const std::string shaOnly = Sha.substr(0, length - 1);
+        const std::string shaOnlyPath = "/" + shaOnly + ".zip";
+        const std::optional<PackageRoute> shaOnlyRoute = PackageRouter::Parse(shaOnlyPath);
+        REQUIRE(shaOnlyRoute.has_value());
+        CHECK(shaOnlyRoute->sha == shaOnly);
+    }
+
+    // A byte not allowed anywhere is found in the first block, on its last byte, and in the block or tail after it
+    for (const size_t length : { 15, 16, 17, 31, 32, 33 })
+    {
+        const std::string path = "/a/b/c/" + Sha.substr(0, length - 7);
+        for (size_t i = 1; i < path.size(); ++i)
+        {
+            if (path[i] == '/')
+            {
+                continue;
+            }
+
+            std::string invalid = path;
+            invalid[i] = '%';
+            CHECK_FALSE(PackageRouter::Parse(invalid).has_value());
+        }
+    }
+}
+
+TEST_CASE("Bytes above 0x7f are rejected", "[packagerouter]")
+{
+    for (const char c : { '\x80', '\xc3', '\xfe', '\xff' })
+    {
+        // In the scalar tail, in a full block, and in the sha
+        CHECK_FALSE(PackageRouter::Parse(std::string("/x64-linux/zli") + c + "/1.3.1/" + Sha).has_value());
+        CHECK_FALSE(PackageRouter::Parse(std::string("/x64-linux/zlib/1.3.1/") + Sha.substr(0, 8) + c).has_value());
+        CHECK_FALSE(PackageRouter::Parse(std::string("/") + c + "/b/c/" + Sha).has_value());
+        CHECK_FALSE(PackageRouter::Parse(std::string("/") + Sha.substr(0, 20) + c + ".zip").has_value());
+    }
+}
+
+TEST_CASE("Dot segments are rejected", "[packagerouter]")
+{
+    CHECK_FALSE(PackageRouter::Parse("/./zlib/1.3.1/" + Sha).has_value());
+    CHECK_FALSE(PackageRouter::Parse("/x64-linux/../1.3.1/" + Sha).has_value());
+    CHECK_FALSE(PackageRouter::Parse("/x64-linux/zlib/../" + Sha).has_value());
+    CHECK_FALSE(PackageRouter::Parse("/x64-linux/zlib/./" + Sha).has_value());
+
+    // Dots are allowed within a segment
+    CHECK(PackageRouter::Parse("/x64-linux/zlib/.../" + Sha).has_value());
+    CHECK(PackageRouter::Parse("/x64-linux/zlib/1.3.1.2/" + Sha).has_value());
+}
+
+TEST_CASE("Only lowercase hexadecimal shas are accepted", "[packagerouter]")
+{
+    std::string upper = Sha;
+    for (char& c : upper)
+    {
+        if (c >= 'a' && c <= 'f')
+        {
+            c = static_cast<char>(c - 'a' + 'A');
+        }
+    }
+
+    CHECK_FALSE(PackageRouter::Parse("/x64-linux/zlib/1.3.1/" + upper).has_value());
+    CHECK_FALSE(PackageRouter::Parse("/" + upper + ".zip").has_value());
+    CHECK_FALSE(PackageRouter::Parse("/x64-linux/zlib/1.3.1/" + Sha.substr(0, 40) + "g").has_value());
+
+    // Uppercase is fine in the other segments
+    CHECK(PackageRouter::Parse("/X64-Linux/Qt/6.7.0/" + Sha).has_value());
+}
+
+TEST_CASE("Wrong number of segments", "[packagerouter]")
+{
+    CHECK_FALSE(PackageRouter::Parse("/x64-linux/zlib/" + Sha).has_value());
+    CHECK_FALSE(PackageRouter::Parse("/extra/x64-linux/zlib/1.3.1/" + Sha).has_value());
+    CHECK_FALSE(PackageRouter::Parse("/a/b/c/d/e/f/" + Sha).has_value());
+    CHECK_FALSE(PackageRouter::Parse("/x64-linux//1.3.1/" + Sha).has_value());
+    CHECK_FALSE(PackageRouter::Parse("/x64-linux/zlib/1.3.1/" + Sha + "/").has_value());
+}
+
+TEST_CASE("Malformed paths", "[packagerouter]")
+{
+    CHECK_FALSE(PackageRouter::Parse("").has_value());
+    CHECK_FALSE(PackageRouter::Parse("/").has_value());
+    CHECK_FALSE(PackageRouter::Parse("x64-linux/zlib/1.3.1/" + Sha).has_value());
+    CHECK_FALSE(PackageRouter::Parse("/x64-linux/zlib/1.3.1/" + Sha + ".zip").has_value());
+
+    const std::string longest(PackageRouter::MaxSegmentLength, 'a');
+    CHECK(PackageRouter::Parse("/" + longest + "/zlib/1.3.1/" + Sha).has_value());
+    CHECK_FALSE(PackageRouter::Parse("/" + longest + "a/zlib/1.3.1/" + Sha).has_value());
+}